@@ -6,6 +6,8 @@
 
 #ifdef HAVE_FFMPEG
 #include "streaming/video/ffmpeg.h"
+#include "streaming/video/decodebenchmark.h"
+#include "streaming/video/ffmpeg-renderers/pacer/pacersimulator.h"
 #endif
 
 #if defined(_WIN32) || defined(_WIN64)
@@ -21,6 +23,8 @@
 #include "backend/identitymanager.h"
 #include <glog/logging.h>
 
+#include <memory>
+
 #if defined(_WIN32) || defined(_WIN64)
 #define IS_UNSPECIFIED_HANDLE(x) ((x) == INVALID_HANDLE_VALUE || (x) == NULL)
 #else
@@ -234,10 +238,24 @@ MyWindow g_window(L"MyWindow", StringUtils::stringToWString(programName).c_str()
 
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
 {
-    SingleInstanceChecker checker;
+    // The decode benchmark and pacer simulation don't touch the UI
+    // or the network, so they can run alongside a normal instance.
+    bool runBenchmark = false;
+    bool runPacerSimulation = false;
+#ifdef HAVE_FFMPEG
+    DECODE_BENCHMARK_OPTIONS benchmarkOptions;
+    runBenchmark = DecodeBenchmark::parseCommandLine(lpCmdLine, &benchmarkOptions);
 
-    if (!checker.isRunning())
-        return -1;
+    PACER_SIMULATION_OPTIONS pacerSimulationOptions;
+    runPacerSimulation = PacerSimulator::parseCommandLine(lpCmdLine, &pacerSimulationOptions);
+#endif
+
+    std::unique_ptr<SingleInstanceChecker> checker;
+    if (!runBenchmark && !runPacerSimulation) {
+        checker = std::make_unique<SingleInstanceChecker>();
+        if (!checker->isRunning())
+            return -1;
+    }
 
     SDL_SetMainReady();
 
@@ -359,6 +377,19 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
                 "Running with SDL %d.%d.%d",
                 runtimeVersion.major, runtimeVersion.minor, runtimeVersion.patch);
 
+#ifdef HAVE_FFMPEG
+    if (runBenchmark) {
+        int exitCode = DecodeBenchmark::run(benchmarkOptions);
+        google::ShutdownGoogleLogging();
+        return exitCode;
+    }
+    else if (runPacerSimulation) {
+        int exitCode = PacerSimulator::run(pacerSimulationOptions);
+        google::ShutdownGoogleLogging();
+        return exitCode;
+    }
+#endif
+
     SystemProperties::get();
 
     // Create the identity manager on the main thread
@@ -25,6 +25,13 @@ std::string Path::getBoxArtCacheDir()
     return boxArtDir;
 }
 
+std::string Path::getCacheDir()
+{
+    std::string cacheDir = s_CacheDir.string();
+    assert(!cacheDir.empty());
+    return cacheDir;
+}
+
 std::string Path::readDataFile(std::string fileName)
 {
     std::string absPath = Path::getDataFilePath(fileName);
@@ -7,6 +7,7 @@ class Path
 public:
     static std::string getLogDir();
     static std::string getBoxArtCacheDir();
+    static std::string getCacheDir();
 
     static std::string readDataFile(std::string fileName);
     static void deleteCacheFile(std::string fileName);
@@ -1,4 +1,6 @@
 #include "../session.h"
+#include "../tracer.h"
+#include "../streamrecorder.h"
 #include "renderers/renderer.h"
 
 #ifdef HAVE_SOUNDIO
@@ -13,6 +15,129 @@
 
 #include <Limelight.h>
 
+// Audio that arrives while a replacement renderer is being created is played
+// once it's ready. Anything older than this would only add latency.
+#define AUDIO_REINIT_QUEUE_MS 20
+
+// Don't retry creating a renderer more often than this, to avoid
+// thrashing if the audio device is unavailable.
+#define AUDIO_REINIT_INTERVAL_MS 1000
+
+// Reads a frame length from a self-delimited Opus packet (RFC 6716 3.2.1)
+static bool readOpusFrameLength(const unsigned char** data, int* length, int* frameLength)
+{
+    if (*length < 1) {
+        return false;
+    }
+    else if ((*data)[0] < 252) {
+        *frameLength = (*data)[0];
+        *data += 1;
+        *length -= 1;
+        return true;
+    }
+    else if (*length < 2) {
+        return false;
+    }
+    else {
+        *frameLength = (*data)[0] + 4 * (*data)[1];
+        *data += 2;
+        *length -= 2;
+        return true;
+    }
+}
+
+// Returns true if a packet has FEC data for the packet before it. In multistream
+// packets, only the first stream is checked. The host encodes all streams the
+// same way, but only the last stream is a normal Opus packet that libopus can
+// check for us, and we'd have to parse through all the others to find it.
+static bool hasOpusFecData(const unsigned char* data, int length, int streams)
+{
+    if (streams <= 1) {
+        return opus_packet_has_lbrr(data, length) > 0;
+    }
+
+    // The first stream is self-delimited (RFC 6716 Appendix B), so find its first
+    // frame and check that as a single frame packet with the same configuration.
+    if (length < 1) {
+        return false;
+    }
+
+    unsigned char toc = data[0];
+    const unsigned char* p = data + 1;
+    int remaining = length - 1;
+    int frameLength = 0;
+
+    switch (toc & 0x3) {
+    case 0:
+    case 1:
+    case 2:
+        // The first length is the first frame's for all of these
+        if (!readOpusFrameLength(&p, &remaining, &frameLength)) {
+            return false;
+        }
+        if ((toc & 0x3) == 2) {
+            // Skip the self-delimiting length of the second frame
+            int secondFrameLength;
+            if (!readOpusFrameLength(&p, &remaining, &secondFrameLength)) {
+                return false;
+            }
+        }
+        break;
+
+    case 3:
+    {
+        if (remaining < 1) {
+            return false;
+        }
+
+        unsigned char frameCountByte = *p++;
+        remaining--;
+
+        int frameCount = frameCountByte & 0x3F;
+        if (frameCount == 0) {
+            return false;
+        }
+
+        // Skip the padding length, which is trailing data we don't need
+        if (frameCountByte & 0x40) {
+            unsigned char paddingByte;
+            do {
+                if (remaining < 1) {
+                    return false;
+                }
+                paddingByte = *p++;
+                remaining--;
+            } while (paddingByte == 255);
+        }
+
+        // VBR packets list the first N-1 frame lengths, then the self-delimiting
+        // length of the last one. CBR packets just have the one length.
+        if (!readOpusFrameLength(&p, &remaining, &frameLength)) {
+            return false;
+        }
+        if (frameCountByte & 0x80) {
+            for (int i = 1; i < frameCount; i++) {
+                int otherFrameLength;
+                if (!readOpusFrameLength(&p, &remaining, &otherFrameLength)) {
+                    return false;
+                }
+            }
+        }
+        break;
+    }
+    }
+
+    if (frameLength > remaining || frameLength > 1275) {
+        return false;
+    }
+
+    unsigned char firstFrame[1 + 1275];
+    firstFrame[0] = toc & ~0x3;
+    memcpy(&firstFrame[1], p, frameLength);
+
+    return opus_packet_has_lbrr(firstFrame, 1 + frameLength) > 0;
+}
+
 #define TRY_INIT_RENDERER(renderer, opusConfig)        \
 {                                                      \
     IAudioRenderer* __renderer = new renderer();       \
@@ -64,36 +189,35 @@ IAudioRenderer* Session::createAudioRenderer(const POPUS_MULTISTREAM_CONFIGURATI
     return nullptr;
 }
 
-bool Session::initializeAudioRenderer()
+bool Session::createAudioPipeline(POPUS_MULTISTREAM_CONFIGURATION originalConfig,
+                                  IAudioRenderer** renderer,
+                                  OpusMSDecoder** decoder,
+                                  POPUS_MULTISTREAM_CONFIGURATION activeConfig)
 {
     int error;
 
-    SDL_assert(m_OriginalAudioConfig.channelCount > 0);
-    SDL_assert(m_AudioRenderer == nullptr);
-    SDL_assert(m_OpusDecoder == nullptr);
-
-    m_AudioRenderer = createAudioRenderer(&m_OriginalAudioConfig);
+    *renderer = createAudioRenderer(originalConfig);
 
     // We may be unable to create an audio renderer right now
-    if (m_AudioRenderer == nullptr) {
+    if (*renderer == nullptr) {
         return false;
     }
 
     // Allow the chosen renderer to remap Opus channels as needed to ensure proper output
-    m_ActiveAudioConfig = m_OriginalAudioConfig;
-    m_AudioRenderer->remapChannels(&m_ActiveAudioConfig);
+    *activeConfig = *originalConfig;
+    (*renderer)->remapChannels(activeConfig);
 
     // Create the Opus decoder with the renderer's preferred channel mapping
-    m_OpusDecoder =
-        opus_multistream_decoder_create(m_ActiveAudioConfig.sampleRate,
-                                        m_ActiveAudioConfig.channelCount,
-                                        m_ActiveAudioConfig.streams,
-                                        m_ActiveAudioConfig.coupledStreams,
-                                        m_ActiveAudioConfig.mapping,
+    *decoder =
+        opus_multistream_decoder_create(activeConfig->sampleRate,
+                                        activeConfig->channelCount,
+                                        activeConfig->streams,
+                                        activeConfig->coupledStreams,
+                                        activeConfig->mapping,
                                         &error);
-    if (m_OpusDecoder == nullptr) {
-        delete m_AudioRenderer;
-        m_AudioRenderer = nullptr;
+    if (*decoder == nullptr) {
+        delete *renderer;
+        *renderer = nullptr;
         SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
                      "Failed to create decoder: %d",
                      error);
@@ -102,7 +226,152 @@ bool Session::initializeAudioRenderer()
 
     SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
                 "Audio stream has %d channels",
-                m_ActiveAudioConfig.channelCount);
+                activeConfig->channelCount);
+    return true;
+}
+
+bool Session::initializeAudioRenderer()
+{
+    SDL_assert(m_OriginalAudioConfig.channelCount > 0);
+    SDL_assert(m_AudioRenderer == nullptr);
+    SDL_assert(m_OpusDecoder == nullptr);
+
+    if (!createAudioPipeline(&m_OriginalAudioConfig, &m_AudioRenderer, &m_OpusDecoder, &m_ActiveAudioConfig)) {
+        return false;
+    }
+
+    // Losses before the new decoder has any history can only be concealed
+    m_AudioLossPending = false;
+    m_LastAudioFrameSamples = m_ActiveAudioConfig.samplesPerFrame;
+    return true;
+}
+
+int Session::audioReinitThread(void* context)
+{
+    auto me = reinterpret_cast<Session*>(context);
+
+    me->m_AudioReinitSucceeded = createAudioPipeline(&me->m_OriginalAudioConfig,
+                                                     &me->m_PendingAudioRenderer,
+                                                     &me->m_PendingOpusDecoder,
+                                                     &me->m_PendingAudioConfig);
+
+    // Publishes the results above to the audio thread
+    me->m_AudioReinitDone.store(true, std::memory_order_release);
+    return 0;
+}
+
+void Session::updateAudioRendererReinit()
+{
+    SDL_assert(m_AudioRenderer == nullptr);
+
+    if (m_AudioReinitThread != nullptr) {
+        if (!m_AudioReinitDone.load(std::memory_order_acquire)) {
+            // Still working on it
+            return;
+        }
+
+        SDL_WaitThread(m_AudioReinitThread, nullptr);
+        m_AudioReinitThread = nullptr;
+
+        if (m_AudioReinitSucceeded) {
+            SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                        "Audio reinitialization took %d ms",
+                        SDL_GetTicks() - m_AudioReinitStartTime);
+
+            m_AudioRenderer = m_PendingAudioRenderer;
+            m_OpusDecoder = m_PendingOpusDecoder;
+            m_ActiveAudioConfig = m_PendingAudioConfig;
+            m_PendingAudioRenderer = nullptr;
+            m_PendingOpusDecoder = nullptr;
+
+            m_AudioLossPending = false;
+            m_LastAudioFrameSamples = m_ActiveAudioConfig.samplesPerFrame;
+
+            // Play what arrived while we were waiting. Empty packets were lost.
+            while (!m_QueuedAudioPackets.empty() && m_AudioRenderer != nullptr) {
+                const std::vector<unsigned char>& packet = m_QueuedAudioPackets.front();
+                decodeAndPlayAudio(packet.empty() ? nullptr : packet.data(), (int)packet.size(), false);
+                m_QueuedAudioPackets.pop_front();
+            }
+            m_QueuedAudioPackets.clear();
+            return;
+        }
+    }
+
+    // Start right away after a failure, but only retry once in a while
+    // if the device is still unavailable.
+    if (m_AudioReinitStartTime != 0 &&
+            !SDL_TICKS_PASSED(SDL_GetTicks(), m_AudioReinitStartTime + AUDIO_REINIT_INTERVAL_MS)) {
+        return;
+    }
+
+    m_AudioReinitStartTime = SDL_GetTicks();
+    m_AudioReinitDone.store(false, std::memory_order_relaxed);
+    m_AudioReinitThread = SDL_CreateThread(Session::audioReinitThread, "AudioReinit", this);
+    if (m_AudioReinitThread == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "SDL_CreateThread() failed: %s",
+                     SDL_GetError());
+    }
+}
+
+void Session::getAudioStats(AUDIO_STATS& stats)
+{
+    stats.receivedPackets = m_AudioReceivedPackets.load(std::memory_order_relaxed);
+    stats.lostPackets = m_AudioLostPackets.load(std::memory_order_relaxed);
+    stats.fecRecoveredPackets = m_AudioFecRecoveredPackets.load(std::memory_order_relaxed);
+    stats.concealedPackets = m_AudioConcealedPackets.load(std::memory_order_relaxed);
+}
+
+bool Session::decodeAndPlayAudio(const unsigned char* data, int length, bool fec)
+{
+    int samplesDecoded;
+
+    int desiredSize = sizeof(short) * m_ActiveAudioConfig.samplesPerFrame * m_ActiveAudioConfig.channelCount;
+    void* buffer = m_AudioRenderer->getAudioBuffer(&desiredSize);
+    if (buffer == nullptr) {
+        return true;
+    }
+
+    // Recovered and concealed audio has to be exactly as long as what was lost,
+    // which we assume is as long as the last packet we decoded.
+    int frameSize = desiredSize / sizeof(short) / m_ActiveAudioConfig.channelCount;
+    if (data == nullptr || fec) {
+        frameSize = SDL_min(frameSize, m_LastAudioFrameSamples);
+    }
+
+    samplesDecoded = opus_multistream_decode(m_OpusDecoder,
+                                             data,
+                                             length,
+                                             (short*)buffer,
+                                             frameSize,
+                                             fec ? 1 : 0);
+
+    // Update desiredSize with the number of bytes actually populated by the decoding operation
+    if (samplesDecoded > 0) {
+        SDL_assert(desiredSize >= (int)(sizeof(short) * samplesDecoded * m_ActiveAudioConfig.channelCount));
+        desiredSize = sizeof(short) * samplesDecoded * m_ActiveAudioConfig.channelCount;
+
+        if (data != nullptr && !fec) {
+            m_LastAudioFrameSamples = samplesDecoded;
+        }
+    }
+    else {
+        desiredSize = 0;
+    }
+
+    if (!m_AudioRenderer->submitAudio(desiredSize)) {
+        SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                    "Reinitializing audio renderer after failure");
+
+        opus_multistream_decoder_destroy(m_OpusDecoder);
+        m_OpusDecoder = nullptr;
+
+        delete m_AudioRenderer;
+        m_AudioRenderer = nullptr;
+        return false;
+    }
+
     return true;
 }
 
@@ -151,12 +420,30 @@ int Session::arInit(int /* audioConfiguration */,
                     void* /* arContext */, int /* arFlags */)
 {
     SDL_memcpy(&s_ActiveSession->m_OriginalAudioConfig, opusConfig, sizeof(*opusConfig));
+
+    if (StreamRecorder::isEnabled()) {
+        StreamRecorder::recordAudioSetup(opusConfig);
+    }
+
     s_ActiveSession->initializeAudioRenderer();
     return 0;
 }
 
 void Session::arCleanup()
 {
+    // Wait for any replacement renderer being created, then throw it away
+    if (s_ActiveSession->m_AudioReinitThread != nullptr) {
+        SDL_WaitThread(s_ActiveSession->m_AudioReinitThread, nullptr);
+        s_ActiveSession->m_AudioReinitThread = nullptr;
+
+        delete s_ActiveSession->m_PendingAudioRenderer;
+        s_ActiveSession->m_PendingAudioRenderer = nullptr;
+
+        opus_multistream_decoder_destroy(s_ActiveSession->m_PendingOpusDecoder);
+        s_ActiveSession->m_PendingOpusDecoder = nullptr;
+    }
+    s_ActiveSession->m_QueuedAudioPackets.clear();
+
     delete s_ActiveSession->m_AudioRenderer;
     s_ActiveSession->m_AudioRenderer = nullptr;
 
@@ -166,7 +453,12 @@ void Session::arCleanup()
 
 void Session::arDecodeAndPlaySample(char* sampleData, int sampleLength)
 {
-    int samplesDecoded;
+    TRACE_SCOPE("Session::arDecodeAndPlaySample");
+
+    // Record everything the host sent, even if we end up dropping it
+    if (StreamRecorder::isEnabled()) {
+        StreamRecorder::recordAudioSample(sampleData, sampleLength);
+    }
 
 #ifndef STEAM_LINK
     // Set this thread to high priority to reduce the chance of missing
@@ -182,79 +474,77 @@ void Session::arDecodeAndPlaySample(char* sampleData, int sampleLength)
     }
 #endif
 
-    // See if we need to drop this sample
-    if (s_ActiveSession->m_DropAudioEndTime != 0) {
-        if (SDL_TICKS_PASSED(SDL_GetTicks(), s_ActiveSession->m_DropAudioEndTime)) {
-            // Avoid calling SDL_GetTicks() now
-            s_ActiveSession->m_DropAudioEndTime = 0;
-
-            SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
-                        "Audio drop window has ended");
-        }
-        else {
-            // We're still in the drop window
-            return;
-        }
+    // The library calls us without any data in place of each
+    // packet it has detected as lost from the sequence numbers.
+    bool packetLost = sampleData == nullptr || sampleLength == 0;
+    if (packetLost) {
+        s_ActiveSession->m_AudioLostPackets.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        s_ActiveSession->m_AudioReceivedPackets.fetch_add(1, std::memory_order_relaxed);
     }
 
     s_ActiveSession->m_AudioSampleCount++;
 
     // If audio is muted, don't decode or play the audio
     if (s_ActiveSession->m_AudioMuted) {
+        s_ActiveSession->m_AudioLossPending = false;
         return;
     }
 
     if (s_ActiveSession->m_AudioRenderer != nullptr) {
-        int desiredSize = sizeof(short) * s_ActiveSession->m_ActiveAudioConfig.samplesPerFrame * s_ActiveSession->m_ActiveAudioConfig.channelCount;
-        void* buffer = s_ActiveSession->m_AudioRenderer->getAudioBuffer(&desiredSize);
-        if (buffer == nullptr) {
-            return;
-        }
-
-        samplesDecoded = opus_multistream_decode(s_ActiveSession->m_OpusDecoder,
-                                                 (unsigned char*)sampleData,
-                                                 sampleLength,
-                                                 (short*)buffer,
-                                                 desiredSize / sizeof(short) / s_ActiveSession->m_ActiveAudioConfig.channelCount,
-                                                 0);
-
-        // Update desiredSize with the number of bytes actually populated by the decoding operation
-        if (samplesDecoded > 0) {
-            SDL_assert(desiredSize >= (int)(sizeof(short) * samplesDecoded * s_ActiveSession->m_ActiveAudioConfig.channelCount));
-            desiredSize = sizeof(short) * samplesDecoded * s_ActiveSession->m_ActiveAudioConfig.channelCount;
+        if (packetLost) {
+            // Hold off on a loss until the next packet arrives, since it may carry
+            // a low bitrate copy of the lost one (Opus in-band FEC). The renderer's
+            // buffering covers the extra packet of delay. If we were already holding
+            // a loss, the next packet can't help with that one, so conceal it now.
+            if (s_ActiveSession->m_AudioLossPending) {
+                s_ActiveSession->m_AudioConcealedPackets.fetch_add(1, std::memory_order_relaxed);
+                s_ActiveSession->decodeAndPlayAudio(nullptr, 0, false);
+            }
+            s_ActiveSession->m_AudioLossPending = true;
         }
         else {
-            desiredSize = 0;
+            bool rendererOk = true;
+
+            if (s_ActiveSession->m_AudioLossPending) {
+                s_ActiveSession->m_AudioLossPending = false;
+
+                // Opus falls back to concealment if there's no FEC data
+                const unsigned char* data = (const unsigned char*)sampleData;
+                if (hasOpusFecData(data, sampleLength, s_ActiveSession->m_ActiveAudioConfig.streams)) {
+                    s_ActiveSession->m_AudioFecRecoveredPackets.fetch_add(1, std::memory_order_relaxed);
+                }
+                else {
+                    s_ActiveSession->m_AudioConcealedPackets.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                rendererOk = s_ActiveSession->decodeAndPlayAudio(data, sampleLength, true);
+            }
+
+            if (rendererOk) {
+                s_ActiveSession->decodeAndPlayAudio((const unsigned char*)sampleData, sampleLength, false);
+            }
         }
+    }
 
-        if (!s_ActiveSession->m_AudioRenderer->submitAudio(desiredSize)) {
-            SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
-                        "Reinitializing audio renderer after failure");
-
-            opus_multistream_decoder_destroy(s_ActiveSession->m_OpusDecoder);
-            s_ActiveSession->m_OpusDecoder = nullptr;
-
-            delete s_ActiveSession->m_AudioRenderer;
-            s_ActiveSession->m_AudioRenderer = nullptr;
+    // Renderers can take a long time to create, so a failed one is replaced in
+    // the background. Meanwhile, keep the latest audio to play once it's ready.
+    if (s_ActiveSession->m_AudioRenderer == nullptr) {
+        int maxQueuedPackets = SDL_max(1, AUDIO_REINIT_QUEUE_MS * (s_ActiveSession->m_OriginalAudioConfig.sampleRate / 1000) /
+                                          s_ActiveSession->m_OriginalAudioConfig.samplesPerFrame);
+        while ((int)s_ActiveSession->m_QueuedAudioPackets.size() >= maxQueuedPackets) {
+            s_ActiveSession->m_QueuedAudioPackets.pop_front();
         }
-    }
 
-    // Only try to recreate the audio renderer every 200 samples (1 second)
-    // to avoid thrashing if the audio device is unavailable. It is
-    // safe to reinitialize here because we can't be torn down while
-    // the audio decoder/playback thread is still alive.
-    if (s_ActiveSession->m_AudioRenderer == nullptr && (s_ActiveSession->m_AudioSampleCount % 200) == 0) {
-        // Since we're doing this inline and audio initialization takes time, we need
-        // to drop samples to account for the time we've spent blocking audio rendering
-        // so we return to real-time playback and don't accumulate latency.
-        Uint32 audioReinitStartTime = SDL_GetTicks();
-        if (s_ActiveSession->initializeAudioRenderer()) {
-            Uint32 audioReinitStopTime = SDL_GetTicks();
-
-            s_ActiveSession->m_DropAudioEndTime = audioReinitStopTime + (audioReinitStopTime - audioReinitStartTime);
-            SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
-                        "Audio reinitialization took %d ms - starting drop window",
-                        audioReinitStopTime - audioReinitStartTime);
+        if (packetLost) {
+            s_ActiveSession->m_QueuedAudioPackets.emplace_back();
+        }
+        else {
+            s_ActiveSession->m_QueuedAudioPackets.emplace_back((unsigned char*)sampleData,
+                                                               (unsigned char*)sampleData + sampleLength);
         }
+
+        s_ActiveSession->updateAudioRendererReinit();
     }
 }
@@ -0,0 +1,378 @@
+#include "audioconverter.h"
+
+#include <SDL.h>
+
+#include <cmath>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__)
+// SSE2 is always available on x64
+#define HAVE_SSE2_AUDIO
+#include <emmintrin.h>
+#endif
+
+#define S16_TO_F32_SCALE (1.0f / 32768)
+
+// -3 dB, for splitting a channel between two speakers
+#define FOLD_GAIN_SPLIT 0.7071f
+
+// Where each speaker position is mixed to when the output doesn't have it,
+// in order of preference. Each target is only usable if the output has all
+// of its positions. LFE is dropped, as is usual when downmixing.
+static const struct {
+    int positions[2];
+    float gain;
+} k_FoldTargets[AUDIO_CHANNEL_MAX][3] = {
+    // FL
+    { { { AUDIO_CHANNEL_FC, AUDIO_CHANNEL_NONE }, 1.0f } },
+    // FR
+    { { { AUDIO_CHANNEL_FC, AUDIO_CHANNEL_NONE }, 1.0f } },
+    // FC
+    { { { AUDIO_CHANNEL_FL, AUDIO_CHANNEL_FR }, FOLD_GAIN_SPLIT } },
+    // LFE
+    { },
+    // BL
+    { { { AUDIO_CHANNEL_SL, AUDIO_CHANNEL_NONE }, 1.0f },
+      { { AUDIO_CHANNEL_FL, AUDIO_CHANNEL_NONE }, FOLD_GAIN_SPLIT },
+      { { AUDIO_CHANNEL_FC, AUDIO_CHANNEL_NONE }, FOLD_GAIN_SPLIT } },
+    // BR
+    { { { AUDIO_CHANNEL_SR, AUDIO_CHANNEL_NONE }, 1.0f },
+      { { AUDIO_CHANNEL_FR, AUDIO_CHANNEL_NONE }, FOLD_GAIN_SPLIT },
+      { { AUDIO_CHANNEL_FC, AUDIO_CHANNEL_NONE }, FOLD_GAIN_SPLIT } },
+    // SL
+    { { { AUDIO_CHANNEL_BL, AUDIO_CHANNEL_NONE }, 1.0f },
+      { { AUDIO_CHANNEL_FL, AUDIO_CHANNEL_NONE }, FOLD_GAIN_SPLIT },
+      { { AUDIO_CHANNEL_FC, AUDIO_CHANNEL_NONE }, FOLD_GAIN_SPLIT } },
+    // SR
+    { { { AUDIO_CHANNEL_BR, AUDIO_CHANNEL_NONE }, 1.0f },
+      { { AUDIO_CHANNEL_FR, AUDIO_CHANNEL_NONE }, FOLD_GAIN_SPLIT },
+      { { AUDIO_CHANNEL_FC, AUDIO_CHANNEL_NONE }, FOLD_GAIN_SPLIT } },
+};
+
+static void convertS16ToF32(const int16_t* input, float* output, int samples)
+{
+    int i = 0;
+
+#ifdef HAVE_SSE2_AUDIO
+    const __m128 scale = _mm_set1_ps(S16_TO_F32_SCALE);
+    for (; i + 8 <= samples; i += 8) {
+        __m128i s16 = _mm_loadu_si128((const __m128i*)&input[i]);
+
+        // Sign extend by unpacking each sample into the top of a 32-bit lane
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s16, s16), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s16, s16), 16);
+
+        _mm_storeu_ps(&output[i], _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(&output[i + 4], _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+#endif
+
+    for (; i < samples; i++) {
+        output[i] = input[i] * S16_TO_F32_SCALE;
+    }
+}
+
+static inline int16_t clampToS16(float value)
+{
+    return (int16_t)SDL_clamp(lrintf(value), -32768, 32767);
+}
+
+AudioConverter::AudioConverter()
+    : m_Kernel(KERNEL_COPY),
+      m_OutputFormat(SAMPLE_FORMAT_S16),
+      m_InputChannels(0),
+      m_OutputChannels(0)
+{
+    memset(m_Sources, 0, sizeof(m_Sources));
+    memset(m_Matrix, 0, sizeof(m_Matrix));
+}
+
+void AudioConverter::getStreamLayout(int channels, int* layout)
+{
+    // Our streams always use the first positions in order
+    for (int i = 0; i < channels; i++) {
+        layout[i] = i < AUDIO_CHANNEL_MAX ? i : AUDIO_CHANNEL_NONE;
+    }
+}
+
+bool AudioConverter::remapOpusChannels(POPUS_MULTISTREAM_CONFIGURATION opusConfig, const int* layout)
+{
+    bool used[AUDIO_CHANNEL_MAX] = {};
+
+    if (opusConfig->channelCount > AUDIO_CHANNEL_MAX) {
+        return false;
+    }
+
+    // The layout has to be a reordering of the stream's own channels
+    for (int i = 0; i < opusConfig->channelCount; i++) {
+        if (layout[i] < 0 || layout[i] >= opusConfig->channelCount || used[layout[i]]) {
+            return false;
+        }
+        used[layout[i]] = true;
+    }
+
+    unsigned char mapping[sizeof(opusConfig->mapping)];
+    for (int i = 0; i < opusConfig->channelCount; i++) {
+        mapping[i] = opusConfig->mapping[layout[i]];
+    }
+    memcpy(opusConfig->mapping, mapping, opusConfig->channelCount);
+
+    return true;
+}
+
+bool AudioConverter::initialize(const int* inputLayout, int inputChannels,
+                                const int* outputLayout, int outputChannels,
+                                SampleFormat outputFormat)
+{
+    if (inputChannels <= 0 || inputChannels > AUDIO_CHANNEL_MAX ||
+            outputChannels <= 0 || outputChannels > AUDIO_CONVERTER_MAX_OUTPUT_CHANNELS) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Unsupported audio conversion: %d to %d channels",
+                     inputChannels,
+                     outputChannels);
+        return false;
+    }
+
+    m_InputChannels = inputChannels;
+    m_OutputChannels = outputChannels;
+    m_OutputFormat = outputFormat;
+    memset(m_Matrix, 0, sizeof(m_Matrix));
+
+    int outputForPosition[AUDIO_CHANNEL_MAX];
+    for (int i = 0; i < AUDIO_CHANNEL_MAX; i++) {
+        outputForPosition[i] = -1;
+    }
+    for (int i = 0; i < outputChannels; i++) {
+        m_Sources[i] = -1;
+        if (outputLayout[i] >= 0 && outputLayout[i] < AUDIO_CHANNEL_MAX && outputForPosition[outputLayout[i]] < 0) {
+            outputForPosition[outputLayout[i]] = i;
+        }
+    }
+
+    bool mixing = false;
+    for (int i = 0; i < inputChannels; i++) {
+        int position = inputLayout[i];
+        if (position < 0 || position >= AUDIO_CHANNEL_MAX) {
+            continue;
+        }
+
+        int output = outputForPosition[position];
+        if (output >= 0) {
+            if (m_Sources[output] < 0) {
+                m_Sources[output] = i;
+                m_Matrix[output][i] = 1.0f;
+            }
+            continue;
+        }
+
+        // Mix this channel into the first of its fold targets we have
+        for (const auto& target : k_FoldTargets[position]) {
+            if (target.gain == 0) {
+                break;
+            }
+
+            int first = outputForPosition[target.positions[0]];
+            int second = target.positions[1] != AUDIO_CHANNEL_NONE ?
+                        outputForPosition[target.positions[1]] : -1;
+            if (first < 0 || (target.positions[1] != AUDIO_CHANNEL_NONE && second < 0)) {
+                continue;
+            }
+
+            m_Matrix[first][i] += target.gain;
+            if (second >= 0) {
+                m_Matrix[second][i] += target.gain;
+            }
+            mixing = true;
+            break;
+        }
+    }
+
+    if (mixing) {
+        // Scale everything down enough that a full scale signal on every
+        // input channel can't clip any of the output channels.
+        float maxGain = 1.0f;
+        for (int i = 0; i < outputChannels; i++) {
+            float gain = 0;
+            for (int j = 0; j < inputChannels; j++) {
+                gain += m_Matrix[i][j];
+            }
+            maxGain = SDL_max(maxGain, gain);
+        }
+
+        float scale = 1.0f / maxGain;
+        if (outputFormat == SAMPLE_FORMAT_F32) {
+            scale *= S16_TO_F32_SCALE;
+        }
+
+        for (int i = 0; i < outputChannels; i++) {
+            for (int j = 0; j < inputChannels; j++) {
+                m_Matrix[i][j] *= scale;
+            }
+        }
+
+        m_Kernel = KERNEL_MIX;
+    }
+    else {
+        bool identity = inputChannels == outputChannels;
+        for (int i = 0; i < outputChannels && identity; i++) {
+            identity = m_Sources[i] == i;
+        }
+
+        if (identity) {
+            m_Kernel = outputFormat == SAMPLE_FORMAT_S16 ? KERNEL_COPY : KERNEL_CONVERT;
+        }
+        else {
+            m_Kernel = KERNEL_SHUFFLE;
+        }
+    }
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Audio conversion: %d to %d channels (%s) as %s",
+                inputChannels,
+                outputChannels,
+                m_Kernel == KERNEL_MIX ? "mix" :
+                    m_Kernel == KERNEL_SHUFFLE ? "reorder" : "direct",
+                outputFormat == SAMPLE_FORMAT_S16 ? "S16" : "F32");
+    return true;
+}
+
+bool AudioConverter::isPassthrough()
+{
+    return m_Kernel == KERNEL_COPY;
+}
+
+int AudioConverter::getOutputFrameSize()
+{
+    return m_OutputChannels * (m_OutputFormat == SAMPLE_FORMAT_S16 ? sizeof(int16_t) : sizeof(float));
+}
+
+void AudioConverter::fillSilence(void* output, int frames)
+{
+    // Zero is silence in both formats
+    memset(output, 0, (size_t)frames * getOutputFrameSize());
+}
+
+void AudioConverter::convert(const int16_t* input, void* output, int frames)
+{
+    switch (m_Kernel) {
+    case KERNEL_COPY:
+        memcpy(output, input, (size_t)frames * m_InputChannels * sizeof(int16_t));
+        break;
+    case KERNEL_CONVERT:
+        convertS16ToF32(input, (float*)output, frames * m_InputChannels);
+        break;
+    case KERNEL_SHUFFLE:
+        shuffle(input, output, frames);
+        break;
+    case KERNEL_MIX:
+        mix(input, output, frames);
+        break;
+    }
+}
+
+void AudioConverter::shuffle(const int16_t* input, void* output, int frames)
+{
+    if (m_OutputFormat == SAMPLE_FORMAT_S16) {
+        int16_t* out = (int16_t*)output;
+        for (int i = 0; i < frames; i++) {
+            for (int ch = 0; ch < m_OutputChannels; ch++) {
+                out[ch] = m_Sources[ch] >= 0 ? input[m_Sources[ch]] : 0;
+            }
+            input += m_InputChannels;
+            out += m_OutputChannels;
+        }
+    }
+    else {
+        float* out = (float*)output;
+        for (int i = 0; i < frames; i++) {
+            for (int ch = 0; ch < m_OutputChannels; ch++) {
+                out[ch] = m_Sources[ch] >= 0 ? input[m_Sources[ch]] * S16_TO_F32_SCALE : 0;
+            }
+            input += m_InputChannels;
+            out += m_OutputChannels;
+        }
+    }
+}
+
+void AudioConverter::mix(const int16_t* input, void* output, int frames)
+{
+    int16_t* outS16 = (int16_t*)output;
+    float* outF32 = (float*)output;
+
+#ifdef HAVE_SSE2_AUDIO
+    // Every input frame fits in a single register. The unused lanes stay zero.
+    int16_t frame[AUDIO_CHANNEL_MAX] = {};
+
+    if (m_OutputChannels == 2) {
+        const __m128 left0 = _mm_loadu_ps(&m_Matrix[0][0]);
+        const __m128 left1 = _mm_loadu_ps(&m_Matrix[0][4]);
+        const __m128 right0 = _mm_loadu_ps(&m_Matrix[1][0]);
+        const __m128 right1 = _mm_loadu_ps(&m_Matrix[1][4]);
+
+        for (int i = 0; i < frames; i++) {
+            memcpy(frame, &input[i * m_InputChannels], m_InputChannels * sizeof(int16_t));
+            __m128i s16 = _mm_loadu_si128((const __m128i*)frame);
+            __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s16, s16), 16));
+            __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s16, s16), 16));
+
+            __m128 left = _mm_add_ps(_mm_mul_ps(lo, left0), _mm_mul_ps(hi, left1));
+            __m128 right = _mm_add_ps(_mm_mul_ps(lo, right0), _mm_mul_ps(hi, right1));
+
+            // Sum the lanes of both at once, leaving L and R in the low lanes
+            __m128 sums = _mm_add_ps(_mm_unpacklo_ps(left, right), _mm_unpackhi_ps(left, right));
+            sums = _mm_add_ps(sums, _mm_movehl_ps(sums, sums));
+
+            if (m_OutputFormat == SAMPLE_FORMAT_S16) {
+                __m128i packed = _mm_cvtps_epi32(sums);
+                packed = _mm_packs_epi32(packed, packed);
+                int32_t pair = _mm_cvtsi128_si32(packed);
+                memcpy(&outS16[i * 2], &pair, sizeof(pair));
+            }
+            else {
+                _mm_storel_pi((__m64*)&outF32[i * 2], sums);
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < frames; i++) {
+        memcpy(frame, &input[i * m_InputChannels], m_InputChannels * sizeof(int16_t));
+        __m128i s16 = _mm_loadu_si128((const __m128i*)frame);
+        __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s16, s16), 16));
+        __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s16, s16), 16));
+
+        for (int ch = 0; ch < m_OutputChannels; ch++) {
+            __m128 sum = _mm_add_ps(_mm_mul_ps(lo, _mm_loadu_ps(&m_Matrix[ch][0])),
+                                    _mm_mul_ps(hi, _mm_loadu_ps(&m_Matrix[ch][4])));
+            sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+            sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+
+            float value = _mm_cvtss_f32(sum);
+            if (m_OutputFormat == SAMPLE_FORMAT_S16) {
+                outS16[i * m_OutputChannels + ch] = clampToS16(value);
+            }
+            else {
+                outF32[i * m_OutputChannels + ch] = value;
+            }
+        }
+    }
+#else
+    for (int i = 0; i < frames; i++) {
+        const int16_t* in = &input[i * m_InputChannels];
+
+        for (int ch = 0; ch < m_OutputChannels; ch++) {
+            float value = 0;
+            for (int j = 0; j < m_InputChannels; j++) {
+                value += in[j] * m_Matrix[ch][j];
+            }
+
+            if (m_OutputFormat == SAMPLE_FORMAT_S16) {
+                outS16[i * m_OutputChannels + ch] = clampToS16(value);
+            }
+            else {
+                outF32[i * m_OutputChannels + ch] = value;
+            }
+        }
+    }
+#endif
+}
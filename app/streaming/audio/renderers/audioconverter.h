@@ -0,0 +1,85 @@
+#pragma once
+
+#include <Limelight.h>
+
+#include <stdint.h>
+
+// Speaker positions, numbered in the channel order of our Opus streams
+enum AudioChannel {
+    AUDIO_CHANNEL_NONE = -1,
+    AUDIO_CHANNEL_FL = 0,
+    AUDIO_CHANNEL_FR,
+    AUDIO_CHANNEL_FC,
+    AUDIO_CHANNEL_LFE,
+    AUDIO_CHANNEL_BL,
+    AUDIO_CHANNEL_BR,
+    AUDIO_CHANNEL_SL,
+    AUDIO_CHANNEL_SR,
+    AUDIO_CHANNEL_MAX
+};
+
+// Devices can have more speakers than our streams do
+#define AUDIO_CONVERTER_MAX_OUTPUT_CHANNELS 32
+
+// Converts interleaved S16 audio from the decoder into the sample format and
+// speaker layout of an audio device. The cheapest way to do the conversion is
+// picked once up front, so the real-time audio callback doesn't have to work
+// it out for every sample. Channels the device doesn't have are mixed into
+// the nearest ones it does, and its channels without a source are silent.
+class AudioConverter
+{
+public:
+    enum SampleFormat {
+        SAMPLE_FORMAT_S16,
+        SAMPLE_FORMAT_F32
+    };
+
+    AudioConverter();
+
+    // Layouts list the speaker position of each channel. Output channels
+    // can be AUDIO_CHANNEL_NONE to leave them silent.
+    bool initialize(const int* inputLayout, int inputChannels,
+                    const int* outputLayout, int outputChannels,
+                    SampleFormat outputFormat);
+
+    // Returns true if the output is exactly the input
+    bool isPassthrough();
+
+    int getOutputFrameSize();
+
+    void convert(const int16_t* input, void* output, int frames);
+
+    void fillSilence(void* output, int frames);
+
+    // Fills in the default layout of a stream with this many channels
+    static void getStreamLayout(int channels, int* layout);
+
+    // Reorders the streams in an Opus configuration so the decoder outputs
+    // the channels in this layout, which is free compared to reordering them
+    // ourselves. The layout must contain the same positions as the stream.
+    static bool remapOpusChannels(POPUS_MULTISTREAM_CONFIGURATION opusConfig, const int* layout);
+
+private:
+    enum Kernel {
+        KERNEL_COPY,
+        KERNEL_CONVERT,
+        KERNEL_SHUFFLE,
+        KERNEL_MIX
+    };
+
+    void shuffle(const int16_t* input, void* output, int frames);
+
+    void mix(const int16_t* input, void* output, int frames);
+
+    Kernel m_Kernel;
+    SampleFormat m_OutputFormat;
+    int m_InputChannels;
+    int m_OutputChannels;
+
+    // Input channel for each output channel (or -1 for silence) when shuffling
+    int m_Sources[AUDIO_CONVERTER_MAX_OUTPUT_CHANNELS];
+
+    // Gain from each input channel to each output channel when mixing,
+    // including the scaling to the output format
+    float m_Matrix[AUDIO_CONVERTER_MAX_OUTPUT_CHANNELS][AUDIO_CHANNEL_MAX];
+};
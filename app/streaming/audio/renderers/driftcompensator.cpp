@@ -0,0 +1,151 @@
+#include "driftcompensator.h"
+
+#include "streaming/streamutils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Fill levels are fitted over windows this long, which is enough to see
+// through the sawtooth of packets arriving and the device reading them.
+#define DRIFT_WINDOW_MS 5000
+#define MIN_WINDOW_SAMPLES 50
+
+// Fraction of each window's drift measurement added to the estimate
+#define DRIFT_SMOOTHING 0.25
+
+// How long we take to pull the fill level back to the target. This is
+// slow enough for the change in pitch to be inaudible.
+#define FILL_CONVERGENCE_TIME_S 10
+
+// Real clocks are within a few hundred ppm of each other
+#define MAX_COMPENSATION 0.002
+
+// Frames of the previous input kept for interpolation
+#define HISTORY_FRAMES 3
+
+AudioDriftCompensator::AudioDriftCompensator(int channelCount, int sampleRate)
+    : m_ChannelCount(channelCount),
+      m_SampleRate(sampleRate),
+      m_Compensation(0),
+      m_DeviceDrift(0),
+      m_HasDriftEstimate(false),
+      m_Input(HISTORY_FRAMES * channelCount, 0),
+      m_Position(HISTORY_FRAMES - 1)
+{
+    discardFillLevels();
+}
+
+AudioDriftCompensator::~AudioDriftCompensator()
+{
+    if (m_HasDriftEstimate) {
+        SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                    "Audio device clock drift: %.0f ppm",
+                    m_DeviceDrift * 1000000);
+    }
+}
+
+void AudioDriftCompensator::discardFillLevels()
+{
+    m_WindowStartNs = 0;
+    m_WindowStartCorrectedFrames = 0;
+    m_WindowSamples = 0;
+    m_SumT = m_SumTT = 0;
+    m_SumFill = m_SumTarget = 0;
+    m_SumTrend = m_SumTTrend = 0;
+}
+
+void AudioDriftCompensator::updateFillLevel(int fillFrames, int targetFrames, uint32_t correctedFrames)
+{
+    uint64_t nowNs = StreamUtils::getMonotonicNanoseconds();
+    if (m_WindowStartNs == 0) {
+        m_WindowStartNs = nowNs;
+        m_WindowStartCorrectedFrames = correctedFrames;
+    }
+
+    double t = (nowNs - m_WindowStartNs) / 1000000000.0;
+    double trend = fillFrames + (int32_t)(correctedFrames - m_WindowStartCorrectedFrames);
+    m_WindowSamples++;
+    m_SumT += t;
+    m_SumTT += t * t;
+    m_SumFill += fillFrames;
+    m_SumTarget += targetFrames;
+    m_SumTrend += trend;
+    m_SumTTrend += t * trend;
+
+    if (t < DRIFT_WINDOW_MS / 1000.0) {
+        return;
+    }
+
+    double denominator = m_WindowSamples * m_SumTT - m_SumT * m_SumT;
+    if (m_WindowSamples >= MIN_WINDOW_SAMPLES && denominator > 0) {
+        double slope = (m_WindowSamples * m_SumTTrend - m_SumT * m_SumTrend) / denominator;
+        double meanFill = m_SumFill / m_WindowSamples;
+        double meanTarget = m_SumTarget / m_WindowSamples;
+
+        // Our compensation was constant over the window, so whatever it
+        // didn't cancel out of the fill level's trend is the device's drift.
+        double drift = m_Compensation - slope / m_SampleRate;
+        if (m_HasDriftEstimate) {
+            m_DeviceDrift += (drift - m_DeviceDrift) * DRIFT_SMOOTHING;
+        }
+        else {
+            m_DeviceDrift = drift;
+            m_HasDriftEstimate = true;
+        }
+
+        m_Compensation = m_DeviceDrift + (meanTarget - meanFill) / ((double)FILL_CONVERGENCE_TIME_S * m_SampleRate);
+        m_Compensation = SDL_clamp(m_Compensation, -MAX_COMPENSATION, MAX_COMPENSATION);
+    }
+
+    discardFillLevels();
+}
+
+int AudioDriftCompensator::process(const int16_t* samples, int frames, const int16_t** output)
+{
+    // Append the new input after the history frames
+    size_t historySamples = HISTORY_FRAMES * m_ChannelCount;
+    m_Input.resize(historySamples + (size_t)frames * m_ChannelCount);
+    memcpy(&m_Input[historySamples], samples, (size_t)frames * m_ChannelCount * sizeof(int16_t));
+
+    int inputFrames = HISTORY_FRAMES + frames;
+    double step = 1.0 / (1.0 + m_Compensation);
+
+    m_Output.resize(((size_t)(frames * (1.0 + MAX_COMPENSATION)) + 2) * m_ChannelCount);
+
+    // Cubic Hermite interpolation between the frames around each position,
+    // which stays flat across the audible range unlike linear interpolation.
+    int outputFrames = 0;
+    for (;;) {
+        int i = (int)m_Position;
+        if (i + 2 >= inputFrames || (size_t)(outputFrames + 1) * m_ChannelCount > m_Output.size()) {
+            break;
+        }
+
+        float x = (float)(m_Position - i);
+        const int16_t* p0 = &m_Input[(size_t)(i - 1) * m_ChannelCount];
+        const int16_t* p1 = p0 + m_ChannelCount;
+        const int16_t* p2 = p1 + m_ChannelCount;
+        const int16_t* p3 = p2 + m_ChannelCount;
+        int16_t* out = &m_Output[(size_t)outputFrames * m_ChannelCount];
+
+        for (int ch = 0; ch < m_ChannelCount; ch++) {
+            float c1 = 0.5f * (p2[ch] - p0[ch]);
+            float c2 = p0[ch] - 2.5f * p1[ch] + 2.0f * p2[ch] - 0.5f * p3[ch];
+            float c3 = 0.5f * (p3[ch] - p0[ch]) + 1.5f * (p1[ch] - p2[ch]);
+            float value = ((c3 * x + c2) * x + c1) * x + p1[ch];
+
+            out[ch] = (int16_t)SDL_clamp(lrintf(value), -32768, 32767);
+        }
+
+        outputFrames++;
+        m_Position += step;
+    }
+
+    // Keep the tail of this input as history for the next one
+    memmove(m_Input.data(), &m_Input[(size_t)(inputFrames - HISTORY_FRAMES) * m_ChannelCount], historySamples * sizeof(int16_t));
+    m_Position -= frames;
+
+    *output = m_Output.data();
+    return outputFrames;
+}
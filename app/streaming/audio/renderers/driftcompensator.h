@@ -0,0 +1,63 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <stdint.h>
+#include <vector>
+
+// The audio device's clock runs slightly fast or slow compared to the host's,
+// so the buffered audio slowly grows or drains even without network jitter.
+// This estimates that drift from the trend in the buffer fill level and
+// stretches the decoded audio by the same tiny ratio to cancel it out, while
+// also nudging the fill level towards the renderer's target.
+//
+// All methods must be called on the thread submitting audio.
+class AudioDriftCompensator
+{
+public:
+    AudioDriftCompensator(int channelCount, int sampleRate);
+
+    ~AudioDriftCompensator();
+
+    // Called with the buffer fill level before each packet is added. If the
+    // renderer drops or repeats frames itself to correct the fill level, it
+    // must pass the running total of dropped minus repeated frames, since
+    // they would otherwise hide the drift from us.
+    void updateFillLevel(int fillFrames, int targetFrames, uint32_t correctedFrames = 0);
+
+    // Called when the fill level isn't meaningful (while the renderer is
+    // buffering up after an underrun, for example)
+    void discardFillLevels();
+
+    // Returns the number of frames in the output, which remains valid until
+    // the next call. The output lags the input by a frame.
+    int process(const int16_t* samples, int frames, const int16_t** output);
+
+private:
+    int m_ChannelCount;
+    int m_SampleRate;
+
+    // Extra output frames produced for each input frame
+    double m_Compensation;
+    double m_DeviceDrift;
+    bool m_HasDriftEstimate;
+
+    // Least squares fit of fill level against time in the current window
+    uint64_t m_WindowStartNs;
+    uint32_t m_WindowStartCorrectedFrames;
+    int m_WindowSamples;
+    double m_SumT;
+    double m_SumTT;
+    double m_SumFill;
+    double m_SumTarget;
+
+    // The fill level with the renderer's corrections added back in
+    double m_SumTrend;
+    double m_SumTTrend;
+
+    // Interpolation state. The input is appended to the last few frames of
+    // the previous input, and the position is relative to the start of them.
+    std::vector<int16_t> m_Input;
+    std::vector<int16_t> m_Output;
+    double m_Position;
+};
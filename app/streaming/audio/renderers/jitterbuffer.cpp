@@ -0,0 +1,268 @@
+#include "jitterbuffer.h"
+
+#include "streaming/streamutils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// How quickly a burst of jitter stops counting towards the target
+#define JITTER_PEAK_HALF_LIFE_MS 15000
+
+// Fraction of each new fill level measurement added to the average
+#define FILL_SMOOTHING (1.0 / 16)
+
+// One frame is dropped or repeated every this many frames, depending on
+// whether the fill level is just outside the target or far away from it.
+#define SLOW_CORRECTION_INTERVAL 500
+#define FAST_CORRECTION_INTERVAL 100
+
+AudioJitterBuffer::AudioJitterBuffer(int channelCount, int sampleRate, int packetFrames, int deviceFrames)
+    : m_ChannelCount(channelCount),
+      m_SampleRate(sampleRate),
+      m_PacketFrames(packetFrames),
+      m_DeviceFrames(deviceFrames),
+      m_MaxTargetFrames(sampleRate * AUDIO_JITTER_BUFFER_MAX_MS / 1000),
+      m_Ring(nullptr),
+      m_RingFrames(0),
+      m_RingMask(0),
+      m_WritePos(0),
+      m_ReadPos(0),
+      m_TargetFrames(0),
+      m_LastArrivalTimeNs(0),
+      m_JitterPeakNs(0),
+      m_LastUnderrunCount(0),
+      m_OverflowFrames(0),
+      m_UnderrunCount(0),
+      m_Priming(true),
+      m_SmoothedFill(0),
+      m_Correction(CORRECTION_NONE),
+      m_CorrectionInterval(0),
+      m_FramesUntilCorrection(0),
+      m_DroppedFrames(0),
+      m_InsertedFrames(0),
+      m_CorrectedFrames(0),
+      m_LastReadFillFrames(0)
+{
+    // Start with enough to cover one packet arriving late
+    m_TargetFrames = std::min(m_DeviceFrames + m_PacketFrames * 2, m_MaxTargetFrames);
+}
+
+AudioJitterBuffer::~AudioJitterBuffer()
+{
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Audio jitter buffer: %u underruns, %u frames dropped, %u frames repeated, %u frames overflowed, final target %d ms",
+                m_UnderrunCount.load(),
+                m_DroppedFrames,
+                m_InsertedFrames,
+                m_OverflowFrames,
+                m_TargetFrames.load() * 1000 / m_SampleRate);
+
+    SDL_free(m_Ring);
+}
+
+bool AudioJitterBuffer::initialize()
+{
+    // Leave plenty of headroom over the maximum target, since a stalled
+    // audio device could let the fill level go well past it.
+    m_RingFrames = 1;
+    while (m_RingFrames < (uint32_t)(m_MaxTargetFrames + m_DeviceFrames) * 2) {
+        m_RingFrames <<= 1;
+    }
+    m_RingMask = m_RingFrames - 1;
+
+    m_Ring = (int16_t*)SDL_calloc(m_RingFrames, sizeof(int16_t) * m_ChannelCount);
+    if (m_Ring == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Failed to allocate audio jitter buffer");
+        return false;
+    }
+
+    return true;
+}
+
+int AudioJitterBuffer::getFillFrames()
+{
+    return m_LastReadFillFrames.load(std::memory_order_relaxed);
+}
+
+int AudioJitterBuffer::getTargetFrames()
+{
+    return m_TargetFrames.load(std::memory_order_relaxed);
+}
+
+uint32_t AudioJitterBuffer::getCorrectedFrames()
+{
+    return m_CorrectedFrames.load(std::memory_order_relaxed);
+}
+
+bool AudioJitterBuffer::isPriming()
+{
+    return m_Priming.load(std::memory_order_relaxed);
+}
+
+void AudioJitterBuffer::updateTarget(uint64_t arrivalTimeNs, int frames)
+{
+    if (m_LastArrivalTimeNs != 0) {
+        // Any time beyond the duration of the audio between two packets
+        // is time the consumer has to be able to play without them.
+        double intervalNs = (double)(arrivalTimeNs - m_LastArrivalTimeNs);
+        double lateNs = intervalNs - (frames * 1000000000.0 / m_SampleRate);
+
+        m_JitterPeakNs *= std::exp2(-intervalNs / (JITTER_PEAK_HALF_LIFE_MS * 1000000.0));
+        m_JitterPeakNs = std::max(m_JitterPeakNs, lateNs);
+    }
+    m_LastArrivalTimeNs = arrivalTimeNs;
+
+    // Underruns mean we didn't measure enough jitter to cover the
+    // real thing, so widen the margin by a packet for each one.
+    uint32_t underrunCount = m_UnderrunCount.load(std::memory_order_relaxed);
+    if (underrunCount != m_LastUnderrunCount) {
+        m_JitterPeakNs += (underrunCount - m_LastUnderrunCount) * (m_PacketFrames * 1000000000.0 / m_SampleRate);
+        m_LastUnderrunCount = underrunCount;
+    }
+
+    int jitterFrames = (int)(m_JitterPeakNs * m_SampleRate / 1000000000.0);
+    m_TargetFrames.store(std::min(m_DeviceFrames + m_PacketFrames + jitterFrames, m_MaxTargetFrames),
+                         std::memory_order_relaxed);
+}
+
+void AudioJitterBuffer::write(const int16_t* samples, int frames)
+{
+    updateTarget(StreamUtils::getMonotonicNanoseconds(), frames);
+
+    uint32_t writePos = m_WritePos.load(std::memory_order_relaxed);
+    uint32_t readPos = m_ReadPos.load(std::memory_order_acquire);
+    int freeFrames = (int)(m_RingFrames - (writePos - readPos));
+
+    if (frames > freeFrames) {
+        m_OverflowFrames += frames - freeFrames;
+        frames = freeFrames;
+    }
+
+    // The write may wrap around the end of the ring
+    uint32_t offset = writePos & m_RingMask;
+    int firstFrames = std::min(frames, (int)(m_RingFrames - offset));
+    memcpy(&m_Ring[offset * m_ChannelCount], samples, firstFrames * sizeof(int16_t) * m_ChannelCount);
+    memcpy(m_Ring, &samples[firstFrames * m_ChannelCount], (frames - firstFrames) * sizeof(int16_t) * m_ChannelCount);
+
+    m_WritePos.store(writePos + frames, std::memory_order_release);
+}
+
+void AudioJitterBuffer::copyFrames(int16_t* dst, uint32_t readPos, int frames)
+{
+    uint32_t offset = readPos & m_RingMask;
+    int firstFrames = std::min(frames, (int)(m_RingFrames - offset));
+    memcpy(dst, &m_Ring[offset * m_ChannelCount], firstFrames * sizeof(int16_t) * m_ChannelCount);
+    memcpy(&dst[firstFrames * m_ChannelCount], m_Ring, (frames - firstFrames) * sizeof(int16_t) * m_ChannelCount);
+}
+
+void AudioJitterBuffer::blendFrames(int16_t* dst, uint32_t readPos)
+{
+    const int16_t* a = &m_Ring[(readPos & m_RingMask) * m_ChannelCount];
+    const int16_t* b = &m_Ring[((readPos + 1) & m_RingMask) * m_ChannelCount];
+
+    for (int i = 0; i < m_ChannelCount; i++) {
+        dst[i] = (int16_t)(((int)a[i] + b[i]) / 2);
+    }
+}
+
+void AudioJitterBuffer::updateCorrection(int fillFrames)
+{
+    m_SmoothedFill += (fillFrames - m_SmoothedFill) * FILL_SMOOTHING;
+
+    // Don't chase the sawtooth of packets arriving and being played
+    double error = m_SmoothedFill - m_TargetFrames.load(std::memory_order_relaxed);
+    double hysteresis = std::max(m_PacketFrames / 2, m_SampleRate / 1000);
+
+    Correction correction;
+    if (error > hysteresis) {
+        correction = CORRECTION_DROP;
+    }
+    else if (error < -hysteresis) {
+        correction = CORRECTION_INSERT;
+    }
+    else {
+        correction = CORRECTION_NONE;
+    }
+
+    if (correction != m_Correction) {
+        m_FramesUntilCorrection = SLOW_CORRECTION_INTERVAL;
+    }
+
+    m_Correction = correction;
+    m_CorrectionInterval = std::abs(error) > hysteresis * 4 ?
+                FAST_CORRECTION_INTERVAL : SLOW_CORRECTION_INTERVAL;
+}
+
+void AudioJitterBuffer::read(int16_t* samples, int frames)
+{
+    uint32_t readPos = m_ReadPos.load(std::memory_order_relaxed);
+    uint32_t writePos = m_WritePos.load(std::memory_order_acquire);
+    int fillFrames = (int)(writePos - readPos);
+
+    m_LastReadFillFrames.store(fillFrames, std::memory_order_relaxed);
+
+    // Build back up to the target before we start playing, so we don't
+    // immediately underrun again.
+    if (m_Priming) {
+        if (fillFrames < m_TargetFrames.load(std::memory_order_relaxed)) {
+            memset(samples, 0, frames * sizeof(int16_t) * m_ChannelCount);
+            return;
+        }
+
+        m_Priming = false;
+        m_SmoothedFill = fillFrames;
+    }
+
+    updateCorrection(fillFrames);
+
+    int produced = 0;
+    while (produced < frames) {
+        int16_t* dst = &samples[produced * m_ChannelCount];
+        int availableFrames = (int)(writePos - readPos);
+
+        if (availableFrames == 0) {
+            memset(dst, 0, (frames - produced) * sizeof(int16_t) * m_ChannelCount);
+            m_UnderrunCount.fetch_add(1, std::memory_order_relaxed);
+            m_Priming = true;
+            break;
+        }
+
+        if (m_Correction != CORRECTION_NONE && m_FramesUntilCorrection == 0 && availableFrames >= 2) {
+            if (m_Correction == CORRECTION_DROP) {
+                // Play 2 frames as 1
+                blendFrames(dst, readPos);
+                readPos += 2;
+                produced++;
+                m_DroppedFrames++;
+                m_CorrectedFrames.fetch_add(1, std::memory_order_relaxed);
+                m_FramesUntilCorrection = m_CorrectionInterval;
+                continue;
+            }
+            else if (frames - produced >= 2) {
+                // Play a frame followed by its blend with the next one
+                copyFrames(dst, readPos, 1);
+                blendFrames(&dst[m_ChannelCount], readPos);
+                readPos++;
+                produced += 2;
+                m_InsertedFrames++;
+                m_CorrectedFrames.fetch_sub(1, std::memory_order_relaxed);
+                m_FramesUntilCorrection = m_CorrectionInterval;
+                continue;
+            }
+        }
+
+        int copyFrameCount = std::min(frames - produced, availableFrames);
+        if (m_Correction != CORRECTION_NONE && m_FramesUntilCorrection > 0) {
+            copyFrameCount = std::min(copyFrameCount, m_FramesUntilCorrection);
+            m_FramesUntilCorrection -= copyFrameCount;
+        }
+
+        copyFrames(dst, readPos, copyFrameCount);
+        readPos += copyFrameCount;
+        produced += copyFrameCount;
+    }
+
+    m_ReadPos.store(readPos, std::memory_order_release);
+}
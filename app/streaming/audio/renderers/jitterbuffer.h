@@ -0,0 +1,100 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <atomic>
+#include <stdint.h>
+
+// Longest we'll ever buffer to ride out network jitter
+#define AUDIO_JITTER_BUFFER_MAX_MS 200
+
+// A single producer, single consumer ring buffer of interleaved S16 audio
+// between the audio receive thread and the audio device callback. Rather
+// than a fixed amount of buffering, it aims to hold just enough audio to
+// cover the jitter measured in packet arrival times. The fill level is
+// steered towards that target by dropping or repeating single frames
+// (blended with their neighbours), so packets never have to be dropped
+// wholesale to keep latency down.
+class AudioJitterBuffer
+{
+public:
+    // packetFrames is the usual number of frames in each write and
+    // deviceFrames is the usual number of frames in each read.
+    AudioJitterBuffer(int channelCount, int sampleRate, int packetFrames, int deviceFrames);
+
+    ~AudioJitterBuffer();
+
+    // Returns false if the ring buffer couldn't be allocated
+    bool initialize();
+
+    // Producer only. Frames that don't fit are discarded.
+    void write(const int16_t* samples, int frames);
+
+    // Consumer only. Always fills the entire output buffer, padding
+    // with silence if there isn't enough audio buffered.
+    void read(int16_t* samples, int frames);
+
+    // The fill level before the consumer's last read, which is the point
+    // where the fill level is steered towards the target.
+    int getFillFrames();
+
+    int getTargetFrames();
+
+    // Total frames dropped minus frames repeated to correct the fill level
+    uint32_t getCorrectedFrames();
+
+    // True while playback is stopped to build the buffer back up
+    bool isPriming();
+
+private:
+    enum Correction {
+        CORRECTION_NONE,
+        CORRECTION_DROP,
+        CORRECTION_INSERT
+    };
+
+    void updateTarget(uint64_t arrivalTimeNs, int frames);
+
+    void updateCorrection(int fillFrames);
+
+    // Copies contiguous frames out of the ring buffer, handling wraparound
+    void copyFrames(int16_t* dst, uint32_t readPos, int frames);
+
+    // Writes the average of the frames at readPos and readPos + 1
+    void blendFrames(int16_t* dst, uint32_t readPos);
+
+    int m_ChannelCount;
+    int m_SampleRate;
+    int m_PacketFrames;
+    int m_DeviceFrames;
+    int m_MaxTargetFrames;
+
+    int16_t* m_Ring;
+    uint32_t m_RingFrames;
+    uint32_t m_RingMask;
+
+    // Monotonically increasing frame counters, which wrap at 2^32
+    std::atomic<uint32_t> m_WritePos;
+    std::atomic<uint32_t> m_ReadPos;
+
+    // Written by the producer and read by the consumer
+    std::atomic<int> m_TargetFrames;
+
+    // Producer state
+    uint64_t m_LastArrivalTimeNs;
+    double m_JitterPeakNs;
+    uint32_t m_LastUnderrunCount;
+    uint32_t m_OverflowFrames;
+
+    // Consumer state
+    std::atomic<uint32_t> m_UnderrunCount;
+    std::atomic<bool> m_Priming;
+    double m_SmoothedFill;
+    Correction m_Correction;
+    int m_CorrectionInterval;
+    int m_FramesUntilCorrection;
+    uint32_t m_DroppedFrames;
+    uint32_t m_InsertedFrames;
+    std::atomic<uint32_t> m_CorrectedFrames;
+    std::atomic<int> m_LastReadFillFrames;
+};
@@ -24,5 +24,8 @@ public:
         // 3 - LFE
         // 4 - Surround Left
         // 5 - Surround Right
+        //
+        // Renderers needing another order should use AudioConverter::remapOpusChannels()
+        // so the decoder does the reordering rather than the audio callback.
     }
 };
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "renderer.h"
+#include "audioconverter.h"
+#include "driftcompensator.h"
+#include "jitterbuffer.h"
 #include <SDL.h>
 
 class SdlAudioRenderer : public IAudioRenderer
@@ -19,7 +22,18 @@ public:
     virtual int getCapabilities();
 
 private:
+    static void SDLCALL audioCallback(void* userdata, Uint8* stream, int len);
+
     SDL_AudioDeviceID m_AudioDevice;
     void* m_AudioBuffer;
     int m_FrameSize;
+    int m_ChannelCount;
+    AudioJitterBuffer* m_JitterBuffer;
+    AudioDriftCompensator* m_DriftCompensator;
+
+    // We open the device with its own format and layout, so SDL doesn't
+    // have to convert anything behind our back.
+    AudioConverter m_Converter;
+    int16_t* m_ConversionBuffer;
+    int m_ConversionBufferFrames;
 };
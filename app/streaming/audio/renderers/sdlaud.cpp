@@ -3,9 +3,28 @@
 #include <Limelight.h>
 #include <SDL.h>
 
+// Speaker positions of SDL's channel layouts, by channel count
+static const int k_SdlLayouts[8][8] = {
+    { AUDIO_CHANNEL_FC },
+    { AUDIO_CHANNEL_FL, AUDIO_CHANNEL_FR },
+    { AUDIO_CHANNEL_FL, AUDIO_CHANNEL_FR, AUDIO_CHANNEL_LFE },
+    { AUDIO_CHANNEL_FL, AUDIO_CHANNEL_FR, AUDIO_CHANNEL_BL, AUDIO_CHANNEL_BR },
+    { AUDIO_CHANNEL_FL, AUDIO_CHANNEL_FR, AUDIO_CHANNEL_LFE, AUDIO_CHANNEL_BL, AUDIO_CHANNEL_BR },
+    { AUDIO_CHANNEL_FL, AUDIO_CHANNEL_FR, AUDIO_CHANNEL_FC, AUDIO_CHANNEL_LFE, AUDIO_CHANNEL_BL, AUDIO_CHANNEL_BR },
+    // We have nothing for the back center speaker
+    { AUDIO_CHANNEL_FL, AUDIO_CHANNEL_FR, AUDIO_CHANNEL_FC, AUDIO_CHANNEL_LFE, AUDIO_CHANNEL_NONE, AUDIO_CHANNEL_SL, AUDIO_CHANNEL_SR },
+    { AUDIO_CHANNEL_FL, AUDIO_CHANNEL_FR, AUDIO_CHANNEL_FC, AUDIO_CHANNEL_LFE, AUDIO_CHANNEL_BL, AUDIO_CHANNEL_BR, AUDIO_CHANNEL_SL, AUDIO_CHANNEL_SR },
+};
+
 SdlAudioRenderer::SdlAudioRenderer()
     : m_AudioDevice(0),
-      m_AudioBuffer(nullptr)
+      m_AudioBuffer(nullptr),
+      m_FrameSize(0),
+      m_ChannelCount(0),
+      m_JitterBuffer(nullptr),
+      m_DriftCompensator(nullptr),
+      m_ConversionBuffer(nullptr),
+      m_ConversionBufferFrames(0)
 {
     SDL_assert(!SDL_WasInit(SDL_INIT_AUDIO));
 
@@ -23,25 +42,38 @@ bool SdlAudioRenderer::prepareForPlayback(const OPUS_MULTISTREAM_CONFIGURATION*
 
     SDL_zero(want);
     want.freq = opusConfig->sampleRate;
-    want.format = AUDIO_S16;
+    want.format = AUDIO_S16SYS;
     want.channels = opusConfig->channelCount;
 
+#if SDL_VERSION_ATLEAST(2, 24, 0)
+    // Ask for the device's own format and layout, so the conversion happens
+    // in our precomputed converter rather than SDL's generic one. If this is
+    // wrong, SDL will still convert for us.
+    SDL_AudioSpec deviceSpec;
+    if (SDL_GetDefaultAudioInfo(nullptr, &deviceSpec, 0) == 0) {
+        if (deviceSpec.format == AUDIO_F32SYS) {
+            want.format = AUDIO_F32SYS;
+        }
+        if (deviceSpec.channels >= 1 && deviceSpec.channels <= SDL_arraysize(k_SdlLayouts)) {
+            want.channels = deviceSpec.channels;
+        }
+    }
+#endif
+
+    want.callback = audioCallback;
+    want.userdata = this;
+
     // On PulseAudio systems, setting a value too small can cause underruns for other
     // applications sharing this output device. We impose a floor of 480 samples (10 ms)
-    // to mitigate this issue. Otherwise, we will buffer up to 3 frames of audio which
-    // is 15 ms at regular 5 ms frames and 30 ms at 10 ms frames for slow connections.
-    // The buffering helps avoid audio underruns due to network jitter.
-//#ifndef Q_OS_DARWIN
-#if !defined(__APPLE__) || !defined(__MACH__)
-    want.samples = SDL_max(480, opusConfig->samplesPerFrame * 3);
-#else
-    // HACK: Changing the buffer size can lead to Bluetooth HFP
-    // audio issues on macOS, so we're leaving this alone.
+    // to mitigate this issue. Network jitter is absorbed by our jitter buffer, so the
+    // device buffer doesn't need to be any larger than that.
+    //
+    // NB: Changing the buffer size can also lead to Bluetooth HFP audio issues on macOS.
     // https://github.com/moonlight-stream/moonlight-qt/issues/1071
     want.samples = SDL_max(480, opusConfig->samplesPerFrame);
-#endif
 
     m_FrameSize = opusConfig->samplesPerFrame * sizeof(short) * opusConfig->channelCount;
+    m_ChannelCount = opusConfig->channelCount;
 
     m_AudioDevice = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
     if (m_AudioDevice == 0) {
@@ -51,6 +83,36 @@ bool SdlAudioRenderer::prepareForPlayback(const OPUS_MULTISTREAM_CONFIGURATION*
         return false;
     }
 
+    int streamLayout[AUDIO_CHANNEL_MAX];
+    AudioConverter::getStreamLayout(opusConfig->channelCount, streamLayout);
+    if (!m_Converter.initialize(streamLayout, opusConfig->channelCount,
+                                k_SdlLayouts[have.channels - 1], have.channels,
+                                have.format == AUDIO_F32SYS ?
+                                    AudioConverter::SAMPLE_FORMAT_F32 : AudioConverter::SAMPLE_FORMAT_S16)) {
+        return false;
+    }
+
+    if (!m_Converter.isPassthrough()) {
+        m_ConversionBufferFrames = have.samples;
+        m_ConversionBuffer = (int16_t*)SDL_malloc(m_ConversionBufferFrames * sizeof(int16_t) * opusConfig->channelCount);
+        if (m_ConversionBuffer == nullptr) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                         "Failed to allocate audio conversion buffer");
+            return false;
+        }
+    }
+
+    // The callback won't be invoked until we unpause the device
+    m_JitterBuffer = new AudioJitterBuffer(opusConfig->channelCount,
+                                           opusConfig->sampleRate,
+                                           opusConfig->samplesPerFrame,
+                                           have.samples);
+    if (!m_JitterBuffer->initialize()) {
+        return false;
+    }
+
+    m_DriftCompensator = new AudioDriftCompensator(opusConfig->channelCount, opusConfig->sampleRate);
+
     m_AudioBuffer = SDL_malloc(m_FrameSize);
     if (m_AudioBuffer == nullptr) {
         SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
@@ -61,7 +123,7 @@ bool SdlAudioRenderer::prepareForPlayback(const OPUS_MULTISTREAM_CONFIGURATION*
     SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
                 "Desired audio buffer: %u samples (%u bytes)",
                 want.samples,
-                want.samples * (Uint32)sizeof(short) * want.channels);
+                want.samples * (Uint32)(SDL_AUDIO_BITSIZE(want.format) / 8) * want.channels);
 
     SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
                 "Obtained audio buffer: %u samples (%u bytes)",
@@ -86,10 +148,17 @@ SdlAudioRenderer::~SdlAudioRenderer()
         SDL_CloseAudioDevice(m_AudioDevice);
     }
 
+    // Must be destroyed after the device is closed
+    // or we could still get audioCallback() calls.
+    delete m_JitterBuffer;
+    delete m_DriftCompensator;
+
     if (m_AudioBuffer != nullptr) {
         SDL_free(m_AudioBuffer);
     }
 
+    SDL_free(m_ConversionBuffer);
+
     SDL_QuitSubSystem(SDL_INIT_AUDIO);
     SDL_assert(!SDL_WasInit(SDL_INIT_AUDIO));
 }
@@ -106,41 +175,56 @@ bool SdlAudioRenderer::submitAudio(int bytesWritten)
         return true;
     }
 
-    // Don't queue if there's already more than 30 ms of audio data waiting
-    // in Moonlight's audio queue.
-    if (LiGetPendingAudioDuration() > 30) {
-        return true;
+    // Our device may enter a permanent error status upon removal, so we need
+    // to recreate the audio device to pick up the new default audio device.
+    if (SDL_GetAudioDeviceStatus(m_AudioDevice) == SDL_AUDIO_STOPPED) {
+        return false;
     }
 
-    // Provide backpressure on the queue to ensure too many frames don't build up
-    // in SDL's audio queue, but don't wait forever to avoid a deadlock if the
-    // audio device fails.
-    for (int i = 0; i < 100; i++) {
-        // Our device may enter a permanent error status upon removal, so we need
-        // to recreate the audio device to pick up the new default audio device.
-        if (SDL_GetAudioDeviceStatus(m_AudioDevice) == SDL_AUDIO_STOPPED) {
-            return false;
-        }
+    // The fill level is meaningless while the jitter buffer is waiting to start playback
+    if (m_JitterBuffer->isPriming()) {
+        m_DriftCompensator->discardFillLevels();
+    }
+    else {
+        m_DriftCompensator->updateFillLevel(m_JitterBuffer->getFillFrames(),
+                                            m_JitterBuffer->getTargetFrames(),
+                                            m_JitterBuffer->getCorrectedFrames());
+    }
 
-        // Only queue more samples where there are 10 frames or less in SDL's queue
-        if (SDL_GetQueuedAudioSize(m_AudioDevice) / m_FrameSize <= 10) {
-            break;
-        }
+    const int16_t* samples;
+    int frames = m_DriftCompensator->process((const int16_t*)m_AudioBuffer,
+                                             bytesWritten / (sizeof(short) * m_ChannelCount),
+                                             &samples);
 
-        SDL_Delay(1);
-    }
+    // The jitter buffer decides how much of this to keep, so we never block here
+    m_JitterBuffer->write(samples, frames);
 
-    if (SDL_QueueAudio(m_AudioDevice, m_AudioBuffer, bytesWritten) < 0) {
-        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
-                     "Failed to queue audio sample: %s",
-                     SDL_GetError());
+    return true;
+}
+
+void SDLCALL SdlAudioRenderer::audioCallback(void* userdata, Uint8* stream, int len)
+{
+    auto me = reinterpret_cast<SdlAudioRenderer*>(userdata);
+    int frames = len / me->m_Converter.getOutputFrameSize();
+
+    if (me->m_Converter.isPassthrough()) {
+        me->m_JitterBuffer->read((int16_t*)stream, frames);
+        return;
     }
 
-    return true;
+    while (frames > 0) {
+        int chunkFrames = SDL_min(frames, me->m_ConversionBufferFrames);
+
+        me->m_JitterBuffer->read(me->m_ConversionBuffer, chunkFrames);
+        me->m_Converter.convert(me->m_ConversionBuffer, stream, chunkFrames);
+
+        stream += chunkFrames * me->m_Converter.getOutputFrameSize();
+        frames -= chunkFrames;
+    }
 }
 
 int SdlAudioRenderer::getCapabilities()
 {
-    // Direct submit can't be used because we use LiGetPendingAudioDuration()
-    return CAPABILITY_SUPPORTS_ARBITRARY_AUDIO_DURATION;
+    // Submitting audio never blocks, so it's fine to do it on the receive thread
+    return CAPABILITY_DIRECT_SUBMIT | CAPABILITY_SUPPORTS_ARBITRARY_AUDIO_DURATION;
 }
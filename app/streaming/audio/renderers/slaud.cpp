@@ -1,4 +1,5 @@
 #include "slaud.h"
+#include "audioconverter.h"
 
 #include <SDL.h>
 
@@ -43,25 +44,26 @@ bool SLAudioRenderer::prepareForPlayback(const OPUS_MULTISTREAM_CONFIGURATION* o
 }
 
 void SLAudioRenderer::remapChannels(POPUS_MULTISTREAM_CONFIGURATION opusConfig) {
-    OPUS_MULTISTREAM_CONFIGURATION originalConfig = *opusConfig;
-
     // The Moonlight's default channel order is FL,FR,C,LFE,RL,RR,SL,SR
-    // SLAudio expects FL,C,FR,RL,RR,(SL,SR),LFE for 5.1/7.1 so we swap the channels around to match
-
-    if (opusConfig->channelCount == 3 || opusConfig->channelCount >= 6) {
-        // Swap FR and C
-        opusConfig->mapping[1] = originalConfig.mapping[2];
-        opusConfig->mapping[2] = originalConfig.mapping[1];
+    // SLAudio expects FL,C,FR,RL,RR,(SL,SR),LFE for 5.1/7.1 so we have the decoder swap them around to match
+    static const int k_SLAudioOrder[] = {
+        AUDIO_CHANNEL_FL, AUDIO_CHANNEL_FC, AUDIO_CHANNEL_FR,
+        AUDIO_CHANNEL_BL, AUDIO_CHANNEL_BR, AUDIO_CHANNEL_SL, AUDIO_CHANNEL_SR,
+        AUDIO_CHANNEL_LFE
+    };
+
+    int layout[AUDIO_CHANNEL_MAX];
+    int channels = 0;
+    for (int position : k_SLAudioOrder) {
+        if (position < opusConfig->channelCount) {
+            layout[channels++] = position;
+        }
     }
 
-    if (opusConfig->channelCount >= 6) {
-        // SLAudio expects the LFE channel at the end
-        opusConfig->mapping[opusConfig->channelCount - 1] = originalConfig.mapping[3];
-
-        // Slide the other channels down
-        memcpy(&opusConfig->mapping[3],
-               &originalConfig.mapping[4],
-               opusConfig->channelCount - 4);
+    if (!AudioConverter::remapOpusChannels(opusConfig, layout)) {
+        SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                    "Unable to remap %d audio channels for SLAudio",
+                    opusConfig->channelCount);
     }
 }
 
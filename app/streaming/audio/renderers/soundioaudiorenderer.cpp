@@ -5,12 +5,21 @@
 //#include <QtGlobal>
 #include <algorithm>
 
+// Frames converted at a time for devices that don't take interleaved audio
+#define CONVERSION_BUFFER_FRAMES 512
+
 SoundIoAudioRenderer::SoundIoAudioRenderer()
     : m_OpusChannelCount(0),
       m_SoundIo(nullptr),
       m_Device(nullptr),
       m_OutputStream(nullptr),
       m_RingBuffer(nullptr),
+      m_AudioBuffer(nullptr),
+      m_DriftCompensator(nullptr),
+      m_TargetFillFrames(0),
+      m_OutputFormat(AudioConverter::SAMPLE_FORMAT_S16),
+      m_Converter(&m_Converters[0]),
+      m_ConversionBuffer(nullptr),
       m_AudioPacketDuration(0),
       m_Latency(0),
       m_Errored(false)
@@ -38,6 +47,14 @@ SoundIoAudioRenderer::~SoundIoAudioRenderer()
         soundio_device_unref(m_Device);
     }
 
+    if (m_AudioBuffer != nullptr) {
+        SDL_free(m_AudioBuffer);
+    }
+
+    SDL_free(m_ConversionBuffer);
+
+    delete m_DriftCompensator;
+
     if (m_SoundIo != nullptr) {
         soundio_destroy(m_SoundIo);
     }
@@ -165,7 +182,18 @@ bool SoundIoAudioRenderer::prepareForPlayback(const OPUS_MULTISTREAM_CONFIGURATI
 
     m_AudioPacketDuration = (opusConfig->samplesPerFrame / (opusConfig->sampleRate / 1000)) / 1000.0;
 
-    m_OutputStream->format = SoundIoFormatS16NE;
+    // Give the device its own sample format if we can, so we convert it
+    // once instead of the backend converting whatever we give it.
+    if (m_Device->current_format == SoundIoFormatFloat32NE ||
+            (!soundio_device_supports_format(m_Device, SoundIoFormatS16NE) &&
+             soundio_device_supports_format(m_Device, SoundIoFormatFloat32NE))) {
+        m_OutputStream->format = SoundIoFormatFloat32NE;
+        m_OutputFormat = AudioConverter::SAMPLE_FORMAT_F32;
+    }
+    else {
+        m_OutputStream->format = SoundIoFormatS16NE;
+        m_OutputFormat = AudioConverter::SAMPLE_FORMAT_S16;
+    }
     m_OutputStream->sample_rate = opusConfig->sampleRate;
     m_OutputStream->software_latency = m_AudioPacketDuration;
     m_OutputStream->name = "Moonlight";
@@ -220,7 +248,7 @@ bool SoundIoAudioRenderer::prepareForPlayback(const OPUS_MULTISTREAM_CONFIGURATI
     for (int i = 0; i < m_EffectiveLayout.channel_count; i++) {
         if (opusConfig->channelCount == 6) {
             // For 5.1, replace side L/R with back L/R so our channel position
-            // logic in sioWriteCallback() works.
+            // logic below works.
             if (m_EffectiveLayout.channels[i] == SoundIoChannelIdSideLeft) {
                 m_EffectiveLayout.channels[i] = SoundIoChannelIdBackLeft;
             }
@@ -229,8 +257,8 @@ bool SoundIoAudioRenderer::prepareForPlayback(const OPUS_MULTISTREAM_CONFIGURATI
             }
         }
         else if (opusConfig->channelCount == 8) {
-            // For 5.1, replace side L/R with LOC/ROC so our channel position
-            // logic in sioWriteCallback() works.
+            // For 7.1, replace side L/R with LOC/ROC so our channel position
+            // logic below works.
             if (m_EffectiveLayout.channels[i] == SoundIoChannelIdSideLeft) {
                 m_EffectiveLayout.channels[i] = SoundIoChannelIdFrontLeftCenter;
             }
@@ -240,6 +268,29 @@ bool SoundIoAudioRenderer::prepareForPlayback(const OPUS_MULTISTREAM_CONFIGURATI
         }
     }
 
+    // SoundIoChannelId - 1 happens to match our speaker positions
+    // after we've applied our fixups to m_EffectiveLayout for 5.1 and 7.1.
+    for (int i = 0; i < m_EffectiveLayout.channel_count; i++) {
+        int position = m_EffectiveLayout.channels[i] - 1;
+        m_OutputLayout[i] = position >= 0 && position < AUDIO_CHANNEL_MAX ?
+                    position : AUDIO_CHANNEL_NONE;
+    }
+
+    int streamLayout[AUDIO_CHANNEL_MAX];
+    AudioConverter::getStreamLayout(m_OpusChannelCount, streamLayout);
+    if (!m_Converters[0].initialize(streamLayout, m_OpusChannelCount,
+                                    m_OutputLayout, m_EffectiveLayout.channel_count,
+                                    m_OutputFormat)) {
+        return false;
+    }
+
+    m_ConversionBuffer = SDL_malloc(CONVERSION_BUFFER_FRAMES * m_OutputStream->bytes_per_frame);
+    if (m_ConversionBuffer == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Failed to allocate audio conversion buffer");
+        return false;
+    }
+
     int packetsToBuffer;
 
     if (m_SoundIo->current_backend == SoundIoBackendWasapi) {
@@ -258,8 +309,10 @@ bool SoundIoAudioRenderer::prepareForPlayback(const OPUS_MULTISTREAM_CONFIGURATI
                 "Audio buffer size: %f seconds",
                 packetsToBuffer * m_AudioPacketDuration);
 
+    // The ring buffer holds decoded audio, which is converted for
+    // the device as it's read out in sioWriteCallback().
     m_RingBuffer = soundio_ring_buffer_create(m_SoundIo,
-                                              m_OutputStream->bytes_per_sample *
+                                              sizeof(int16_t) *
                                               m_OpusChannelCount *
                                               opusConfig->samplesPerFrame *
                                               packetsToBuffer);
@@ -269,6 +322,20 @@ bool SoundIoAudioRenderer::prepareForPlayback(const OPUS_MULTISTREAM_CONFIGURATI
         return false;
     }
 
+    // Audio is decoded here first, since drift compensation can make
+    // a packet slightly longer than the decoder's output.
+    m_AudioBuffer = SDL_malloc(sizeof(short) * m_OpusChannelCount * opusConfig->samplesPerFrame);
+    if (m_AudioBuffer == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Failed to allocate audio buffer");
+        return false;
+    }
+
+    // Keep the ring buffer half full, so there's as much room
+    // to absorb a late packet as there is for an early one.
+    m_DriftCompensator = new AudioDriftCompensator(m_OpusChannelCount, opusConfig->sampleRate);
+    m_TargetFillFrames = opusConfig->samplesPerFrame * packetsToBuffer / 2;
+
     err = soundio_outstream_start(m_OutputStream);
     if (err != SoundIoErrorNone) {
         SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
@@ -285,17 +352,9 @@ bool SoundIoAudioRenderer::prepareForPlayback(const OPUS_MULTISTREAM_CONFIGURATI
     return true;
 }
 
-void* SoundIoAudioRenderer::getAudioBuffer(int* size)
+void* SoundIoAudioRenderer::getAudioBuffer(int*)
 {
-    // We must always write a full frame of audio. If we don't,
-    // the reader will get out of sync with the writer and our
-    // channels will get all mixed up. To ensure this is always
-    // the case, round our bytes free down to the next multiple
-    // of our frame size.
-    int bytesFree = soundio_ring_buffer_free_count(m_RingBuffer);
-    int bytesPerFrame = m_OpusChannelCount * m_OutputStream->bytes_per_sample;
-    *size = std::min(*size, (bytesFree / bytesPerFrame) * bytesPerFrame);
-    return soundio_ring_buffer_write_ptr(m_RingBuffer);
+    return m_AudioBuffer;
 }
 
 bool SoundIoAudioRenderer::submitAudio(int bytesWritten)
@@ -312,12 +371,51 @@ bool SoundIoAudioRenderer::submitAudio(int bytesWritten)
     // Flush events to update with new device arrivals
     soundio_flush_events(m_SoundIo);
 
+    int bytesPerFrame = m_OpusChannelCount * sizeof(int16_t);
+    m_DriftCompensator->updateFillLevel(soundio_ring_buffer_fill_count(m_RingBuffer) / bytesPerFrame,
+                                        m_TargetFillFrames);
+
+    const int16_t* samples;
+    int frames = m_DriftCompensator->process((const int16_t*)m_AudioBuffer,
+                                             bytesWritten / bytesPerFrame,
+                                             &samples);
+
+    // We must always write a full frame of audio. If we don't,
+    // the reader will get out of sync with the writer and our
+    // channels will get all mixed up. To ensure this is always
+    // the case, round our bytes free down to the next multiple
+    // of our frame size.
+    int bytesFree = soundio_ring_buffer_free_count(m_RingBuffer);
+    int bytesToWrite = std::min(frames * bytesPerFrame, (bytesFree / bytesPerFrame) * bytesPerFrame);
+
+    // The ring buffer is mirrored in memory, so this can't run off the end
+    memcpy(soundio_ring_buffer_write_ptr(m_RingBuffer), samples, bytesToWrite);
+
     // Advance the write pointer
-    soundio_ring_buffer_advance_write_ptr(m_RingBuffer, bytesWritten);
+    soundio_ring_buffer_advance_write_ptr(m_RingBuffer, bytesToWrite);
 
     return true;
 }
 
+void SoundIoAudioRenderer::remapChannels(POPUS_MULTISTREAM_CONFIGURATION opusConfig)
+{
+    // If the device has exactly our channels in another order, have the
+    // decoder output them in that order so we can play them as they are.
+    if (m_EffectiveLayout.channel_count != opusConfig->channelCount ||
+            !AudioConverter::remapOpusChannels(opusConfig, m_OutputLayout)) {
+        return;
+    }
+
+    // Nothing has been decoded with the old order yet, so it's safe to switch
+    // converters under the running stream.
+    AudioConverter* converter = &m_Converters[1];
+    if (converter->initialize(m_OutputLayout, opusConfig->channelCount,
+                              m_OutputLayout, m_EffectiveLayout.channel_count,
+                              m_OutputFormat)) {
+        m_Converter.store(converter, std::memory_order_release);
+    }
+}
+
 int SoundIoAudioRenderer::getCapabilities()
 {
     // TODO: Tweak buffer sizes then re-enable arbitrary audio duration
@@ -378,14 +476,15 @@ void SoundIoAudioRenderer::sioDevicesChanged(SoundIo* soundio)
     }
 }
 
-// bytes_per_frame should never be used on the ring buffer! It's not always
-// the same number of bytes per frames as the output stream!
+// bytes_per_frame should never be used on the ring buffer! It holds decoded
+// audio, which doesn't have the output stream's sample format or layout!
 void SoundIoAudioRenderer::sioWriteCallback(SoundIoOutStream* stream, int frameCountMin, int frameCountMax)
 {
     auto me = reinterpret_cast<SoundIoAudioRenderer*>(stream->userdata);
+    AudioConverter* converter = me->m_Converter.load(std::memory_order_acquire);
+    int ringFrameSize = me->m_OpusChannelCount * sizeof(int16_t);
     char* readPtr = soundio_ring_buffer_read_ptr(me->m_RingBuffer);
-    int framesLeft = soundio_ring_buffer_fill_count(me->m_RingBuffer) /
-            (me->m_OpusChannelCount * stream->bytes_per_sample);
+    int framesLeft = soundio_ring_buffer_fill_count(me->m_RingBuffer) / ringFrameSize;
     int bytesRead = 0;
 
     // Ensure we always write at least a buffer, even if it's silence, to avoid
@@ -428,34 +527,50 @@ void SoundIoAudioRenderer::sioWriteCallback(SoundIoOutStream* stream, int frameC
             break;
         }
 
-        for (int frame = 0; frame < frameCount; frame++) {
-            for (int ch = 0; ch < me->m_EffectiveLayout.channel_count; ch++) {
-                // SoundIoChannelId - 1 happens to match Moonlight's channel layout
-                // after we've applied our fixups to m_EffectiveLayout for 5.1 and 7.1.
-                int readPtrChannel = me->m_EffectiveLayout.channels[ch] - 1;
-
-                if (frame >= framesLeft || readPtrChannel >= me->m_OpusChannelCount) {
-                    // Write silence if we have no buffered frames left or
-                    // nothing in the audio stream for this channel
-                    memset(areas[ch].ptr, 0, stream->bytes_per_sample);
-                }
-                else {
-                    // Write audio data from our ring buffer
-                    memcpy(areas[ch].ptr,
-                           &readPtr[readPtrChannel * stream->bytes_per_sample],
-                           stream->bytes_per_sample);
-                }
+        // Write silence if we have no buffered frames left
+        int audioFrames = std::min(frameCount, framesLeft);
 
-                areas[ch].ptr += areas[ch].step;
+        bool interleaved = true;
+        for (int ch = 0; ch < stream->layout.channel_count; ch++) {
+            if (areas[ch].step != stream->bytes_per_frame ||
+                    areas[ch].ptr != areas[0].ptr + ch * stream->bytes_per_sample) {
+                interleaved = false;
+                break;
             }
+        }
 
-            // Move on to the next frame if we aren't inserting silence
-            if (frame < framesLeft) {
-                readPtr += stream->bytes_per_sample * me->m_OpusChannelCount;
-                bytesRead += stream->bytes_per_sample * me->m_OpusChannelCount;
+        if (interleaved) {
+            // Convert straight into the device's buffer
+            converter->convert((const int16_t*)readPtr, areas[0].ptr, audioFrames);
+            converter->fillSilence(areas[0].ptr + audioFrames * stream->bytes_per_frame,
+                                   frameCount - audioFrames);
+        }
+        else {
+            // Convert in chunks, then scatter each sample to its channel
+            for (int frame = 0; frame < frameCount;) {
+                int chunkFrames = std::min(frameCount - frame, CONVERSION_BUFFER_FRAMES);
+                int chunkAudioFrames = SDL_clamp(audioFrames - frame, 0, chunkFrames);
+                char* src = (char*)me->m_ConversionBuffer;
+
+                converter->convert((const int16_t*)&readPtr[frame * ringFrameSize], src, chunkAudioFrames);
+                converter->fillSilence(src + chunkAudioFrames * stream->bytes_per_frame,
+                                       chunkFrames - chunkAudioFrames);
+
+                for (int i = 0; i < chunkFrames; i++) {
+                    for (int ch = 0; ch < stream->layout.channel_count; ch++) {
+                        memcpy(areas[ch].ptr, src, stream->bytes_per_sample);
+                        areas[ch].ptr += areas[ch].step;
+                        src += stream->bytes_per_sample;
+                    }
+                }
+
+                frame += chunkFrames;
             }
         }
 
+        readPtr += audioFrames * ringFrameSize;
+        bytesRead += audioFrames * ringFrameSize;
+
         err = soundio_outstream_end_write(stream);
         if (err != SoundIoErrorNone && err != SoundIoErrorUnderflow) {
             SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
@@ -1,9 +1,13 @@
 #pragma once
 
 #include "renderer.h"
+#include "audioconverter.h"
+#include "driftcompensator.h"
 
 #include <soundio/soundio.h>
 
+#include <atomic>
+
 class SoundIoAudioRenderer : public IAudioRenderer
 {
 public:
@@ -19,6 +23,8 @@ public:
 
     virtual int getCapabilities();
 
+    virtual void remapChannels(POPUS_MULTISTREAM_CONFIGURATION opusConfig);
+
 private:
     int scoreChannelLayout(const struct SoundIoChannelLayout* layout, const OPUS_MULTISTREAM_CONFIGURATION* opusConfig);
 
@@ -35,7 +41,20 @@ private:
     struct SoundIoDevice* m_Device;
     struct SoundIoOutStream* m_OutputStream;
     struct SoundIoRingBuffer* m_RingBuffer;
+    void* m_AudioBuffer;
+    AudioDriftCompensator* m_DriftCompensator;
+    int m_TargetFillFrames;
     struct SoundIoChannelLayout m_EffectiveLayout;
+    int m_OutputLayout[SOUNDIO_MAX_CHANNELS];
+    AudioConverter::SampleFormat m_OutputFormat;
+
+    // The write callback uses whichever converter this points to, so a new
+    // one can be swapped in while the stream is running.
+    AudioConverter m_Converters[2];
+    std::atomic<AudioConverter*> m_Converter;
+
+    // Staging for devices that don't take interleaved audio
+    void* m_ConversionBuffer;
     double m_AudioPacketDuration;
     double m_Latency;
     bool m_Errored;
@@ -1,4 +1,5 @@
 #include "streaming/session.h"
+#include "streaming/tracer.h"
 
 #include <Limelight.h>
 #include <SDL.h>
@@ -191,6 +192,8 @@ Uint32 SdlInputHandler::mouseEmulationTimerCallback(Uint32 interval, void *param
 
 void SdlInputHandler::handleControllerAxisEvent(SDL_ControllerAxisEvent* event)
 {
+    TRACE_SCOPE("SdlInputHandler::handleControllerAxisEvent");
+
     SDL_JoystickID gameControllerId = event->which;
     GamepadState* state = findStateForGamepad(gameControllerId);
     if (state == NULL) {
@@ -255,6 +258,8 @@ void SdlInputHandler::handleControllerAxisEvent(SDL_ControllerAxisEvent* event)
 
 void SdlInputHandler::handleControllerButtonEvent(SDL_ControllerButtonEvent* event)
 {
+    TRACE_SCOPE("SdlInputHandler::handleControllerButtonEvent");
+
     if (event->button >= SDL_arraysize(k_ButtonMap)) {
         SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
                     "No mapping for gamepad button: %u",
@@ -406,6 +411,8 @@ void SdlInputHandler::handleControllerButtonEvent(SDL_ControllerButtonEvent* eve
 
 void SdlInputHandler::handleControllerSensorEvent(SDL_ControllerSensorEvent* event)
 {
+    TRACE_SCOPE("SdlInputHandler::handleControllerSensorEvent");
+
     GamepadState* state = findStateForGamepad(event->which);
     if (state == NULL) {
         return;
@@ -441,6 +448,8 @@ void SdlInputHandler::handleControllerSensorEvent(SDL_ControllerSensorEvent* eve
 
 void SdlInputHandler::handleControllerTouchpadEvent(SDL_ControllerTouchpadEvent* event)
 {
+    TRACE_SCOPE("SdlInputHandler::handleControllerTouchpadEvent");
+
     GamepadState* state = findStateForGamepad(event->which);
     if (state == NULL) {
         return;
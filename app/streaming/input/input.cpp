@@ -1,6 +1,7 @@
 #include <Limelight.h>
 #include <SDL.h>
 #include "streaming/session.h"
+#include "streaming/tracer.h"
 #include "settings/mappingmanager.h"
 #include "path.h"
 #include "utils.h"
@@ -431,6 +432,8 @@ void SdlInputHandler::setCaptureActive(bool active)
 
 void SdlInputHandler::handleTouchFingerEvent(SDL_TouchFingerEvent* event)
 {
+    TRACE_SCOPE("SdlInputHandler::handleTouchFingerEvent");
+
 #if SDL_VERSION_ATLEAST(2, 0, 10)
     if (SDL_GetTouchDeviceType(event->touchId) != SDL_TOUCH_DEVICE_DIRECT) {
         // Ignore anything that isn't a touchscreen. We may get callbacks
@@ -1,4 +1,5 @@
 #include "streaming/session.h"
+#include "streaming/tracer.h"
 
 #include <Limelight.h>
 #include <SDL.h>
@@ -146,6 +147,8 @@ void SdlInputHandler::performSpecialKeyCombo(KeyCombo combo)
 
 void SdlInputHandler::handleKeyEvent(SDL_KeyboardEvent* event)
 {
+    TRACE_SCOPE("SdlInputHandler::handleKeyEvent");
+
     short keyCode;
     char modifiers;
 
@@ -3,9 +3,12 @@
 #include <Limelight.h>
 #include <SDL.h>
 #include "streaming/streamutils.h"
+#include "streaming/tracer.h"
 
 void SdlInputHandler::handleMouseButtonEvent(SDL_MouseButtonEvent* event)
 {
+    TRACE_SCOPE("SdlInputHandler::handleMouseButtonEvent");
+
     int button;
 
     if (event->which == SDL_TOUCH_MOUSEID) {
@@ -70,6 +73,8 @@ void SdlInputHandler::handleMouseButtonEvent(SDL_MouseButtonEvent* event)
 
 void SdlInputHandler::handleMouseMotionEvent(SDL_MouseMotionEvent* event)
 {
+    TRACE_SCOPE("SdlInputHandler::handleMouseMotionEvent");
+
     if (!isCaptureActive()) {
         // Not capturing
         return;
@@ -156,6 +161,8 @@ void SdlInputHandler::handleMouseMotionEvent(SDL_MouseMotionEvent* event)
 
 void SdlInputHandler::handleMouseWheelEvent(SDL_MouseWheelEvent* event)
 {
+    TRACE_SCOPE("SdlInputHandler::handleMouseWheelEvent");
+
     if (!isCaptureActive()) {
         // Not capturing
         return;
@@ -1,6 +1,8 @@
 #include "session.h"
 #include "settings/streamingpreferences.h"
 #include "streaming/streamutils.h"
+#include "streaming/tracer.h"
+#include "streaming/streamrecorder.h"
 #include "backend/richpresencemanager.h"
 #include "backend/systemproperties.h"
 
@@ -297,6 +299,8 @@ bool Session::chooseDecoder(StreamingPreferences::VideoDecoderSelection vds,
     params.enableFramePacing = enableFramePacing;
     params.testOnly = testOnly;
     params.vds = vds;
+    params.framePool = nullptr;
+    params.frameSource = nullptr;
 
     SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
                 "V-sync %s",
@@ -347,6 +351,10 @@ int Session::drSetup(int videoFormat, int width, int height, int frameRate, void
     s_ActiveSession->m_ActiveVideoHeight = height;
     s_ActiveSession->m_ActiveVideoFrameRate = frameRate;
 
+    if (StreamRecorder::isEnabled()) {
+        StreamRecorder::recordVideoSetup(videoFormat, width, height, frameRate);
+    }
+
     // Defer decoder setup until we've started streaming so we
     // don't have to hide and show the SDL window (which seems to
     // cause pointer hiding to break on Windows).
@@ -367,6 +375,10 @@ int Session::drSubmitDecodeUnit(PDECODE_UNIT du)
     // safely return DR_OK and wait for the IDR frame request by
     // the decoder reinitialization code.
 
+    if (StreamRecorder::isEnabled()) {
+        StreamRecorder::recordVideoFrame(du);
+    }
+
     if (SDL_AtomicTryLock(&s_ActiveSession->m_DecoderLock)) {
         IVideoDecoder* decoder = s_ActiveSession->m_VideoDecoder;
         if (decoder != nullptr) {
@@ -386,38 +398,68 @@ int Session::drSubmitDecodeUnit(PDECODE_UNIT du)
     }
 }
 
+bool Session::probeDecoder(StreamingPreferences::VideoDecoderSelection vds,
+                           SDL_Window* window, int videoFormat, int width, int height,
+                           int frameRate, DECODER_PROBE_RESULT& result)
+{
+    IVideoDecoder* decoder;
+
+    if (DecoderProbeCache::get()->lookup(vds, videoFormat, width, height, frameRate, result)) {
+        return result.success;
+    }
+
+    uint64_t startTimeNs = StreamUtils::getMonotonicNanoseconds();
+
+    SDL_zero(result);
+    result.success = chooseDecoder(vds, window, videoFormat, width, height, frameRate, false, false, true, decoder);
+    if (result.success) {
+        result.isHardwareAccelerated = decoder->isHardwareAccelerated();
+        result.isAlwaysFullScreen = decoder->isAlwaysFullScreen();
+        result.isHdrSupported = decoder->isHdrSupported();
+        result.maxResolution = decoder->getDecoderMaxResolution();
+        result.capabilities = decoder->getDecoderCapabilities();
+        result.colorspace = decoder->getDecoderColorspace();
+        result.colorRange = decoder->getDecoderColorRange();
+        delete decoder;
+    }
+
+    result.probeTimeUs = (uint32_t)((StreamUtils::getMonotonicNanoseconds() - startTimeNs) / 1000);
+
+    DecoderProbeCache::get()->store(vds, videoFormat, width, height, frameRate, result);
+    return result.success;
+}
+
 void Session::getDecoderInfo(SDL_Window* window,
                              bool& isHardwareAccelerated, bool& isFullScreenOnly,
                              bool& isHdrSupported, RazerSize& maxResolution)
 {
-    IVideoDecoder* decoder;
+    DecoderProbingScope probingScope;
+    DECODER_PROBE_RESULT result;
 
     // Since AV1 support on the host side is in its infancy, let's not consider
     // _only_ a working AV1 decoder to be acceptable and still show the warning
     // dialog indicating lack of hardware decoding support.
 
     // Try an HEVC Main10 decoder first to see if we have HDR support
-    if (chooseDecoder(StreamingPreferences::VDS_FORCE_HARDWARE,
-                      window, VIDEO_FORMAT_H265_MAIN10, 1920, 1080, 60,
-                      false, false, true, decoder)) {
-        isHardwareAccelerated = decoder->isHardwareAccelerated();
-        isFullScreenOnly = decoder->isAlwaysFullScreen();
-        isHdrSupported = decoder->isHdrSupported();
-        maxResolution = decoder->getDecoderMaxResolution();
-        delete decoder;
+    if (probeDecoder(StreamingPreferences::VDS_FORCE_HARDWARE,
+                     window, VIDEO_FORMAT_H265_MAIN10, 1920, 1080, 60,
+                     result)) {
+        isHardwareAccelerated = result.isHardwareAccelerated;
+        isFullScreenOnly = result.isAlwaysFullScreen;
+        isHdrSupported = result.isHdrSupported;
+        maxResolution = result.maxResolution;
 
         return;
     }
 
     // Try an AV1 Main10 decoder next to see if we have HDR support
-    if (chooseDecoder(StreamingPreferences::VDS_FORCE_HARDWARE,
-                      window, VIDEO_FORMAT_AV1_MAIN10, 1920, 1080, 60,
-                      false, false, true, decoder)) {
+    if (probeDecoder(StreamingPreferences::VDS_FORCE_HARDWARE,
+                     window, VIDEO_FORMAT_AV1_MAIN10, 1920, 1080, 60,
+                     result)) {
         // If we've got a working AV1 Main 10-bit decoder, we'll enable the HDR checkbox
         // but we will still continue probing to get other attributes for HEVC or H.264
         // decoders. See the AV1 comment at the top of the function for more info.
-        isHdrSupported = decoder->isHdrSupported();
-        delete decoder;
+        isHdrSupported = result.isHdrSupported;
     }
     else {
         // HDR can only be supported by a hardware codec that can handle 10-bit video.
@@ -426,26 +468,24 @@ void Session::getDecoderInfo(SDL_Window* window,
     }
 
     // Try a regular hardware accelerated HEVC decoder now
-    if (chooseDecoder(StreamingPreferences::VDS_FORCE_HARDWARE,
-                      window, VIDEO_FORMAT_H265, 1920, 1080, 60,
-                      false, false, true, decoder)) {
-        isHardwareAccelerated = decoder->isHardwareAccelerated();
-        isFullScreenOnly = decoder->isAlwaysFullScreen();
-        maxResolution = decoder->getDecoderMaxResolution();
-        delete decoder;
+    if (probeDecoder(StreamingPreferences::VDS_FORCE_HARDWARE,
+                     window, VIDEO_FORMAT_H265, 1920, 1080, 60,
+                     result)) {
+        isHardwareAccelerated = result.isHardwareAccelerated;
+        isFullScreenOnly = result.isAlwaysFullScreen;
+        maxResolution = result.maxResolution;
 
         return;
     }
 
 
 #if 0 // See AV1 comment at the top of this function
-    if (chooseDecoder(StreamingPreferences::VDS_FORCE_HARDWARE,
-                      window, VIDEO_FORMAT_AV1_MAIN8, 1920, 1080, 60,
-                      false, false, true, decoder)) {
-        isHardwareAccelerated = decoder->isHardwareAccelerated();
-        isFullScreenOnly = decoder->isAlwaysFullScreen();
-        maxResolution = decoder->getDecoderMaxResolution();
-        delete decoder;
+    if (probeDecoder(StreamingPreferences::VDS_FORCE_HARDWARE,
+                     window, VIDEO_FORMAT_AV1_MAIN8, 1920, 1080, 60,
+                     result)) {
+        isHardwareAccelerated = result.isHardwareAccelerated;
+        isFullScreenOnly = result.isAlwaysFullScreen;
+        maxResolution = result.maxResolution;
 
         return;
     }
@@ -453,13 +493,12 @@ void Session::getDecoderInfo(SDL_Window* window,
 
     // If we still didn't find a hardware decoder, try H.264 now.
     // This will fall back to software decoding, so it should always work.
-    if (chooseDecoder(StreamingPreferences::VDS_AUTO,
-                      window, VIDEO_FORMAT_H264, 1920, 1080, 60,
-                      false, false, true, decoder)) {
-        isHardwareAccelerated = decoder->isHardwareAccelerated();
-        isFullScreenOnly = decoder->isAlwaysFullScreen();
-        maxResolution = decoder->getDecoderMaxResolution();
-        delete decoder;
+    if (probeDecoder(StreamingPreferences::VDS_AUTO,
+                     window, VIDEO_FORMAT_H264, 1920, 1080, 60,
+                     result)) {
+        isHardwareAccelerated = result.isHardwareAccelerated;
+        isFullScreenOnly = result.isAlwaysFullScreen;
+        maxResolution = result.maxResolution;
 
         return;
     }
@@ -472,22 +511,18 @@ bool Session::isHardwareDecodeAvailable(SDL_Window* window,
                                         StreamingPreferences::VideoDecoderSelection vds,
                                         int videoFormat, int width, int height, int frameRate)
 {
-    IVideoDecoder* decoder;
+    DECODER_PROBE_RESULT result;
 
-    if (!chooseDecoder(vds, window, videoFormat, width, height, frameRate, false, false, true, decoder)) {
+    if (!probeDecoder(vds, window, videoFormat, width, height, frameRate, result)) {
         return false;
     }
 
-    bool ret = decoder->isHardwareAccelerated();
-
-    delete decoder;
-
-    return ret;
+    return result.isHardwareAccelerated;
 }
 
 bool Session::populateDecoderProperties(SDL_Window* window)
 {
-    IVideoDecoder* decoder;
+    DECODER_PROBE_RESULT result;
 
     int videoFormat;
     if (m_StreamConfig.supportedVideoFormats & VIDEO_FORMAT_AV1_MAIN10) {
@@ -506,17 +541,17 @@ bool Session::populateDecoderProperties(SDL_Window* window)
         videoFormat = VIDEO_FORMAT_H264;
     }
 
-    if (!chooseDecoder(m_Preferences->videoDecoderSelection,
-                       window,
-                       videoFormat,
-                       m_StreamConfig.width,
-                       m_StreamConfig.height,
-                       m_StreamConfig.fps,
-                       false, false, true, decoder)) {
+    if (!probeDecoder(m_Preferences->videoDecoderSelection,
+                      window,
+                      videoFormat,
+                      m_StreamConfig.width,
+                      m_StreamConfig.height,
+                      m_StreamConfig.fps,
+                      result)) {
         return false;
     }
 
-    m_VideoCallbacks.capabilities = decoder->getDecoderCapabilities();
+    m_VideoCallbacks.capabilities = result.capabilities;
     if (m_VideoCallbacks.capabilities & CAPABILITY_PULL_RENDERER) {
         // It is an error to pass a push callback when in pull mode
         m_VideoCallbacks.submitDecodeUnit = nullptr;
@@ -534,7 +569,7 @@ bool Session::populateDecoderProperties(SDL_Window* window)
                         m_StreamConfig.colorSpace);
         }
         else {
-            m_StreamConfig.colorSpace = decoder->getDecoderColorspace();
+            m_StreamConfig.colorSpace = result.colorspace;
         }
 
         m_StreamConfig.colorRange = Environment::environmentVariableIntValue("COLOR_RANGE_OVERRIDE", &ok);
@@ -544,16 +579,14 @@ bool Session::populateDecoderProperties(SDL_Window* window)
                         m_StreamConfig.colorRange);
         }
         else {
-            m_StreamConfig.colorRange = decoder->getDecoderColorRange();
+            m_StreamConfig.colorRange = result.colorRange;
         }
     }
 
-    if (decoder->isAlwaysFullScreen()) {
+    if (result.isAlwaysFullScreen) {
         m_IsFullScreen = true;
     }
 
-    delete decoder;
-
     return true;
 }
 
@@ -575,7 +608,19 @@ Session::Session(NvComputer* computer, NvApp& app, StreamingPreferences *prefere
       m_OpusDecoder(nullptr),
       m_AudioRenderer(nullptr),
       m_AudioSampleCount(0),
-      m_DropAudioEndTime(0)
+      m_AudioLossPending(false),
+      m_LastAudioFrameSamples(0),
+      m_AudioReceivedPackets(0),
+      m_AudioLostPackets(0),
+      m_AudioFecRecoveredPackets(0),
+      m_AudioConcealedPackets(0),
+      m_AudioReinitThread(nullptr),
+      m_AudioReinitDone(false),
+      m_AudioReinitSucceeded(false),
+      m_AudioReinitStartTime(0),
+      m_PendingAudioRenderer(nullptr),
+      m_PendingOpusDecoder(nullptr),
+      m_PendingAudioConfig{}
 {
 }
 
@@ -640,6 +685,9 @@ bool Session::initialize()
         }
     }
 
+    // Reuse the decoder probe results from previous launches where possible
+    DecoderProbingScope probingScope;
+
     LOG(INFO) << "Server GPU:" << m_Computer->gpuModel;
     LOG(INFO) << "Server GFE version:" << m_Computer->gfeVersion;
 
@@ -1153,6 +1201,10 @@ public:
         // Finish cleanup of the connection state
         LiStopConnection();
 
+        // No more audio or video callbacks can arrive now
+        Tracer::stop();
+        StreamRecorder::stop();
+
         // Perform a best-effort app quit
         //if (shouldQuit) {
         //    NvHTTP http(m_Session->m_Computer);
@@ -1694,6 +1746,12 @@ void Session::execInternal()
     // We're now active
     s_ActiveSession = this;
 
+    // Record a pipeline trace if the user asked for one
+    Tracer::startIfRequested();
+
+    // Likewise for a recording of the stream
+    StreamRecorder::startIfRequested();
+
     // Initialize the gamepad code with our preferences
     // NB: m_InputHandler must be initialize before starting the connection.
     m_InputHandler = new SdlInputHandler(*m_Preferences, m_StreamConfig.width, m_StreamConfig.height);
@@ -2196,6 +2254,9 @@ void Session::execInternal()
                     SDL_AtomicUnlock(&m_DecoderLock);
                     SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
                                  "Failed to recreate decoder after reset");
+
+                    // Our cached probes said this decoder would work, so they're stale
+                    DecoderProbeCache::get()->invalidate();
                     s_streamErrorText = "Unable to initialize video decoder. Please check your streaming settings and try again.";
                     s_state = Session::ResetErr;
                     goto DispatchDeferredCleanup;
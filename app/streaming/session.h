@@ -5,11 +5,23 @@
 #include "settings/streamingpreferences.h"
 #include "input/input.h"
 #include "video/decoder.h"
+#include "video/decoderprobecache.h"
 #include "audio/renderers/renderer.h"
 #include "video/overlaymanager.h"
 
 #include "boost/interprocess/sync/interprocess_semaphore.hpp"
 
+#include <atomic>
+#include <deque>
+#include <vector>
+
+typedef struct _AUDIO_STATS {
+    uint32_t receivedPackets;
+    uint32_t lostPackets;
+    uint32_t fecRecoveredPackets;
+    uint32_t concealedPackets;
+} AUDIO_STATS, *PAUDIO_STATS;
+
 class RazerSemaphore
 {
 public:
@@ -127,6 +139,13 @@ public:
 
     void flushWindowEvents();
 
+    // Safe to call from any thread
+    void getAudioStats(AUDIO_STATS& stats);
+
+    // Also used to play back recordings outside of a session
+    static
+    IAudioRenderer* createAudioRenderer(const POPUS_MULTISTREAM_CONFIGURATION opusConfig);
+
 private:
     void execInternal();
 
@@ -140,10 +159,24 @@ private:
 
     bool populateDecoderProperties(SDL_Window* window);
 
-    IAudioRenderer* createAudioRenderer(const POPUS_MULTISTREAM_CONFIGURATION opusConfig);
-
     bool initializeAudioRenderer();
 
+    // Creates a renderer and an Opus decoder using the renderer's channel mapping
+    static
+    bool createAudioPipeline(POPUS_MULTISTREAM_CONFIGURATION originalConfig,
+                             IAudioRenderer** renderer,
+                             OpusMSDecoder** decoder,
+                             POPUS_MULTISTREAM_CONFIGURATION activeConfig);
+
+    // Swaps in a replacement renderer once it's ready, or starts creating one
+    void updateAudioRendererReinit();
+
+    static
+    int audioReinitThread(void* context);
+
+    // Returns false if the audio renderer failed and was destroyed
+    bool decodeAndPlayAudio(const unsigned char* data, int length, bool fec);
+
     bool testAudio(int audioConfiguration);
 
     int getAudioRendererCapabilities(int audioConfiguration);
@@ -162,6 +195,11 @@ private:
                                    StreamingPreferences::VideoDecoderSelection vds,
                                    int videoFormat, int width, int height, int frameRate);
 
+    static
+    bool probeDecoder(StreamingPreferences::VideoDecoderSelection vds,
+                      SDL_Window* window, int videoFormat, int width, int height,
+                      int frameRate, DECODER_PROBE_RESULT& result);
+
     static
     bool chooseDecoder(StreamingPreferences::VideoDecoderSelection vds,
                        SDL_Window* window, int videoFormat, int width, int height,
@@ -251,7 +289,23 @@ private:
     OPUS_MULTISTREAM_CONFIGURATION m_ActiveAudioConfig;
     OPUS_MULTISTREAM_CONFIGURATION m_OriginalAudioConfig;
     int m_AudioSampleCount;
-    Uint32 m_DropAudioEndTime;
+    bool m_AudioLossPending;
+    int m_LastAudioFrameSamples;
+    std::atomic<uint32_t> m_AudioReceivedPackets;
+    std::atomic<uint32_t> m_AudioLostPackets;
+    std::atomic<uint32_t> m_AudioFecRecoveredPackets;
+    std::atomic<uint32_t> m_AudioConcealedPackets;
+
+    // A replacement for a failed renderer is created on m_AudioReinitThread,
+    // while the audio thread queues up the latest packets to play with it.
+    SDL_Thread* m_AudioReinitThread;
+    std::atomic<bool> m_AudioReinitDone;
+    bool m_AudioReinitSucceeded;
+    Uint32 m_AudioReinitStartTime;
+    IAudioRenderer* m_PendingAudioRenderer;
+    OpusMSDecoder* m_PendingOpusDecoder;
+    OPUS_MULTISTREAM_CONFIGURATION m_PendingAudioConfig;
+    std::deque<std::vector<unsigned char>> m_QueuedAudioPackets;
 
     Overlay::OverlayManager m_OverlayManager;
 
@@ -0,0 +1,313 @@
+#include "streamrecorder.h"
+#include "streamutils.h"
+
+#include <SDL.h>
+
+#include <mutex>
+
+// Records waiting to be written beyond this are dropped. This is
+// seconds of video at the highest bitrates we support.
+#define MAX_PENDING_RECORDING_BYTES (64 * 1024 * 1024)
+
+#define RECORDING_FLUSH_INTERVAL_MS 100
+
+namespace {
+
+// Recording threads append to the pending buffer, and the writer thread
+// swaps it with the writing buffer to write it out. Both buffers keep their
+// capacity, so recording doesn't allocate once they've grown to size.
+std::mutex s_BufferLock;
+std::vector<uint8_t> s_PendingBuffer;
+std::vector<uint8_t> s_WritingBuffer;
+std::atomic<uint32_t> s_DroppedRecords(0);
+
+// Only touched by start(), stop() and the writer thread
+FILE* s_File = nullptr;
+SDL_Thread* s_WriterThread = nullptr;
+SDL_sem* s_StopSemaphore = nullptr;
+uint64_t s_BytesWritten = 0;
+
+std::atomic<uint64_t> s_StartNs(0);
+
+// Returns where the payload should be written, or nullptr if the record
+// must be dropped. The caller must hold s_BufferLock.
+uint8_t* reserveRecord(StreamRecordType type, uint32_t length)
+{
+    if (s_PendingBuffer.size() + sizeof(STREAM_RECORD_HEADER) + length > MAX_PENDING_RECORDING_BYTES) {
+        // The writer thread has fallen behind
+        s_DroppedRecords++;
+        return nullptr;
+    }
+
+    STREAM_RECORD_HEADER header;
+    header.type = type;
+    header.length = length;
+    header.timestampUs = (StreamUtils::getMonotonicNanoseconds() - s_StartNs.load(std::memory_order_relaxed)) / 1000;
+
+    size_t offset = s_PendingBuffer.size();
+    s_PendingBuffer.resize(offset + sizeof(header) + length);
+    memcpy(&s_PendingBuffer[offset], &header, sizeof(header));
+    return s_PendingBuffer.data() + offset + sizeof(header);
+}
+
+void appendRecord(StreamRecordType type, const void* payload, uint32_t length)
+{
+    std::lock_guard<std::mutex> locker(s_BufferLock);
+
+    uint8_t* data = reserveRecord(type, length);
+    if (data != nullptr && length != 0) {
+        memcpy(data, payload, length);
+    }
+}
+
+}
+
+std::atomic<bool> StreamRecorder::s_Enabled(false);
+
+void StreamRecorder::startIfRequested()
+{
+    const char* path = SDL_getenv("MOONLIGHT_RECORD_FILE");
+    if (path != nullptr && *path != 0) {
+        start(path);
+    }
+}
+
+bool StreamRecorder::start(const char* path)
+{
+    if (isEnabled()) {
+        return false;
+    }
+
+    s_File = fopen(path, "wb");
+    if (s_File == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Unable to open recording file: %s",
+                     path);
+        return false;
+    }
+
+    s_StopSemaphore = SDL_CreateSemaphore(0);
+    if (s_StopSemaphore == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "SDL_CreateSemaphore() failed: %s",
+                     SDL_GetError());
+        fclose(s_File);
+        s_File = nullptr;
+        return false;
+    }
+
+    STREAM_RECORDING_HEADER header;
+    header.magic = STREAM_RECORDING_MAGIC;
+    header.version = STREAM_RECORDING_VERSION;
+    fwrite(&header, sizeof(header), 1, s_File);
+    s_BytesWritten = sizeof(header);
+
+    {
+        // Throw away any records that straggled in after the last recording stopped
+        std::lock_guard<std::mutex> locker(s_BufferLock);
+        s_PendingBuffer.clear();
+        s_DroppedRecords = 0;
+        s_StartNs = StreamUtils::getMonotonicNanoseconds();
+    }
+
+    s_WriterThread = SDL_CreateThread(StreamRecorder::writerThread, "RecordWriter", nullptr);
+    if (s_WriterThread == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "SDL_CreateThread() failed: %s",
+                     SDL_GetError());
+        SDL_DestroySemaphore(s_StopSemaphore);
+        s_StopSemaphore = nullptr;
+        fclose(s_File);
+        s_File = nullptr;
+        return false;
+    }
+
+    s_Enabled = true;
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Recording stream to: %s",
+                path);
+    return true;
+}
+
+void StreamRecorder::stop()
+{
+    if (!isEnabled()) {
+        return;
+    }
+
+    s_Enabled = false;
+
+    // The writer thread writes everything one last time before exiting
+    SDL_SemPost(s_StopSemaphore);
+    SDL_WaitThread(s_WriterThread, nullptr);
+    s_WriterThread = nullptr;
+
+    SDL_DestroySemaphore(s_StopSemaphore);
+    s_StopSemaphore = nullptr;
+
+    fclose(s_File);
+    s_File = nullptr;
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Stream recording complete (%llu bytes, %u records dropped)",
+                (unsigned long long)s_BytesWritten,
+                s_DroppedRecords.load());
+}
+
+void StreamRecorder::recordVideoSetup(int videoFormat, int width, int height, int frameRate)
+{
+    STREAM_RECORD_VIDEO_SETUP setup;
+    setup.videoFormat = videoFormat;
+    setup.width = width;
+    setup.height = height;
+    setup.frameRate = frameRate;
+
+    appendRecord(SRT_VIDEO_SETUP, &setup, sizeof(setup));
+}
+
+void StreamRecorder::recordAudioSetup(const OPUS_MULTISTREAM_CONFIGURATION* opusConfig)
+{
+    STREAM_RECORD_AUDIO_SETUP setup;
+    setup.sampleRate = opusConfig->sampleRate;
+    setup.channelCount = opusConfig->channelCount;
+    setup.streams = opusConfig->streams;
+    setup.coupledStreams = opusConfig->coupledStreams;
+    setup.samplesPerFrame = opusConfig->samplesPerFrame;
+    memcpy(setup.mapping, opusConfig->mapping, sizeof(setup.mapping));
+
+    appendRecord(SRT_AUDIO_SETUP, &setup, sizeof(setup));
+}
+
+void StreamRecorder::recordVideoFrame(const DECODE_UNIT* du)
+{
+    STREAM_RECORD_VIDEO_FRAME frame = {};
+    uint32_t length = sizeof(frame);
+
+    for (PLENTRY entry = du->bufferList; entry != nullptr; entry = entry->next) {
+        length += sizeof(STREAM_RECORD_BUFFER) + entry->length;
+        frame.bufferCount++;
+    }
+
+    frame.frameNumber = du->frameNumber;
+    frame.frameType = du->frameType;
+    frame.receiveTimeMs = du->receiveTimeMs;
+    frame.enqueueTimeMs = du->enqueueTimeMs;
+    frame.captureTimeMs = LiGetMillis();
+    frame.presentationTimeMs = du->presentationTimeMs;
+    frame.frameHostProcessingLatency = du->frameHostProcessingLatency;
+    frame.hdrActive = du->hdrActive;
+    frame.colorspace = du->colorspace;
+
+    std::lock_guard<std::mutex> locker(s_BufferLock);
+
+    uint8_t* data = reserveRecord(SRT_VIDEO_FRAME, length);
+    if (data == nullptr) {
+        return;
+    }
+
+    memcpy(data, &frame, sizeof(frame));
+    data += sizeof(frame);
+
+    for (PLENTRY entry = du->bufferList; entry != nullptr; entry = entry->next) {
+        STREAM_RECORD_BUFFER buffer;
+        buffer.bufferType = entry->bufferType;
+        buffer.length = entry->length;
+
+        memcpy(data, &buffer, sizeof(buffer));
+        data += sizeof(buffer);
+        memcpy(data, entry->data, entry->length);
+        data += entry->length;
+    }
+}
+
+void StreamRecorder::recordAudioSample(const char* sampleData, int sampleLength)
+{
+    appendRecord(SRT_AUDIO_SAMPLE, sampleData, sampleLength);
+}
+
+int StreamRecorder::writerThread(void*)
+{
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+    for (;;) {
+        bool stopping = SDL_SemWaitTimeout(s_StopSemaphore, RECORDING_FLUSH_INTERVAL_MS) == 0;
+
+        {
+            std::lock_guard<std::mutex> locker(s_BufferLock);
+            s_PendingBuffer.swap(s_WritingBuffer);
+        }
+
+        if (!s_WritingBuffer.empty()) {
+            if (fwrite(s_WritingBuffer.data(), 1, s_WritingBuffer.size(), s_File) != s_WritingBuffer.size()) {
+                SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                             "Failed to write stream recording");
+            }
+            s_BytesWritten += s_WritingBuffer.size();
+            s_WritingBuffer.clear();
+            fflush(s_File);
+        }
+
+        if (stopping) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+StreamRecordingReader::StreamRecordingReader()
+    : m_File(nullptr)
+{
+
+}
+
+StreamRecordingReader::~StreamRecordingReader()
+{
+    if (m_File != nullptr) {
+        fclose(m_File);
+    }
+}
+
+bool StreamRecordingReader::open(const char* path)
+{
+    SDL_assert(m_File == nullptr);
+
+    m_File = fopen(path, "rb");
+    if (m_File == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Unable to open recording: %s",
+                     path);
+        return false;
+    }
+
+    STREAM_RECORDING_HEADER header;
+    if (fread(&header, sizeof(header), 1, m_File) != 1 ||
+            header.magic != STREAM_RECORDING_MAGIC ||
+            header.version != STREAM_RECORDING_VERSION) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Unsupported recording: %s",
+                     path);
+        fclose(m_File);
+        m_File = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+bool StreamRecordingReader::readRecord(STREAM_RECORD_HEADER* header, std::vector<uint8_t>& payload)
+{
+    if (m_File == nullptr || fread(header, sizeof(*header), 1, m_File) != 1) {
+        return false;
+    }
+
+    payload.resize(header->length);
+    if (header->length != 0 && fread(payload.data(), header->length, 1, m_File) != 1) {
+        SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                    "Recording is truncated");
+        return false;
+    }
+
+    return true;
+}
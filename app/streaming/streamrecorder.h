@@ -0,0 +1,131 @@
+#pragma once
+
+#include <Limelight.h>
+
+#include <atomic>
+#include <cstdio>
+#include <stdint.h>
+#include <vector>
+
+// Recordings are a STREAM_RECORDING_HEADER followed by records, each of
+// which is a STREAM_RECORD_HEADER followed by its payload. Everything is
+// stored little-endian with fields at their natural alignment.
+#define STREAM_RECORDING_MAGIC 0x43524C4D // "MLRC"
+
+// Bump this if the layout or meaning of any record changes
+#define STREAM_RECORDING_VERSION 1
+
+typedef struct _STREAM_RECORDING_HEADER {
+    uint32_t magic;
+    uint32_t version;
+} STREAM_RECORDING_HEADER;
+
+enum StreamRecordType {
+    SRT_VIDEO_SETUP = 1,
+    SRT_AUDIO_SETUP,
+    SRT_VIDEO_FRAME,
+    SRT_AUDIO_SAMPLE
+};
+
+typedef struct _STREAM_RECORD_HEADER {
+    uint32_t type;
+
+    // Bytes of payload following this header
+    uint32_t length;
+
+    // When the record was captured, relative to the start of the recording
+    uint64_t timestampUs;
+} STREAM_RECORD_HEADER;
+
+typedef struct _STREAM_RECORD_VIDEO_SETUP {
+    int32_t videoFormat;
+    int32_t width;
+    int32_t height;
+    int32_t frameRate;
+} STREAM_RECORD_VIDEO_SETUP;
+
+typedef struct _STREAM_RECORD_AUDIO_SETUP {
+    int32_t sampleRate;
+    int32_t channelCount;
+    int32_t streams;
+    int32_t coupledStreams;
+    int32_t samplesPerFrame;
+    uint8_t mapping[AUDIO_CONFIGURATION_MAX_CHANNEL_COUNT];
+} STREAM_RECORD_AUDIO_SETUP;
+
+// Followed by bufferCount STREAM_RECORD_BUFFERs, each followed by its data.
+// The Opus data is the entire payload of SRT_AUDIO_SAMPLE records. An empty
+// SRT_AUDIO_SAMPLE record is a lost packet, which is concealed on replay.
+typedef struct _STREAM_RECORD_VIDEO_FRAME {
+    int32_t frameNumber;
+    int32_t frameType;
+    uint64_t receiveTimeMs;
+    uint64_t enqueueTimeMs;
+
+    // LiGetMillis() when the frame was captured, which
+    // lets replays reproduce the time spent queued
+    uint64_t captureTimeMs;
+
+    uint32_t presentationTimeMs;
+    uint16_t frameHostProcessingLatency;
+    uint16_t bufferCount;
+    uint8_t hdrActive;
+    uint8_t colorspace;
+    uint8_t reserved[6];
+} STREAM_RECORD_VIDEO_FRAME;
+
+typedef struct _STREAM_RECORD_BUFFER {
+    int32_t bufferType;
+    int32_t length;
+} STREAM_RECORD_BUFFER;
+
+// Records the video and audio data the host sends us to a file named by
+// MOONLIGHT_RECORD_FILE, so stutter can be reproduced offline by replaying
+// it through the decoder. Records are copied into a buffer that a background
+// thread writes out, so recording never blocks on disk I/O. When recording is
+// disabled, each hook costs a single atomic load.
+class StreamRecorder
+{
+public:
+    // Starts recording to the file named by MOONLIGHT_RECORD_FILE, if it's set
+    static void startIfRequested();
+
+    static bool start(const char* path);
+
+    static void stop();
+
+    static bool isEnabled()
+    {
+        return s_Enabled.load(std::memory_order_relaxed);
+    }
+
+    static void recordVideoSetup(int videoFormat, int width, int height, int frameRate);
+
+    static void recordAudioSetup(const OPUS_MULTISTREAM_CONFIGURATION* opusConfig);
+
+    static void recordVideoFrame(const DECODE_UNIT* du);
+
+    static void recordAudioSample(const char* sampleData, int sampleLength);
+
+private:
+    static int writerThread(void* context);
+
+    static std::atomic<bool> s_Enabled;
+};
+
+// Reads records from a recording one at a time
+class StreamRecordingReader
+{
+public:
+    StreamRecordingReader();
+
+    ~StreamRecordingReader();
+
+    bool open(const char* path);
+
+    // Returns false at the end of the recording or if it's truncated
+    bool readRecord(STREAM_RECORD_HEADER* header, std::vector<uint8_t>& payload);
+
+private:
+    FILE* m_File;
+};
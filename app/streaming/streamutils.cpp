@@ -311,3 +311,11 @@ bool StreamUtils::getNativeDesktopMode(int displayIndex, SDL_DisplayMode* mode,
     return true;
 }
 
+uint64_t StreamUtils::getMonotonicNanoseconds()
+{
+    static const uint64_t frequency = SDL_GetPerformanceFrequency();
+    uint64_t counter = SDL_GetPerformanceCounter();
+
+    // Split the conversion to avoid overflowing 64 bits on long uptimes
+    return (counter / frequency) * 1000000000ULL + ((counter % frequency) * 1000000000ULL) / frequency;
+}
@@ -36,4 +36,8 @@ public:
 
     static
     bool hasFastAes();
+
+    // Monotonic clock with sub-millisecond precision for latency measurements
+    static
+    uint64_t getMonotonicNanoseconds();
 };
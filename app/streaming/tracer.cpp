@@ -0,0 +1,273 @@
+#include "tracer.h"
+
+#include <SDL.h>
+
+#include <cstdio>
+#include <mutex>
+
+// Number of spans each thread can record before the writer drains them.
+// This must be a power of 2.
+#define TRACE_BUFFER_EVENTS 8192
+
+// Maximum number of threads that can record spans at the same time
+#define MAX_TRACE_THREADS 64
+
+#define TRACE_FLUSH_INTERVAL_MS 100
+
+namespace {
+
+struct TraceEvent {
+    const char* name;
+    uint64_t startNs;
+    uint64_t endNs;
+    uint32_t frameId;
+};
+
+// Single producer (the owning thread) and single consumer (the writer thread)
+struct ThreadBuffer {
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    std::atomic<bool> inUse;
+    SDL_threadID threadId;
+};
+
+// Releases the thread's buffer for reuse when the thread exits
+struct ThreadBufferHolder {
+    ThreadBuffer* buffer = nullptr;
+
+    ~ThreadBufferHolder()
+    {
+        if (buffer != nullptr) {
+            buffer->inUse.store(false, std::memory_order_release);
+        }
+    }
+};
+
+// Buffers are never freed, because a thread may still be recording
+// into one when tracing stops. They're recycled as threads come and go.
+std::mutex s_RegistrationLock;
+ThreadBuffer* s_Buffers[MAX_TRACE_THREADS];
+std::atomic<int> s_BufferCount(0);
+std::atomic<uint32_t> s_DroppedEvents(0);
+
+// Only touched by start(), stop() and the writer thread
+FILE* s_File = nullptr;
+SDL_Thread* s_WriterThread = nullptr;
+SDL_sem* s_StopSemaphore = nullptr;
+uint64_t s_StartNs = 0;
+bool s_WroteFirstEvent = false;
+
+thread_local ThreadBufferHolder t_BufferHolder;
+
+ThreadBuffer* getThreadBuffer()
+{
+    if (t_BufferHolder.buffer != nullptr) {
+        return t_BufferHolder.buffer;
+    }
+
+    // This only happens on the first span recorded by each thread
+    std::lock_guard<std::mutex> locker(s_RegistrationLock);
+
+    ThreadBuffer* buffer = nullptr;
+    int bufferCount = s_BufferCount.load(std::memory_order_relaxed);
+
+    // Reuse the buffer of an exited thread once the writer has drained it
+    for (int i = 0; i < bufferCount; i++) {
+        if (!s_Buffers[i]->inUse.load(std::memory_order_acquire) &&
+                s_Buffers[i]->head.load(std::memory_order_acquire) == s_Buffers[i]->tail.load(std::memory_order_relaxed)) {
+            buffer = s_Buffers[i];
+            break;
+        }
+    }
+
+    if (buffer == nullptr) {
+        if (bufferCount == MAX_TRACE_THREADS) {
+            return nullptr;
+        }
+
+        buffer = new ThreadBuffer();
+        buffer->head.store(0, std::memory_order_relaxed);
+        buffer->tail.store(0, std::memory_order_relaxed);
+        s_Buffers[bufferCount] = buffer;
+        s_BufferCount.store(bufferCount + 1, std::memory_order_release);
+    }
+
+    // The writer only reads this after it sees an event from us
+    buffer->threadId = SDL_ThreadID();
+    buffer->inUse.store(true, std::memory_order_release);
+
+    t_BufferHolder.buffer = buffer;
+    return buffer;
+}
+
+void writeEvent(const TraceEvent& event, SDL_threadID threadId)
+{
+    // Spans may have started slightly before tracing did
+    double startUs = (double)(int64_t)(event.startNs - s_StartNs) / 1000;
+    double durationUs = (double)(event.endNs - event.startNs) / 1000;
+
+    fprintf(s_File,
+            "%s{\"name\":\"%s\",\"cat\":\"stream\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%lu",
+            s_WroteFirstEvent ? ",\n" : "",
+            event.name,
+            startUs,
+            durationUs,
+            (unsigned long)threadId);
+    if (event.frameId != 0) {
+        fprintf(s_File, ",\"args\":{\"frame\":%u}", event.frameId);
+    }
+    fprintf(s_File, "}");
+
+    s_WroteFirstEvent = true;
+}
+
+void drainBuffers(bool discard)
+{
+    int bufferCount = s_BufferCount.load(std::memory_order_acquire);
+
+    for (int i = 0; i < bufferCount; i++) {
+        ThreadBuffer* buffer = s_Buffers[i];
+        uint32_t head = buffer->head.load(std::memory_order_relaxed);
+        uint32_t tail = buffer->tail.load(std::memory_order_acquire);
+
+        if (!discard) {
+            for (; head != tail; head++) {
+                writeEvent(buffer->events[head % TRACE_BUFFER_EVENTS], buffer->threadId);
+            }
+        }
+
+        buffer->head.store(tail, std::memory_order_release);
+    }
+}
+
+}
+
+std::atomic<bool> Tracer::s_Enabled(false);
+
+void Tracer::startIfRequested()
+{
+    const char* path = SDL_getenv("MOONLIGHT_TRACE_FILE");
+    if (path != nullptr && *path != 0) {
+        start(path);
+    }
+}
+
+bool Tracer::start(const char* path)
+{
+    if (isEnabled()) {
+        return false;
+    }
+
+    s_File = fopen(path, "w");
+    if (s_File == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Unable to open trace file: %s",
+                     path);
+        return false;
+    }
+
+    s_StopSemaphore = SDL_CreateSemaphore(0);
+    if (s_StopSemaphore == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "SDL_CreateSemaphore() failed: %s",
+                     SDL_GetError());
+        fclose(s_File);
+        s_File = nullptr;
+        return false;
+    }
+
+    // Throw away any spans that straggled in after the last trace stopped
+    drainBuffers(true);
+    s_DroppedEvents = 0;
+
+    fprintf(s_File, "[\n");
+    s_WroteFirstEvent = false;
+    s_StartNs = StreamUtils::getMonotonicNanoseconds();
+
+    s_WriterThread = SDL_CreateThread(Tracer::writerThread, "TraceWriter", nullptr);
+    if (s_WriterThread == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "SDL_CreateThread() failed: %s",
+                     SDL_GetError());
+        SDL_DestroySemaphore(s_StopSemaphore);
+        s_StopSemaphore = nullptr;
+        fclose(s_File);
+        s_File = nullptr;
+        return false;
+    }
+
+    s_Enabled = true;
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Writing streaming trace to: %s",
+                path);
+    return true;
+}
+
+void Tracer::stop()
+{
+    if (!isEnabled()) {
+        return;
+    }
+
+    s_Enabled = false;
+
+    // The writer thread drains everything one last time before exiting
+    SDL_SemPost(s_StopSemaphore);
+    SDL_WaitThread(s_WriterThread, nullptr);
+    s_WriterThread = nullptr;
+
+    SDL_DestroySemaphore(s_StopSemaphore);
+    s_StopSemaphore = nullptr;
+
+    fprintf(s_File, "\n]\n");
+    fclose(s_File);
+    s_File = nullptr;
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Streaming trace complete (%u spans dropped)",
+                s_DroppedEvents.load());
+}
+
+void Tracer::recordSpan(const char* name, uint64_t startNs, uint64_t endNs, uint32_t frameId)
+{
+    ThreadBuffer* buffer = getThreadBuffer();
+    if (buffer == nullptr) {
+        s_DroppedEvents++;
+        return;
+    }
+
+    uint32_t tail = buffer->tail.load(std::memory_order_relaxed);
+    if (tail - buffer->head.load(std::memory_order_acquire) >= TRACE_BUFFER_EVENTS) {
+        // The writer thread has fallen behind
+        s_DroppedEvents++;
+        return;
+    }
+
+    TraceEvent& event = buffer->events[tail % TRACE_BUFFER_EVENTS];
+    event.name = name;
+    event.startNs = startNs;
+    event.endNs = endNs;
+    event.frameId = frameId;
+
+    buffer->tail.store(tail + 1, std::memory_order_release);
+}
+
+int Tracer::writerThread(void*)
+{
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+    for (;;) {
+        bool stopping = SDL_SemWaitTimeout(s_StopSemaphore, TRACE_FLUSH_INTERVAL_MS) == 0;
+
+        drainBuffers(false);
+        fflush(s_File);
+
+        if (stopping) {
+            break;
+        }
+    }
+
+    return 0;
+}
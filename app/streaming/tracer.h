@@ -0,0 +1,67 @@
+#pragma once
+
+#include "streamutils.h"
+
+#include <atomic>
+#include <stdint.h>
+
+// Records a span covering the rest of the enclosing scope
+#define TRACE_SCOPE(name) TraceScope traceScope__(name)
+
+// Writes Chrome trace event JSON (viewable in Perfetto or chrome://tracing)
+// for the streaming pipeline. Each thread records spans into its own
+// lock-free ring, and a background thread drains the rings to the file,
+// so recording a span never blocks or allocates after the first one on
+// a thread. When tracing is disabled, a span costs a single atomic load.
+class Tracer
+{
+public:
+    // Starts tracing to the file named by MOONLIGHT_TRACE_FILE, if it's set
+    static void startIfRequested();
+
+    static bool start(const char* path);
+
+    static void stop();
+
+    static bool isEnabled()
+    {
+        return s_Enabled.load(std::memory_order_relaxed);
+    }
+
+    // The name must be a string literal, since it's read by the writer thread later
+    static void recordSpan(const char* name, uint64_t startNs, uint64_t endNs, uint32_t frameId);
+
+private:
+    static int writerThread(void* context);
+
+    static std::atomic<bool> s_Enabled;
+};
+
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* name, uint32_t frameId = 0)
+        : m_Name(name),
+          m_FrameId(frameId),
+          m_StartNs(Tracer::isEnabled() ? StreamUtils::getMonotonicNanoseconds() : 0)
+    {
+    }
+
+    ~TraceScope()
+    {
+        if (m_StartNs != 0 && Tracer::isEnabled()) {
+            Tracer::recordSpan(m_Name, m_StartNs, StreamUtils::getMonotonicNanoseconds(), m_FrameId);
+        }
+    }
+
+    // For spans where the frame isn't known until partway through
+    void setFrameId(uint32_t frameId)
+    {
+        m_FrameId = frameId;
+    }
+
+private:
+    const char* m_Name;
+    uint32_t m_FrameId;
+    uint64_t m_StartNs;
+};
@@ -0,0 +1,908 @@
+#include "decodebenchmark.h"
+#include "ffmpeg.h"
+#include "ffmpeg-renderers/planecopier.h"
+#include "streaming/session.h"
+#include "utils.h"
+
+#include <Limelight.h>
+#include <SDL.h>
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <Windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#define DEFAULT_BENCHMARK_FRAME_RATE 60
+#define DEFAULT_BENCHMARK_SECONDS 10
+
+// How often we collect presented frames from the timeline. This must be
+// often enough that the ring doesn't wrap when running unthrottled.
+#define BENCHMARK_POLL_INTERVAL_MS 10
+
+// Give up waiting for more frames to be presented after this long
+#define BENCHMARK_STALL_TIMEOUT_MS 5000
+
+// Frames dropped by Pacer are never presented, so we stop waiting for
+// the rest once the decoder has run out of input and gone quiet.
+#define BENCHMARK_DRAIN_TIMEOUT_MS 500
+
+static void printResult(const char* format, ...)
+{
+    char buffer[512];
+    va_list args;
+
+    va_start(args, format);
+    SDL_vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    // The log goes to disk, so also print them for scripts
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "%s", buffer);
+    fprintf(stdout, "%s\n", buffer);
+}
+
+bool DecodeBenchmark::parseCommandLine(const char* commandLine, PDECODE_BENCHMARK_OPTIONS options)
+{
+    std::vector<std::string> args = StringUtils::splitCommandLine(commandLine);
+
+    options->inputFile.clear();
+    options->replayFile.clear();
+    options->videoFormat = VIDEO_FORMAT_H264;
+    options->frameRate = DEFAULT_BENCHMARK_FRAME_RATE;
+    options->frameCount = 0;
+    options->unthrottled = false;
+    options->framePacing = false;
+    options->uploadOnly = false;
+
+    if (std::find(args.begin(), args.end(), "--decode-benchmark") == args.end()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        bool hasValue = i + 1 < args.size();
+
+        if (arg == "--decode-benchmark") {
+            continue;
+        }
+        else if (arg == "--input" && hasValue) {
+            options->inputFile = args[++i];
+        }
+        else if (arg == "--replay" && hasValue) {
+            options->replayFile = args[++i];
+        }
+        else if (arg == "--codec" && hasValue) {
+            const std::string& codec = args[++i];
+
+            if (codec == "h264") {
+                options->videoFormat = VIDEO_FORMAT_H264;
+            }
+            else if (codec == "hevc") {
+                options->videoFormat = VIDEO_FORMAT_H265;
+            }
+            else if (codec == "hevc10") {
+                options->videoFormat = VIDEO_FORMAT_H265_MAIN10;
+            }
+            else if (codec == "av1") {
+                options->videoFormat = VIDEO_FORMAT_AV1_MAIN8;
+            }
+            else if (codec == "av1-10") {
+                options->videoFormat = VIDEO_FORMAT_AV1_MAIN10;
+            }
+            else {
+                SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                             "Unknown benchmark codec: %s",
+                             codec.c_str());
+                options->videoFormat = 0;
+            }
+        }
+        else if (arg == "--fps" && hasValue) {
+            options->frameRate = SDL_atoi(args[++i].c_str());
+        }
+        else if (arg == "--frames" && hasValue) {
+            options->frameCount = SDL_atoi(args[++i].c_str());
+        }
+        else if (arg == "--unthrottled") {
+            options->unthrottled = true;
+        }
+        else if (arg == "--pacing") {
+            options->framePacing = true;
+        }
+        else if (arg == "--upload") {
+            options->uploadOnly = true;
+        }
+        else {
+            SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                        "Ignoring unknown argument: %s",
+                        arg.c_str());
+        }
+    }
+
+    return true;
+}
+
+int DecodeBenchmark::run(const DECODE_BENCHMARK_OPTIONS& options)
+{
+    if (options.uploadOnly) {
+        return runUploadBenchmark();
+    }
+
+    DecodeBenchmark benchmark(options);
+    return benchmark.execute();
+}
+
+DecodeBenchmark::DecodeBenchmark(const DECODE_BENCHMARK_OPTIONS& options)
+    : m_Options(options),
+      m_Width(0),
+      m_Height(0),
+      m_FrameCount(0),
+      m_HasAudio(false),
+      m_ReplayStartUs(0),
+      m_AudioThread(nullptr),
+      m_AudioSamplesPlayed(0),
+      m_AudioSamplesDropped(0),
+      m_Woken(false),
+      m_NeedIdr(false),
+      m_FeedFinished(false),
+      m_NextFrameIndex(0),
+      m_SubmittedFrames(0),
+      m_AcceptedFrames(0),
+      m_StartCpuTimeUs(0),
+      m_NextScanFrameId(1),
+      m_LastPresentCpuTimeUs(0)
+{
+    SDL_zero(m_DecodeUnit);
+    SDL_zero(m_AudioConfig);
+}
+
+uint64_t DecodeBenchmark::getProcessCpuTimeUs()
+{
+#if defined(_WIN32) || defined(_WIN64)
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime)) {
+        return 0;
+    }
+
+    // FILETIMEs are in 100 ns units
+    ULARGE_INTEGER kernel, user;
+    kernel.LowPart = kernelTime.dwLowDateTime;
+    kernel.HighPart = kernelTime.dwHighDateTime;
+    user.LowPart = userTime.dwLowDateTime;
+    user.HighPart = userTime.dwHighDateTime;
+    return (kernel.QuadPart + user.QuadPart) / 10;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#endif
+}
+
+void DecodeBenchmark::addFrame(const uint8_t* data, int length, bool isKeyFrame)
+{
+    Frame frame = {};
+
+    frame.data.assign(data, data + length);
+    frame.buffers.push_back({ BUFFER_TYPE_PICDATA, length });
+    frame.isKeyFrame = isKeyFrame;
+    m_Frames.push_back(std::move(frame));
+}
+
+bool DecodeBenchmark::loadFrames()
+{
+    if (m_Options.inputFile.empty()) {
+        const uint8_t* data;
+        int length;
+
+        if (!FFmpegVideoDecoder::getTestFrame(m_Options.videoFormat, &data, &length)) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                         "No sample frame for format: %x",
+                         m_Options.videoFormat);
+            return false;
+        }
+
+        // The samples are single 720p IDR frames
+        addFrame(data, length, true);
+        m_Width = 1280;
+        m_Height = 720;
+        return true;
+    }
+
+    // Read the whole file up front, so I/O doesn't show up in the results
+    std::ifstream file(m_Options.inputFile, std::ios::binary);
+    if (!file.is_open()) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Unable to open benchmark input: %s",
+                     m_Options.inputFile.c_str());
+        return false;
+    }
+
+    std::vector<uint8_t> fileData((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    enum AVCodecID codecId;
+    if (m_Options.videoFormat & VIDEO_FORMAT_MASK_H264) {
+        codecId = AV_CODEC_ID_H264;
+    }
+    else if (m_Options.videoFormat & VIDEO_FORMAT_MASK_H265) {
+        codecId = AV_CODEC_ID_HEVC;
+    }
+    else {
+        codecId = AV_CODEC_ID_AV1;
+    }
+
+    // Split the stream into access units like the host sends them
+    AVCodecParserContext* parser = av_parser_init(codecId);
+    AVCodecContext* parserCtx = avcodec_alloc_context3(nullptr);
+    if (parser == nullptr || parserCtx == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Unable to create parser for format: %x",
+                     m_Options.videoFormat);
+        av_parser_close(parser);
+        avcodec_free_context(&parserCtx);
+        return false;
+    }
+
+    const uint8_t* data = fileData.data();
+    int remaining = (int)fileData.size();
+    for (;;) {
+        uint8_t* frameData;
+        int frameLength;
+
+        // Passing no data flushes the last frame out of the parser
+        int consumed = av_parser_parse2(parser, parserCtx, &frameData, &frameLength,
+                                        remaining > 0 ? data : nullptr, remaining,
+                                        AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+        if (consumed < 0) {
+            break;
+        }
+
+        data += consumed;
+        remaining -= consumed;
+
+        if (frameLength > 0) {
+            bool isKeyFrame = parser->key_frame == 1;
+
+            // The decoder can't start until the first key frame
+            if (isKeyFrame || !m_Frames.empty()) {
+                addFrame(frameData, frameLength, isKeyFrame);
+            }
+
+            if (isKeyFrame && m_Width == 0) {
+                m_Width = parser->width;
+                m_Height = parser->height;
+            }
+        }
+        else if (remaining == 0) {
+            break;
+        }
+    }
+
+    av_parser_close(parser);
+    avcodec_free_context(&parserCtx);
+
+    if (m_Frames.empty()) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "No key frames found in benchmark input: %s",
+                     m_Options.inputFile.c_str());
+        return false;
+    }
+
+    if (m_Width <= 0 || m_Height <= 0) {
+        SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                    "Unable to determine stream dimensions. Assuming 1080p.");
+        m_Width = 1920;
+        m_Height = 1080;
+    }
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Loaded %d frames (%dx%d) from %s",
+                (int)m_Frames.size(),
+                m_Width,
+                m_Height,
+                m_Options.inputFile.c_str());
+    return true;
+}
+
+bool DecodeBenchmark::loadRecording()
+{
+    StreamRecordingReader reader;
+    if (!reader.open(m_Options.replayFile.c_str())) {
+        return false;
+    }
+
+    bool haveVideoSetup = false;
+    bool haveAudioSetup = false;
+    STREAM_RECORD_HEADER header;
+    std::vector<uint8_t> payload;
+    while (reader.readRecord(&header, payload)) {
+        if (header.type == SRT_VIDEO_SETUP && payload.size() >= sizeof(STREAM_RECORD_VIDEO_SETUP)) {
+            // Only replay the first video stream in the recording,
+            // since the decoder can't change format midstream.
+            if (haveVideoSetup) {
+                SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                            "Stopping replay at the next video stream in the recording");
+                break;
+            }
+
+            STREAM_RECORD_VIDEO_SETUP setup;
+            memcpy(&setup, payload.data(), sizeof(setup));
+
+            m_Options.videoFormat = setup.videoFormat;
+            m_Options.frameRate = setup.frameRate;
+            m_Width = setup.width;
+            m_Height = setup.height;
+            haveVideoSetup = true;
+        }
+        else if (header.type == SRT_AUDIO_SETUP && payload.size() >= sizeof(STREAM_RECORD_AUDIO_SETUP)) {
+            if (haveAudioSetup) {
+                continue;
+            }
+
+            STREAM_RECORD_AUDIO_SETUP setup;
+            memcpy(&setup, payload.data(), sizeof(setup));
+
+            m_AudioConfig.sampleRate = setup.sampleRate;
+            m_AudioConfig.channelCount = setup.channelCount;
+            m_AudioConfig.streams = setup.streams;
+            m_AudioConfig.coupledStreams = setup.coupledStreams;
+            m_AudioConfig.samplesPerFrame = setup.samplesPerFrame;
+            memcpy(m_AudioConfig.mapping, setup.mapping, sizeof(m_AudioConfig.mapping));
+            haveAudioSetup = true;
+        }
+        else if (header.type == SRT_VIDEO_FRAME && haveVideoSetup && payload.size() >= sizeof(STREAM_RECORD_VIDEO_FRAME)) {
+            Frame frame = {};
+            memcpy(&frame.recorded, payload.data(), sizeof(frame.recorded));
+            frame.isKeyFrame = frame.recorded.frameType == FRAME_TYPE_IDR;
+            frame.timestampUs = header.timestampUs;
+
+            size_t offset = sizeof(frame.recorded);
+            for (int i = 0; i < frame.recorded.bufferCount; i++) {
+                STREAM_RECORD_BUFFER buffer;
+
+                if (offset + sizeof(buffer) > payload.size()) {
+                    break;
+                }
+                memcpy(&buffer, payload.data() + offset, sizeof(buffer));
+                offset += sizeof(buffer);
+
+                if (buffer.length < 0 || offset + (size_t)buffer.length > payload.size()) {
+                    break;
+                }
+                frame.data.insert(frame.data.end(), payload.data() + offset, payload.data() + offset + buffer.length);
+                frame.buffers.push_back(buffer);
+                offset += buffer.length;
+            }
+
+            if (frame.buffers.size() != frame.recorded.bufferCount) {
+                SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                            "Skipping corrupt frame %d in recording",
+                            frame.recorded.frameNumber);
+                continue;
+            }
+
+            // The decoder can't start until the first key frame
+            if (frame.isKeyFrame || !m_Frames.empty()) {
+                m_Frames.push_back(std::move(frame));
+            }
+        }
+        else if (header.type == SRT_AUDIO_SAMPLE && haveAudioSetup) {
+            m_AudioSamples.push_back({ header.timestampUs, payload });
+        }
+    }
+
+    if (m_Frames.empty()) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "No key frames found in recording: %s",
+                     m_Options.replayFile.c_str());
+        return false;
+    }
+
+    // Everything is replayed relative to the first frame we feed the decoder
+    m_ReplayStartUs = m_Frames.front().timestampUs;
+    m_HasAudio = haveAudioSetup && !m_AudioSamples.empty();
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Loaded %d frames (%dx%d) and %d audio samples from %s",
+                (int)m_Frames.size(),
+                m_Width,
+                m_Height,
+                (int)m_AudioSamples.size(),
+                m_Options.replayFile.c_str());
+    return true;
+}
+
+std::chrono::steady_clock::time_point DecodeBenchmark::getReplayTime(uint64_t timestampUs)
+{
+    // Anything recorded before the first frame is due immediately
+    return m_StartTime + std::chrono::microseconds(timestampUs > m_ReplayStartUs ? timestampUs - m_ReplayStartUs : 0);
+}
+
+bool DecodeBenchmark::waitForNextVideoFrame(VIDEO_FRAME_HANDLE* handle, PDECODE_UNIT* du)
+{
+    std::unique_lock<std::mutex> locker(m_Lock);
+
+    bool replaying = !m_Options.replayFile.empty();
+
+    if (m_SubmittedFrames == 0) {
+        m_StartTime = std::chrono::steady_clock::now();
+        m_StartCpuTimeUs = getProcessCpuTimeUs();
+    }
+
+    if (m_NeedIdr) {
+        // The decoder can only recover from a key frame. There's always one at
+        // the start, which we loop back to unless we're replaying a recording.
+        while (m_NextFrameIndex < m_Frames.size() && !m_Frames[m_NextFrameIndex].isKeyFrame) {
+            m_NextFrameIndex++;
+            if (!replaying && m_NextFrameIndex == m_Frames.size()) {
+                m_NextFrameIndex = 0;
+            }
+        }
+        m_NeedIdr = false;
+    }
+
+    if (m_SubmittedFrames == m_FrameCount || m_NextFrameIndex == m_Frames.size()) {
+        // Out of frames, so just wait to be told to stop
+        m_FeedFinished = true;
+        m_WakeCond.wait(locker, [this] { return m_Woken; });
+    }
+    else if (!m_Options.unthrottled) {
+        // Frames arrive when they did in the recording, or
+        // otherwise at the stream frame rate like they would
+        // from the host.
+        auto frameTime = replaying ?
+                    getReplayTime(m_Frames[m_NextFrameIndex].timestampUs) :
+                    m_StartTime + std::chrono::microseconds((int64_t)m_SubmittedFrames * 1000000 / m_Options.frameRate);
+        m_WakeCond.wait_until(locker, frameTime, [this] { return m_Woken; });
+    }
+
+    if (m_Woken) {
+        return false;
+    }
+
+    const Frame& frame = m_Frames[m_NextFrameIndex++];
+    if (!replaying && m_NextFrameIndex == m_Frames.size()) {
+        m_NextFrameIndex = 0;
+    }
+
+    const uint8_t* data = frame.data.data();
+    for (size_t i = 0; i < frame.buffers.size(); i++) {
+        LENTRY& entry = m_BufferEntries[i];
+
+        entry.next = i + 1 < frame.buffers.size() ? &m_BufferEntries[i + 1] : nullptr;
+        entry.data = (char*)data;
+        entry.length = frame.buffers[i].length;
+        entry.bufferType = frame.buffers[i].bufferType;
+        data += entry.length;
+    }
+
+    SDL_zero(m_DecodeUnit);
+    m_DecodeUnit.frameNumber = ++m_SubmittedFrames;
+    m_DecodeUnit.frameType = frame.isKeyFrame ? FRAME_TYPE_IDR : FRAME_TYPE_PFRAME;
+    m_DecodeUnit.receiveTimeMs = m_DecodeUnit.enqueueTimeMs = LiGetMillis();
+    m_DecodeUnit.presentationTimeMs = (unsigned int)((int64_t)m_SubmittedFrames * 1000 / m_Options.frameRate);
+    m_DecodeUnit.fullLength = (int)frame.data.size();
+    m_DecodeUnit.bufferList = &m_BufferEntries[0];
+
+    if (replaying) {
+        const STREAM_RECORD_VIDEO_FRAME& recorded = frame.recorded;
+
+        // Reproduce how long the frame spent in the connection's queues
+        uint64_t now = m_DecodeUnit.receiveTimeMs;
+        m_DecodeUnit.frameType = recorded.frameType;
+        m_DecodeUnit.receiveTimeMs = now - (std::min)(now, recorded.captureTimeMs - (std::min)(recorded.captureTimeMs, recorded.receiveTimeMs));
+        m_DecodeUnit.enqueueTimeMs = now - (std::min)(now, recorded.captureTimeMs - (std::min)(recorded.captureTimeMs, recorded.enqueueTimeMs));
+        m_DecodeUnit.presentationTimeMs = recorded.presentationTimeMs;
+        m_DecodeUnit.frameHostProcessingLatency = recorded.frameHostProcessingLatency;
+        m_DecodeUnit.hdrActive = recorded.hdrActive != 0;
+        m_DecodeUnit.colorspace = recorded.colorspace;
+    }
+
+    // Audio starts along with the first frame
+    if (m_SubmittedFrames == 1) {
+        m_WakeCond.notify_all();
+    }
+
+    *handle = &m_DecodeUnit;
+    *du = &m_DecodeUnit;
+    return true;
+}
+
+void DecodeBenchmark::completeVideoFrame(VIDEO_FRAME_HANDLE, int drStatus)
+{
+    std::lock_guard<std::mutex> locker(m_Lock);
+
+    if (drStatus == DR_OK) {
+        m_AcceptedFrames++;
+    }
+    else {
+        m_NeedIdr = true;
+    }
+}
+
+void DecodeBenchmark::wakeWaitForVideoFrame()
+{
+    std::lock_guard<std::mutex> locker(m_Lock);
+    m_Woken = true;
+    m_WakeCond.notify_all();
+}
+
+void DecodeBenchmark::requestIdrFrame()
+{
+    std::lock_guard<std::mutex> locker(m_Lock);
+    m_NeedIdr = true;
+}
+
+int DecodeBenchmark::audioThreadProc(void* context)
+{
+    ((DecodeBenchmark*)context)->playAudio();
+    return 0;
+}
+
+void DecodeBenchmark::playAudio()
+{
+    OPUS_MULTISTREAM_CONFIGURATION activeConfig;
+    int error;
+
+    IAudioRenderer* renderer = Session::createAudioRenderer(&m_AudioConfig);
+    if (renderer == nullptr) {
+        SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                    "Unable to create audio renderer. Replaying video only.");
+        return;
+    }
+
+    // Decode the same way the session does
+    activeConfig = m_AudioConfig;
+    renderer->remapChannels(&activeConfig);
+
+    OpusMSDecoder* opusDecoder =
+        opus_multistream_decoder_create(activeConfig.sampleRate,
+                                        activeConfig.channelCount,
+                                        activeConfig.streams,
+                                        activeConfig.coupledStreams,
+                                        activeConfig.mapping,
+                                        &error);
+    if (opusDecoder == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Failed to create decoder: %d",
+                     error);
+        delete renderer;
+        return;
+    }
+
+    for (const AudioSample& sample : m_AudioSamples) {
+        {
+            std::unique_lock<std::mutex> locker(m_Lock);
+
+            m_WakeCond.wait(locker, [this] { return m_SubmittedFrames > 0 || m_Woken; });
+            if (!m_Options.unthrottled) {
+                m_WakeCond.wait_until(locker, getReplayTime(sample.timestampUs), [this] { return m_Woken; });
+            }
+
+            if (m_Woken) {
+                break;
+            }
+        }
+
+        int desiredSize = sizeof(short) * activeConfig.samplesPerFrame * activeConfig.channelCount;
+        void* buffer = renderer->getAudioBuffer(&desiredSize);
+        if (buffer == nullptr) {
+            m_AudioSamplesDropped++;
+            continue;
+        }
+
+        int samplesDecoded = opus_multistream_decode(opusDecoder,
+                                                     sample.data.data(),
+                                                     (opus_int32)sample.data.size(),
+                                                     (short*)buffer,
+                                                     desiredSize / sizeof(short) / activeConfig.channelCount,
+                                                     0);
+        if (samplesDecoded > 0) {
+            desiredSize = sizeof(short) * samplesDecoded * activeConfig.channelCount;
+        }
+        else {
+            desiredSize = 0;
+        }
+
+        if (!renderer->submitAudio(desiredSize)) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                         "Audio renderer failed during replay");
+            break;
+        }
+
+        m_AudioSamplesPlayed++;
+    }
+
+    opus_multistream_decoder_destroy(opusDecoder);
+    delete renderer;
+}
+
+void DecodeBenchmark::collectFrameIntervals(FFmpegVideoDecoder* decoder)
+{
+    size_t presentedFrames = m_IntervalSamplesUs[FTI_TOTAL].size();
+
+    decoder->getFrameTimeline()->scanPresentedFrames(&m_NextScanFrameId, [this](const uint32_t intervalsUs[FTI_MAX]) {
+        for (int i = 0; i < FTI_MAX; i++) {
+            m_IntervalSamplesUs[i].push_back(intervalsUs[i]);
+        }
+    });
+
+    if (m_IntervalSamplesUs[FTI_TOTAL].size() != presentedFrames) {
+        m_LastPresentTime = std::chrono::steady_clock::now();
+        m_LastPresentCpuTimeUs = getProcessCpuTimeUs();
+    }
+}
+
+int DecodeBenchmark::execute()
+{
+    if (!m_Options.replayFile.empty()) {
+        if (!loadRecording()) {
+            return -1;
+        }
+    }
+    else if (!loadFrames()) {
+        return -1;
+    }
+
+    if (m_Options.videoFormat == 0 || m_Options.frameRate <= 0) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Invalid benchmark options");
+        return -1;
+    }
+
+    size_t maxBufferCount = 0;
+    for (const Frame& frame : m_Frames) {
+        maxBufferCount = (std::max)(maxBufferCount, frame.buffers.size());
+    }
+    m_BufferEntries.resize(maxBufferCount);
+
+    if (!m_Options.replayFile.empty()) {
+        // Recordings aren't looped
+        m_FrameCount = m_Options.frameCount > 0 ?
+                    (std::min)(m_Options.frameCount, (int)m_Frames.size()) :
+                    (int)m_Frames.size();
+    }
+    else if (m_Options.frameCount > 0) {
+        m_FrameCount = m_Options.frameCount;
+    }
+    else if (!m_Options.inputFile.empty()) {
+        m_FrameCount = (int)m_Frames.size();
+    }
+    else {
+        m_FrameCount = m_Options.frameRate * DEFAULT_BENCHMARK_SECONDS;
+    }
+
+    for (int i = 0; i < FTI_MAX; i++) {
+        m_IntervalSamplesUs[i].reserve(m_FrameCount);
+    }
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Decode benchmark: %d frames at %d FPS%s%s",
+                m_FrameCount,
+                m_Options.frameRate,
+                m_Options.unthrottled ? " (unthrottled)" : "",
+                m_Options.framePacing ? " (paced)" : "");
+
+    DECODER_PARAMETERS params;
+    SDL_zero(params);
+    params.window = nullptr;
+    params.vds = StreamingPreferences::VDS_FORCE_SOFTWARE;
+    params.videoFormat = m_Options.videoFormat;
+    params.width = m_Width;
+    params.height = m_Height;
+    params.frameRate = m_Options.frameRate;
+    params.enableVsync = false;
+    params.enableFramePacing = m_Options.framePacing;
+    params.testOnly = false;
+    params.frameSource = this;
+
+    // The decoder threads start pulling frames as soon as it's initialized
+    FFmpegVideoDecoder* decoder = new FFmpegVideoDecoder(false);
+    if (!decoder->initialize(&params)) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Unable to initialize decoder for benchmark");
+        delete decoder;
+        return -1;
+    }
+
+    if (m_HasAudio) {
+        m_AudioThread = SDL_CreateThread(DecodeBenchmark::audioThreadProc, "BenchmarkAudio", this);
+        if (m_AudioThread == nullptr) {
+            SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                        "Unable to create audio thread: %s",
+                        SDL_GetError());
+        }
+    }
+
+    m_LastPresentTime = std::chrono::steady_clock::now();
+    for (;;) {
+        SDL_Delay(BENCHMARK_POLL_INTERVAL_MS);
+        collectFrameIntervals(decoder);
+
+        bool feedFinished;
+        int acceptedFrames;
+        {
+            std::lock_guard<std::mutex> locker(m_Lock);
+            feedFinished = m_FeedFinished;
+            acceptedFrames = m_AcceptedFrames;
+        }
+
+        auto idleTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_LastPresentTime).count();
+        if (feedFinished && ((int)m_IntervalSamplesUs[FTI_TOTAL].size() >= acceptedFrames || idleTime >= BENCHMARK_DRAIN_TIMEOUT_MS)) {
+            break;
+        }
+        else if (idleTime >= BENCHMARK_STALL_TIMEOUT_MS) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                         "Decode benchmark stalled after %d frames",
+                         (int)m_IntervalSamplesUs[FTI_TOTAL].size());
+            break;
+        }
+    }
+
+    FRAME_POOL_STATS poolStats;
+    decoder->getFramePoolStats(&poolStats);
+
+    // This also logs the decoder's own stats
+    delete decoder;
+
+    if (m_AudioThread != nullptr) {
+        // Stop the audio if the video finished first
+        wakeWaitForVideoFrame();
+        SDL_WaitThread(m_AudioThread, nullptr);
+        m_AudioThread = nullptr;
+    }
+
+    if (m_IntervalSamplesUs[FTI_TOTAL].empty()) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "No frames were presented during the benchmark");
+        return -1;
+    }
+
+    reportResults(poolStats.misses);
+    return 0;
+}
+
+void DecodeBenchmark::reportResults(uint32_t allocations)
+{
+    uint32_t frames = (uint32_t)m_IntervalSamplesUs[FTI_TOTAL].size();
+    double elapsedSec = std::chrono::duration<double>(m_LastPresentTime - m_StartTime).count();
+
+    printResult("Frames: %d submitted, %d accepted, %u presented",
+                m_SubmittedFrames, m_AcceptedFrames, frames);
+    printResult("Frame rate: %.2f FPS",
+                elapsedSec > 0 ? frames / elapsedSec : 0.0);
+    printResult("CPU time: %.3f ms per frame",
+                (m_LastPresentCpuTimeUs - m_StartCpuTimeUs) / 1000.0 / frames);
+    printResult("Frame allocations: %.3f per frame (%u total)",
+                (double)allocations / frames, allocations);
+    if (m_HasAudio) {
+        printResult("Audio: %u of %u samples played, %u dropped",
+                    m_AudioSamplesPlayed, (uint32_t)m_AudioSamples.size(), m_AudioSamplesDropped);
+    }
+
+    printResult("Frame timeline p50/p95/p99/max:");
+    for (int i = 0; i < FTI_MAX; i++) {
+        std::vector<uint32_t>& samples = m_IntervalSamplesUs[i];
+        std::sort(samples.begin(), samples.end());
+
+        printResult("  %s: %.2f/%.2f/%.2f/%.2f ms",
+                    FrameTimeline::getIntervalName((FrameTimelineInterval)i),
+                    samples[samples.size() * 50 / 100] / 1000.0f,
+                    samples[samples.size() * 95 / 100] / 1000.0f,
+                    samples[samples.size() * 99 / 100] / 1000.0f,
+                    samples.back() / 1000.0f);
+    }
+
+    fflush(stdout);
+}
+
+int DecodeBenchmark::runUploadBenchmark()
+{
+    static const struct {
+        int width;
+        int height;
+    } resolutions[] = {
+        { 1280, 720 },
+        { 1920, 1080 },
+        { 2560, 1440 },
+        { 3840, 2160 },
+    };
+    static const enum AVPixelFormat formats[] = {
+        AV_PIX_FMT_NV12,
+        AV_PIX_FMT_P010,
+        AV_PIX_FMT_YUV420P,
+    };
+
+    PlaneCopier copier;
+
+    printResult("Frame upload ms per frame: row memcpy / single thread / parallel");
+    for (const auto& resolution : resolutions) {
+        for (enum AVPixelFormat format : formats) {
+            AVFrame* frame = av_frame_alloc();
+            if (frame == nullptr) {
+                return -1;
+            }
+
+            frame->format = format;
+            frame->width = resolution.width;
+            frame->height = resolution.height;
+            if (av_frame_get_buffer(frame, 0) < 0) {
+                av_frame_free(&frame);
+                return -1;
+            }
+
+            PLANE_COPY planes[AV_NUM_DATA_POINTERS];
+            int planeCount = PlaneCopier::getFramePlanes(frame, planes);
+
+            // Give the destination a different pitch than the frame,
+            // like the texture memory we get from SDL_LockTexture().
+            std::vector<std::vector<uint8_t>> textureMemory(planeCount);
+            size_t frameBytes = 0;
+            for (int i = 0; i < planeCount; i++) {
+                memset(frame->data[i], 0x80, (size_t)frame->linesize[i] * planes[i].rows);
+
+                planes[i].dstPitch = frame->linesize[i] + 128;
+                textureMemory[i].resize((size_t)planes[i].dstPitch * planes[i].rows);
+                planes[i].dst = textureMemory[i].data();
+                frameBytes += (size_t)planes[i].rowBytes * planes[i].rows;
+            }
+
+            double msPerFrame[3];
+            for (int method = 0; method < 3; method++) {
+                const int iterations = 100;
+
+                auto startTime = std::chrono::steady_clock::now();
+                for (int iteration = 0; iteration < iterations; iteration++) {
+                    if (method == 0) {
+                        // What we did before the plane copier
+                        for (int i = 0; i < planeCount; i++) {
+                            for (int row = 0; row < planes[i].rows; row++) {
+                                memcpy(planes[i].dst + (size_t)planes[i].dstPitch * row,
+                                       planes[i].src + (size_t)planes[i].srcPitch * row,
+                                       planes[i].rowBytes);
+                            }
+                        }
+                    }
+                    else if (method == 1) {
+                        for (int i = 0; i < planeCount; i++) {
+                            PlaneCopier::copyRows(&planes[i], 0, planes[i].rows);
+                        }
+                    }
+                    else {
+                        copier.copy(planes, planeCount);
+                    }
+                }
+
+                msPerFrame[method] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count() / iterations;
+            }
+
+            printResult("  %dx%d %s (%.1f MB): %.3f / %.3f / %.3f ms (%.1f GB/s parallel)",
+                        resolution.width,
+                        resolution.height,
+                        av_get_pix_fmt_name(format),
+                        frameBytes / (1024.0 * 1024.0),
+                        msPerFrame[0],
+                        msPerFrame[1],
+                        msPerFrame[2],
+                        msPerFrame[2] > 0 ? frameBytes / (msPerFrame[2] * 1000000.0) : 0.0);
+
+            av_frame_free(&frame);
+        }
+    }
+
+    fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "decoder.h"
+#include "streaming/streamrecorder.h"
+
+#include <opus_multistream.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class FFmpegVideoDecoder;
+
+typedef struct _DECODE_BENCHMARK_OPTIONS {
+    // Annex B H.264 or HEVC, or an AV1 OBU stream. If this is
+    // empty, the built-in sample frame for the codec is looped.
+    std::string inputFile;
+
+    // A recording made with MOONLIGHT_RECORD_FILE. This replaces the input
+    // file, codec and frame rate, and the recorded video and audio are fed
+    // with their original timing unless running unthrottled.
+    std::string replayFile;
+
+    int videoFormat;
+    int frameRate;
+
+    // Frames to decode, or 0 for the whole file (or 10 seconds of the sample)
+    int frameCount;
+
+    // Feed frames as fast as the decoder takes them instead of at frameRate
+    bool unthrottled;
+
+    // Pace frames to a simulated display at frameRate with Pacer's timer
+    // V-sync source instead of presenting them as soon as they're decoded
+    bool framePacing;
+
+    // Measure copying software frames into texture memory at
+    // common resolutions instead of decoding anything
+    bool uploadOnly;
+} DECODE_BENCHMARK_OPTIONS, *PDECODE_BENCHMARK_OPTIONS;
+
+// Feeds frames from a file through the decoder, its threads and Pacer to
+// a null renderer without any host or window, then reports the frame rate,
+// the latency of each stage, and the CPU time and allocations per frame.
+// This lets us measure the decode path without streaming. Replays also
+// play the recorded audio through a real audio renderer.
+class DecodeBenchmark : public IVideoFrameSource
+{
+public:
+    // Returns true if the command line asks for the benchmark
+    static bool parseCommandLine(const char* commandLine, PDECODE_BENCHMARK_OPTIONS options);
+
+    // Returns the process exit code
+    static int run(const DECODE_BENCHMARK_OPTIONS& options);
+
+    virtual bool waitForNextVideoFrame(VIDEO_FRAME_HANDLE* handle, PDECODE_UNIT* du) override;
+
+    virtual void completeVideoFrame(VIDEO_FRAME_HANDLE handle, int drStatus) override;
+
+    virtual void wakeWaitForVideoFrame() override;
+
+    virtual void requestIdrFrame() override;
+
+private:
+    struct Frame {
+        // The data of each buffer back to back
+        std::vector<uint8_t> data;
+        std::vector<STREAM_RECORD_BUFFER> buffers;
+        bool isKeyFrame;
+
+        // Only set for replays
+        uint64_t timestampUs;
+        STREAM_RECORD_VIDEO_FRAME recorded;
+    };
+
+    struct AudioSample {
+        uint64_t timestampUs;
+        std::vector<uint8_t> data;
+    };
+
+    DecodeBenchmark(const DECODE_BENCHMARK_OPTIONS& options);
+
+    bool loadFrames();
+
+    bool loadRecording();
+
+    void addFrame(const uint8_t* data, int length, bool isKeyFrame);
+
+    std::chrono::steady_clock::time_point getReplayTime(uint64_t timestampUs);
+
+    static int audioThreadProc(void* context);
+
+    void playAudio();
+
+    int execute();
+
+    void collectFrameIntervals(FFmpegVideoDecoder* decoder);
+
+    void reportResults(uint32_t allocations);
+
+    static uint64_t getProcessCpuTimeUs();
+
+    static int runUploadBenchmark();
+
+    DECODE_BENCHMARK_OPTIONS m_Options;
+    std::vector<Frame> m_Frames;
+    int m_Width;
+    int m_Height;
+    int m_FrameCount;
+
+    // Owned by the decoder's input thread between wait and complete.
+    // It only ever takes one frame at a time.
+    DECODE_UNIT m_DecodeUnit;
+    std::vector<LENTRY> m_BufferEntries;
+
+    // Replays only
+    std::vector<AudioSample> m_AudioSamples;
+    bool m_HasAudio;
+    OPUS_MULTISTREAM_CONFIGURATION m_AudioConfig;
+    uint64_t m_ReplayStartUs;
+    SDL_Thread* m_AudioThread;
+    uint32_t m_AudioSamplesPlayed;
+    uint32_t m_AudioSamplesDropped;
+
+    std::mutex m_Lock;
+    std::condition_variable m_WakeCond;
+    bool m_Woken;
+    bool m_NeedIdr;
+    bool m_FeedFinished;
+    size_t m_NextFrameIndex;
+    int m_SubmittedFrames;
+    int m_AcceptedFrames;
+    std::chrono::steady_clock::time_point m_StartTime;
+    uint64_t m_StartCpuTimeUs;
+
+    // Only touched by the thread running the benchmark
+    uint32_t m_NextScanFrameId;
+    std::vector<uint32_t> m_IntervalSamplesUs[FTI_MAX];
+    std::chrono::steady_clock::time_point m_LastPresentTime;
+    uint64_t m_LastPresentCpuTimeUs;
+};
@@ -3,11 +3,33 @@
 #include <Limelight.h>
 #include <SDL.h>
 #include "settings/streamingpreferences.h"
+#include "frametimeline.h"
 
 #define SDL_CODE_FRAME_READY 0
 
 #define MAX_SLICES 4
 
+class FramePool;
+
+// Supplies decode units to the decoder. Streams get them from the host
+// through moonlight-common-c, but the decode benchmark feeds them from
+// files without any connection.
+class IVideoFrameSource {
+public:
+    virtual ~IVideoFrameSource() {}
+
+    // Blocks until the next frame is available. Returns false if
+    // woken by wakeWaitForVideoFrame() or out of frames.
+    virtual bool waitForNextVideoFrame(VIDEO_FRAME_HANDLE* handle, PDECODE_UNIT* du) = 0;
+
+    // Returns the frame and its buffers to the source
+    virtual void completeVideoFrame(VIDEO_FRAME_HANDLE handle, int drStatus) = 0;
+
+    virtual void wakeWaitForVideoFrame() = 0;
+
+    virtual void requestIdrFrame() = 0;
+};
+
 typedef struct _VIDEO_STATS {
     uint32_t receivedFrames;
     uint32_t decodedFrames;
@@ -15,6 +37,7 @@ typedef struct _VIDEO_STATS {
     uint32_t totalFrames;
     uint32_t networkDroppedFrames;
     uint32_t pacerDroppedFrames;
+    uint32_t pacerMissedVsyncs;
     uint16_t minHostProcessingLatency;
     uint16_t maxHostProcessingLatency;
     uint32_t totalHostProcessingLatency;
@@ -23,6 +46,12 @@ typedef struct _VIDEO_STATS {
     uint32_t totalDecodeTime;
     uint32_t totalPacerTime;
     uint32_t totalRenderTime;
+    uint64_t totalDecoderInputWaitTimeUs;
+    uint64_t totalDecoderOutputWaitTimeUs;
+    uint32_t readBackFrames;
+    uint64_t totalReadBackTimeUs;
+    uint64_t totalReadBackWaitTimeUs;
+    FRAME_TIMELINE_STATS timeline;
     uint32_t lastRtt;
     uint32_t lastRttVariance;
     float totalFps;
@@ -43,6 +72,12 @@ typedef struct _DECODER_PARAMETERS {
     bool enableVsync;
     bool enableFramePacing;
     bool testOnly;
+
+    // Populated by the decoder for renderers that allocate frames
+    FramePool* framePool;
+
+    // Frames come from the host connection if this is null
+    IVideoFrameSource* frameSource;
 } DECODER_PARAMETERS, *PDECODER_PARAMETERS;
 
 #define WINDOW_STATE_CHANGE_SIZE 0x01
@@ -0,0 +1,352 @@
+#include "decoderprobecache.h"
+#include "path.h"
+
+#include <json.hpp>
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <dxgi.h>
+#endif
+
+#define DECODER_PROBE_CACHE_FILE "decoderprobes.json"
+
+// Bump this if the layout or meaning of the cached results changes
+#define DECODER_PROBE_CACHE_VERSION 2
+
+DecoderProbeCache* DecoderProbeCache::get()
+{
+    static DecoderProbeCache s_Instance;
+    return &s_Instance;
+}
+
+DecoderProbeCache::DecoderProbeCache()
+    : m_Enabled(true),
+      m_Loaded(false),
+      m_Dirty(false),
+      m_ProbingRefCount(0),
+      m_Hits(0),
+      m_Misses(0),
+      m_TimeSavedUs(0),
+      m_TimeSpentUs(0)
+{
+    char* envValue = std::getenv("DISABLE_DECODER_PROBE_CACHE");
+    if (envValue && strcmp(envValue, "1") == 0) {
+        SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                    "Decoder probe cache is disabled by environment variable");
+        m_Enabled = false;
+    }
+}
+
+std::string DecoderProbeCache::getSystemFingerprint()
+{
+    std::string fingerprint;
+    char buffer[512];
+
+    // A new version may probe differently
+    SDL_snprintf(buffer, sizeof(buffer), "Moonlight %s;", VERSION_STR);
+    fingerprint += buffer;
+
+    SDL_version sdlVersion;
+    SDL_GetVersion(&sdlVersion);
+    SDL_snprintf(buffer, sizeof(buffer), "SDL %d.%d.%d (%s);",
+                 sdlVersion.major, sdlVersion.minor, sdlVersion.patch,
+                 SDL_GetRevision());
+    fingerprint += buffer;
+
+    SDL_snprintf(buffer, sizeof(buffer), "FFmpeg %s (avcodec %u, avutil %u);",
+                 av_version_info(), avcodec_version(), avutil_version());
+    fingerprint += buffer;
+
+    // Software decoders pick their slice count based on the number of cores
+    SDL_snprintf(buffer, sizeof(buffer), "CPUs %d;", SDL_GetCPUCount());
+    fingerprint += buffer;
+
+    const char* videoDriver = SDL_GetCurrentVideoDriver();
+    SDL_snprintf(buffer, sizeof(buffer), "Video driver %s;", videoDriver ? videoDriver : "none");
+    fingerprint += buffer;
+
+    for (int i = 0; i < SDL_GetNumVideoDisplays(); i++) {
+        SDL_DisplayMode mode;
+        const char* displayName = SDL_GetDisplayName(i);
+
+        if (SDL_GetDesktopDisplayMode(i, &mode) != 0) {
+            SDL_zero(mode);
+        }
+
+        SDL_snprintf(buffer, sizeof(buffer), "Display %d %s %dx%dx%d %x;",
+                     i, displayName ? displayName : "",
+                     mode.w, mode.h, mode.refresh_rate, mode.format);
+        fingerprint += buffer;
+    }
+
+#if defined(_WIN32) || defined(_WIN64)
+    IDXGIFactory1* factory;
+    if (SUCCEEDED(CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void**)&factory))) {
+        IDXGIAdapter1* adapter;
+        for (UINT i = 0; factory->EnumAdapters1(i, &adapter) != DXGI_ERROR_NOT_FOUND; i++) {
+            DXGI_ADAPTER_DESC1 adapterDesc;
+            LARGE_INTEGER driverVersion;
+
+            if (FAILED(adapter->GetDesc1(&adapterDesc)) || (adapterDesc.Flags & DXGI_ADAPTER_FLAG_SOFTWARE)) {
+                adapter->Release();
+                continue;
+            }
+
+            // The UMD version is the only reliable way to get the driver version through DXGI
+            if (FAILED(adapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &driverVersion))) {
+                driverVersion.QuadPart = 0;
+            }
+
+            SDL_snprintf(buffer, sizeof(buffer), "GPU %u %x:%x:%x:%x driver %u.%u.%u.%u;",
+                         i,
+                         adapterDesc.VendorId,
+                         adapterDesc.DeviceId,
+                         adapterDesc.SubSysId,
+                         adapterDesc.Revision,
+                         HIWORD(driverVersion.HighPart),
+                         LOWORD(driverVersion.HighPart),
+                         HIWORD(driverVersion.LowPart),
+                         LOWORD(driverVersion.LowPart));
+            fingerprint += buffer;
+
+            adapter->Release();
+        }
+
+        factory->Release();
+    }
+#endif
+
+    return fingerprint;
+}
+
+void DecoderProbeCache::beginProbing()
+{
+    std::lock_guard<std::mutex> locker(m_Lock);
+
+    if (!m_Enabled || m_ProbingRefCount++ > 0) {
+        return;
+    }
+
+    m_Hits = m_Misses = 0;
+    m_TimeSavedUs = m_TimeSpentUs = 0;
+
+    if (!m_Loaded) {
+        load();
+        m_Loaded = true;
+    }
+
+    // The displays and drivers can change while we're running,
+    // so we have to check this each time we start probing.
+    std::string fingerprint = getSystemFingerprint();
+    if (fingerprint != m_Fingerprint) {
+        if (!m_Results.empty()) {
+            SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                        "System configuration changed. Discarding %d cached decoder probes.",
+                        (int)m_Results.size());
+        }
+
+        m_Results.clear();
+        m_Fingerprint = fingerprint;
+        m_Dirty = true;
+    }
+}
+
+void DecoderProbeCache::endProbing()
+{
+    std::lock_guard<std::mutex> locker(m_Lock);
+
+    if (!m_Enabled || --m_ProbingRefCount > 0) {
+        return;
+    }
+
+    if (m_Hits + m_Misses > 0) {
+        SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                    "Decoder probes: %u cached, %u run (%u ms). Cache saved approximately %u ms.",
+                    m_Hits,
+                    m_Misses,
+                    (uint32_t)(m_TimeSpentUs / 1000),
+                    (uint32_t)(m_TimeSavedUs / 1000));
+    }
+
+    if (m_Dirty) {
+        save();
+    }
+}
+
+bool DecoderProbeCache::lookup(StreamingPreferences::VideoDecoderSelection vds,
+                               int videoFormat, int width, int height, int frameRate,
+                               DECODER_PROBE_RESULT& result)
+{
+    std::lock_guard<std::mutex> locker(m_Lock);
+
+    // Never trust the cache outside of a probing pass, because
+    // we haven't checked it against the current system.
+    if (!m_Enabled || m_ProbingRefCount == 0) {
+        return false;
+    }
+
+    auto it = m_Results.find(ProbeKey(vds, videoFormat, width, height, frameRate));
+    if (it == m_Results.end()) {
+        m_Misses++;
+        return false;
+    }
+
+    result = it->second;
+    m_Hits++;
+    m_TimeSavedUs += result.probeTimeUs;
+    return true;
+}
+
+void DecoderProbeCache::store(StreamingPreferences::VideoDecoderSelection vds,
+                              int videoFormat, int width, int height, int frameRate,
+                              const DECODER_PROBE_RESULT& result)
+{
+    std::lock_guard<std::mutex> locker(m_Lock);
+
+    if (!m_Enabled || m_ProbingRefCount == 0) {
+        return;
+    }
+
+    // Failures may be transient (a busy GPU or a driver hiccup), so they
+    // are always probed again rather than sticking until the system changes.
+    if (!result.success) {
+        return;
+    }
+
+    m_Results[ProbeKey(vds, videoFormat, width, height, frameRate)] = result;
+    m_TimeSpentUs += result.probeTimeUs;
+    m_Dirty = true;
+}
+
+void DecoderProbeCache::invalidate()
+{
+    std::lock_guard<std::mutex> locker(m_Lock);
+
+    if (!m_Enabled || m_Results.empty()) {
+        return;
+    }
+
+    SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                "Discarding cached decoder probes");
+
+    m_Results.clear();
+    m_Dirty = true;
+
+    // Save now in case we don't probe again before exiting
+    save();
+}
+
+void DecoderProbeCache::load()
+{
+    std::filesystem::path cachePath = std::filesystem::path(Path::getCacheDir()) / DECODER_PROBE_CACHE_FILE;
+    std::ifstream file(cachePath, std::ios::binary);
+    if (!file.is_open()) {
+        return;
+    }
+
+    try {
+        nlohmann::json root = nlohmann::json::parse(file);
+
+        if (root.at("version").get<int>() != DECODER_PROBE_CACHE_VERSION) {
+            return;
+        }
+
+        m_Fingerprint = root.at("fingerprint").get<std::string>();
+
+        for (const nlohmann::json& entry : root.at("results")) {
+            DECODER_PROBE_RESULT result;
+
+            result.success = entry.at("success").get<bool>();
+            result.isHardwareAccelerated = entry.at("hardwareAccelerated").get<bool>();
+            result.isAlwaysFullScreen = entry.at("alwaysFullScreen").get<bool>();
+            result.isHdrSupported = entry.at("hdrSupported").get<bool>();
+            result.maxResolution.width = entry.at("maxWidth").get<int>();
+            result.maxResolution.height = entry.at("maxHeight").get<int>();
+            result.capabilities = entry.at("capabilities").get<int>();
+            result.colorspace = entry.at("colorspace").get<int>();
+            result.colorRange = entry.at("colorRange").get<int>();
+            result.probeTimeUs = entry.at("probeTimeUs").get<uint32_t>();
+
+            m_Results[ProbeKey(entry.at("vds").get<int>(),
+                               entry.at("videoFormat").get<int>(),
+                               entry.at("width").get<int>(),
+                               entry.at("height").get<int>(),
+                               entry.at("frameRate").get<int>())] = result;
+        }
+    }
+    catch (const std::exception& e) {
+        SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                    "Ignoring corrupt decoder probe cache: %s",
+                    e.what());
+        m_Fingerprint.clear();
+        m_Results.clear();
+        return;
+    }
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Loaded %d cached decoder probes",
+                (int)m_Results.size());
+}
+
+void DecoderProbeCache::save()
+{
+    nlohmann::json results = nlohmann::json::array();
+
+    for (const auto& it : m_Results) {
+        const DECODER_PROBE_RESULT& result = it.second;
+        nlohmann::json entry;
+
+        entry["vds"] = std::get<0>(it.first);
+        entry["videoFormat"] = std::get<1>(it.first);
+        entry["width"] = std::get<2>(it.first);
+        entry["height"] = std::get<3>(it.first);
+        entry["frameRate"] = std::get<4>(it.first);
+        entry["success"] = result.success;
+        entry["hardwareAccelerated"] = result.isHardwareAccelerated;
+        entry["alwaysFullScreen"] = result.isAlwaysFullScreen;
+        entry["hdrSupported"] = result.isHdrSupported;
+        entry["maxWidth"] = result.maxResolution.width;
+        entry["maxHeight"] = result.maxResolution.height;
+        entry["capabilities"] = result.capabilities;
+        entry["colorspace"] = result.colorspace;
+        entry["colorRange"] = result.colorRange;
+        entry["probeTimeUs"] = result.probeTimeUs;
+
+        results.push_back(entry);
+    }
+
+    nlohmann::json root;
+    root["version"] = DECODER_PROBE_CACHE_VERSION;
+    root["fingerprint"] = m_Fingerprint;
+    root["results"] = results;
+
+    try {
+        std::filesystem::path cacheDir(Path::getCacheDir());
+        std::filesystem::create_directories(cacheDir);
+
+        std::ofstream file(cacheDir / DECODER_PROBE_CACHE_FILE, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                        "Unable to write decoder probe cache");
+            return;
+        }
+
+        file << root.dump();
+    }
+    catch (const std::exception& e) {
+        SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                    "Unable to write decoder probe cache: %s",
+                    e.what());
+        return;
+    }
+
+    m_Dirty = false;
+}
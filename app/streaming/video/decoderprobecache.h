@@ -0,0 +1,93 @@
+#pragma once
+
+#include "settings/streamingpreferences.h"
+#include "common.h"
+
+#include <SDL.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+typedef struct _DECODER_PROBE_RESULT {
+    bool success;
+    bool isHardwareAccelerated;
+    bool isAlwaysFullScreen;
+    bool isHdrSupported;
+    RazerSize maxResolution;
+    int capabilities;
+    int colorspace;
+    int colorRange;
+
+    // How long the probe took when it actually ran
+    uint32_t probeTimeUs;
+} DECODER_PROBE_RESULT, *PDECODER_PROBE_RESULT;
+
+// Persists the results of test-only decoder probes across launches, so we
+// don't have to build a decoder and decode a test frame for each codec
+// every time a stream starts. Results are keyed by the probe parameters
+// and are all thrown away when the GPU, driver, displays, or the app, SDL
+// or FFmpeg versions change. Only successful probes are cached.
+class DecoderProbeCache
+{
+public:
+    static DecoderProbeCache* get();
+
+    // Loads the cache and checks it against the current system. Calls
+    // must be paired with endProbing(), which saves any new results.
+    void beginProbing();
+
+    void endProbing();
+
+    bool lookup(StreamingPreferences::VideoDecoderSelection vds,
+                int videoFormat, int width, int height, int frameRate,
+                DECODER_PROBE_RESULT& result);
+
+    void store(StreamingPreferences::VideoDecoderSelection vds,
+               int videoFormat, int width, int height, int frameRate,
+               const DECODER_PROBE_RESULT& result);
+
+    // Called when a decoder fails in a way the cached results didn't predict
+    void invalidate();
+
+private:
+    typedef std::tuple<int, int, int, int, int> ProbeKey;
+
+    DecoderProbeCache();
+
+    static std::string getSystemFingerprint();
+
+    void load();
+
+    void save();
+
+    std::mutex m_Lock;
+    bool m_Enabled;
+    bool m_Loaded;
+    bool m_Dirty;
+    int m_ProbingRefCount;
+    std::string m_Fingerprint;
+    std::map<ProbeKey, DECODER_PROBE_RESULT> m_Results;
+
+    // Statistics for the current probing pass
+    uint32_t m_Hits;
+    uint32_t m_Misses;
+    uint64_t m_TimeSavedUs;
+    uint64_t m_TimeSpentUs;
+};
+
+// Keeps the cache in a probing pass for the rest of the enclosing scope
+class DecoderProbingScope
+{
+public:
+    DecoderProbingScope()
+    {
+        DecoderProbeCache::get()->beginProbing();
+    }
+
+    ~DecoderProbingScope()
+    {
+        DecoderProbeCache::get()->endProbing();
+    }
+};
@@ -0,0 +1,160 @@
+#include "decoderthreadscaler.h"
+#include "decoder.h"
+
+#include <Limelight.h>
+#include <SDL.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// Pixels per second that one core can decode at 8-bit, roughly measured
+// with FFmpeg's software decoders and libdav1d on a modern desktop CPU
+#define H264_PIXELS_PER_THREAD 120000000.0
+#define HEVC_PIXELS_PER_THREAD 80000000.0
+#define AV1_PIXELS_PER_THREAD 70000000.0
+
+// 10-bit content costs this much more to decode
+#define HIGH_BIT_DEPTH_COST 1.25
+
+// We want a frame to decode within this fraction of the frame interval,
+// because decode time is directly added to latency.
+#define TARGET_DECODE_BUDGET 0.25
+
+// Add threads when decoding takes longer than this fraction of the frame
+// interval, and remove them when it's under the lower one for a while.
+#define RAISE_THREADS_THRESHOLD 0.5
+#define LOWER_THREADS_THRESHOLD 0.15
+#define LOWER_THREADS_IDLE_WINDOWS 5
+
+// Each change costs us a decoder reopen and an IDR frame,
+// so give the last change time to settle before the next.
+#define CHANGE_COOLDOWN_WINDOWS 5
+
+// Cores left for the render, input, audio and network threads
+#define RESERVED_CORES 2
+
+DecoderThreadScaler::DecoderThreadScaler()
+    : m_SliceCount(1),
+      m_ThreadCount(1),
+      m_MinThreadCount(1),
+      m_MaxThreadCount(1),
+      m_FrameIntervalMs(0),
+      m_WindowsSinceChange(0),
+      m_IdleWindows(0)
+{
+
+}
+
+void DecoderThreadScaler::initialize(int videoFormat, int width, int height, int frameRate, bool isDav1d)
+{
+    int cpuCount = SDL_GetCPUCount();
+    double pixelsPerThread;
+
+    if (videoFormat & VIDEO_FORMAT_MASK_H264) {
+        pixelsPerThread = H264_PIXELS_PER_THREAD;
+    }
+    else if (videoFormat & VIDEO_FORMAT_MASK_H265) {
+        pixelsPerThread = HEVC_PIXELS_PER_THREAD;
+    }
+    else {
+        pixelsPerThread = AV1_PIXELS_PER_THREAD;
+    }
+
+    if (videoFormat & VIDEO_FORMAT_MASK_10BIT) {
+        pixelsPerThread /= HIGH_BIT_DEPTH_COST;
+    }
+
+    // Small machines keep the old behavior of one slice per core
+    // up to MAX_SLICES. Larger ones leave some cores for everything else.
+    m_MinThreadCount = (std::min)(MAX_SLICES, cpuCount);
+    m_MaxThreadCount = (std::max)(m_MinThreadCount, cpuCount - RESERVED_CORES);
+
+    double pixelRate = (double)width * height * frameRate;
+    int requiredThreads = (int)std::ceil(pixelRate / pixelsPerThread / TARGET_DECODE_BUDGET);
+    m_ThreadCount = SDL_clamp(requiredThreads, m_MinThreadCount, m_MaxThreadCount);
+
+    if (isDav1d) {
+        // libdav1d splits each frame across threads by tile and by
+        // post-filter rows, so it can use more threads than we have slices.
+        m_SliceCount = m_ThreadCount;
+    }
+    else {
+        // FFmpeg's slice threading can't use more threads than slices.
+        // Ask for enough slices to leave headroom for adding threads later.
+        m_SliceCount = (std::min)((std::min)(m_ThreadCount * 2, m_MaxThreadCount), MAX_SCALED_SLICES);
+        m_MaxThreadCount = (std::max)(m_MinThreadCount, m_SliceCount);
+        m_ThreadCount = (std::min)(m_ThreadCount, m_SliceCount);
+    }
+    m_SliceCount = SDL_clamp(m_SliceCount, 1, MAX_SCALED_SLICES);
+
+    m_FrameIntervalMs = 1000.0f / frameRate;
+    m_WindowsSinceChange = 0;
+    m_IdleWindows = 0;
+
+    char* envValue = std::getenv("DECODER_THREAD_SCALING");
+    if (envValue && strcmp(envValue, "0") == 0) {
+        // Go back to the old fixed behavior
+        m_ThreadCount = m_MinThreadCount;
+        m_MaxThreadCount = m_MinThreadCount;
+        m_SliceCount = m_MinThreadCount;
+    }
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Software decoding with %d threads (%d-%d) and %d slices per frame",
+                m_ThreadCount,
+                m_MinThreadCount,
+                m_MaxThreadCount,
+                m_SliceCount);
+}
+
+int DecoderThreadScaler::getSliceCount()
+{
+    return m_SliceCount;
+}
+
+int DecoderThreadScaler::getThreadCount()
+{
+    return m_ThreadCount;
+}
+
+bool DecoderThreadScaler::updateDecodeTime(float averageDecodeTimeMs)
+{
+    int newThreadCount = m_ThreadCount;
+
+    if (++m_WindowsSinceChange < CHANGE_COOLDOWN_WINDOWS) {
+        return false;
+    }
+
+    if (averageDecodeTimeMs > m_FrameIntervalMs * RAISE_THREADS_THRESHOLD) {
+        // We're in danger of falling behind, so add threads aggressively
+        newThreadCount = (std::min)(m_MaxThreadCount, m_ThreadCount + (std::max)(1, m_ThreadCount / 2));
+        m_IdleWindows = 0;
+    }
+    else if (averageDecodeTimeMs < m_FrameIntervalMs * LOWER_THREADS_THRESHOLD) {
+        // Only give back threads after being idle for a while
+        if (++m_IdleWindows >= LOWER_THREADS_IDLE_WINDOWS) {
+            newThreadCount = (std::max)(m_MinThreadCount, m_ThreadCount - (std::max)(1, m_ThreadCount / 4));
+            m_IdleWindows = 0;
+        }
+    }
+    else {
+        m_IdleWindows = 0;
+    }
+
+    if (newThreadCount == m_ThreadCount) {
+        return false;
+    }
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Changing decoder threads from %d to %d (%.2f ms decode time, %.2f ms frame interval)",
+                m_ThreadCount,
+                newThreadCount,
+                averageDecodeTimeMs,
+                m_FrameIntervalMs);
+
+    m_ThreadCount = newThreadCount;
+    m_WindowsSinceChange = 0;
+    return true;
+}
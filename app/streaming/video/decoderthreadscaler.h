@@ -0,0 +1,35 @@
+#pragma once
+
+// Beyond this, the bitrate cost of slicing outweighs the extra parallelism
+#define MAX_SCALED_SLICES 16
+
+// Picks slice and thread counts for software decoding based on the number
+// of cores and the cost of the stream, then adjusts the thread count while
+// streaming based on how long frames take to decode. The slice count is
+// negotiated with the host at launch, so only the thread count can change.
+class DecoderThreadScaler
+{
+public:
+    DecoderThreadScaler();
+
+    void initialize(int videoFormat, int width, int height, int frameRate, bool isDav1d);
+
+    // Number of slices per frame to request from the host
+    int getSliceCount();
+
+    int getThreadCount();
+
+    // Called once per stats window with the average time from a frame being
+    // submitted to being decoded. Returns true if the thread count changed,
+    // in which case the decoder must be reopened to apply it.
+    bool updateDecodeTime(float averageDecodeTimeMs);
+
+private:
+    int m_SliceCount;
+    int m_ThreadCount;
+    int m_MinThreadCount;
+    int m_MaxThreadCount;
+    float m_FrameIntervalMs;
+    int m_WindowsSinceChange;
+    int m_IdleWindows;
+};
@@ -91,13 +91,13 @@ D3D11VARenderer::D3D11VARenderer(int decoderSelectionPass)
       m_VideoBt2020LimPixelShader(nullptr),
       m_VideoVertexBuffer(nullptr),
       m_VideoTexture(nullptr),
-      m_OverlayLock(0),
       m_OverlayPixelShader(nullptr),
       m_HwDeviceContext(nullptr)
 {
     RtlZeroMemory(m_OverlayVertexBuffers, sizeof(m_OverlayVertexBuffers));
     RtlZeroMemory(m_OverlayTextures, sizeof(m_OverlayTextures));
     RtlZeroMemory(m_OverlayTextureResourceViews, sizeof(m_OverlayTextureResourceViews));
+    RtlZeroMemory(m_OverlayRects, sizeof(m_OverlayRects));
     RtlZeroMemory(m_VideoTextureResourceViews, sizeof(m_VideoTextureResourceViews));
 
     m_ContextLock = SDL_CreateMutex();
@@ -563,50 +563,194 @@ void D3D11VARenderer::renderFrame(AVFrame* frame)
     }
 }
 
-void D3D11VARenderer::renderOverlay(Overlay::OverlayType type)
+void D3D11VARenderer::releaseOverlay(Overlay::OverlayType type)
 {
-    if (!Session::get()->getOverlayManager().isOverlayEnabled(type)) {
+    SAFE_COM_RELEASE(m_OverlayTextureResourceViews[type]);
+    m_OverlayTextureResourceViews[type] = nullptr;
+
+    SAFE_COM_RELEASE(m_OverlayTextures[type]);
+    m_OverlayTextures[type] = nullptr;
+
+    SAFE_COM_RELEASE(m_OverlayVertexBuffers[type]);
+    m_OverlayVertexBuffers[type] = nullptr;
+}
+
+void D3D11VARenderer::updateOverlay(Overlay::OverlayType type, SDL_Surface* region, const SDL_Rect* regionRect,
+                                    int overlayWidth, int overlayHeight)
+{
+    HRESULT hr;
+
+    SDL_assert(!SDL_MUSTLOCK(region));
+    SDL_assert(region->format->format == SDL_PIXELFORMAT_ARGB8888);
+
+    // Only the region that changed needs to be uploaded, as long as the
+    // overlay is still the same size as our texture.
+    if (m_OverlayTextures[type] != nullptr) {
+        D3D11_TEXTURE2D_DESC existingDesc;
+        m_OverlayTextures[type]->GetDesc(&existingDesc);
+        if (existingDesc.Width != (UINT)overlayWidth || existingDesc.Height != (UINT)overlayHeight) {
+            SAFE_COM_RELEASE(m_OverlayTextureResourceViews[type]);
+            m_OverlayTextureResourceViews[type] = nullptr;
+
+            SAFE_COM_RELEASE(m_OverlayTextures[type]);
+            m_OverlayTextures[type] = nullptr;
+        }
+    }
+
+    if (m_OverlayTextures[type] == nullptr) {
+        // A resized overlay is always redrawn in full, so the region
+        // is the texture's initial contents
+        SDL_assert(regionRect->w == overlayWidth && regionRect->h == overlayHeight);
+
+        D3D11_TEXTURE2D_DESC texDesc = {};
+        texDesc.Width = overlayWidth;
+        texDesc.Height = overlayHeight;
+        texDesc.MipLevels = 1;
+        texDesc.ArraySize = 1;
+        texDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+        texDesc.SampleDesc.Count = 1;
+        texDesc.SampleDesc.Quality = 0;
+        texDesc.Usage = D3D11_USAGE_DEFAULT;
+        texDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        texDesc.CPUAccessFlags = 0;
+        texDesc.MiscFlags = 0;
+
+        D3D11_SUBRESOURCE_DATA texData = {};
+        texData.pSysMem = region->pixels;
+        texData.SysMemPitch = region->pitch;
+
+        ID3D11Texture2D* newTexture;
+        hr = m_Device->CreateTexture2D(&texDesc, &texData, &newTexture);
+        if (FAILED(hr)) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                         "ID3D11Device::CreateTexture2D() failed: %x",
+                         hr);
+            return;
+        }
+
+        ID3D11ShaderResourceView* newTextureResourceView;
+        hr = m_Device->CreateShaderResourceView((ID3D11Resource*)newTexture, nullptr, &newTextureResourceView);
+        if (FAILED(hr)) {
+            newTexture->Release();
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                         "ID3D11Device::CreateShaderResourceView() failed: %x",
+                         hr);
+            return;
+        }
+
+        m_OverlayTextures[type] = newTexture;
+        m_OverlayTextureResourceViews[type] = newTextureResourceView;
+    }
+    else {
+        D3D11_BOX dstBox;
+        dstBox.left = regionRect->x;
+        dstBox.top = regionRect->y;
+        dstBox.right = regionRect->x + regionRect->w;
+        dstBox.bottom = regionRect->y + regionRect->h;
+        dstBox.front = 0;
+        dstBox.back = 1;
+
+        m_DeviceContext->UpdateSubresource(m_OverlayTextures[type], 0, &dstBox,
+                                           region->pixels, region->pitch, 0);
+    }
+
+    SDL_Rect renderRect = {};
+
+    if (type == Overlay::OverlayStatusUpdate) {
+        // Bottom Left
+        renderRect.x = 0;
+        renderRect.y = 0;
+    }
+    else if (type == Overlay::OverlayDebug) {
+        // Top left
+        renderRect.x = 0;
+        renderRect.y = m_DisplayHeight - overlayHeight;
+    }
+
+    renderRect.w = overlayWidth;
+    renderRect.h = overlayHeight;
+
+    // The vertex buffer only needs to change if the overlay moved or was resized
+    if (m_OverlayVertexBuffers[type] != nullptr && SDL_RectEquals(&renderRect, &m_OverlayRects[type])) {
         return;
     }
 
-    // If the overlay is being updated, just skip rendering it this frame
-    if (!SDL_AtomicTryLock(&m_OverlayLock)) {
+    SAFE_COM_RELEASE(m_OverlayVertexBuffers[type]);
+    m_OverlayVertexBuffers[type] = nullptr;
+
+    // Convert screen space to normalized device coordinates
+    SDL_FRect ndcRect = { (float)renderRect.x, (float)renderRect.y, (float)renderRect.w, (float)renderRect.h };
+    StreamUtils::screenSpaceToNormalizedDeviceCoords(&ndcRect, m_DisplayWidth, m_DisplayHeight);
+
+    VERTEX verts[] =
+    {
+        {ndcRect.x, ndcRect.y, 0, 1},
+        {ndcRect.x, ndcRect.y+ndcRect.h, 0, 0},
+        {ndcRect.x+ndcRect.w, ndcRect.y, 1, 1},
+        {ndcRect.x+ndcRect.w, ndcRect.y+ndcRect.h, 1, 0},
+    };
+
+    D3D11_BUFFER_DESC vbDesc = {};
+    vbDesc.ByteWidth = sizeof(verts);
+    vbDesc.Usage = D3D11_USAGE_IMMUTABLE;
+    vbDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+    vbDesc.CPUAccessFlags = 0;
+    vbDesc.MiscFlags = 0;
+    vbDesc.StructureByteStride = sizeof(VERTEX);
+
+    D3D11_SUBRESOURCE_DATA vbData = {};
+    vbData.pSysMem = verts;
+
+    hr = m_Device->CreateBuffer(&vbDesc, &vbData, &m_OverlayVertexBuffers[type]);
+    if (FAILED(hr)) {
+        m_OverlayVertexBuffers[type] = nullptr;
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "ID3D11Device::CreateBuffer() failed: %x",
+                     hr);
         return;
     }
 
-    ID3D11Texture2D* overlayTexture = m_OverlayTextures[type];
-    ID3D11Buffer* overlayVertexBuffer = m_OverlayVertexBuffers[type];
-    ID3D11ShaderResourceView* overlayTextureResourceView = m_OverlayTextureResourceViews[type];
+    m_OverlayRects[type] = renderRect;
+}
 
-    if (overlayTexture == nullptr) {
-        SDL_AtomicUnlock(&m_OverlayLock);
+void D3D11VARenderer::renderOverlay(Overlay::OverlayType type)
+{
+    if (!Session::get()->getOverlayManager().isOverlayEnabled(type)) {
+        // Don't hold onto the overlay resources while it's hidden
+        releaseOverlay(type);
         return;
     }
 
-    // Reference these objects so they don't immediately go away if the
-    // overlay update thread tries to release them.
-    SDL_assert(overlayVertexBuffer != nullptr);
-    overlayTexture->AddRef();
-    overlayVertexBuffer->AddRef();
-    overlayTextureResourceView->AddRef();
+    // If the overlay has been updated, upload the part that changed.
+    // NB: We have to do this at render-time because the device context can
+    // only be used while we're holding the context lock.
+    SDL_Rect regionRect;
+    int overlayWidth, overlayHeight;
+    SDL_Surface* newRegion = Session::get()->getOverlayManager().getUpdatedOverlayRegion(type,
+                                                                                         m_OverlayTextures[type] == nullptr,
+                                                                                         &regionRect,
+                                                                                         &overlayWidth,
+                                                                                         &overlayHeight);
+    if (newRegion != nullptr) {
+        updateOverlay(type, newRegion, &regionRect, overlayWidth, overlayHeight);
+        SDL_FreeSurface(newRegion);
+    }
 
-    SDL_AtomicUnlock(&m_OverlayLock);
+    if (m_OverlayTextures[type] == nullptr || m_OverlayVertexBuffers[type] == nullptr) {
+        return;
+    }
 
     // Bind vertex buffer
     UINT stride = sizeof(VERTEX);
     UINT offset = 0;
-    m_DeviceContext->IASetVertexBuffers(0, 1, &overlayVertexBuffer, &stride, &offset);
+    m_DeviceContext->IASetVertexBuffers(0, 1, &m_OverlayVertexBuffers[type], &stride, &offset);
 
     // Bind pixel shader and resources
     m_DeviceContext->PSSetShader(m_OverlayPixelShader, nullptr, 0);
-    m_DeviceContext->PSSetShaderResources(0, 1, &overlayTextureResourceView);
+    m_DeviceContext->PSSetShaderResources(0, 1, &m_OverlayTextureResourceViews[type]);
 
     // Draw the overlay
     m_DeviceContext->DrawIndexed(6, 0, 0);
-
-    overlayTextureResourceView->Release();
-    overlayTexture->Release();
-    overlayVertexBuffer->Release();
 }
 
 void D3D11VARenderer::bindColorConversion(AVFrame* frame)
@@ -721,142 +865,6 @@ void D3D11VARenderer::renderVideo(AVFrame* frame)
     m_DeviceContext->DrawIndexed(6, 0, 0);
 }
 
-// This function must NOT use any DXGI or ID3D11DeviceContext methods
-// since it can be called on an arbitrary thread!
-void D3D11VARenderer::notifyOverlayUpdated(Overlay::OverlayType type)
-{
-    HRESULT hr;
-
-    SDL_Surface* newSurface = Session::get()->getOverlayManager().getUpdatedOverlaySurface(type);
-    bool overlayEnabled = Session::get()->getOverlayManager().isOverlayEnabled(type);
-    if (newSurface == nullptr && overlayEnabled) {
-        // The overlay is enabled and there is no new surface. Leave the old texture alone.
-        return;
-    }
-
-    SDL_AtomicLock(&m_OverlayLock);
-    ID3D11Texture2D* oldTexture = m_OverlayTextures[type];
-    m_OverlayTextures[type] = nullptr;
-
-    ID3D11Buffer* oldVertexBuffer = m_OverlayVertexBuffers[type];
-    m_OverlayVertexBuffers[type] = nullptr;
-
-    ID3D11ShaderResourceView* oldTextureResourceView = m_OverlayTextureResourceViews[type];
-    m_OverlayTextureResourceViews[type] = nullptr;
-    SDL_AtomicUnlock(&m_OverlayLock);
-
-    SAFE_COM_RELEASE(oldTextureResourceView);
-    SAFE_COM_RELEASE(oldTexture);
-    SAFE_COM_RELEASE(oldVertexBuffer);
-
-    // If the overlay is disabled, we're done
-    if (!overlayEnabled) {
-        SDL_FreeSurface(newSurface);
-        return;
-    }
-
-    // Create a texture with our pixel data
-    SDL_assert(!SDL_MUSTLOCK(newSurface));
-    SDL_assert(newSurface->format->format == SDL_PIXELFORMAT_ARGB8888);
-
-    D3D11_TEXTURE2D_DESC texDesc = {};
-    texDesc.Width = newSurface->w;
-    texDesc.Height = newSurface->h;
-    texDesc.MipLevels = 1;
-    texDesc.ArraySize = 1;
-    texDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-    texDesc.SampleDesc.Count = 1;
-    texDesc.SampleDesc.Quality = 0;
-    texDesc.Usage = D3D11_USAGE_IMMUTABLE;
-    texDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-    texDesc.CPUAccessFlags = 0;
-    texDesc.MiscFlags = 0;
-
-    D3D11_SUBRESOURCE_DATA texData = {};
-    texData.pSysMem = newSurface->pixels;
-    texData.SysMemPitch = newSurface->pitch;
-
-    ID3D11Texture2D* newTexture;
-    hr = m_Device->CreateTexture2D(&texDesc, &texData, &newTexture);
-    if (FAILED(hr)) {
-        SDL_FreeSurface(newSurface);
-        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
-                     "ID3D11Device::CreateTexture2D() failed: %x",
-                     hr);
-        return;
-    }
-
-    ID3D11ShaderResourceView* newTextureResourceView = nullptr;
-    hr = m_Device->CreateShaderResourceView((ID3D11Resource*)newTexture, nullptr, &newTextureResourceView);
-    if (FAILED(hr)) {
-        SAFE_COM_RELEASE(newTexture);
-        SDL_FreeSurface(newSurface);
-        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
-                     "ID3D11Device::CreateShaderResourceView() failed: %x",
-                     hr);
-        return;
-    }
-
-    SDL_FRect renderRect = {};
-
-    if (type == Overlay::OverlayStatusUpdate) {
-        // Bottom Left
-        renderRect.x = 0;
-        renderRect.y = 0;
-    }
-    else if (type == Overlay::OverlayDebug) {
-        // Top left
-        renderRect.x = 0;
-        renderRect.y = m_DisplayHeight - newSurface->h;
-    }
-
-    renderRect.w = newSurface->w;
-    renderRect.h = newSurface->h;
-
-    // Convert screen space to normalized device coordinates
-    StreamUtils::screenSpaceToNormalizedDeviceCoords(&renderRect, m_DisplayWidth, m_DisplayHeight);
-
-    // The surface is no longer required
-    SDL_FreeSurface(newSurface);
-    newSurface = nullptr;
-
-    VERTEX verts[] =
-    {
-        {renderRect.x, renderRect.y, 0, 1},
-        {renderRect.x, renderRect.y+renderRect.h, 0, 0},
-        {renderRect.x+renderRect.w, renderRect.y, 1, 1},
-        {renderRect.x+renderRect.w, renderRect.y+renderRect.h, 1, 0},
-    };
-
-    D3D11_BUFFER_DESC vbDesc = {};
-    vbDesc.ByteWidth = sizeof(verts);
-    vbDesc.Usage = D3D11_USAGE_IMMUTABLE;
-    vbDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-    vbDesc.CPUAccessFlags = 0;
-    vbDesc.MiscFlags = 0;
-    vbDesc.StructureByteStride = sizeof(VERTEX);
-
-    D3D11_SUBRESOURCE_DATA vbData = {};
-    vbData.pSysMem = verts;
-
-    ID3D11Buffer* newVertexBuffer;
-    hr = m_Device->CreateBuffer(&vbDesc, &vbData, &newVertexBuffer);
-    if (FAILED(hr)) {
-        SAFE_COM_RELEASE(newTextureResourceView);
-        SAFE_COM_RELEASE(newTexture);
-        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
-                     "ID3D11Device::CreateBuffer() failed: %x",
-                     hr);
-        return;
-    }
-
-    SDL_AtomicLock(&m_OverlayLock);
-    m_OverlayVertexBuffers[type] = newVertexBuffer;
-    m_OverlayTextures[type] = newTexture;
-    m_OverlayTextureResourceViews[type] = newTextureResourceView;
-    SDL_AtomicUnlock(&m_OverlayLock);
-}
-
 bool D3D11VARenderer::checkDecoderSupport(IDXGIAdapter* adapter)
 {
     HRESULT hr;
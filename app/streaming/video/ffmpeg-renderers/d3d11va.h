@@ -17,7 +17,6 @@ public:
     virtual bool initialize(PDECODER_PARAMETERS params) override;
     virtual bool prepareDecoderContext(AVCodecContext* context, AVDictionary**) override;
     virtual void renderFrame(AVFrame* frame) override;
-    virtual void notifyOverlayUpdated(Overlay::OverlayType) override;
     virtual int getRendererAttributes() override;
     virtual int getDecoderCapabilities() override;
     virtual bool needsTestFrame() override;
@@ -29,6 +28,9 @@ private:
 
     bool setupRenderingResources();
     bool setupVideoTexture();
+    void updateOverlay(Overlay::OverlayType type, SDL_Surface* region, const SDL_Rect* regionRect,
+                       int overlayWidth, int overlayHeight);
+    void releaseOverlay(Overlay::OverlayType type);
     void renderOverlay(Overlay::OverlayType type);
     void bindColorConversion(AVFrame* frame);
     void renderVideo(AVFrame* frame);
@@ -63,8 +65,9 @@ private:
     ID3D11Texture2D* m_VideoTexture;
     ID3D11ShaderResourceView* m_VideoTextureResourceViews[2];
 
-    SDL_SpinLock m_OverlayLock;
+    // Overlays are only touched on the render thread
     ID3D11Buffer* m_OverlayVertexBuffers[Overlay::OverlayMax];
+    SDL_Rect m_OverlayRects[Overlay::OverlayMax];
     ID3D11Texture2D* m_OverlayTextures[Overlay::OverlayMax];
     ID3D11ShaderResourceView* m_OverlayTextureResourceViews[Overlay::OverlayMax];
     ID3D11PixelShader* m_OverlayPixelShader;
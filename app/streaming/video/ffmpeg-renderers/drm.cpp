@@ -4,8 +4,11 @@
 #endif
 
 #include "drm.h"
+#include "../ffmpeg.h"
 #include "string.h"
 
+#include <cstdlib>
+
 extern "C" {
     #include <libavutil/hwcontext_drm.h>
 }
@@ -46,6 +49,10 @@ extern "C" {
 
 #include <sys/mman.h>
 
+// Pitch and plane alignment of decoder buffers, which covers the
+// strictest SIMD alignment FFmpeg's decoders use
+#define DECODER_BUFFER_ALIGNMENT 64
+
 #include "streaming/streamutils.h"
 #include "streaming/session.h"
 
@@ -84,12 +91,20 @@ DrmRenderer::DrmRenderer(bool hwaccel, IFFmpegRenderer *backendRenderer)
       m_Version(nullptr),
       m_HdrOutputMetadataBlobId(0),
       m_SwFrameMapper(this),
-      m_CurrentSwFrameIdx(0)
+      m_CurrentSwFrameIdx(0),
+      m_DecoderBuffersEnabled(false),
+      m_DecoderBufferPool(nullptr),
+      m_DecoderBufferFormat(AV_PIX_FMT_NONE),
+      m_DecoderBufferWidth(0),
+      m_DecoderBufferHeight(0),
+      m_DecoderBufferAlignedWidth(0),
+      m_DecoderBufferAlignedHeight(0)
 #ifdef HAVE_EGL
     , m_EglImageFactory(this)
 #endif
 {
     SDL_zero(m_SwFrame);
+    SDL_zero(m_DisplayedDecoderBuffers);
 }
 
 DrmRenderer::~DrmRenderer()
@@ -97,6 +112,18 @@ DrmRenderer::~DrmRenderer()
     // Ensure we're out of HDR mode
     setHdrMode(false);
 
+    for (int i = 0; i < k_SwFrameCount; i++) {
+        av_buffer_unref(&m_DisplayedDecoderBuffers[i]);
+    }
+
+    // Decoder buffers still referenced by frames elsewhere are freed when
+    // their last reference goes away. They use their own DRM fd for that.
+    {
+        std::lock_guard<std::mutex> locker(m_DecoderBuffersLock);
+        m_DecoderBuffers.clear();
+    }
+    av_buffer_pool_uninit(&m_DecoderBufferPool);
+
     for (int i = 0; i < k_SwFrameCount; i++) {
         if (m_SwFrame[i].primeFd) {
             close(m_SwFrame[i].primeFd);
@@ -173,6 +200,10 @@ bool DrmRenderer::prepareDecoderContext(AVCodecContext* context, AVDictionary**
         context->hw_device_ctx = av_buffer_ref(m_HwContext);
     }
 
+    if (m_DecoderBuffersEnabled) {
+        context->get_buffer2 = ffGetBuffer2;
+    }
+
     SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
                 "Using DRM renderer");
 
@@ -185,6 +216,15 @@ bool DrmRenderer::initialize(PDECODER_PARAMETERS params)
 
     m_Main10Hdr = (params->videoFormat & VIDEO_FORMAT_MASK_10BIT);
     m_SwFrameMapper.setVideoFormat(params->videoFormat);
+    m_SwFrameMapper.setFramePool(params->framePool);
+
+    // Software decoders can write frames straight into our dumb buffers rather than
+    // having mapSoftwareFrame() copy them there, but they also read their reference
+    // frames back out of them. Dumb buffers are usually write-combined, which makes
+    // those reads slow enough to cost more than the copy on some devices.
+    char* envValue = std::getenv("DRM_DECODE_TO_DUMB_BUFFERS");
+    m_DecoderBuffersEnabled = !m_HwAccelBackend && m_BackendRenderer == nullptr &&
+                              envValue != nullptr && strcmp(envValue, "1") == 0;
 
 #if SDL_VERSION_ATLEAST(2, 0, 15)
     SDL_SysWMinfo info;
@@ -764,6 +804,37 @@ bool DrmRenderer::mapSoftwareFrame(AVFrame *frame, AVDRMFrameDescriptor *mappedF
         goto Exit;
     }
 
+    {
+        // If the decoder wrote this frame into one of our dumb buffers,
+        // we can display it from there without copying anything.
+        DecoderBuffer* decoderBuffer = findDecoderBuffer(frame);
+        if (decoderBuffer != nullptr) {
+            SDL_zerop(mappedFrame);
+
+            mappedFrame->nb_objects = 1;
+            mappedFrame->objects[0].fd = decoderBuffer->primeFd;
+            mappedFrame->objects[0].format_modifier = DRM_FORMAT_MOD_LINEAR;
+            mappedFrame->objects[0].size = decoderBuffer->size;
+
+            mappedFrame->nb_layers = 1;
+
+            auto &layer = mappedFrame->layers[0];
+            layer.format = drmFormat;
+            layer.nb_planes = decoderBuffer->planeCount;
+            for (int i = 0; i < decoderBuffer->planeCount; i++) {
+                layer.planes[i].object_index = 0;
+                layer.planes[i].offset = decoderBuffer->offsets[i];
+                layer.planes[i].pitch = decoderBuffer->pitches[i];
+            }
+
+            // End the decoder's CPU access that began in getDecoderBuffer()
+            endDecoderBufferCpuAccess(decoderBuffer);
+
+            ret = true;
+            goto Exit;
+        }
+    }
+
     // Create a new dumb buffer if needed
     if (!drmFrame->handle) {
         struct drm_mode_create_dumb createBuf = {};
@@ -907,12 +978,304 @@ bool DrmRenderer::mapSoftwareFrame(AVFrame *frame, AVDRMFrameDescriptor *mappedF
 
 Exit:
     if (freeFrame) {
-        av_frame_free(&frame);
+        m_SwFrameMapper.releaseSwFrame(&frame);
     }
 
     return ret;
 }
 
+int DrmRenderer::ffGetBuffer2(AVCodecContext* context, AVFrame* frame, int flags)
+{
+    DrmRenderer* me = (DrmRenderer*)((FFmpegVideoDecoder*)context->opaque)->getBackendRenderer();
+
+    // Let FFmpeg allocate anything we can't put in a dumb buffer
+    if (!me->getDecoderBuffer(context, frame)) {
+        return avcodec_default_get_buffer2(context, frame, flags);
+    }
+
+    return 0;
+}
+
+bool DrmRenderer::getDecoderBuffer(AVCodecContext* context, AVFrame* frame)
+{
+    // Decoders without DR1 must use the default allocator
+    if (!(context->codec->capabilities & AV_CODEC_CAP_DR1) || context->hw_frames_ctx != nullptr) {
+        return false;
+    }
+
+    if (m_DecoderBufferPool == nullptr) {
+        // NB: Keep this list updated with mapSoftwareFrame()
+        switch (frame->format) {
+        case AV_PIX_FMT_NV12:
+        case AV_PIX_FMT_NV21:
+        case AV_PIX_FMT_P010:
+        case AV_PIX_FMT_YUV420P:
+        case AV_PIX_FMT_YUVJ420P:
+            break;
+        default:
+            return false;
+        }
+
+        // Decoders write past the visible frame to whole macroblocks or coding units
+        int alignedWidth = frame->width;
+        int alignedHeight = frame->height;
+        int linesizeAlign[AV_NUM_DATA_POINTERS];
+        avcodec_align_dimensions2(context, &alignedWidth, &alignedHeight, linesizeAlign);
+        for (int i = 0; i < 3; i++) {
+            if (DECODER_BUFFER_ALIGNMENT % linesizeAlign[i] != 0) {
+                SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                            "Decoder requires %d byte line alignment",
+                            linesizeAlign[i]);
+                m_DecoderBuffersEnabled = false;
+                return false;
+            }
+        }
+
+        m_DecoderBufferFormat = (enum AVPixelFormat)frame->format;
+        m_DecoderBufferWidth = frame->width;
+        m_DecoderBufferHeight = frame->height;
+        m_DecoderBufferAlignedWidth = alignedWidth;
+        m_DecoderBufferAlignedHeight = alignedHeight;
+
+        // The buffer size is decided by the kernel in ffPoolAlloc()
+        m_DecoderBufferPool = av_buffer_pool_init2(0, this, ffPoolAlloc, nullptr);
+        if (m_DecoderBufferPool == nullptr) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                         "Failed create buffer pool");
+            m_DecoderBuffersEnabled = false;
+            return false;
+        }
+    }
+
+    if (!m_DecoderBuffersEnabled ||
+            frame->format != m_DecoderBufferFormat ||
+            frame->width != m_DecoderBufferWidth ||
+            frame->height != m_DecoderBufferHeight) {
+        return false;
+    }
+
+    AVBufferRef* pooledBuffer = av_buffer_pool_get(m_DecoderBufferPool);
+    if (pooledBuffer == nullptr) {
+        return false;
+    }
+
+    // Frames that are never displayed (dropped by the pacer, flushed, or still
+    // in flight at teardown) don't reach mapSoftwareFrame(), so wrap the pooled
+    // buffer to end CPU access when the decoder buffer returns to the pool.
+    AVBufferRef* buffer = av_buffer_create(pooledBuffer->data, pooledBuffer->size,
+                                           ffDecoderBufferRelease, pooledBuffer, 0);
+    if (buffer == nullptr) {
+        av_buffer_unref(&pooledBuffer);
+        return false;
+    }
+
+    auto decoderBuffer = (DecoderBuffer*)av_buffer_pool_buffer_get_opaque(pooledBuffer);
+
+    frame->buf[0] = buffer;
+    for (int i = 0; i < decoderBuffer->planeCount; i++) {
+        frame->data[i] = decoderBuffer->mapping + decoderBuffer->offsets[i];
+        frame->linesize[i] = decoderBuffer->pitches[i];
+    }
+    frame->extended_data = frame->data;
+
+    // Prepare for the decoder to read and write the dumb buffer from the CPU
+    SDL_assert(!decoderBuffer->cpuAccess);
+    struct dma_buf_sync sync;
+    sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
+    drmIoctl(decoderBuffer->primeFd, DMA_BUF_IOCTL_SYNC, &sync);
+    decoderBuffer->cpuAccess = true;
+
+    return true;
+}
+
+void DrmRenderer::endDecoderBufferCpuAccess(DecoderBuffer* decoderBuffer)
+{
+    // A frame can be mapped more than once, but CPU access only ends once
+    if (decoderBuffer->cpuAccess.exchange(false)) {
+        struct dma_buf_sync sync;
+        sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
+        drmIoctl(decoderBuffer->primeFd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+}
+
+void DrmRenderer::ffDecoderBufferRelease(void* opaque, uint8_t*)
+{
+    auto pooledBuffer = (AVBufferRef*)opaque;
+
+    endDecoderBufferCpuAccess((DecoderBuffer*)av_buffer_pool_buffer_get_opaque(pooledBuffer));
+
+    // Return the decoder buffer to the pool
+    av_buffer_unref(&pooledBuffer);
+}
+
+AVBufferRef* DrmRenderer::ffPoolAlloc(void* opaque, size_t)
+{
+    DrmRenderer* me = (DrmRenderer*)opaque;
+    bool fullyPlanar = me->m_DecoderBufferFormat == AV_PIX_FMT_YUV420P ||
+                       me->m_DecoderBufferFormat == AV_PIX_FMT_YUVJ420P;
+
+    auto decoderBuffer = new DecoderBuffer();
+    decoderBuffer->primeFd = -1;
+
+    // Buffers can outlive the renderer in frames that are still referenced
+    // elsewhere when it's destroyed, so they hold their own DRM fd to free
+    // the dumb buffer with.
+    decoderBuffer->drmFd = fcntl(me->m_DrmFd, F_DUPFD_CLOEXEC, 0);
+    if (decoderBuffer->drmFd < 0) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "fcntl(F_DUPFD_CLOEXEC) failed: %d",
+                     errno);
+        decoderBuffer->drmFd = -1;
+        ffDecoderBufferFree(decoderBuffer, nullptr);
+        return nullptr;
+    }
+
+    // Same layout as mapSoftwareFrame(), except the chroma planes start
+    // after the padded rows of the plane before them.
+    struct drm_mode_create_dumb createBuf = {};
+    createBuf.width = FFALIGN(me->m_DecoderBufferAlignedWidth, DECODER_BUFFER_ALIGNMENT);
+    createBuf.height = me->m_DecoderBufferAlignedHeight * 2; // Y + CbCr at 2x2 subsampling
+    createBuf.bpp = me->m_DecoderBufferFormat == AV_PIX_FMT_P010 ? 16 : 8;
+
+    int err = drmIoctl(decoderBuffer->drmFd, DRM_IOCTL_MODE_CREATE_DUMB, &createBuf);
+    if (err < 0) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "DRM_IOCTL_MODE_CREATE_DUMB failed: %d",
+                     errno);
+        ffDecoderBufferFree(decoderBuffer, nullptr);
+        return nullptr;
+    }
+
+    decoderBuffer->handle = createBuf.handle;
+    decoderBuffer->size = createBuf.size;
+
+    // Every plane and line must be aligned for the decoder, including the
+    // half-pitch U/V planes of fully planar formats.
+    uint32_t pitch = createBuf.pitch;
+    uint32_t height = me->m_DecoderBufferAlignedHeight;
+    if (pitch % (fullyPlanar ? DECODER_BUFFER_ALIGNMENT * 2 : DECODER_BUFFER_ALIGNMENT) != 0) {
+        SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                    "Dumb buffer pitch is unaligned: %u",
+                    pitch);
+        me->m_DecoderBuffersEnabled = false;
+        ffDecoderBufferFree(decoderBuffer, nullptr);
+        return nullptr;
+    }
+
+    decoderBuffer->offsets[0] = 0;
+    decoderBuffer->pitches[0] = pitch;
+    if (fullyPlanar) {
+        decoderBuffer->planeCount = 3;
+        decoderBuffer->offsets[1] = pitch * height;
+        decoderBuffer->pitches[1] = pitch / 2;
+        decoderBuffer->offsets[2] = decoderBuffer->offsets[1] + (pitch / 2) * (height / 2);
+        decoderBuffer->pitches[2] = pitch / 2;
+    }
+    else {
+        decoderBuffer->planeCount = 2;
+        decoderBuffer->offsets[1] = pitch * height;
+        decoderBuffer->pitches[1] = pitch;
+    }
+
+    struct drm_mode_map_dumb mapBuf = {};
+    mapBuf.handle = decoderBuffer->handle;
+
+    err = drmIoctl(decoderBuffer->drmFd, DRM_IOCTL_MODE_MAP_DUMB, &mapBuf);
+    if (err < 0) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "DRM_IOCTL_MODE_MAP_DUMB failed: %d",
+                     errno);
+        ffDecoderBufferFree(decoderBuffer, nullptr);
+        return nullptr;
+    }
+
+    // Unlike the m_SwFrame mappings, the decoder reads from these too
+#if defined(__GLIBC__) && QT_POINTER_SIZE == 4
+    decoderBuffer->mapping = (uint8_t*)mmap64(nullptr, decoderBuffer->size, PROT_READ | PROT_WRITE, MAP_SHARED, decoderBuffer->drmFd, mapBuf.offset);
+#else
+    decoderBuffer->mapping = (uint8_t*)mmap(nullptr, decoderBuffer->size, PROT_READ | PROT_WRITE, MAP_SHARED, decoderBuffer->drmFd, mapBuf.offset);
+#endif
+    if (decoderBuffer->mapping == MAP_FAILED) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "mmap() failed for dumb buffer: %d",
+                     errno);
+        decoderBuffer->mapping = nullptr;
+        ffDecoderBufferFree(decoderBuffer, nullptr);
+        return nullptr;
+    }
+
+    err = drmPrimeHandleToFD(decoderBuffer->drmFd, decoderBuffer->handle, O_CLOEXEC, &decoderBuffer->primeFd);
+    if (err < 0) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "drmPrimeHandleToFD() failed: %d",
+                     errno);
+        decoderBuffer->primeFd = -1;
+        ffDecoderBufferFree(decoderBuffer, nullptr);
+        return nullptr;
+    }
+
+    AVBufferRef* buffer = av_buffer_create(decoderBuffer->mapping, decoderBuffer->size,
+                                           ffDecoderBufferFree, decoderBuffer, 0);
+    if (buffer == nullptr) {
+        ffDecoderBufferFree(decoderBuffer, nullptr);
+        return nullptr;
+    }
+
+    // The pool only frees its buffers when it is uninitialized,
+    // so entries in this list stay valid until then.
+    {
+        std::lock_guard<std::mutex> locker(me->m_DecoderBuffersLock);
+        me->m_DecoderBuffers.push_back(decoderBuffer);
+
+        SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                    "Decoder dumb buffer high-water mark: %d",
+                    (int)me->m_DecoderBuffers.size());
+    }
+
+    return buffer;
+}
+
+void DrmRenderer::ffDecoderBufferFree(void* opaque, uint8_t*)
+{
+    auto decoderBuffer = (DecoderBuffer*)opaque;
+
+    if (decoderBuffer->primeFd != -1) {
+        close(decoderBuffer->primeFd);
+    }
+
+    if (decoderBuffer->mapping) {
+        munmap(decoderBuffer->mapping, decoderBuffer->size);
+    }
+
+    if (decoderBuffer->handle) {
+        struct drm_mode_destroy_dumb destroyBuf = {};
+        destroyBuf.handle = decoderBuffer->handle;
+        drmIoctl(decoderBuffer->drmFd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroyBuf);
+    }
+
+    if (decoderBuffer->drmFd != -1) {
+        close(decoderBuffer->drmFd);
+    }
+
+    delete decoderBuffer;
+}
+
+DrmRenderer::DecoderBuffer* DrmRenderer::findDecoderBuffer(const AVFrame* frame)
+{
+    if (frame->buf[0] == nullptr) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> locker(m_DecoderBuffersLock);
+    for (DecoderBuffer* decoderBuffer : m_DecoderBuffers) {
+        if (frame->buf[0]->data == decoderBuffer->mapping) {
+            return decoderBuffer;
+        }
+    }
+
+    return nullptr;
+}
+
 bool DrmRenderer::addFbForFrame(AVFrame *frame, uint32_t* newFbId, bool testMode)
 {
     AVDRMFrameDescriptor mappedFrame;
@@ -1027,6 +1390,19 @@ bool DrmRenderer::addFbForFrame(AVFrame *frame, uint32_t* newFbId, bool testMode
     }
 }
 
+void DrmRenderer::prepareToRender(AVFrame* frame)
+{
+    // Only non-exportable hwframes are read back by mapSoftwareFrame()
+    if (frame->hw_frames_ctx != nullptr && frame->format != AV_PIX_FMT_DRM_PRIME && !m_DrmPrimeBackend) {
+        m_SwFrameMapper.startReadBack(frame);
+    }
+}
+
+bool DrmRenderer::getLastReadBackTime(uint64_t* readBackTimeNs, uint64_t* waitTimeNs)
+{
+    return m_SwFrameMapper.getLastReadBackTime(readBackTimeNs, waitTimeNs);
+}
+
 void DrmRenderer::renderFrame(AVFrame* frame)
 {
     int err;
@@ -1156,6 +1532,16 @@ void DrmRenderer::renderFrame(AVFrame* frame)
 
     // Free the previous FB object which has now been superseded
     drmModeRmFB(m_DrmFd, lastFbId);
+
+    // Keep the decoder from reusing the buffers of this frame and the one before
+    // it while the display may still be scanning them out.
+    if (frame->format != AV_PIX_FMT_DRM_PRIME && findDecoderBuffer(frame) != nullptr) {
+        av_buffer_unref(&m_DisplayedDecoderBuffers[k_SwFrameCount - 1]);
+        for (int i = k_SwFrameCount - 1; i > 0; i--) {
+            m_DisplayedDecoderBuffers[i] = m_DisplayedDecoderBuffers[i - 1];
+        }
+        m_DisplayedDecoderBuffers[0] = av_buffer_ref(frame->buf[0]);
+    }
 }
 
 bool DrmRenderer::needsTestFrame()
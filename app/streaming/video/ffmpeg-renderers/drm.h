@@ -10,6 +10,10 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include <atomic>
+#include <mutex>
+#include <vector>
+
 // Newer libdrm headers have these HDR structs, but some older ones don't.
 namespace DrmDefs
 {
@@ -53,6 +57,8 @@ public:
     virtual bool initialize(PDECODER_PARAMETERS params) override;
     virtual bool prepareDecoderContext(AVCodecContext* context, AVDictionary** options) override;
     virtual void renderFrame(AVFrame* frame) override;
+    virtual void prepareToRender(AVFrame* frame) override;
+    virtual bool getLastReadBackTime(uint64_t* readBackTimeNs, uint64_t* waitTimeNs) override;
     virtual enum AVPixelFormat getPreferredPixelFormat(int videoFormat) override;
     virtual bool isPixelFormatSupported(int videoFormat, AVPixelFormat pixelFormat) override;
     virtual int getRendererAttributes() override;
@@ -73,6 +79,11 @@ private:
     const char* getDrmColorEncodingValue(AVFrame* frame);
     const char* getDrmColorRangeValue(AVFrame* frame);
     bool mapSoftwareFrame(AVFrame* frame, AVDRMFrameDescriptor* mappedFrame);
+    static int ffGetBuffer2(AVCodecContext* context, AVFrame* frame, int flags);
+    bool getDecoderBuffer(AVCodecContext* context, AVFrame* frame);
+    static AVBufferRef* ffPoolAlloc(void* opaque, size_t size);
+    static void ffDecoderBufferFree(void* opaque, uint8_t* data);
+    static void ffDecoderBufferRelease(void* opaque, uint8_t* data);
     bool addFbForFrame(AVFrame* frame, uint32_t* newFbId, bool testMode);
 
     IFFmpegRenderer* m_BackendRenderer;
@@ -110,6 +121,37 @@ private:
         int primeFd;
     } m_SwFrame[k_SwFrameCount];
 
+    // Dumb buffers that a software decoder writes frames into, so
+    // mapSoftwareFrame() doesn't need to copy them into m_SwFrame.
+    struct DecoderBuffer {
+        int drmFd;
+        uint32_t handle;
+        uint64_t size;
+        uint8_t* mapping;
+        int primeFd;
+        int planeCount;
+        uint32_t offsets[3];
+        uint32_t pitches[3];
+
+        // Set between DMA_BUF_SYNC_START and DMA_BUF_SYNC_END
+        std::atomic<bool> cpuAccess;
+    };
+    DecoderBuffer* findDecoderBuffer(const AVFrame* frame);
+    static void endDecoderBufferCpuAccess(DecoderBuffer* decoderBuffer);
+    bool m_DecoderBuffersEnabled;
+    AVBufferPool* m_DecoderBufferPool;
+    enum AVPixelFormat m_DecoderBufferFormat;
+    int m_DecoderBufferWidth;
+    int m_DecoderBufferHeight;
+    int m_DecoderBufferAlignedWidth;
+    int m_DecoderBufferAlignedHeight;
+    std::mutex m_DecoderBuffersLock;
+    std::vector<DecoderBuffer*> m_DecoderBuffers;
+
+    // Decoder buffers stay referenced while the display may still be
+    // scanning them out, like the m_SwFrame rotation above.
+    AVBufferRef* m_DisplayedDecoderBuffers[k_SwFrameCount];
+
 #ifdef HAVE_EGL
     EglImageFactory m_EglImageFactory;
 #endif
@@ -10,6 +10,11 @@
 #include <Limelight.h>
 #include <unistd.h>
 
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
 #include <SDL_render.h>
 #include <SDL_syswm.h>
 
@@ -27,6 +32,20 @@
 #define GL_UNPACK_ROW_LENGTH_EXT 0x0CF2
 #endif
 
+// Linked shader programs are cached in this directory, one file per program
+#define PROGRAM_CACHE_DIR "eglprograms"
+
+// Bump this if the layout of the cache files changes
+#define PROGRAM_CACHE_VERSION 1
+
+typedef struct _PROGRAM_CACHE_HEADER
+{
+    uint32_t version;
+    uint32_t binaryFormat;
+    uint32_t keyLength;
+    uint32_t binaryLength;
+} PROGRAM_CACHE_HEADER, *PPROGRAM_CACHE_HEADER;
+
 typedef struct _OVERLAY_VERTEX
 {
     float x, y;
@@ -84,6 +103,8 @@ EGLRenderer::EGLRenderer(IFFmpegRenderer *backendRenderer)
         m_eglCreateSyncKHR(nullptr),
         m_eglDestroySync(nullptr),
         m_eglClientWaitSync(nullptr),
+        m_glGetProgramBinaryOES(nullptr),
+        m_glProgramBinaryOES(nullptr),
         m_GlesMajorVersion(0),
         m_GlesMinorVersion(0),
         m_HasExtUnpackSubimage(false),
@@ -290,16 +311,16 @@ void EGLRenderer::renderOverlay(Overlay::OverlayType type, int viewportWidth, in
 }
 
 int EGLRenderer::loadAndBuildShader(int shaderType,
-                                    const char *file) {
+                                    const char *file,
+                                    const std::string& source) {
     GLuint shader = glCreateShader(shaderType);
     if (!shader || shader == GL_INVALID_ENUM) {
         EGL_LOG(Error, "Can't create shader: %d", glGetError());
         return 0;
     }
 
-    auto sourceData = Path::readDataFile(file);
-    GLint len = sourceData.size();
-    const char *buf = sourceData.data();
+    GLint len = source.size();
+    const char *buf = source.data();
 
     glShaderSource(shader, 1, &buf, &len);
     glCompileShader(shader);
@@ -363,14 +384,151 @@ bool EGLRenderer::openDisplay(unsigned int platform, void* nativeDisplay)
     return m_EGLDisplay != EGL_NO_DISPLAY;
 }
 
+// 64-bit FNV-1a, which unlike std::hash is the same in every build
+static uint64_t hashBytes(uint64_t hash, const std::string& data)
+{
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static std::filesystem::path getProgramCachePath(const std::string& cacheKey)
+{
+    char fileName[32];
+    snprintf(fileName, sizeof(fileName), "%016llx.bin",
+             (unsigned long long)hashBytes(0xcbf29ce484222325ULL, cacheKey));
+    return std::filesystem::path(Path::getCacheDir()) / PROGRAM_CACHE_DIR / fileName;
+}
+
+unsigned EGLRenderer::loadCachedProgram(const std::string& cacheKey)
+{
+    std::ifstream file(getProgramCachePath(cacheKey), std::ios::binary);
+    if (!file.is_open()) {
+        return 0;
+    }
+
+    PROGRAM_CACHE_HEADER header;
+    if (!file.read((char*)&header, sizeof(header)) ||
+            header.version != PROGRAM_CACHE_VERSION ||
+            header.keyLength != cacheKey.size() ||
+            header.binaryLength == 0) {
+        return 0;
+    }
+
+    // The file name is only a hash of the key, so make sure it's really ours
+    std::string key(header.keyLength, '\0');
+    std::vector<char> binary(header.binaryLength);
+    if (!file.read(key.data(), key.size()) || key != cacheKey ||
+            !file.read(binary.data(), binary.size())) {
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    if (!program) {
+        EGL_LOG(Error, "Cannot create shader program");
+        return 0;
+    }
+
+    m_glProgramBinaryOES(program, header.binaryFormat, binary.data(), header.binaryLength);
+
+    // Drivers reject binaries that they didn't build or no longer understand
+    // (with GL_INVALID_ENUM for unknown formats), which isn't a problem for us.
+    while (glGetError() != GL_NO_ERROR);
+
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (!status) {
+        EGL_LOG(Info, "Cached shader program was rejected by the driver");
+        glDeleteProgram(program);
+        return 0;
+    }
+
+    return program;
+}
+
+void EGLRenderer::saveCachedProgram(unsigned program, const std::string& cacheKey)
+{
+    GLint binaryLength = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &binaryLength);
+    if (binaryLength <= 0) {
+        return;
+    }
+
+    std::vector<char> binary(binaryLength);
+    GLenum binaryFormat;
+    m_glGetProgramBinaryOES(program, binaryLength, &binaryLength, &binaryFormat, binary.data());
+    if (glGetError() != GL_NO_ERROR || binaryLength <= 0) {
+        EGL_LOG(Warn, "glGetProgramBinary() failed");
+        return;
+    }
+
+    PROGRAM_CACHE_HEADER header;
+    header.version = PROGRAM_CACHE_VERSION;
+    header.binaryFormat = binaryFormat;
+    header.keyLength = cacheKey.size();
+    header.binaryLength = binaryLength;
+
+    std::filesystem::path cachePath = getProgramCachePath(cacheKey);
+    std::filesystem::path tempPath = cachePath;
+    tempPath += ".tmp";
+
+    try {
+        std::filesystem::create_directories(cachePath.parent_path());
+
+        {
+            std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) {
+                EGL_LOG(Warn, "Unable to write shader program cache");
+                return;
+            }
+
+            file.write((const char*)&header, sizeof(header));
+            file.write(cacheKey.data(), cacheKey.size());
+            file.write(binary.data(), binaryLength);
+            if (!file.flush()) {
+                EGL_LOG(Warn, "Unable to write shader program cache");
+                return;
+            }
+        }
+
+        // Another instance may be loading this program right now,
+        // so it must never see a partially written file.
+        std::filesystem::rename(tempPath, cachePath);
+    }
+    catch (const std::exception& e) {
+        EGL_LOG(Warn, "Unable to write shader program cache: %s", e.what());
+        std::error_code ec;
+        std::filesystem::remove(tempPath, ec);
+    }
+}
+
 unsigned EGLRenderer::compileShader(const char* vertexShaderSrc, const char* fragmentShaderSrc) {
     unsigned shader = 0;
+    std::string vertexSource = Path::readDataFile(vertexShaderSrc);
+    std::string fragmentSource = Path::readDataFile(fragmentShaderSrc);
+    std::string cacheKey;
+
+    if (!m_ProgramCacheFingerprint.empty()) {
+        // Cached programs are only valid for the exact driver and shader
+        // sources they were built from.
+        char sourceHash[32];
+        snprintf(sourceHash, sizeof(sourceHash), "%016llx",
+                 (unsigned long long)hashBytes(hashBytes(0xcbf29ce484222325ULL, vertexSource), fragmentSource));
+        cacheKey = m_ProgramCacheFingerprint + "\n" + vertexShaderSrc + "\n" + fragmentShaderSrc + "\n" + sourceHash;
+
+        shader = loadCachedProgram(cacheKey);
+        if (shader) {
+            return shader;
+        }
+    }
 
-    GLuint vertexShader = loadAndBuildShader(GL_VERTEX_SHADER, vertexShaderSrc);
+    GLuint vertexShader = loadAndBuildShader(GL_VERTEX_SHADER, vertexShaderSrc, vertexSource);
     if (!vertexShader)
         return false;
 
-    GLuint fragmentShader = loadAndBuildShader(GL_FRAGMENT_SHADER, fragmentShaderSrc);
+    GLuint fragmentShader = loadAndBuildShader(GL_FRAGMENT_SHADER, fragmentShaderSrc, fragmentSource);
     if (!fragmentShader)
         goto fragError;
 
@@ -392,6 +550,9 @@ unsigned EGLRenderer::compileShader(const char* vertexShaderSrc, const char* fra
         glDeleteProgram(shader);
         shader = 0;
     }
+    else if (!cacheKey.empty()) {
+        saveCachedProgram(shader, cacheKey);
+    }
 
 progFailCreate:
     glDeleteShader(fragmentShader);
@@ -635,6 +796,38 @@ bool EGLRenderer::initialize(PDECODER_PARAMETERS params)
         return false;
     }
 
+    // Program binaries let us skip compiling our shaders each time the
+    // renderer is recreated (including after a device reset).
+    char* envValue = std::getenv("DISABLE_EGL_PROGRAM_CACHE");
+    if (envValue && strcmp(envValue, "1") == 0) {
+        EGL_LOG(Info, "Shader program cache is disabled by environment variable");
+    }
+    else if (SDL_GL_ExtensionSupported("GL_OES_get_program_binary")) {
+        m_glGetProgramBinaryOES = (typeof(m_glGetProgramBinaryOES))eglGetProcAddress("glGetProgramBinaryOES");
+        m_glProgramBinaryOES = (typeof(m_glProgramBinaryOES))eglGetProcAddress("glProgramBinaryOES");
+    }
+    else if (m_GlesMajorVersion >= 3) {
+        // They are included in OpenGL ES 3.0 as part of the standard
+        m_glGetProgramBinaryOES = (typeof(m_glGetProgramBinaryOES))eglGetProcAddress("glGetProgramBinary");
+        m_glProgramBinaryOES = (typeof(m_glProgramBinaryOES))eglGetProcAddress("glProgramBinary");
+    }
+
+    if (m_glGetProgramBinaryOES && m_glProgramBinaryOES) {
+        // Some drivers expose the functions without any binary formats to use them with
+        GLint binaryFormatCount = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &binaryFormatCount);
+
+        const char* vendor = (const char*)glGetString(GL_VENDOR);
+        const char* renderer = (const char*)glGetString(GL_RENDERER);
+        const char* version = (const char*)glGetString(GL_VERSION);
+        if (binaryFormatCount > 0 && vendor && renderer && version) {
+            m_ProgramCacheFingerprint = std::string(vendor) + "\n" + renderer + "\n" + version;
+        }
+        else {
+            EGL_LOG(Info, "Shader program binaries are not supported");
+        }
+    }
+
     // EGL_KHR_fence_sync is an extension for EGL 1.1+
     if (eglExtensions.isSupported("EGL_KHR_fence_sync")) {
         // eglCreateSyncKHR() has a slightly different prototype to eglCreateSync()
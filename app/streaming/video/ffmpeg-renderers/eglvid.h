@@ -6,6 +6,8 @@
 #include <SDL_egl.h>
 #include <SDL_opengles2.h>
 
+#include <string>
+
 class EGLRenderer : public IFFmpegRenderer {
 public:
     EGLRenderer(IFFmpegRenderer *backendRenderer);
@@ -25,11 +27,13 @@ private:
 
     void renderOverlay(Overlay::OverlayType type, int viewportWidth, int viewportHeight);
     unsigned compileShader(const char* vertexShaderSrc, const char* fragmentShaderSrc);
+    unsigned loadCachedProgram(const std::string& cacheKey);
+    void saveCachedProgram(unsigned program, const std::string& cacheKey);
     bool compileShaders();
     bool specialize();
     const float *getColorOffsets(const AVFrame* frame);
     const float *getColorMatrix(const AVFrame* frame);
-    static int loadAndBuildShader(int shaderType, const char *filename);
+    static int loadAndBuildShader(int shaderType, const char *filename, const std::string& source);
     bool openDisplay(unsigned int platform, void* nativeDisplay);
 
     AVPixelFormat m_EGLImagePixelFormat;
@@ -55,10 +59,16 @@ private:
     PFNEGLCREATESYNCKHRPROC m_eglCreateSyncKHR;
     PFNEGLDESTROYSYNCPROC m_eglDestroySync;
     PFNEGLCLIENTWAITSYNCPROC m_eglClientWaitSync;
+    PFNGLGETPROGRAMBINARYOESPROC m_glGetProgramBinaryOES;
+    PFNGLPROGRAMBINARYOESPROC m_glProgramBinaryOES;
     int m_GlesMajorVersion;
     int m_GlesMinorVersion;
     bool m_HasExtUnpackSubimage;
 
+    // Identifies the GL driver that built our cached program binaries.
+    // Empty if program binaries can't be cached.
+    std::string m_ProgramCacheFingerprint;
+
 #define NV12_PARAM_YUVMAT 0
 #define NV12_PARAM_OFFSET 1
 #define NV12_PARAM_PLANE1 2
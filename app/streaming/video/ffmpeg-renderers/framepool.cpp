@@ -0,0 +1,161 @@
+#include "framepool.h"
+
+#include <SDL.h>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+// Maximum number of unused AVFrames we'll keep around. This is larger
+// than the number of frames that can be queued in the Pacer, so we don't
+// expect to ever hit this limit during normal streaming.
+#define MAX_FREE_FRAMES 16
+
+// Line alignment for frame data. This is large enough for any SIMD
+// instructions that FFmpeg or SDL may use to read the planes.
+#define FRAME_LINE_ALIGNMENT 64
+
+FramePool::FramePool()
+    : m_Hits(0),
+      m_Misses(0),
+      m_FramesInFlight(0)
+{
+    m_FreeFrames.reserve(MAX_FREE_FRAMES);
+}
+
+FramePool::~FramePool()
+{
+    // Any frames still in flight at this point will be leaked
+    SDL_assert(m_FramesInFlight == 0);
+
+    for (AVFrame* frame : m_FreeFrames) {
+        av_frame_free(&frame);
+    }
+
+    // Buffers still referenced by frames will free themselves
+    // (and their pool) when the last reference is dropped.
+    for (auto& entry : m_BufferPools) {
+        av_buffer_pool_uninit(&entry.second);
+    }
+}
+
+AVBufferRef* FramePool::allocPoolBuffer(void* opaque, size_t size)
+{
+    FramePool* me = reinterpret_cast<FramePool*>(opaque);
+
+    // The AVBufferPool is out of free buffers, so we must allocate a new one
+    me->m_Misses++;
+    return av_buffer_alloc(size);
+}
+
+AVFrame* FramePool::acquireFrame()
+{
+    AVFrame* frame = nullptr;
+
+    {
+        std::lock_guard<std::mutex> locker(m_Lock);
+        if (!m_FreeFrames.empty()) {
+            frame = m_FreeFrames.back();
+            m_FreeFrames.pop_back();
+        }
+    }
+
+    if (frame != nullptr) {
+        m_Hits++;
+    }
+    else {
+        m_Misses++;
+        frame = av_frame_alloc();
+        if (frame == nullptr) {
+            return nullptr;
+        }
+    }
+
+    m_FramesInFlight++;
+    return frame;
+}
+
+AVFrame* FramePool::acquireFrame(enum AVPixelFormat format, int width, int height)
+{
+    int size = av_image_get_buffer_size(format, width, height, FRAME_LINE_ALIGNMENT);
+    if (size < 0) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "av_image_get_buffer_size() failed: %d",
+                     size);
+        return nullptr;
+    }
+
+    AVBufferPool* bufferPool;
+    {
+        std::lock_guard<std::mutex> locker(m_Lock);
+        auto key = std::make_tuple((int)format, width, height);
+        auto it = m_BufferPools.find(key);
+        if (it != m_BufferPools.end()) {
+            bufferPool = it->second;
+        }
+        else {
+            bufferPool = av_buffer_pool_init2(size, this, allocPoolBuffer, nullptr);
+            if (bufferPool == nullptr) {
+                return nullptr;
+            }
+            m_BufferPools[key] = bufferPool;
+        }
+    }
+
+    AVFrame* frame = acquireFrame();
+    if (frame == nullptr) {
+        return nullptr;
+    }
+
+    // A hit on the AVBufferPool won't invoke allocPoolBuffer()
+    frame->buf[0] = av_buffer_pool_get(bufferPool);
+    if (frame->buf[0] == nullptr) {
+        releaseFrame(&frame);
+        return nullptr;
+    }
+
+    int err = av_image_fill_arrays(frame->data, frame->linesize,
+                                   frame->buf[0]->data, format,
+                                   width, height, FRAME_LINE_ALIGNMENT);
+    if (err < 0) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "av_image_fill_arrays() failed: %d",
+                     err);
+        releaseFrame(&frame);
+        return nullptr;
+    }
+
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    return frame;
+}
+
+void FramePool::releaseFrame(AVFrame** frame)
+{
+    if (*frame == nullptr) {
+        return;
+    }
+
+    // Drop the data references now so the buffers go back to their pools
+    av_frame_unref(*frame);
+    m_FramesInFlight--;
+
+    {
+        std::lock_guard<std::mutex> locker(m_Lock);
+        if (m_FreeFrames.size() < MAX_FREE_FRAMES) {
+            m_FreeFrames.push_back(*frame);
+            *frame = nullptr;
+            return;
+        }
+    }
+
+    av_frame_free(frame);
+}
+
+void FramePool::getStats(PFRAME_POOL_STATS stats)
+{
+    stats->hits = m_Hits;
+    stats->misses = m_Misses;
+    stats->framesInFlight = m_FramesInFlight;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/buffer.h>
+}
+
+typedef struct _FRAME_POOL_STATS {
+    // Frames handed out without allocating
+    uint32_t hits;
+    // Allocations of either an AVFrame or a frame data buffer
+    uint32_t misses;
+    int framesInFlight;
+} FRAME_POOL_STATS, *PFRAME_POOL_STATS;
+
+// Recycles AVFrames and their data buffers between the decoder, the
+// SwFrameMapper and the Pacer, so steady-state streaming does not need
+// any heap allocations per frame. This is safe to use from any thread.
+class FramePool
+{
+public:
+    FramePool();
+    ~FramePool();
+
+    // Returns an empty frame suitable for avcodec_receive_frame() or av_hwframe_map()
+    AVFrame* acquireFrame();
+
+    // Returns a frame with data buffers allocated for the specified format and dimensions
+    AVFrame* acquireFrame(enum AVPixelFormat format, int width, int height);
+
+    // Unreferences the frame and keeps it for reuse. *frame is set to nullptr.
+    void releaseFrame(AVFrame** frame);
+
+    void getStats(PFRAME_POOL_STATS stats);
+
+private:
+    static AVBufferRef* allocPoolBuffer(void* opaque, size_t size);
+
+    std::mutex m_Lock;
+    std::vector<AVFrame*> m_FreeFrames;
+
+    // Keyed by pixel format, width, and height
+    std::map<std::tuple<int, int, int>, AVBufferPool*> m_BufferPools;
+
+    std::atomic<uint32_t> m_Hits;
+    std::atomic<uint32_t> m_Misses;
+    std::atomic<int> m_FramesInFlight;
+};
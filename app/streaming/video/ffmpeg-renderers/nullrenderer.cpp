@@ -0,0 +1,45 @@
+#include "nullrenderer.h"
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
+
+NullRenderer::NullRenderer()
+{
+
+}
+
+NullRenderer::~NullRenderer()
+{
+
+}
+
+bool NullRenderer::initialize(PDECODER_PARAMETERS params)
+{
+    // We can only be used without a window
+    SDL_assert(params->window == nullptr);
+    return true;
+}
+
+bool NullRenderer::prepareDecoderContext(AVCodecContext*, AVDictionary**)
+{
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Using null renderer");
+    return true;
+}
+
+void NullRenderer::renderFrame(AVFrame*)
+{
+    // Pacer frees the frame after we return
+}
+
+void NullRenderer::notifyOverlayUpdated(Overlay::OverlayType)
+{
+    // No overlays without a window
+}
+
+bool NullRenderer::isPixelFormatSupported(int, enum AVPixelFormat pixelFormat)
+{
+    // We never look at the frames, so any software format will do
+    return !(av_pix_fmt_desc_get(pixelFormat)->flags & AV_PIX_FMT_FLAG_HWACCEL);
+}
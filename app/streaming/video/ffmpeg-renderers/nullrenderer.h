@@ -0,0 +1,16 @@
+#pragma once
+
+#include "renderer.h"
+
+// Discards every frame. This is used when decoding without a window,
+// so the decode benchmark can measure everything up to presentation.
+class NullRenderer : public IFFmpegRenderer {
+public:
+    NullRenderer();
+    virtual ~NullRenderer() override;
+    virtual bool initialize(PDECODER_PARAMETERS params) override;
+    virtual bool prepareDecoderContext(AVCodecContext* context, AVDictionary** options) override;
+    virtual void renderFrame(AVFrame* frame) override;
+    virtual void notifyOverlayUpdated(Overlay::OverlayType) override;
+    virtual bool isPixelFormatSupported(int videoFormat, enum AVPixelFormat pixelFormat) override;
+};
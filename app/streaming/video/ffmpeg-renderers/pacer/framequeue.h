@@ -0,0 +1,150 @@
+#pragma once
+
+#include <atomic>
+#include <climits>
+#include <vector>
+
+#include <SDL.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Bounded lock-free frame queue with a single producer and a single consumer.
+// When the queue is full, the producer evicts the oldest frame to make room,
+// so pop() uses a CAS on the head to resolve races with an eviction.
+template <int Capacity>
+class FrameQueue
+{
+public:
+    FrameQueue()
+        : m_Head(0),
+          m_Tail(0)
+    {
+        for (int i = 0; i < Capacity; i++) {
+            m_Slots[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    // Producer only. Returns the frame evicted to make room or nullptr.
+    AVFrame* push(AVFrame* frame)
+    {
+        AVFrame* evictedFrame = nullptr;
+        uint64_t tail = m_Tail.load(std::memory_order_relaxed);
+        uint64_t head = m_Head.load(std::memory_order_acquire);
+
+        // Only evict while the queue is still full. If the consumer pops
+        // first, our CAS fails and reloads head, and we can stop without
+        // throwing away another frame.
+        while (tail - head >= Capacity) {
+            AVFrame* headFrame = m_Slots[head % Capacity].load(std::memory_order_relaxed);
+            if (m_Head.compare_exchange_weak(head, head + 1,
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_acquire)) {
+                evictedFrame = headFrame;
+                break;
+            }
+        }
+
+        m_Slots[tail % Capacity].store(frame, std::memory_order_relaxed);
+        m_Tail.store(tail + 1, std::memory_order_release);
+        return evictedFrame;
+    }
+
+    // Consumer (or the producer when evicting). Returns false if empty.
+    bool pop(AVFrame** frame)
+    {
+        uint64_t head = m_Head.load(std::memory_order_acquire);
+
+        for (;;) {
+            if (head == m_Tail.load(std::memory_order_acquire)) {
+                return false;
+            }
+
+            // This slot can't be reused until head moves past it, so the value
+            // we read is valid if and only if our CAS succeeds.
+            AVFrame* headFrame = m_Slots[head % Capacity].load(std::memory_order_relaxed);
+            if (m_Head.compare_exchange_weak(head, head + 1,
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_acquire)) {
+                *frame = headFrame;
+                return true;
+            }
+        }
+    }
+
+    int size()
+    {
+        // Head must be read first so the result can't go negative
+        uint64_t head = m_Head.load(std::memory_order_acquire);
+        uint64_t tail = m_Tail.load(std::memory_order_acquire);
+        return (int)SDL_min(tail - head, (uint64_t)Capacity);
+    }
+
+private:
+    std::atomic<AVFrame*> m_Slots[Capacity];
+    std::atomic<uint64_t> m_Head;
+    std::atomic<uint64_t> m_Tail;
+};
+
+// Tracks the minimum of the last N queue lengths in O(1) per update. Queue
+// lengths are small, so a histogram of the window replaces a scan of it.
+// This is not thread-safe and must only be used from one thread.
+template <int MaxValue>
+class QueueHistory
+{
+public:
+    QueueHistory()
+        : m_Next(0),
+          m_Count(0)
+    {
+        for (int i = 0; i <= MaxValue; i++) {
+            m_Histogram[i] = 0;
+        }
+    }
+
+    // Must be called before push() and not during streaming
+    void setWindowSize(int windowSize)
+    {
+        m_Entries.assign(SDL_max(windowSize, 1), 0);
+        m_Next = m_Count = 0;
+        for (int i = 0; i <= MaxValue; i++) {
+            m_Histogram[i] = 0;
+        }
+    }
+
+    void push(int value)
+    {
+        value = SDL_clamp(value, 0, MaxValue);
+
+        if (m_Count == (int)m_Entries.size()) {
+            // Evict the oldest entry in the window
+            m_Histogram[m_Entries[m_Next]]--;
+        }
+        else {
+            m_Count++;
+        }
+
+        m_Entries[m_Next] = value;
+        m_Histogram[value]++;
+        m_Next = (m_Next + 1) % m_Entries.size();
+    }
+
+    // Returns INT_MAX if there is no history yet
+    int getMinimum()
+    {
+        for (int i = 0; i <= MaxValue; i++) {
+            if (m_Histogram[i] != 0) {
+                return i;
+            }
+        }
+
+        return INT_MAX;
+    }
+
+private:
+    std::vector<int> m_Entries;
+    int m_Histogram[MaxValue + 1];
+    int m_Next;
+    int m_Count;
+};
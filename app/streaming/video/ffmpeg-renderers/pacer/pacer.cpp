@@ -1,5 +1,6 @@
 #include "pacer.h"
 #include "streaming/streamutils.h"
+#include "streaming/tracer.h"
 
 //#ifdef Q_OS_WIN32
 #if defined(_WIN32) || defined(_WIN64)
@@ -13,28 +14,26 @@
 #include "waylandvsyncsource.h"
 #endif
 
+#include "timervsyncsource.h"
+
 #include <SDL_syswm.h>
 
-// Limit the number of queued frames to prevent excessive memory consumption
-// if the V-Sync source or renderer is blocked for a while. It's important
-// that the sum of all queued frames between both pacing and rendering queues
-// must not exceed the number buffer pool size to avoid running the decoder
-// out of available decoding surfaces.
-#define MAX_QUEUED_FRAMES 4
-
-// We may be woken up slightly late so don't go all the way
-// up to the next V-sync since we may accidentally step into
-// the next V-sync period. It also takes some amount of time
-// to do the render itself, so we can't render right before
-// V-sync happens.
-#define TIMER_SLACK_MS 3
-
-Pacer::Pacer(IFFmpegRenderer* renderer, PVIDEO_STATS videoStats) :
+#include <cstdlib>
+#include <cstring>
+
+Pacer::Pacer(IFFmpegRenderer* renderer, PVIDEO_STATS videoStats, FramePool* framePool, FrameTimeline* frameTimeline) :
+    m_RenderQueueNotEmpty(nullptr),
+    m_PacingQueueNotEmpty(nullptr),
+    m_VsyncSignalled(nullptr),
     m_RenderThread(nullptr),
     m_VsyncThread(nullptr),
     m_Stopping(false),
+    m_FrameReleasedOnLastVsync(false),
+    m_RenderInProgress(false),
     m_VsyncSource(nullptr),
     m_VsyncRenderer(renderer),
+    m_FramePool(framePool),
+    m_FrameTimeline(frameTimeline),
     m_MaxVideoFps(0),
     m_DisplayFps(0),
     m_VideoStats(videoStats)
@@ -48,18 +47,14 @@ Pacer::~Pacer()
 
     // Stop the V-sync thread
     if (m_VsyncThread != nullptr) {
-        m_PacingQueueNotEmpty.notify_all();
-        m_VsyncSignalled.notify_all();
+        SDL_SemPost(m_PacingQueueNotEmpty);
+        SDL_SemPost(m_VsyncSignalled);
         SDL_WaitThread(m_VsyncThread, nullptr);
     }
 
-    // Stop V-sync callbacks
-    delete m_VsyncSource;
-    m_VsyncSource = nullptr;
-
     // Stop the render thread
     if (m_RenderThread != nullptr) {
-        m_RenderQueueNotEmpty.notify_all();
+        SDL_SemPost(m_RenderQueueNotEmpty);
         SDL_WaitThread(m_RenderThread, nullptr);
     }
     else {
@@ -68,16 +63,28 @@ Pacer::~Pacer()
         m_VsyncRenderer->cleanupRenderContext();
     }
 
+    // Stop V-sync callbacks. The render thread reports
+    // presents to the V-sync source, so this comes after it.
+    delete m_VsyncSource;
+    m_VsyncSource = nullptr;
+
     // Delete any remaining unconsumed frames
-    while (!m_RenderQueue.empty()) {
-        AVFrame* frame = m_RenderQueue.front();
-        m_RenderQueue.pop();
-        av_frame_free(&frame);
+    AVFrame* frame;
+    while (m_RenderQueue.pop(&frame)) {
+        m_FramePool->releaseFrame(&frame);
+    }
+    while (m_PacingQueue.pop(&frame)) {
+        m_FramePool->releaseFrame(&frame);
+    }
+
+    if (m_RenderQueueNotEmpty != nullptr) {
+        SDL_DestroySemaphore(m_RenderQueueNotEmpty);
     }
-    while (!m_PacingQueue.empty()) {
-        AVFrame* frame = m_PacingQueue.front();
-        m_PacingQueue.pop();
-        av_frame_free(&frame);
+    if (m_PacingQueueNotEmpty != nullptr) {
+        SDL_DestroySemaphore(m_PacingQueueNotEmpty);
+    }
+    if (m_VsyncSignalled != nullptr) {
+        SDL_DestroySemaphore(m_VsyncSignalled);
     }
 }
 
@@ -88,18 +95,10 @@ void Pacer::renderOnMainThread()
         return;
     }
 
-    m_FrameQueueLock.lock();
-
-    if (!m_RenderQueue.empty()) {
-        AVFrame* frame = m_RenderQueue.front();
-        m_RenderQueue.pop();
-        m_FrameQueueLock.unlock();
-
+    AVFrame* frame;
+    if (m_RenderQueue.pop(&frame)) {
         renderFrame(frame);
     }
-    else {
-        m_FrameQueueLock.unlock();
-    }
 }
 
 int Pacer::vsyncThread(void *context)
@@ -116,8 +115,10 @@ int Pacer::vsyncThread(void *context)
     while (!me->m_Stopping) {
         if (async) {
             // Wait for the VSync source to invoke signalVsync() or 100ms to elapse
-            std::unique_lock<std::mutex> locker(me->m_FrameQueueLock);
-            me->m_VsyncSignalled.wait_for(locker, std::chrono::milliseconds(100));
+            if (SDL_SemWaitTimeout(me->m_VsyncSignalled, 100) == 0) {
+                // Coalesce any signals that arrived while we were busy
+                while (SDL_SemTryWait(me->m_VsyncSignalled) == 0);
+            }
         }
         else {
             // Let the VSync source wait in the context of our thread
@@ -148,25 +149,20 @@ int Pacer::renderThread(void* context)
         // Wait for the renderer to be ready for the next frame
         me->m_VsyncRenderer->waitToRender();
 
-        // Acquire the frame queue lock to protect the queue and
-        // the not empty condition
-        std::unique_lock<std::mutex> locker(me->m_FrameQueueLock);
-
-        // Wait for a frame to be ready to render
-        while (!me->m_Stopping && me->m_RenderQueue.empty()) {
-            me->m_RenderQueueNotEmpty.wait(locker);
+        // Wait for a frame to be ready to render. The semaphore may be
+        // signalled more times than there are frames, because frames can
+        // be dropped after they're posted, so always recheck the queue.
+        AVFrame* frame = nullptr;
+        while (!me->m_Stopping && !me->m_RenderQueue.pop(&frame)) {
+            SDL_SemWait(me->m_RenderQueueNotEmpty);
         }
 
         if (me->m_Stopping) {
             // Exit this thread
-            locker.unlock();
+            me->m_FramePool->releaseFrame(&frame);
             break;
         }
 
-        AVFrame* frame = me->m_RenderQueue.front();
-        me->m_RenderQueue.pop();
-        locker.unlock();
-
         me->renderFrame(frame);
     }
 
@@ -177,15 +173,15 @@ int Pacer::renderThread(void* context)
     return 0;
 }
 
-void Pacer::enqueueFrameForRenderingAndUnlock(AVFrame *frame, std::shared_ptr<std::unique_lock<std::mutex>> spLocker)
+void Pacer::enqueueFrameForRendering(AVFrame *frame)
 {
-    dropFrameForEnqueue(m_RenderQueue);
-    m_RenderQueue.push(frame);
+    // Let the renderer get a head start on the frame before the render thread sees it
+    m_VsyncRenderer->prepareToRender(frame);
 
-    spLocker->unlock();
+    enqueueFrame(m_RenderQueue, frame);
 
     if (m_RenderThread != nullptr) {
-        m_RenderQueueNotEmpty.notify_one();
+        SDL_SemPost(m_RenderQueueNotEmpty);
     }
     else {
         SDL_Event event;
@@ -204,80 +200,51 @@ void Pacer::handleVsync(int timeUntilNextVsyncMillis)
     // Make sure initialize() has been called
     SDL_assert(m_MaxVideoFps != 0);
 
-    std::shared_ptr<std::unique_lock<std::mutex>> spLocker(new std::unique_lock<std::mutex>(m_FrameQueueLock));
-
-    // If the queue length history entries are large, be strict
-    // about dropping excess frames.
-    int frameDropTarget = 1;
-
-    // If we may get more frames per second than we can display, use
-    // frame history to drop frames only if consistently above the
-    // one queued frame mark.
-    if (m_MaxVideoFps >= m_DisplayFps) {
-        // for (int queueHistoryEntry : m_PacingQueueHistory) {
-        //     if (queueHistoryEntry <= 1) {
-        //         // Be lenient as long as the queue length
-        //         // resolves before the end of frame history
-        //         frameDropTarget = 3;
-        //         break;
-        //     }
-        // }
-        std::queue<int> pacingQueueHistoryCopy(m_PacingQueueHistory);
-        while (!pacingQueueHistoryCopy.empty()) {
-            int queueHistoryEntry = pacingQueueHistoryCopy.front();
-            pacingQueueHistoryCopy.pop();
-            if (queueHistoryEntry <= 1) {
-                // Be lenient as long as the queue length
-                // resolves before the end of frame history
-                frameDropTarget = 3;
-                break;
-            }
-        }
+    TraceScope traceScope("Pacer::handleVsync");
 
-        // Keep a rolling 500 ms window of pacing queue history
-        if (m_PacingQueueHistory.size() == m_DisplayFps / 2) {
-            m_PacingQueueHistory.pop();
-        }
+    // Find the latest time we can release a frame to the renderer
+    uint64_t releaseDeadlineNs = m_Policy.handleVsync(StreamUtils::getMonotonicNanoseconds(),
+                                                      timeUntilNextVsyncMillis);
 
-        m_PacingQueueHistory.push(m_PacingQueue.size());
+    if (m_FrameReleasedOnLastVsync && m_Policy.isReleasedFrameLate(m_RenderInProgress, m_RenderQueue.size())) {
+        m_VideoStats->pacerMissedVsyncs++;
     }
+    m_FrameReleasedOnLastVsync = false;
 
     // Catch up if we're several frames ahead
-    while (m_PacingQueue.size() > frameDropTarget) {
-        AVFrame* frame = m_PacingQueue.front();
-        m_PacingQueue.pop();
-
-        // Drop the lock while we call av_frame_free()
-        spLocker->unlock();
+    int frameDropTarget = m_Policy.getPacingDropTarget(m_PacingQueue.size());
+    AVFrame* frame;
+    while (m_PacingQueue.size() > frameDropTarget && m_PacingQueue.pop(&frame)) {
         m_VideoStats->pacerDroppedFrames++;
-        av_frame_free(&frame);
-        spLocker->lock();
+        m_FramePool->releaseFrame(&frame);
     }
 
-    while (m_PacingQueue.empty()) {
+    while (!m_PacingQueue.pop(&frame)) {
+        uint64_t now = StreamUtils::getMonotonicNanoseconds();
+        Uint32 timeoutMs = now < releaseDeadlineNs ? (Uint32)((releaseDeadlineNs - now) / 1000000) : 0;
+
         // Wait for a frame to arrive or our V-sync timeout to expire
-        if (m_PacingQueueNotEmpty.wait_for(*spLocker.get(), std::chrono::milliseconds(SDL_max(timeUntilNextVsyncMillis, TIMER_SLACK_MS) - TIMER_SLACK_MS)) == std::cv_status::timeout) {
-            // Wait timed out - unlock and bail
-            spLocker->unlock();
+        if (SDL_SemWaitTimeout(m_PacingQueueNotEmpty, timeoutMs) == SDL_MUTEX_TIMEDOUT) {
+            // Wait timed out - bail
             return;
         }
 
         if (m_Stopping) {
-            spLocker->unlock();
             return;
         }
     }
 
     // Place the first frame on the render queue
-    AVFrame *frame = m_PacingQueue.front();
-    m_PacingQueue.pop();
-    enqueueFrameForRenderingAndUnlock(frame, spLocker);
+    traceScope.setFrameId(FrameTimeline::getFrameId(frame));
+    m_FrameReleasedOnLastVsync = true;
+    enqueueFrameForRendering(frame);
 }
 
 bool Pacer::initialize(SDL_Window* window, int maxVideoFps, bool enablePacing)
 {
     m_MaxVideoFps = maxVideoFps;
-    m_DisplayFps = StreamUtils::getDisplayRefreshRate(window);
+    // Headless decoding has no display, so we pretend it matches the stream
+    m_DisplayFps = window != nullptr ? StreamUtils::getDisplayRefreshRate(window) : maxVideoFps;
     m_RendererAttributes = m_VsyncRenderer->getRendererAttributes();
 
     if (enablePacing) {
@@ -287,7 +254,11 @@ bool Pacer::initialize(SDL_Window* window, int maxVideoFps, bool enablePacing)
 
         SDL_SysWMinfo info;
         SDL_VERSION(&info.version);
-        if (!SDL_GetWindowWMInfo(window, &info)) {
+        if (window == nullptr) {
+            // Headless decoding can only be paced by a timer
+            info.subsystem = SDL_SYSWM_UNKNOWN;
+        }
+        else if (!SDL_GetWindowWMInfo(window, &info)) {
             SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
                          "SDL_GetWindowWMInfo() failed: %s",
                          SDL_GetError());
@@ -313,19 +284,29 @@ bool Pacer::initialize(SDL_Window* window, int maxVideoFps, bool enablePacing)
     #endif
 
         default:
-            // Platforms without a VsyncSource will just render frames
-            // immediately like they used to.
             break;
         }
 
-        SDL_assert(m_VsyncSource != nullptr || !(m_RendererAttributes & RENDERER_ATTRIBUTE_FORCE_PACING));
-
         if (m_VsyncSource != nullptr && !m_VsyncSource->initialize(window, m_DisplayFps)) {
             SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
-                        "Vsync source failed to initialize. Frame pacing will not be available!");
+                        "Platform vsync source failed to initialize. Falling back to a timer.");
             delete m_VsyncSource;
             m_VsyncSource = nullptr;
         }
+
+        // Platforms without a way to wait for V-sync (X11, KMSDRM, and
+        // Windows 7) or whose V-sync source failed count out refresh
+        // periods with a timer instead.
+        if (m_VsyncSource == nullptr) {
+            m_VsyncSource = new TimerVsyncSource(this);
+
+            if (!m_VsyncSource->initialize(window, m_DisplayFps)) {
+                SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                            "Vsync source failed to initialize. Frame pacing will not be available!");
+                delete m_VsyncSource;
+                m_VsyncSource = nullptr;
+            }
+        }
     }
     else {
         SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
@@ -333,6 +314,28 @@ bool Pacer::initialize(SDL_Window* window, int maxVideoFps, bool enablePacing)
                     m_DisplayFps, m_MaxVideoFps);
     }
 
+    m_RenderQueueNotEmpty = SDL_CreateSemaphore(0);
+    m_PacingQueueNotEmpty = SDL_CreateSemaphore(0);
+    m_VsyncSignalled = SDL_CreateSemaphore(0);
+    if (m_RenderQueueNotEmpty == nullptr || m_PacingQueueNotEmpty == nullptr || m_VsyncSignalled == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "SDL_CreateSemaphore() failed: %s",
+                     SDL_GetError());
+        return false;
+    }
+
+    bool jitScheduling = false;
+    if (m_VsyncSource != nullptr) {
+        char* envValue = std::getenv("PACER_DISABLE_JIT");
+        jitScheduling = !(envValue && strcmp(envValue, "1") == 0);
+
+        SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                    "Frame pacing: just-in-time scheduling %s",
+                    jitScheduling ? "enabled" : "disabled");
+    }
+
+    m_Policy.initialize(m_MaxVideoFps, m_DisplayFps, m_RendererAttributes, jitScheduling);
+
     if (m_VsyncSource != nullptr) {
         m_VsyncThread = SDL_CreateThread(Pacer::vsyncThread, "PacerVsync", this);
     }
@@ -346,86 +349,65 @@ bool Pacer::initialize(SDL_Window* window, int maxVideoFps, bool enablePacing)
 
 void Pacer::signalVsync()
 {
-    m_VsyncSignalled.notify_one();
+    SDL_SemPost(m_VsyncSignalled);
 }
 
 void Pacer::renderFrame(AVFrame* frame)
 {
+    uint32_t frameId = FrameTimeline::getFrameId(frame);
+    TraceScope traceScope("Pacer::renderFrame", frameId);
+
+    uint64_t beforeRenderNs = StreamUtils::getMonotonicNanoseconds();
+    m_FrameTimeline->markStage(frameId, FTS_RENDER_START, beforeRenderNs);
+
     // Count time spent in Pacer's queues
     Uint32 beforeRender = SDL_GetTicks();
-    m_VideoStats->totalPacerTime += beforeRender - frame->pkt_dts;
+    uint64_t decodedNs = m_FrameTimeline->getStageTime(frameId, FTS_RECEIVE_FRAME);
+    if (decodedNs != 0) {
+        m_VideoStats->totalPacerTime += (uint32_t)((beforeRenderNs - decodedNs + 500000) / 1000000);
+    }
 
     // Render it
-    m_VsyncRenderer->renderFrame(frame);
+    m_RenderInProgress = true;
+    {
+        TraceScope rendererTraceScope("IFFmpegRenderer::renderFrame", frameId);
+        m_VsyncRenderer->renderFrame(frame);
+    }
+    m_RenderInProgress = false;
+    uint64_t afterRenderNs = StreamUtils::getMonotonicNanoseconds();
+    m_FrameTimeline->markStage(frameId, FTS_PRESENT, afterRenderNs);
+    m_Policy.updateRenderCost(afterRenderNs - beforeRenderNs);
     Uint32 afterRender = SDL_GetTicks();
 
     m_VideoStats->totalRenderTime += afterRender - beforeRender;
     m_VideoStats->renderedFrames++;
-    av_frame_free(&frame);
 
-    // Drop frames if we have too many queued up for a while
-    m_FrameQueueLock.lock();
-
-    int frameDropTarget;
-
-    if (m_RendererAttributes & RENDERER_ATTRIBUTE_NO_BUFFERING) {
-        // Renderers that don't buffer any frames but don't support waitToRender() need us to buffer
-        // an extra frame to ensure they don't starve while waiting to present.
-        frameDropTarget = 1;
+    uint64_t presentTimeNs;
+    if (m_VsyncSource != nullptr && m_VsyncRenderer->getLastPresentTime(&presentTimeNs)) {
+        m_VsyncSource->notifyPresent(presentTimeNs);
     }
-    else {
-        frameDropTarget = 0;
-        // for (int queueHistoryEntry : m_RenderQueueHistory) {
-        //     if (queueHistoryEntry == 0) {
-        //         // Be lenient as long as the queue length
-        //         // resolves before the end of frame history
-        //         frameDropTarget = 2;
-        //         break;
-        //     }
-        // }
-        std::queue<int> renderQueueHistoryCopy(m_RenderQueueHistory);
-        while (!renderQueueHistoryCopy.empty()) {
-            int queueHistoryEntry = renderQueueHistoryCopy.front();
-            renderQueueHistoryCopy.pop();
-            if (queueHistoryEntry == 0) {
-                // Be lenient as long as the queue length
-                // resolves before the end of frame history
-                frameDropTarget = 2;
-                break;
-            }
-        }
-
-        // Keep a rolling 500 ms window of render queue history
-        if (m_RenderQueueHistory.size() == m_MaxVideoFps / 2) {
-            m_RenderQueueHistory.pop();
-        }
 
-        m_RenderQueueHistory.push(m_RenderQueue.size());
+    uint64_t readBackTimeNs, readBackWaitNs;
+    if (m_VsyncRenderer->getLastReadBackTime(&readBackTimeNs, &readBackWaitNs)) {
+        m_VideoStats->readBackFrames++;
+        m_VideoStats->totalReadBackTimeUs += readBackTimeNs / 1000;
+        m_VideoStats->totalReadBackWaitTimeUs += readBackWaitNs / 1000;
     }
+    m_FramePool->releaseFrame(&frame);
 
-    // Catch up if we're several frames ahead
-    while (m_RenderQueue.size() > frameDropTarget) {
-        AVFrame* frame = m_RenderQueue.front();
-        m_RenderQueue.pop();
-
-        // Drop the lock while we call av_frame_free()
-        m_FrameQueueLock.unlock();
+    // Drop frames if we have too many queued up for a while
+    int frameDropTarget = m_Policy.getRenderDropTarget(m_RenderQueue.size());
+    while (m_RenderQueue.size() > frameDropTarget && m_RenderQueue.pop(&frame)) {
         m_VideoStats->pacerDroppedFrames++;
-        av_frame_free(&frame);
-        m_FrameQueueLock.lock();
+        m_FramePool->releaseFrame(&frame);
     }
-
-    m_FrameQueueLock.unlock();
 }
 
-void Pacer::dropFrameForEnqueue(std::queue<AVFrame*>& queue)
+void Pacer::enqueueFrame(FrameQueue<MAX_QUEUED_FRAMES>& queue, AVFrame* frame)
 {
-    SDL_assert(queue.size() <= MAX_QUEUED_FRAMES);
-    if (queue.size() == MAX_QUEUED_FRAMES) {
-        AVFrame* frame = queue.front();
-        queue.pop();
-        av_frame_free(&frame);
-    }
+    // If the consumer is blocked, the oldest frame is evicted to make room
+    AVFrame* droppedFrame = queue.push(frame);
+    m_FramePool->releaseFrame(&droppedFrame);
 }
 
 void Pacer::submitFrame(AVFrame* frame)
@@ -433,15 +415,14 @@ void Pacer::submitFrame(AVFrame* frame)
     // Make sure initialize() has been called
     SDL_assert(m_MaxVideoFps != 0);
 
+    m_FrameTimeline->markStage(FrameTimeline::getFrameId(frame), FTS_PACER_ENQUEUE);
+
     // Queue the frame and possibly wake up the render thread
-    std::shared_ptr<std::unique_lock<std::mutex>> spLocker(new std::unique_lock<std::mutex>(m_FrameQueueLock));
     if (m_VsyncSource != nullptr) {
-        dropFrameForEnqueue(m_PacingQueue);
-        m_PacingQueue.push(frame);
-        spLocker->unlock();
-        m_PacingQueueNotEmpty.notify_one();
+        enqueueFrame(m_PacingQueue, frame);
+        SDL_SemPost(m_PacingQueueNotEmpty);
     }
     else {
-        enqueueFrameForRenderingAndUnlock(frame, spLocker);
+        enqueueFrameForRendering(frame);
     }
 }
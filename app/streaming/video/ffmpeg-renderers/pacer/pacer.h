@@ -2,10 +2,11 @@
 
 #include "../../decoder.h"
 #include "../renderer.h"
+#include "../framepool.h"
+#include "framequeue.h"
+#include "pacingpolicy.h"
 
-#include <queue>
-#include <mutex>
-#include <condition_variable>
+#include <atomic>
 
 class IVsyncSource {
 public:
@@ -20,12 +21,17 @@ public:
         // Synchronous sources must implement waitForVsync()!
         SDL_assert(false);
     }
+
+    // Called on the render thread with the time a present completed, for
+    // renderers whose presents wait for V-sync. Sources that can't see the
+    // display's V-sync directly can use this to line up with it.
+    virtual void notifyPresent(uint64_t) {}
 };
 
 class Pacer
 {
 public:
-    Pacer(IFFmpegRenderer* renderer, PVIDEO_STATS videoStats);
+    Pacer(IFFmpegRenderer* renderer, PVIDEO_STATS videoStats, FramePool* framePool, FrameTimeline* frameTimeline);
 
     ~Pacer();
 
@@ -44,26 +50,33 @@ private:
 
     void handleVsync(int timeUntilNextVsyncMillis);
 
-    void enqueueFrameForRenderingAndUnlock(AVFrame* frame, std::shared_ptr<std::unique_lock<std::mutex>> spLocker);
+    void enqueueFrameForRendering(AVFrame* frame);
 
     void renderFrame(AVFrame* frame);
 
-    void dropFrameForEnqueue(std::queue<AVFrame*>& queue);
-
-    std::queue<AVFrame*> m_RenderQueue;
-    std::queue<AVFrame*> m_PacingQueue;
-    std::queue<int> m_PacingQueueHistory;
-    std::queue<int> m_RenderQueueHistory;
-    std::mutex m_FrameQueueLock;
-    std::condition_variable m_RenderQueueNotEmpty;
-    std::condition_variable m_PacingQueueNotEmpty;
-    std::condition_variable m_VsyncSignalled;
+    void enqueueFrame(FrameQueue<MAX_QUEUED_FRAMES>& queue, AVFrame* frame);
+
+    // The pacing queue is fed by the decoder thread and drained by the
+    // V-sync thread. The render queue is fed by the V-sync thread (or the
+    // decoder thread without a V-sync source) and drained by the render
+    // thread (or the main thread).
+    FrameQueue<MAX_QUEUED_FRAMES> m_RenderQueue;
+    FrameQueue<MAX_QUEUED_FRAMES> m_PacingQueue;
+    PacingPolicy m_Policy;
+    SDL_sem* m_RenderQueueNotEmpty;
+    SDL_sem* m_PacingQueueNotEmpty;
+    SDL_sem* m_VsyncSignalled;
     SDL_Thread* m_RenderThread;
     SDL_Thread* m_VsyncThread;
-    bool m_Stopping;
+    std::atomic<bool> m_Stopping;
+
+    bool m_FrameReleasedOnLastVsync;
+    std::atomic<bool> m_RenderInProgress;
 
     IVsyncSource* m_VsyncSource;
     IFFmpegRenderer* m_VsyncRenderer;
+    FramePool* m_FramePool;
+    FrameTimeline* m_FrameTimeline;
     int m_MaxVideoFps;
     int m_DisplayFps;
     PVIDEO_STATS m_VideoStats;
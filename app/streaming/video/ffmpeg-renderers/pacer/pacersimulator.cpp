@@ -0,0 +1,540 @@
+#include "pacersimulator.h"
+#include "../renderer.h"
+#include "utils.h"
+
+#include <SDL.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+
+#define DEFAULT_SIMULATION_STREAM_FPS 60
+#define DEFAULT_SIMULATION_SECONDS 60
+
+// Keep simulating after the last frame arrives until it has been shown
+#define SIMULATION_DRAIN_TIME_NS 1000000000ULL
+
+static void printResult(const char* format, ...)
+{
+    char buffer[512];
+    va_list args;
+
+    va_start(args, format);
+    SDL_vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    // The log goes to disk, so also print them for scripts
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "%s", buffer);
+    fprintf(stdout, "%s\n", buffer);
+}
+
+bool PacerSimulator::parseCommandLine(const char* commandLine, PPACER_SIMULATION_OPTIONS options)
+{
+    std::vector<std::string> args = StringUtils::splitCommandLine(commandLine);
+
+    options->streamFps = DEFAULT_SIMULATION_STREAM_FPS;
+    options->displays = { { 60, false }, { 120, false }, { 144, false }, { 165, false }, { 165, true } };
+    options->arrivalJitter = { PSD_NORMAL, 0.0, 1.0 };
+    options->renderCost = { PSD_NORMAL, 1.0, 0.25 };
+    options->clockDriftPpm = 0;
+    options->framePacing = true;
+    options->jitScheduling = true;
+    options->rendererAttributes = 0;
+    options->seconds = DEFAULT_SIMULATION_SECONDS;
+    options->seed = 1;
+
+    if (std::find(args.begin(), args.end(), "--pacer-simulation") == args.end()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        bool hasValue = i + 1 < args.size();
+
+        if (arg == "--pacer-simulation") {
+            continue;
+        }
+        else if (arg == "--stream-fps" && hasValue) {
+            options->streamFps = SDL_atoi(args[++i].c_str());
+        }
+        else if (arg == "--displays" && hasValue) {
+            if (!parseDisplays(args[++i], options->displays)) {
+                SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                             "Invalid simulated displays: %s",
+                             args[i].c_str());
+                options->displays.clear();
+            }
+        }
+        else if ((arg == "--jitter" || arg == "--render-cost") && hasValue) {
+            PPACER_SIMULATION_DISTRIBUTION distribution = arg == "--jitter" ? &options->arrivalJitter : &options->renderCost;
+            if (!parseDistribution(args[++i], distribution)) {
+                SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                             "Invalid distribution for %s: %s",
+                             arg.c_str(),
+                             args[i].c_str());
+                options->displays.clear();
+            }
+        }
+        else if (arg == "--drift-ppm" && hasValue) {
+            options->clockDriftPpm = SDL_atof(args[++i].c_str());
+        }
+        else if (arg == "--no-pacing") {
+            options->framePacing = false;
+        }
+        else if (arg == "--no-jit") {
+            options->jitScheduling = false;
+        }
+        else if (arg == "--no-buffering") {
+            options->rendererAttributes |= RENDERER_ATTRIBUTE_NO_BUFFERING;
+        }
+        else if (arg == "--seconds" && hasValue) {
+            options->seconds = SDL_atoi(args[++i].c_str());
+        }
+        else if (arg == "--seed" && hasValue) {
+            options->seed = (uint32_t)SDL_strtoul(args[++i].c_str(), nullptr, 10);
+        }
+        else {
+            SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                        "Ignoring unknown argument: %s",
+                        arg.c_str());
+        }
+    }
+
+    return true;
+}
+
+bool PacerSimulator::parseDistribution(const std::string& value, PPACER_SIMULATION_DISTRIBUTION distribution)
+{
+    // type:mean[:spread] in milliseconds
+    size_t typeEnd = value.find(':');
+    if (typeEnd == std::string::npos) {
+        return false;
+    }
+
+    std::string type = value.substr(0, typeEnd);
+    if (type == "constant") {
+        distribution->type = PSD_CONSTANT;
+    }
+    else if (type == "uniform") {
+        distribution->type = PSD_UNIFORM;
+    }
+    else if (type == "normal") {
+        distribution->type = PSD_NORMAL;
+    }
+    else if (type == "exponential") {
+        distribution->type = PSD_EXPONENTIAL;
+    }
+    else {
+        return false;
+    }
+
+    size_t meanEnd = value.find(':', typeEnd + 1);
+    distribution->meanMs = SDL_atof(value.substr(typeEnd + 1, meanEnd - typeEnd - 1).c_str());
+    distribution->spreadMs = meanEnd != std::string::npos ? SDL_atof(value.substr(meanEnd + 1).c_str()) : 0;
+    return distribution->meanMs >= 0 && distribution->spreadMs >= 0;
+}
+
+bool PacerSimulator::parseDisplays(const std::string& value, std::vector<PACER_SIMULATION_DISPLAY>& displays)
+{
+    // Comma-separated refresh rates, prefixed with "vrr" for VRR displays
+    displays.clear();
+    for (size_t start = 0; start < value.size();) {
+        size_t end = value.find(',', start);
+        if (end == std::string::npos) {
+            end = value.size();
+        }
+
+        std::string entry = value.substr(start, end - start);
+        PACER_SIMULATION_DISPLAY display;
+        display.vrr = entry.compare(0, 3, "vrr") == 0;
+        display.refreshRate = SDL_atoi(entry.c_str() + (display.vrr ? 3 : 0));
+        if (display.refreshRate <= 0) {
+            return false;
+        }
+
+        displays.push_back(display);
+        start = end + 1;
+    }
+
+    return !displays.empty();
+}
+
+int PacerSimulator::run(const PACER_SIMULATION_OPTIONS& options)
+{
+    if (options.streamFps <= 0 || options.seconds <= 0 || options.displays.empty()) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Invalid pacer simulation options");
+        return -1;
+    }
+
+    printResult("Pacer simulation: %d FPS stream for %d seconds (seed %u, drift %.1f ppm, pacing %s, JIT %s)",
+                options.streamFps,
+                options.seconds,
+                options.seed,
+                options.clockDriftPpm,
+                options.framePacing ? "on" : "off",
+                options.framePacing && options.jitScheduling ? "on" : "off");
+    printResult("Display     Latency mean/p50/p99 ms  Pacer drops  Evicted  Missed V-syncs  Judder stddev/p99 ms  Juddered  Shown");
+
+    for (const PACER_SIMULATION_DISPLAY& display : options.displays) {
+        PACER_SIMULATION_RESULTS results;
+        char displayName[32];
+
+        simulate(options, display, &results);
+
+        SDL_snprintf(displayName, sizeof(displayName), "%s%d Hz",
+                     display.vrr ? "VRR " : "", display.refreshRate);
+        printResult("%-11s %6.2f/%6.2f/%6.2f      %11u  %7u  %14u  %9.2f/%6.2f      %8u  %u/%u",
+                    displayName,
+                    results.latencyMeanMs,
+                    results.latencyP50Ms,
+                    results.latencyP99Ms,
+                    results.pacerDroppedFrames,
+                    results.evictedFrames,
+                    results.missedVsyncs,
+                    results.judderStdDevMs,
+                    results.judderP99Ms,
+                    results.judderedFrames,
+                    results.displayedFrames,
+                    results.submittedFrames);
+    }
+
+    fflush(stdout);
+    return 0;
+}
+
+void PacerSimulator::simulate(const PACER_SIMULATION_OPTIONS& options,
+                              const PACER_SIMULATION_DISPLAY& display,
+                              PPACER_SIMULATION_RESULTS results)
+{
+    PacerSimulator simulator(options, display);
+    simulator.execute(results);
+}
+
+PacerSimulator::PacerSimulator(const PACER_SIMULATION_OPTIONS& options, const PACER_SIMULATION_DISPLAY& display)
+    : m_Options(options),
+      m_Display(display),
+      m_Random(options.seed),
+      m_NextEventSequence(0),
+      m_NowNs(0),
+      m_EndTimeNs(0),
+      m_RefreshPeriodNs(1000000000ULL / display.refreshRate),
+      m_WaitingForFrame(false),
+      m_WaitId(0),
+      m_FrameReleasedOnLastVsync(false),
+      m_RenderInProgress(false),
+      m_BlockedOnPresent(false),
+      m_RenderingFrame(-1),
+      m_RenderStartTimeNs(0),
+      m_PendingFlip(-1),
+      m_ScanoutScheduled(false),
+      m_LastScanoutTimeNs(0),
+      m_PacerDroppedFrames(0),
+      m_EvictedFrames(0),
+      m_MissedVsyncs(0)
+{
+    // Pacer never uses JIT scheduling without a V-sync source
+    m_Policy.initialize(options.streamFps, display.refreshRate, options.rendererAttributes,
+                        options.framePacing && options.jitScheduling);
+}
+
+uint64_t PacerSimulator::sample(const PACER_SIMULATION_DISTRIBUTION& distribution)
+{
+    double valueMs = distribution.meanMs;
+
+    if (distribution.spreadMs > 0) {
+        switch (distribution.type) {
+        case PSD_CONSTANT:
+            break;
+        case PSD_UNIFORM:
+            valueMs = std::uniform_real_distribution<double>(distribution.meanMs - distribution.spreadMs,
+                                                             distribution.meanMs + distribution.spreadMs)(m_Random);
+            break;
+        case PSD_NORMAL:
+            valueMs = std::normal_distribution<double>(distribution.meanMs, distribution.spreadMs)(m_Random);
+            break;
+        case PSD_EXPONENTIAL:
+            valueMs += std::exponential_distribution<double>(1.0 / distribution.spreadMs)(m_Random);
+            break;
+        }
+    }
+
+    return valueMs > 0 ? (uint64_t)(valueMs * 1000000) : 0;
+}
+
+void PacerSimulator::schedule(uint64_t timeNs, EventType type, int arg)
+{
+    m_Events.push({ timeNs, type, m_NextEventSequence++, arg });
+}
+
+void PacerSimulator::execute(PPACER_SIMULATION_RESULTS results)
+{
+    double capturePeriodNs = 1000000000.0 / m_Options.streamFps * (1.0 + m_Options.clockDriftPpm / 1000000.0);
+    int frameCount = m_Options.streamFps * m_Options.seconds;
+
+    // The decoder outputs frames in order, so a late frame holds up the ones behind it
+    uint64_t lastArrivalTimeNs = 0;
+    m_Frames.reserve(frameCount);
+    for (int i = 0; i < frameCount; i++) {
+        Frame frame;
+
+        frame.captureTimeNs = (uint64_t)(i * capturePeriodNs);
+        frame.arrivalTimeNs = (std::max)(lastArrivalTimeNs, frame.captureTimeNs + sample(m_Options.arrivalJitter));
+        frame.displayTimeNs = 0;
+        lastArrivalTimeNs = frame.arrivalTimeNs;
+
+        m_Frames.push_back(frame);
+        schedule(frame.arrivalTimeNs, ET_FRAME_ARRIVAL, i);
+    }
+
+    m_EndTimeNs = lastArrivalTimeNs + SIMULATION_DRAIN_TIME_NS;
+
+    // The display isn't in phase with the host
+    uint64_t phaseNs = std::uniform_int_distribution<uint64_t>(0, m_RefreshPeriodNs - 1)(m_Random);
+    if (!m_Display.vrr) {
+        schedule(phaseNs, ET_SCANOUT);
+    }
+    if (m_Options.framePacing) {
+        schedule(phaseNs, ET_VSYNC);
+    }
+
+    while (!m_Events.empty() && m_Events.top().timeNs <= m_EndTimeNs) {
+        Event event = m_Events.top();
+        m_Events.pop();
+        m_NowNs = event.timeNs;
+
+        switch (event.type) {
+        case ET_SCANOUT:
+            handleScanout();
+            break;
+        case ET_RENDER_DONE:
+            // Present blocks until the display takes the last frame we presented
+            if (m_PendingFlip >= 0) {
+                m_BlockedOnPresent = true;
+            }
+            else {
+                completeRender();
+            }
+            break;
+        case ET_VSYNC:
+            schedule(m_NowNs + m_RefreshPeriodNs, ET_VSYNC);
+            handleVsync();
+            break;
+        case ET_RELEASE_DEADLINE:
+            if (m_WaitingForFrame && event.arg == m_WaitId) {
+                m_WaitingForFrame = false;
+            }
+            break;
+        case ET_FRAME_ARRIVAL:
+            handleFrameArrival(event.arg);
+            break;
+        }
+    }
+
+    computeResults(results);
+}
+
+void PacerSimulator::handleFrameArrival(int frameIndex)
+{
+    if (!m_Options.framePacing) {
+        enqueueFrameForRendering(frameIndex);
+        return;
+    }
+
+    enqueueFrame(m_PacingQueue, frameIndex);
+
+    // Wake the V-sync thread if it's waiting for a frame to release
+    if (m_WaitingForFrame) {
+        m_WaitingForFrame = false;
+
+        int frame = m_PacingQueue.front();
+        m_PacingQueue.pop_front();
+        releaseFrame(frame);
+    }
+}
+
+// Mirrors Pacer::handleVsync()
+void PacerSimulator::handleVsync()
+{
+    // Coalesce with the V-sync we're still handling
+    if (m_WaitingForFrame) {
+        return;
+    }
+
+    uint64_t releaseDeadlineNs = m_Policy.handleVsync(m_NowNs, 1000 / m_Display.refreshRate);
+
+    if (m_FrameReleasedOnLastVsync && m_Policy.isReleasedFrameLate(m_RenderInProgress, (int)m_RenderQueue.size())) {
+        m_MissedVsyncs++;
+    }
+    m_FrameReleasedOnLastVsync = false;
+
+    int frameDropTarget = m_Policy.getPacingDropTarget((int)m_PacingQueue.size());
+    while ((int)m_PacingQueue.size() > frameDropTarget) {
+        m_PacingQueue.pop_front();
+        m_PacerDroppedFrames++;
+    }
+
+    if (!m_PacingQueue.empty()) {
+        int frame = m_PacingQueue.front();
+        m_PacingQueue.pop_front();
+        releaseFrame(frame);
+        return;
+    }
+
+    // Pacer's timed waits only have millisecond granularity
+    uint64_t timeoutMs = m_NowNs < releaseDeadlineNs ? (releaseDeadlineNs - m_NowNs) / 1000000 : 0;
+    if (timeoutMs > 0) {
+        m_WaitingForFrame = true;
+        schedule(m_NowNs + timeoutMs * 1000000, ET_RELEASE_DEADLINE, ++m_WaitId);
+    }
+}
+
+void PacerSimulator::releaseFrame(int frameIndex)
+{
+    m_FrameReleasedOnLastVsync = true;
+    enqueueFrameForRendering(frameIndex);
+}
+
+void PacerSimulator::enqueueFrame(std::deque<int>& queue, int frameIndex)
+{
+    // If the consumer is blocked, the oldest frame is evicted to make room
+    if (queue.size() >= MAX_QUEUED_FRAMES) {
+        queue.pop_front();
+        m_EvictedFrames++;
+    }
+
+    queue.push_back(frameIndex);
+}
+
+void PacerSimulator::enqueueFrameForRendering(int frameIndex)
+{
+    enqueueFrame(m_RenderQueue, frameIndex);
+    startRender();
+}
+
+void PacerSimulator::startRender()
+{
+    if (m_RenderInProgress || m_RenderQueue.empty()) {
+        return;
+    }
+
+    m_RenderingFrame = m_RenderQueue.front();
+    m_RenderQueue.pop_front();
+    m_RenderInProgress = true;
+    m_RenderStartTimeNs = m_NowNs;
+    schedule(m_NowNs + sample(m_Options.renderCost), ET_RENDER_DONE);
+}
+
+// Mirrors the end of Pacer::renderFrame()
+void PacerSimulator::completeRender()
+{
+    m_PendingFlip = m_RenderingFrame;
+    if (m_Display.vrr && !m_ScanoutScheduled) {
+        // VRR displays refresh as soon as they can after a present
+        schedule((std::max)(m_NowNs, m_LastScanoutTimeNs + m_RefreshPeriodNs), ET_SCANOUT);
+        m_ScanoutScheduled = true;
+    }
+
+    m_RenderInProgress = false;
+    m_BlockedOnPresent = false;
+
+    // Like the real thing, this includes any time blocked in present
+    m_Policy.updateRenderCost(m_NowNs - m_RenderStartTimeNs);
+
+    int frameDropTarget = m_Policy.getRenderDropTarget((int)m_RenderQueue.size());
+    while ((int)m_RenderQueue.size() > frameDropTarget) {
+        m_RenderQueue.pop_front();
+        m_PacerDroppedFrames++;
+    }
+
+    startRender();
+}
+
+void PacerSimulator::handleScanout()
+{
+    if (m_Display.vrr) {
+        m_ScanoutScheduled = false;
+    }
+    else {
+        schedule(m_NowNs + m_RefreshPeriodNs, ET_SCANOUT);
+    }
+
+    m_LastScanoutTimeNs = m_NowNs;
+
+    if (m_PendingFlip >= 0) {
+        m_Frames[m_PendingFlip].displayTimeNs = m_NowNs;
+        m_PendingFlip = -1;
+
+        // This unblocks the renderer's present
+        if (m_BlockedOnPresent) {
+            completeRender();
+        }
+    }
+}
+
+void PacerSimulator::computeResults(PPACER_SIMULATION_RESULTS results)
+{
+    std::vector<double> latenciesMs;
+    std::vector<double> judderMs;
+    const Frame* lastDisplayedFrame = nullptr;
+
+    SDL_zerop(results);
+
+    for (const Frame& frame : m_Frames) {
+        if (frame.displayTimeNs == 0) {
+            continue;
+        }
+
+        latenciesMs.push_back((frame.displayTimeNs - frame.arrivalTimeNs) / 1000000.0);
+
+        if (lastDisplayedFrame != nullptr) {
+            double onScreenMs = (frame.displayTimeNs - lastDisplayedFrame->displayTimeNs) / 1000000.0;
+            double expectedMs = (frame.captureTimeNs - lastDisplayedFrame->captureTimeNs) / 1000000.0;
+            judderMs.push_back(onScreenMs - expectedMs);
+        }
+
+        lastDisplayedFrame = &frame;
+    }
+
+    results->submittedFrames = (uint32_t)m_Frames.size();
+    results->displayedFrames = (uint32_t)latenciesMs.size();
+    results->pacerDroppedFrames = m_PacerDroppedFrames;
+    results->evictedFrames = m_EvictedFrames;
+    results->missedVsyncs = m_MissedVsyncs;
+
+    if (!latenciesMs.empty()) {
+        double totalMs = 0;
+        for (double latencyMs : latenciesMs) {
+            totalMs += latencyMs;
+        }
+
+        std::sort(latenciesMs.begin(), latenciesMs.end());
+        results->latencyMeanMs = totalMs / latenciesMs.size();
+        results->latencyP50Ms = latenciesMs[latenciesMs.size() * 50 / 100];
+        results->latencyP99Ms = latenciesMs[latenciesMs.size() * 99 / 100];
+    }
+
+    if (!judderMs.empty()) {
+        double meanMs = 0;
+        for (double errorMs : judderMs) {
+            meanMs += errorMs;
+        }
+        meanMs /= judderMs.size();
+
+        double variance = 0;
+        double halfRefreshMs = m_RefreshPeriodNs / 2000000.0;
+        for (double& errorMs : judderMs) {
+            variance += (errorMs - meanMs) * (errorMs - meanMs);
+
+            errorMs = std::fabs(errorMs);
+            if (errorMs >= halfRefreshMs) {
+                results->judderedFrames++;
+            }
+        }
+
+        std::sort(judderMs.begin(), judderMs.end());
+        results->judderStdDevMs = std::sqrt(variance / judderMs.size());
+        results->judderP99Ms = judderMs[judderMs.size() * 99 / 100];
+    }
+}
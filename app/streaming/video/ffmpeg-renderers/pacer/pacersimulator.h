@@ -0,0 +1,209 @@
+#pragma once
+
+#include "pacingpolicy.h"
+
+#include <deque>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+enum PacerSimulationDistributionType {
+    PSD_CONSTANT,
+
+    // Evenly spread over mean +/- spread
+    PSD_UNIFORM,
+
+    // Spread is the standard deviation
+    PSD_NORMAL,
+
+    // Mean plus an exponential tail with a mean of spread,
+    // which looks like network delay and late frames
+    PSD_EXPONENTIAL
+};
+
+typedef struct _PACER_SIMULATION_DISTRIBUTION {
+    PacerSimulationDistributionType type;
+    double meanMs;
+    double spreadMs;
+} PACER_SIMULATION_DISTRIBUTION, *PPACER_SIMULATION_DISTRIBUTION;
+
+typedef struct _PACER_SIMULATION_DISPLAY {
+    // For VRR displays, this is the maximum refresh rate
+    int refreshRate;
+    bool vrr;
+} PACER_SIMULATION_DISPLAY, *PPACER_SIMULATION_DISPLAY;
+
+typedef struct _PACER_SIMULATION_OPTIONS {
+    int streamFps;
+
+    // Each display is simulated as a separate scenario
+    std::vector<PACER_SIMULATION_DISPLAY> displays;
+
+    // When decoded frames arrive relative to when the host captured them
+    PACER_SIMULATION_DISTRIBUTION arrivalJitter;
+
+    // Time spent in IFFmpegRenderer::renderFrame(), excluding any
+    // time spent waiting for the display to take the frame
+    PACER_SIMULATION_DISTRIBUTION renderCost;
+
+    // How fast the host's capture clock runs relative to the display
+    double clockDriftPpm;
+
+    bool framePacing;
+    bool jitScheduling;
+    int rendererAttributes;
+    int seconds;
+    uint32_t seed;
+} PACER_SIMULATION_OPTIONS, *PPACER_SIMULATION_OPTIONS;
+
+typedef struct _PACER_SIMULATION_RESULTS {
+    uint32_t submittedFrames;
+    uint32_t displayedFrames;
+
+    // Dropped by the pacing policy
+    uint32_t pacerDroppedFrames;
+
+    // Evicted from a full queue
+    uint32_t evictedFrames;
+
+    uint32_t missedVsyncs;
+
+    // From the frame leaving the decoder until the display shows it
+    double latencyMeanMs;
+    double latencyP50Ms;
+    double latencyP99Ms;
+
+    // How far the time each frame was on screen was from the time
+    // between the host capturing it and the next frame we showed
+    double judderStdDevMs;
+    double judderP99Ms;
+
+    // Frames that were on screen half a refresh or more longer or
+    // shorter than they should have been
+    uint32_t judderedFrames;
+} PACER_SIMULATION_RESULTS, *PPACER_SIMULATION_RESULTS;
+
+// Runs PacingPolicy against a simulated decoder, renderer and display on a
+// virtual clock, so changes to the drop and release heuristics can be
+// measured without a real display. Runs are deterministic for a given seed.
+//
+// The display scans out at a fixed rate and the renderer's present blocks
+// while a previous frame is still waiting for scanout, like a V-synced
+// swap chain. VRR displays scan out as soon as a frame is presented, but
+// no faster than their maximum refresh rate, which is also the rate our
+// V-sync source ticks at.
+class PacerSimulator
+{
+public:
+    // Returns true if the command line asks for the simulation
+    static bool parseCommandLine(const char* commandLine, PPACER_SIMULATION_OPTIONS options);
+
+    // Simulates each display and prints the results. Returns the process exit code.
+    static int run(const PACER_SIMULATION_OPTIONS& options);
+
+    static void simulate(const PACER_SIMULATION_OPTIONS& options,
+                         const PACER_SIMULATION_DISPLAY& display,
+                         PPACER_SIMULATION_RESULTS results);
+
+private:
+    // Events at the same time are handled in this order
+    enum EventType {
+        ET_SCANOUT,
+        ET_RENDER_DONE,
+        ET_VSYNC,
+        ET_RELEASE_DEADLINE,
+        ET_FRAME_ARRIVAL
+    };
+
+    struct Event {
+        uint64_t timeNs;
+        EventType type;
+        uint64_t sequence;
+        int arg;
+
+        bool operator>(const Event& other) const
+        {
+            if (timeNs != other.timeNs) {
+                return timeNs > other.timeNs;
+            }
+            else if (type != other.type) {
+                return type > other.type;
+            }
+            return sequence > other.sequence;
+        }
+    };
+
+    struct Frame {
+        uint64_t captureTimeNs;
+        uint64_t arrivalTimeNs;
+
+        // 0 if it was never shown
+        uint64_t displayTimeNs;
+    };
+
+    PacerSimulator(const PACER_SIMULATION_OPTIONS& options, const PACER_SIMULATION_DISPLAY& display);
+
+    static bool parseDistribution(const std::string& value, PPACER_SIMULATION_DISTRIBUTION distribution);
+
+    static bool parseDisplays(const std::string& value, std::vector<PACER_SIMULATION_DISPLAY>& displays);
+
+    uint64_t sample(const PACER_SIMULATION_DISTRIBUTION& distribution);
+
+    void schedule(uint64_t timeNs, EventType type, int arg = 0);
+
+    void execute(PPACER_SIMULATION_RESULTS results);
+
+    void handleFrameArrival(int frameIndex);
+
+    void handleVsync();
+
+    void releaseFrame(int frameIndex);
+
+    void enqueueFrame(std::deque<int>& queue, int frameIndex);
+
+    void enqueueFrameForRendering(int frameIndex);
+
+    void startRender();
+
+    void completeRender();
+
+    void handleScanout();
+
+    void computeResults(PPACER_SIMULATION_RESULTS results);
+
+    PACER_SIMULATION_OPTIONS m_Options;
+    PACER_SIMULATION_DISPLAY m_Display;
+    PacingPolicy m_Policy;
+    std::mt19937 m_Random;
+
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> m_Events;
+    uint64_t m_NextEventSequence;
+    uint64_t m_NowNs;
+    uint64_t m_EndTimeNs;
+    uint64_t m_RefreshPeriodNs;
+
+    std::vector<Frame> m_Frames;
+    std::deque<int> m_PacingQueue;
+    std::deque<int> m_RenderQueue;
+
+    // V-sync thread
+    bool m_WaitingForFrame;
+    int m_WaitId;
+    bool m_FrameReleasedOnLastVsync;
+
+    // Render thread
+    bool m_RenderInProgress;
+    bool m_BlockedOnPresent;
+    int m_RenderingFrame;
+    uint64_t m_RenderStartTimeNs;
+
+    // Display
+    int m_PendingFlip;
+    bool m_ScanoutScheduled;
+    uint64_t m_LastScanoutTimeNs;
+
+    uint32_t m_PacerDroppedFrames;
+    uint32_t m_EvictedFrames;
+    uint32_t m_MissedVsyncs;
+};
@@ -0,0 +1,141 @@
+#include "pacingpolicy.h"
+#include "../renderer.h"
+
+#include <algorithm>
+
+// We may be woken up slightly late so don't go all the way
+// up to the next V-sync since we may accidentally step into
+// the next V-sync period. It also takes some amount of time
+// to do the render itself, so we can't render right before
+// V-sync happens.
+#define TIMER_SLACK_MS 3
+
+// With just-in-time scheduling, frames are released to the renderer at the
+// next V-sync minus the p95 render time and this margin. The margin covers
+// wakeup latency, since our timed waits only have millisecond granularity.
+#define JIT_SAFETY_MARGIN_NS 1500000ULL
+
+PacingPolicy::PacingPolicy() :
+    m_MaxVideoFps(0),
+    m_DisplayFps(0),
+    m_RendererAttributes(0),
+    m_JitScheduling(false),
+    m_LastVsyncTimeNs(0),
+    m_VsyncPeriodNs(0),
+    m_RenderCostNs(0),
+    m_RenderCostSampleCount(0)
+{
+
+}
+
+void PacingPolicy::initialize(int maxVideoFps, int displayFps, int rendererAttributes, bool jitScheduling)
+{
+    m_MaxVideoFps = maxVideoFps;
+    m_DisplayFps = displayFps;
+    m_RendererAttributes = rendererAttributes;
+    m_JitScheduling = jitScheduling;
+
+    // The history windows are sized up front so updates never allocate
+    m_PacingQueueHistory.setWindowSize(m_DisplayFps / 2);
+    m_RenderQueueHistory.setWindowSize(m_MaxVideoFps / 2);
+}
+
+uint64_t PacingPolicy::handleVsync(uint64_t vsyncTimeNs, int timeUntilNextVsyncMillis)
+{
+    updateVsyncPeriod(vsyncTimeNs);
+
+    if (m_JitScheduling) {
+        // Render cost samples that include blocking on V-sync in the renderer
+        // would push the deadline back to this V-sync, so cap our budget.
+        uint64_t renderBudgetNs = SDL_min(m_RenderCostNs + JIT_SAFETY_MARGIN_NS, m_VsyncPeriodNs / 2);
+        return vsyncTimeNs + m_VsyncPeriodNs - renderBudgetNs;
+    }
+    else {
+        return vsyncTimeNs + (uint64_t)(SDL_max(timeUntilNextVsyncMillis, TIMER_SLACK_MS) - TIMER_SLACK_MS) * 1000000;
+    }
+}
+
+bool PacingPolicy::isReleasedFrameLate(bool renderInProgress, int renderQueueSize)
+{
+    // If the frame is still waiting to render or is still rendering, it missed
+    int bufferedFrames = (m_RendererAttributes & RENDERER_ATTRIBUTE_NO_BUFFERING) ? 1 : 0;
+    return renderInProgress || renderQueueSize > bufferedFrames;
+}
+
+int PacingPolicy::getPacingDropTarget(int pacingQueueSize)
+{
+    // If the queue length history entries are large, be strict
+    // about dropping excess frames.
+    int frameDropTarget = 1;
+
+    // If we may get more frames per second than we can display, use
+    // frame history to drop frames only if consistently above the
+    // one queued frame mark.
+    if (m_MaxVideoFps >= m_DisplayFps) {
+        if (m_PacingQueueHistory.getMinimum() <= 1) {
+            // Be lenient as long as the queue length
+            // resolves before the end of frame history
+            frameDropTarget = 3;
+        }
+
+        // Keep a rolling 500 ms window of pacing queue history
+        m_PacingQueueHistory.push(pacingQueueSize);
+    }
+
+    return frameDropTarget;
+}
+
+int PacingPolicy::getRenderDropTarget(int renderQueueSize)
+{
+    if (m_RendererAttributes & RENDERER_ATTRIBUTE_NO_BUFFERING) {
+        // Renderers that don't buffer any frames but don't support waitToRender() need us to buffer
+        // an extra frame to ensure they don't starve while waiting to present.
+        return 1;
+    }
+
+    int frameDropTarget = 0;
+    if (m_RenderQueueHistory.getMinimum() == 0) {
+        // Be lenient as long as the queue length
+        // resolves before the end of frame history
+        frameDropTarget = 2;
+    }
+
+    // Keep a rolling 500 ms window of render queue history
+    m_RenderQueueHistory.push(renderQueueSize);
+
+    return frameDropTarget;
+}
+
+void PacingPolicy::updateVsyncPeriod(uint64_t vsyncTimeNs)
+{
+    uint64_t nominalPeriodNs = 1000000000ULL / m_DisplayFps;
+
+    if (m_LastVsyncTimeNs != 0) {
+        uint64_t intervalNs = vsyncTimeNs - m_LastVsyncTimeNs;
+
+        // Ignore intervals where we missed a V-sync or were woken spuriously
+        if (intervalNs > nominalPeriodNs * 3 / 4 && intervalNs < nominalPeriodNs * 5 / 4) {
+            m_VsyncPeriodNs = (m_VsyncPeriodNs * 15 + intervalNs) / 16;
+        }
+    }
+    else {
+        m_VsyncPeriodNs = nominalPeriodNs;
+    }
+
+    m_LastVsyncTimeNs = vsyncTimeNs;
+}
+
+void PacingPolicy::updateRenderCost(uint64_t renderTimeNs)
+{
+    m_RenderCostSamples[m_RenderCostSampleCount++ % RENDER_COST_SAMPLES] = renderTimeNs;
+
+    // Use the p95 of the recent samples, so an occasional slow frame
+    // doesn't make us give up the latency gains on every other frame.
+    uint64_t sortedSamples[RENDER_COST_SAMPLES];
+    int sampleCount = SDL_min(m_RenderCostSampleCount, RENDER_COST_SAMPLES);
+    std::copy(m_RenderCostSamples, m_RenderCostSamples + sampleCount, sortedSamples);
+
+    int p95Index = sampleCount * 95 / 100;
+    std::nth_element(sortedSamples, sortedSamples + p95Index, sortedSamples + sampleCount);
+    m_RenderCostNs = sortedSamples[p95Index];
+}
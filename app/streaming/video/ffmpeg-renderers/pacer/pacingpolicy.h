@@ -0,0 +1,71 @@
+#pragma once
+
+#include "framequeue.h"
+
+#include <atomic>
+#include <stdint.h>
+
+// Limit the number of queued frames to prevent excessive memory consumption
+// if the V-Sync source or renderer is blocked for a while. It's important
+// that the sum of all queued frames between both pacing and rendering queues
+// must not exceed the number buffer pool size to avoid running the decoder
+// out of available decoding surfaces.
+#define MAX_QUEUED_FRAMES 4
+
+// Number of recent render times used to estimate the render cost
+#define RENDER_COST_SAMPLES 64
+
+// Pacer's decisions about when to release frames to the renderer and when
+// to drop them. These are kept apart from Pacer's threads and clocks, so
+// the same policy can be run against a simulated display by PacerSimulator.
+class PacingPolicy
+{
+public:
+    PacingPolicy();
+
+    // Must be called before anything else and not during streaming
+    void initialize(int maxVideoFps, int displayFps, int rendererAttributes, bool jitScheduling);
+
+    bool isJitScheduling()
+    {
+        return m_JitScheduling;
+    }
+
+    // V-sync thread only. Returns the latest time a frame can be released
+    // to the renderer and still make the next V-sync.
+    uint64_t handleVsync(uint64_t vsyncTimeNs, int timeUntilNextVsyncMillis);
+
+    // V-sync thread only. Returns true if a frame released on the previous
+    // V-sync didn't make it to the display in time for this one.
+    bool isReleasedFrameLate(bool renderInProgress, int renderQueueSize);
+
+    // V-sync thread only. Returns how many frames can stay in the
+    // pacing queue. The rest are dropped, oldest first.
+    int getPacingDropTarget(int pacingQueueSize);
+
+    // Render thread only. Returns how many frames can stay in the
+    // render queue after a render. The rest are dropped, oldest first.
+    int getRenderDropTarget(int renderQueueSize);
+
+    // Render thread only
+    void updateRenderCost(uint64_t renderTimeNs);
+
+private:
+    void updateVsyncPeriod(uint64_t vsyncTimeNs);
+
+    int m_MaxVideoFps;
+    int m_DisplayFps;
+    int m_RendererAttributes;
+    bool m_JitScheduling;
+
+    // Only touched by the V-sync thread
+    QueueHistory<MAX_QUEUED_FRAMES> m_PacingQueueHistory;
+    uint64_t m_LastVsyncTimeNs;
+    uint64_t m_VsyncPeriodNs;
+
+    // Only touched by the render thread, except for the estimate
+    QueueHistory<MAX_QUEUED_FRAMES> m_RenderQueueHistory;
+    std::atomic<uint64_t> m_RenderCostNs;
+    uint64_t m_RenderCostSamples[RENDER_COST_SAMPLES];
+    int m_RenderCostSampleCount;
+};
@@ -0,0 +1,175 @@
+#include "timervsyncsource.h"
+#include "streaming/streamutils.h"
+
+#include <cmath>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <time.h>
+#elif !defined(_WIN32) && !defined(_WIN64)
+#include <time.h>
+#endif
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+// Fraction of the phase error measured from each present that is
+// corrected immediately and folded into the tick period. The period
+// gain is kept well below the square of the phase gain, so the
+// correction settles without overshooting.
+#define PHASE_CORRECTION_GAIN (1.0 / 8)
+#define PERIOD_CORRECTION_GAIN (1.0 / 1024)
+
+// SDL reports whole refresh rates, so a 59.94 Hz display may show up as
+// 59 or 60 Hz. The period is allowed to drift this far to make up for it.
+#define MAX_PERIOD_CORRECTION 0.02
+
+TimerVsyncSource::TimerVsyncSource(Pacer* pacer) :
+    m_Pacer(pacer),
+    m_NominalPeriodNs(0),
+    m_PeriodNs(0),
+    m_NextVsyncNs(0),
+    m_MissedTicks(0),
+    m_LastPresentTimeNs(0)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    m_Timer = nullptr;
+#endif
+}
+
+TimerVsyncSource::~TimerVsyncSource()
+{
+    if (m_MissedTicks != 0) {
+        SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                    "Timer V-sync source missed %u ticks",
+                    m_MissedTicks);
+    }
+
+#if defined(_WIN32) || defined(_WIN64)
+    if (m_Timer != nullptr) {
+        CloseHandle(m_Timer);
+    }
+#endif
+}
+
+bool TimerVsyncSource::initialize(SDL_Window*, int displayFps)
+{
+    if (displayFps <= 0) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Invalid display refresh rate for timer V-sync source: %d",
+                     displayFps);
+        return false;
+    }
+
+#if defined(_WIN32) || defined(_WIN64)
+    // High resolution timers are only available on Windows 10 1803 and later
+    m_Timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (m_Timer == nullptr) {
+        m_Timer = CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+        if (m_Timer == nullptr) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                         "CreateWaitableTimerExW() failed: %d",
+                         GetLastError());
+            return false;
+        }
+    }
+#endif
+
+    m_NominalPeriodNs = m_PeriodNs = 1000000000.0 / displayFps;
+    m_NextVsyncNs = (double)StreamUtils::getMonotonicNanoseconds() + m_PeriodNs;
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Using timer V-sync source at %d Hz",
+                displayFps);
+    return true;
+}
+
+bool TimerVsyncSource::isAsync()
+{
+    // We wait in the context of the Pacer thread
+    return false;
+}
+
+void TimerVsyncSource::notifyPresent(uint64_t presentTimeNs)
+{
+    m_LastPresentTimeNs = presentTimeNs;
+}
+
+void TimerVsyncSource::applyPresentTime(uint64_t presentTimeNs)
+{
+    // Find how far the present was from the nearest tick
+    double errorNs = std::fmod((double)presentTimeNs - m_NextVsyncNs, m_PeriodNs);
+    if (errorNs < -m_PeriodNs / 2) {
+        errorNs += m_PeriodNs;
+    }
+    else if (errorNs >= m_PeriodNs / 2) {
+        errorNs -= m_PeriodNs;
+    }
+
+    // Presents that finish after our ticks mean the display's V-sync
+    // is later than we think, and it's running slower than we are
+    // if that keeps happening.
+    m_NextVsyncNs += errorNs * PHASE_CORRECTION_GAIN;
+    m_PeriodNs += errorNs * PERIOD_CORRECTION_GAIN;
+    m_PeriodNs = SDL_clamp(m_PeriodNs,
+                           m_NominalPeriodNs * (1 - MAX_PERIOD_CORRECTION),
+                           m_NominalPeriodNs * (1 + MAX_PERIOD_CORRECTION));
+}
+
+void TimerVsyncSource::waitForVsync()
+{
+    uint64_t presentTimeNs = m_LastPresentTimeNs.exchange(0);
+    if (presentTimeNs != 0) {
+        applyPresentTime(presentTimeNs);
+    }
+
+    // If we woke up late or the Pacer held onto us for too long,
+    // skip the ticks we missed rather than firing them back to back.
+    double nowNs = (double)StreamUtils::getMonotonicNanoseconds();
+    if (m_NextVsyncNs <= nowNs) {
+        double missedTicks = std::floor((nowNs - m_NextVsyncNs) / m_PeriodNs) + 1;
+        m_NextVsyncNs += missedTicks * m_PeriodNs;
+        m_MissedTicks += (uint32_t)missedTicks;
+    }
+
+    sleepUntil((uint64_t)m_NextVsyncNs);
+    m_NextVsyncNs += m_PeriodNs;
+}
+
+void TimerVsyncSource::sleepUntil(uint64_t deadlineNs)
+{
+    uint64_t nowNs = StreamUtils::getMonotonicNanoseconds();
+    if (deadlineNs <= nowNs) {
+        return;
+    }
+
+#if defined(__linux__)
+    // Our clock may be CLOCK_MONOTONIC_RAW, which clock_nanosleep() doesn't
+    // support, so the deadline is moved over to CLOCK_MONOTONIC. Sleeping
+    // until an absolute time keeps wakeup latency from adding up.
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    uint64_t monotonicDeadlineNs = (uint64_t)deadline.tv_sec * 1000000000ULL + deadline.tv_nsec + (deadlineNs - nowNs);
+    deadline.tv_sec = monotonicDeadlineNs / 1000000000ULL;
+    deadline.tv_nsec = monotonicDeadlineNs % 1000000000ULL;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR);
+#elif defined(_WIN32) || defined(_WIN64)
+    // Negative due times are relative in units of 100 ns
+    LARGE_INTEGER dueTime;
+    dueTime.QuadPart = -(LONGLONG)((deadlineNs - nowNs) / 100);
+    if (SetWaitableTimer(m_Timer, &dueTime, 0, nullptr, nullptr, FALSE)) {
+        WaitForSingleObject(m_Timer, INFINITE);
+    }
+    else {
+        SDL_Delay((Uint32)((deadlineNs - nowNs) / 1000000));
+    }
+#else
+    struct timespec duration;
+    duration.tv_sec = (deadlineNs - nowNs) / 1000000000ULL;
+    duration.tv_nsec = (deadlineNs - nowNs) % 1000000000ULL;
+    nanosleep(&duration, nullptr);
+#endif
+}
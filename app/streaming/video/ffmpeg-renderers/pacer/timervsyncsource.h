@@ -0,0 +1,48 @@
+#pragma once
+
+#include "pacer.h"
+
+#include <atomic>
+
+#if defined(_WIN32) || defined(_WIN64)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#endif
+
+// Ticks at the display refresh rate using absolute timer deadlines, for
+// platforms and sessions (including headless ones) without a way to wait
+// for V-sync. The ticks start at an arbitrary phase, but are pulled towards
+// the display's actual V-sync if the renderer reports its present times.
+class TimerVsyncSource : public IVsyncSource
+{
+public:
+    TimerVsyncSource(Pacer* pacer);
+
+    virtual ~TimerVsyncSource();
+
+    virtual bool initialize(SDL_Window* window, int displayFps) override;
+
+    virtual bool isAsync() override;
+
+    virtual void waitForVsync() override;
+
+    virtual void notifyPresent(uint64_t presentTimeNs) override;
+
+private:
+    void applyPresentTime(uint64_t presentTimeNs);
+
+    void sleepUntil(uint64_t deadlineNs);
+
+    Pacer* m_Pacer;
+    double m_NominalPeriodNs;
+    double m_PeriodNs;
+    double m_NextVsyncNs;
+    uint32_t m_MissedTicks;
+
+    // Written by the render thread and consumed by the V-sync thread
+    std::atomic<uint64_t> m_LastPresentTimeNs;
+
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE m_Timer;
+#endif
+};
@@ -0,0 +1,250 @@
+#include "planecopier.h"
+
+#include <cstring>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+#if defined(_M_X64) || defined(__x86_64__)
+// SSE2 is always available on x64
+#define HAVE_SSE2_COPY
+#include <emmintrin.h>
+#endif
+
+// Copies smaller than this aren't worth waking the workers for
+#define PARALLEL_COPY_MIN_BYTES (1024 * 1024)
+
+// More slices than threads lets threads that start late or get preempted
+// hand their share of the work to the others
+#define SLICES_PER_THREAD 4
+
+// Rows shorter than this are copied with memcpy()
+#define NON_TEMPORAL_COPY_MIN_BYTES 1024
+
+static void copyBytes(uint8_t* dst, const uint8_t* src, size_t length)
+{
+#ifdef HAVE_SSE2_COPY
+    // The texture memory won't be read by the CPU again, so non-temporal
+    // stores avoid evicting the rest of the cache to make room for it.
+    if (length >= NON_TEMPORAL_COPY_MIN_BYTES) {
+        // Streaming stores must be aligned
+        size_t headLength = (16 - ((uintptr_t)dst & 15)) & 15;
+        memcpy(dst, src, headLength);
+        dst += headLength;
+        src += headLength;
+        length -= headLength;
+
+        for (; length >= 64; length -= 64) {
+            __m128i v0 = _mm_loadu_si128((const __m128i*)src);
+            __m128i v1 = _mm_loadu_si128((const __m128i*)(src + 16));
+            __m128i v2 = _mm_loadu_si128((const __m128i*)(src + 32));
+            __m128i v3 = _mm_loadu_si128((const __m128i*)(src + 48));
+            _mm_stream_si128((__m128i*)dst, v0);
+            _mm_stream_si128((__m128i*)(dst + 16), v1);
+            _mm_stream_si128((__m128i*)(dst + 32), v2);
+            _mm_stream_si128((__m128i*)(dst + 48), v3);
+            src += 64;
+            dst += 64;
+        }
+    }
+#endif
+
+    memcpy(dst, src, length);
+}
+
+static void finishCopies()
+{
+#ifdef HAVE_SSE2_COPY
+    // Streaming stores are weakly ordered, so they must be fenced
+    // before another thread can see the copy as complete.
+    _mm_sfence();
+#endif
+}
+
+PlaneCopier::PlaneCopier()
+    : m_WorkerCount(0),
+      m_WorkersStarted(false),
+      m_WorkAvailable(nullptr),
+      m_WorkDone(nullptr),
+      m_Stopping(false),
+      m_Planes(nullptr),
+      m_PlaneCount(0),
+      m_SliceCount(0),
+      m_NextSlice(0)
+{
+    SDL_zero(m_Workers);
+}
+
+PlaneCopier::~PlaneCopier()
+{
+    m_Stopping = true;
+
+    for (int i = 0; i < m_WorkerCount; i++) {
+        SDL_SemPost(m_WorkAvailable);
+    }
+    for (int i = 0; i < m_WorkerCount; i++) {
+        SDL_WaitThread(m_Workers[i], nullptr);
+    }
+
+    if (m_WorkAvailable != nullptr) {
+        SDL_DestroySemaphore(m_WorkAvailable);
+    }
+    if (m_WorkDone != nullptr) {
+        SDL_DestroySemaphore(m_WorkDone);
+    }
+}
+
+int PlaneCopier::getFramePlanes(const AVFrame* frame, PLANE_COPY planes[AV_NUM_DATA_POINTERS])
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (desc == nullptr || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+        return 0;
+    }
+
+    int planeCount = av_pix_fmt_count_planes((AVPixelFormat)frame->format);
+    for (int i = 0; i < planeCount; i++) {
+        planes[i].src = frame->data[i];
+        planes[i].srcPitch = frame->linesize[i];
+        planes[i].dst = nullptr;
+        planes[i].dstPitch = 0;
+        planes[i].rowBytes = av_image_get_linesize((AVPixelFormat)frame->format, frame->width, i);
+        planes[i].rows = (i == 1 || i == 2) ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+
+        if (planes[i].rowBytes < 0) {
+            return 0;
+        }
+    }
+
+    return planeCount;
+}
+
+void PlaneCopier::copyRows(const PLANE_COPY* plane, int firstRow, int rowCount)
+{
+    const uint8_t* src = plane->src + (ptrdiff_t)firstRow * plane->srcPitch;
+    uint8_t* dst = plane->dst + (ptrdiff_t)firstRow * plane->dstPitch;
+
+    if (plane->srcPitch == plane->dstPitch && plane->rowBytes == plane->srcPitch) {
+        // The rows are contiguous in both places
+        copyBytes(dst, src, (size_t)plane->rowBytes * rowCount);
+        return;
+    }
+
+    for (int i = 0; i < rowCount; i++) {
+        copyBytes(dst, src, plane->rowBytes);
+        src += plane->srcPitch;
+        dst += plane->dstPitch;
+    }
+}
+
+void PlaneCopier::copy(const PLANE_COPY* planes, int planeCount)
+{
+    size_t totalBytes = 0;
+    for (int i = 0; i < planeCount; i++) {
+        totalBytes += (size_t)planes[i].rowBytes * planes[i].rows;
+    }
+
+    if (totalBytes < PARALLEL_COPY_MIN_BYTES || !startWorkers()) {
+        for (int i = 0; i < planeCount; i++) {
+            copyRows(&planes[i], 0, planes[i].rows);
+        }
+        finishCopies();
+        return;
+    }
+
+    m_Planes = planes;
+    m_PlaneCount = planeCount;
+    m_SliceCount = (m_WorkerCount + 1) * SLICES_PER_THREAD;
+    m_NextSlice = 0;
+
+    for (int i = 0; i < m_WorkerCount; i++) {
+        SDL_SemPost(m_WorkAvailable);
+    }
+
+    copySlices();
+
+    for (int i = 0; i < m_WorkerCount; i++) {
+        SDL_SemWait(m_WorkDone);
+    }
+}
+
+void PlaneCopier::copySlices()
+{
+    int slice;
+
+    // Each slice is the same band of rows in every plane
+    while ((slice = m_NextSlice.fetch_add(1)) < m_SliceCount) {
+        for (int i = 0; i < m_PlaneCount; i++) {
+            const PLANE_COPY* plane = &m_Planes[i];
+            int firstRow = plane->rows * slice / m_SliceCount;
+            int endRow = plane->rows * (slice + 1) / m_SliceCount;
+
+            copyRows(plane, firstRow, endRow - firstRow);
+        }
+    }
+
+    finishCopies();
+}
+
+bool PlaneCopier::startWorkers()
+{
+    if (m_WorkersStarted) {
+        return m_WorkerCount > 0;
+    }
+
+    m_WorkersStarted = true;
+
+    // Leave the other half of the cores for decoding
+    int threadCount = SDL_min(SDL_GetCPUCount() / 2, PLANE_COPIER_MAX_THREADS);
+    if (threadCount <= 1) {
+        return false;
+    }
+
+    m_WorkAvailable = SDL_CreateSemaphore(0);
+    m_WorkDone = SDL_CreateSemaphore(0);
+    if (m_WorkAvailable == nullptr || m_WorkDone == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "SDL_CreateSemaphore() failed: %s",
+                     SDL_GetError());
+        return false;
+    }
+
+    // The caller is one of the threads
+    for (int i = 0; i < threadCount - 1; i++) {
+        m_Workers[m_WorkerCount] = SDL_CreateThread(PlaneCopier::workerThread, "PlaneCopy", this);
+        if (m_Workers[m_WorkerCount] == nullptr) {
+            SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                        "SDL_CreateThread() failed: %s",
+                        SDL_GetError());
+            break;
+        }
+
+        m_WorkerCount++;
+    }
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Copying frame planes with %d threads",
+                m_WorkerCount + 1);
+    return m_WorkerCount > 0;
+}
+
+int PlaneCopier::workerThread(void* context)
+{
+    PlaneCopier* me = reinterpret_cast<PlaneCopier*>(context);
+
+    // We're holding up the render thread
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+
+    for (;;) {
+        SDL_SemWait(me->m_WorkAvailable);
+        if (me->m_Stopping) {
+            break;
+        }
+
+        me->copySlices();
+        SDL_SemPost(me->m_WorkDone);
+    }
+
+    return 0;
+}
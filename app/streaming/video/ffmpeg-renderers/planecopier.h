@@ -0,0 +1,71 @@
+#pragma once
+
+#include <SDL.h>
+
+#include <atomic>
+#include <stdint.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Most copies are limited by memory bandwidth, which
+// a handful of threads is enough to saturate.
+#define PLANE_COPIER_MAX_THREADS 4
+
+typedef struct _PLANE_COPY {
+    const uint8_t* src;
+    int srcPitch;
+    uint8_t* dst;
+    int dstPitch;
+
+    // Bytes copied from each row, which can be less than either pitch
+    int rowBytes;
+    int rows;
+} PLANE_COPY, *PPLANE_COPY;
+
+// Copies frame planes into texture memory with different pitches, using
+// non-temporal SIMD copies split across a small pool of worker threads
+// (including the caller). The workers are only started for frames large
+// enough to benefit from them.
+class PlaneCopier
+{
+public:
+    PlaneCopier();
+
+    ~PlaneCopier();
+
+    // Fills in the source and size of each plane of a software frame,
+    // leaving the destination for the caller. Interleaved chroma planes
+    // (NV12, P010) are a single plane of twice the chroma width, and
+    // high bit depth formats have 2 bytes per sample. Returns the number
+    // of planes or 0 if the format is unknown.
+    static int getFramePlanes(const AVFrame* frame, PLANE_COPY planes[AV_NUM_DATA_POINTERS]);
+
+    // Returns once all planes have been copied
+    void copy(const PLANE_COPY* planes, int planeCount);
+
+    // The single-threaded equivalent of copy()
+    static void copyRows(const PLANE_COPY* plane, int firstRow, int rowCount);
+
+private:
+    bool startWorkers();
+
+    // Copies slices of the current job until there are none left
+    void copySlices();
+
+    static int workerThread(void* context);
+
+    SDL_Thread* m_Workers[PLANE_COPIER_MAX_THREADS - 1];
+    int m_WorkerCount;
+    bool m_WorkersStarted;
+    SDL_sem* m_WorkAvailable;
+    SDL_sem* m_WorkDone;
+    std::atomic<bool> m_Stopping;
+
+    // The current job, which is only written while the workers are idle
+    const PLANE_COPY* m_Planes;
+    int m_PlaneCount;
+    int m_SliceCount;
+    std::atomic<int> m_NextSlice;
+};
@@ -1,5 +1,6 @@
 #include "plvk.h"
 
+#include "path.h"
 #include "streaming/session.h"
 #include "streaming/streamutils.h"
 
@@ -11,6 +12,8 @@
 
 #include <libavutil/hwcontext_vulkan.h>
 
+#include <filesystem>
+#include <fstream>
 #include <vector>
 #include <set>
 
@@ -18,6 +21,23 @@
 #define VK_KHR_VIDEO_DECODE_AV1_EXTENSION_NAME "VK_KHR_video_decode_av1"
 #endif
 
+// Shader caches are kept in this directory, one file per Vulkan device
+#define SHADER_CACHE_DIR "plvk"
+
+// Bump this if the layout of the cache files changes
+#define SHADER_CACHE_VERSION 1
+
+// libplacebo never drops stale entries on its own
+#define SHADER_CACHE_MAX_SIZE (50 * 1024 * 1024)
+
+typedef struct _SHADER_CACHE_HEADER
+{
+    uint32_t version;
+    uint32_t plApiVersion;
+    uint32_t driverVersion;
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+} SHADER_CACHE_HEADER, *PSHADER_CACHE_HEADER;
+
 // Keep these in sync with hwcontext_vulkan.c
 static const char *k_OptionalDeviceExtensions[] = {
     /* Misc or required by other extensions */
@@ -134,6 +154,10 @@ PlVkRenderer::~PlVkRenderer()
     pl_swapchain_destroy(&m_Swapchain);
     pl_vulkan_destroy(&m_Vulkan);
 
+    // Save this after the GPU is gone, in case it flushes anything into the cache
+    saveShaderCache();
+    pl_cache_destroy(&m_ShaderCache);
+
     // This surface was created by SDL, so there's no libplacebo API to destroy it
     if (fn_vkDestroySurfaceKHR && m_VkSurface) {
         fn_vkDestroySurfaceKHR(m_PlVkInstance->instance, m_VkSurface, nullptr);
@@ -303,6 +327,9 @@ bool PlVkRenderer::tryInitializeDevice(VkPhysicalDevice device, VkPhysicalDevice
         return false;
     }
 
+    // This must be attached before we create the renderer and start compiling shaders
+    loadShaderCache(deviceProps);
+
     SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
                 "Vulkan rendering device chosen: %s",
                 deviceProps->deviceName);
@@ -325,6 +352,114 @@ bool PlVkRenderer::isExtensionSupportedByPhysicalDevice(VkPhysicalDevice device,
     return false;
 }
 
+void PlVkRenderer::loadShaderCache(const VkPhysicalDeviceProperties* deviceProps)
+{
+    SDL_assert(m_ShaderCache == nullptr);
+
+    pl_cache_params cacheParams = pl_cache_default_params;
+    cacheParams.log = m_Log;
+    cacheParams.max_total_size = SHADER_CACHE_MAX_SIZE;
+    m_ShaderCache = pl_cache_create(&cacheParams);
+
+    // Each device gets its own file, which is replaced when its driver changes
+    char fileName[64];
+    snprintf(fileName, sizeof(fileName), "%04x_%04x.cache",
+             deviceProps->vendorID, deviceProps->deviceID);
+    m_ShaderCachePath = (std::filesystem::path(Path::getCacheDir()) / SHADER_CACHE_DIR / fileName).string();
+    m_ShaderCacheDriverVersion = deviceProps->driverVersion;
+    memcpy(m_ShaderCachePipelineUUID, deviceProps->pipelineCacheUUID, VK_UUID_SIZE);
+
+    std::ifstream file(m_ShaderCachePath, std::ios::binary);
+    if (file.is_open()) {
+        SHADER_CACHE_HEADER header;
+        if (file.read((char*)&header, sizeof(header)) &&
+                header.version == SHADER_CACHE_VERSION &&
+                header.plApiVersion == PL_API_VER &&
+                header.driverVersion == m_ShaderCacheDriverVersion &&
+                memcmp(header.pipelineCacheUUID, m_ShaderCachePipelineUUID, VK_UUID_SIZE) == 0) {
+            std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            int objectCount = pl_cache_load(m_ShaderCache, data.data(), data.size());
+            if (objectCount < 0) {
+                SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                            "Ignoring corrupt shader cache: %s",
+                            m_ShaderCachePath.c_str());
+                pl_cache_reset(m_ShaderCache);
+            }
+            else {
+                SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                            "Loaded %d cached shader objects",
+                            objectCount);
+            }
+        }
+        else {
+            SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                        "Discarding shader cache from a different driver version");
+        }
+    }
+
+    // We only need to save the cache again if it changes
+    m_ShaderCacheSignature = pl_cache_signature(m_ShaderCache);
+
+    pl_gpu_set_cache(m_Vulkan->gpu, m_ShaderCache);
+}
+
+void PlVkRenderer::saveShaderCache()
+{
+    if (m_ShaderCache == nullptr || pl_cache_signature(m_ShaderCache) == m_ShaderCacheSignature) {
+        return;
+    }
+
+    std::vector<uint8_t> data(pl_cache_save(m_ShaderCache, nullptr, 0));
+    pl_cache_save(m_ShaderCache, data.data(), data.size());
+
+    SHADER_CACHE_HEADER header;
+    header.version = SHADER_CACHE_VERSION;
+    header.plApiVersion = PL_API_VER;
+    header.driverVersion = m_ShaderCacheDriverVersion;
+    memcpy(header.pipelineCacheUUID, m_ShaderCachePipelineUUID, VK_UUID_SIZE);
+
+    std::filesystem::path cachePath(m_ShaderCachePath);
+    std::filesystem::path tempPath = cachePath;
+    tempPath += ".tmp";
+
+    try {
+        std::filesystem::create_directories(cachePath.parent_path());
+
+        {
+            std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) {
+                SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                            "Unable to write shader cache");
+                return;
+            }
+
+            file.write((const char*)&header, sizeof(header));
+            file.write((const char*)data.data(), data.size());
+            if (!file.flush()) {
+                SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                            "Unable to write shader cache");
+                return;
+            }
+        }
+
+        // Another renderer may be loading the cache right now,
+        // so it must never see a partially written file.
+        std::filesystem::rename(tempPath, cachePath);
+    }
+    catch (const std::exception& e) {
+        SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                    "Unable to write shader cache: %s",
+                    e.what());
+        std::error_code ec;
+        std::filesystem::remove(tempPath, ec);
+        return;
+    }
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                "Saved %d shader objects to cache",
+                pl_cache_objects(m_ShaderCache));
+}
+
 #define POPULATE_FUNCTION(name) \
     fn_##name = (PFN_##name)m_PlVkInstance->get_proc_addr(m_PlVkInstance->instance, #name); \
     if (fn_##name == nullptr) { \
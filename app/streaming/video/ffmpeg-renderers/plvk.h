@@ -7,10 +7,13 @@
 #define VK_USE_PLATFORM_WIN32_KHR
 #endif
 
+#include <libplacebo/cache.h>
 #include <libplacebo/log.h>
 #include <libplacebo/renderer.h>
 #include <libplacebo/vulkan.h>
 
+#include <string>
+
 class PlVkRenderer : public IFFmpegRenderer {
 public:
     PlVkRenderer(IFFmpegRenderer* backendRenderer);
@@ -44,6 +47,8 @@ private:
     bool isPresentModeSupportedByPhysicalDevice(VkPhysicalDevice device, VkPresentModeKHR presentMode);
     bool isColorSpaceSupportedByPhysicalDevice(VkPhysicalDevice device, VkColorSpaceKHR colorSpace);
     bool isSurfacePresentationSupportedByPhysicalDevice(VkPhysicalDevice device);
+    void loadShaderCache(const VkPhysicalDeviceProperties* deviceProps);
+    void saveShaderCache();
 
     // The backend renderer if we're frontend-only
     IFFmpegRenderer* m_Backend;
@@ -61,6 +66,14 @@ private:
     pl_tex m_Textures[PL_MAX_PLANES] = {};
     pl_color_space m_LastColorspace = {};
 
+    // Compiled shaders and pipelines, which are saved to disk on teardown
+    // so the next renderer on this device doesn't have to build them again
+    pl_cache m_ShaderCache = nullptr;
+    std::string m_ShaderCachePath;
+    uint32_t m_ShaderCacheDriverVersion = 0;
+    uint8_t m_ShaderCachePipelineUUID[VK_UUID_SIZE] = {};
+    uint64_t m_ShaderCacheSignature = 0;
+
     // Pending swapchain state shared between waitToRender(), renderFrame(), and cleanupRenderContext()
     pl_swapchain_frame m_SwapchainFrame = {};
     bool m_HasPendingSwapchainFrame = false;
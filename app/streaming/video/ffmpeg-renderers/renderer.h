@@ -153,6 +153,28 @@ public:
         // Don't wait by default
     }
 
+    // Called when a frame is queued for renderFrame(), on the V-sync thread or the
+    // decoder thread. Renderers can start work on the frame here that doesn't need
+    // the render context. The frame may still be dropped before it is rendered.
+    virtual void prepareToRender(AVFrame*) {
+        // Nothing
+    }
+
+    // Called on the same thread as renderFrame() after each frame is rendered.
+    // Returns false if the frame wasn't read back from a hwframe. Otherwise,
+    // returns the time the readback took and how much of that renderFrame()
+    // spent waiting for it.
+    virtual bool getLastReadBackTime(uint64_t*, uint64_t*) {
+        return false;
+    }
+
+    // Called on the same thread as renderFrame() after each frame is rendered.
+    // Renderers whose presents wait for V-sync can return the time the last
+    // present finished waiting, which is shortly after the display's V-sync.
+    virtual bool getLastPresentTime(uint64_t*) {
+        return false;
+    }
+
     // Called on the same thread as renderFrame() during destruction of the renderer
     virtual void cleanupRenderContext() {
         // Nothing
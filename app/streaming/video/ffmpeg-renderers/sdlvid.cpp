@@ -12,6 +12,8 @@ SdlRenderer::SdlRenderer()
       m_Renderer(nullptr),
       m_Texture(nullptr),
       m_ColorSpace(-1),
+      m_VsyncPresents(false),
+      m_LastPresentTimeNs(0),
       m_SwFrameMapper(this)
 {
     SDL_zero(m_OverlayTextures);
@@ -94,6 +96,7 @@ bool SdlRenderer::initialize(PDECODER_PARAMETERS params)
 
     m_VideoFormat = params->videoFormat;
     m_SwFrameMapper.setVideoFormat(m_VideoFormat);
+    m_SwFrameMapper.setFramePool(params->framePool);
 
     if (params->videoFormat & VIDEO_FORMAT_MASK_10BIT) {
         // SDL doesn't support rendering YUV 10-bit textures yet
@@ -149,6 +152,11 @@ bool SdlRenderer::initialize(PDECODER_PARAMETERS params)
         return false;
     }
 
+    SDL_RendererInfo rendererInfo;
+    if (SDL_GetRendererInfo(m_Renderer, &rendererInfo) == 0) {
+        m_VsyncPresents = (rendererInfo.flags & SDL_RENDERER_PRESENTVSYNC) != 0;
+    }
+
     // SDL_CreateRenderer() can end up having to recreate our window (SDL_RecreateWindow())
     // to ensure it's compatible with the renderer's OpenGL context. If that happens, we
     // can get spurious SDL_WINDOWEVENT events that will cause us to (again) recreate our
@@ -191,11 +199,39 @@ void SdlRenderer::renderOverlay(Overlay::OverlayType type)
     if (Session::get()->getOverlayManager().isOverlayEnabled(type)) {
         // If a new surface has been created for updated overlay data, convert it into a texture.
         // NB: We have to do this conversion at render-time because we can only interact
-        // with the renderer on a single thread.
-        SDL_Surface* newSurface = Session::get()->getOverlayManager().getUpdatedOverlaySurface(type);
+        // with the renderer on a single thread. Only the lines that changed need to be
+        // uploaded, as long as the overlay is still the same size as our texture.
+        SDL_Rect regionRect;
+        int overlayWidth, overlayHeight;
+        SDL_Surface* newSurface = Session::get()->getOverlayManager().getUpdatedOverlayRegion(type,
+                                                                                              m_OverlayTextures[type] == nullptr,
+                                                                                              &regionRect,
+                                                                                              &overlayWidth,
+                                                                                              &overlayHeight);
         if (newSurface != nullptr) {
-            if (m_OverlayTextures[type] != nullptr) {
+            if (m_OverlayTextures[type] != nullptr &&
+                    (m_OverlayRects[type].w != overlayWidth || m_OverlayRects[type].h != overlayHeight)) {
                 SDL_DestroyTexture(m_OverlayTextures[type]);
+                m_OverlayTextures[type] = nullptr;
+            }
+
+            if (m_OverlayTextures[type] == nullptr) {
+                // A resized overlay is always redrawn in full
+                SDL_assert(regionRect.w == overlayWidth && regionRect.h == overlayHeight);
+
+                m_OverlayTextures[type] = SDL_CreateTexture(m_Renderer,
+                                                            newSurface->format->format,
+                                                            SDL_TEXTUREACCESS_STREAMING,
+                                                            overlayWidth,
+                                                            overlayHeight);
+                if (m_OverlayTextures[type] != nullptr) {
+                    SDL_SetTextureBlendMode(m_OverlayTextures[type], SDL_BLENDMODE_BLEND);
+                }
+                else {
+                    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                                 "SDL_CreateTexture() failed: %s",
+                                 SDL_GetError());
+                }
             }
 
             if (type == Overlay::OverlayStatusUpdate) {
@@ -203,7 +239,7 @@ void SdlRenderer::renderOverlay(Overlay::OverlayType type)
                 SDL_Rect viewportRect;
                 SDL_RenderGetViewport(m_Renderer, &viewportRect);
                 m_OverlayRects[type].x = 0;
-                m_OverlayRects[type].y = viewportRect.h - newSurface->h;
+                m_OverlayRects[type].y = viewportRect.h - overlayHeight;
             }
             else if (type == Overlay::OverlayDebug) {
                 // Top left
@@ -211,10 +247,16 @@ void SdlRenderer::renderOverlay(Overlay::OverlayType type)
                 m_OverlayRects[type].y = 0;
             }
 
-            m_OverlayRects[type].w = newSurface->w;
-            m_OverlayRects[type].h = newSurface->h;
+            m_OverlayRects[type].w = overlayWidth;
+            m_OverlayRects[type].h = overlayHeight;
+
+            if (m_OverlayTextures[type] != nullptr) {
+                SDL_UpdateTexture(m_OverlayTextures[type],
+                                  &regionRect,
+                                  newSurface->pixels,
+                                  newSurface->pitch);
+            }
 
-            m_OverlayTextures[type] = SDL_CreateTextureFromSurface(m_Renderer, newSurface);
             SDL_FreeSurface(newSurface);
         }
 
@@ -225,6 +267,29 @@ void SdlRenderer::renderOverlay(Overlay::OverlayType type)
     }
 }
 
+void SdlRenderer::prepareToRender(AVFrame* frame)
+{
+    if (frame->hw_frames_ctx != nullptr && frame->format != AV_PIX_FMT_CUDA) {
+        m_SwFrameMapper.startReadBack(frame);
+    }
+}
+
+bool SdlRenderer::getLastPresentTime(uint64_t* presentTimeNs)
+{
+    if (m_LastPresentTimeNs == 0) {
+        return false;
+    }
+
+    *presentTimeNs = m_LastPresentTimeNs;
+    m_LastPresentTimeNs = 0;
+    return true;
+}
+
+bool SdlRenderer::getLastReadBackTime(uint64_t* readBackTimeNs, uint64_t* waitTimeNs)
+{
+    return m_SwFrameMapper.getLastReadBackTime(readBackTimeNs, waitTimeNs);
+}
+
 void SdlRenderer::renderFrame(AVFrame* frame)
 {
     int err;
@@ -387,37 +452,23 @@ ReadbackRetry:
                 goto Exit;
             }
 
-            // If the planar pitches match, we can use a single memcpy() to transfer
-            // the data. If not, we'll need to do separate memcpy() calls for each
-            // line to ensure the pitch doesn't get screwed up.
-
-            if (frame->linesize[0] == texturePitch) {
-                memcpy(pixels,
-                       frame->data[0],
-                       frame->linesize[0] * frame->height);
-            }
-            else {
-                int pitch = SDL_min(frame->linesize[0], texturePitch);
-                for (int i = 0; i < frame->height; i++) {
-                    memcpy(pixels + (texturePitch * i),
-                           frame->data[0] + (frame->linesize[0] * i),
-                           pitch);
-                }
+            // SDL's locked NV12 and NV21 textures have the chroma plane right
+            // after the luma plane with the same pitch. The copier handles
+            // any difference from the frame's pitches.
+            PLANE_COPY planes[AV_NUM_DATA_POINTERS];
+            int planeCount = PlaneCopier::getFramePlanes(frame, planes);
+            SDL_assert(planeCount == 2);
+
+            for (int i = 0; i < planeCount; i++) {
+                planes[i].dst = (uint8_t*)pixels + (i == 0 ? 0 : texturePitch * frame->height);
+                planes[i].dstPitch = texturePitch;
+                planes[i].rowBytes = SDL_min(planes[i].rowBytes, texturePitch);
             }
 
-            if (frame->linesize[1] == texturePitch) {
-                memcpy(pixels + (texturePitch * frame->height),
-                       frame->data[1],
-                       frame->linesize[1] * frame->height / 2);
-            }
-            else {
-                int pitch = SDL_min(frame->linesize[1], texturePitch);
-                for (int i = 0; i < frame->height / 2; i++) {
-                    memcpy(pixels + (texturePitch * (frame->height + i)),
-                           frame->data[1] + (frame->linesize[1] * i),
-                           pitch);
-                }
-            }
+            // Only whole chroma rows fit in SDL's buffer
+            planes[1].rows = frame->height / 2;
+
+            m_PlaneCopier.copy(planes, planeCount);
 
             SDL_UnlockTexture(m_Texture);
         }
@@ -449,11 +500,23 @@ ReadbackRetry:
         renderOverlay((Overlay::OverlayType)i);
     }
 
-    SDL_RenderPresent(m_Renderer);
+    {
+        uint64_t beforePresentNs = StreamUtils::getMonotonicNanoseconds();
+        SDL_RenderPresent(m_Renderer);
+
+        // A present that returns right away didn't wait for V-sync,
+        // so its timing doesn't tell us anything about the display.
+        if (m_VsyncPresents) {
+            uint64_t afterPresentNs = StreamUtils::getMonotonicNanoseconds();
+            if (afterPresentNs - beforePresentNs >= MIN_VSYNC_PRESENT_WAIT_NS) {
+                m_LastPresentTimeNs = afterPresentNs;
+            }
+        }
+    }
 
 Exit:
     if (swFrame != nullptr) {
-        av_frame_free(&swFrame);
+        m_SwFrameMapper.releaseSwFrame(&swFrame);
     }
 }
 
@@ -483,7 +546,7 @@ bool SdlRenderer::testRenderFrame(AVFrame* frame)
             return false;
         }
 
-        av_frame_free(&swFrame);
+        m_SwFrameMapper.releaseSwFrame(&swFrame);
     }
     else if (!isPixelFormatSupported(m_VideoFormat, (AVPixelFormat)frame->format)) {
         SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
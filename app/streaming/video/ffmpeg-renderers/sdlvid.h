@@ -2,11 +2,15 @@
 
 #include "renderer.h"
 #include "swframemapper.h"
+#include "planecopier.h"
 
 #ifdef HAVE_CUDA
 #include "cuda.h"
 #endif
 
+// Presents that take less time than this didn't wait for V-sync
+#define MIN_VSYNC_PRESENT_WAIT_NS 1000000
+
 class SdlRenderer : public IFFmpegRenderer {
 public:
     SdlRenderer();
@@ -14,6 +18,9 @@ public:
     virtual bool initialize(PDECODER_PARAMETERS params) override;
     virtual bool prepareDecoderContext(AVCodecContext* context, AVDictionary** options) override;
     virtual void renderFrame(AVFrame* frame) override;
+    virtual void prepareToRender(AVFrame* frame) override;
+    virtual bool getLastReadBackTime(uint64_t* readBackTimeNs, uint64_t* waitTimeNs) override;
+    virtual bool getLastPresentTime(uint64_t* presentTimeNs) override;
     virtual bool isRenderThreadSupported() override;
     virtual bool isPixelFormatSupported(int videoFormat, enum AVPixelFormat pixelFormat) override;
     virtual bool testRenderFrame(AVFrame* frame) override;
@@ -26,10 +33,13 @@ private:
     SDL_Renderer* m_Renderer;
     SDL_Texture* m_Texture;
     int m_ColorSpace;
+    bool m_VsyncPresents;
+    uint64_t m_LastPresentTimeNs;
     SDL_Texture* m_OverlayTextures[Overlay::OverlayMax];
     SDL_Rect m_OverlayRects[Overlay::OverlayMax];
 
     SwFrameMapper m_SwFrameMapper;
+    PlaneCopier m_PlaneCopier;
 
 #ifdef HAVE_CUDA
     CUDAGLInteropHelper* m_CudaGLHelper;
@@ -1,11 +1,48 @@
 #include "swframemapper.h"
+#include "../frametimeline.h"
+
+#include "streaming/streamutils.h"
+
+#include <cstdlib>
+#include <cstring>
 
 SwFrameMapper::SwFrameMapper(IFFmpegRenderer* renderer)
     : m_Renderer(renderer),
+      m_FramePool(nullptr),
       m_VideoFormat(0),
       m_SwPixelFormat(AV_PIX_FMT_NONE),
-      m_MapFrame(false)
+      m_MapFrame(false),
+      m_AsyncReadBackReady(false),
+      m_ReadBackThread(nullptr),
+      m_ReadBackStopping(false),
+      m_LastReadBackFrameId(0),
+      m_LastFrameReadBack(false),
+      m_LastReadBackTimeNs(0),
+      m_LastReadBackWaitNs(0)
 {
+    SDL_zero(m_ReadBackSlots);
+
+    // Some drivers may not cope with reading back frames on one
+    // thread while the renderer uses the device on another.
+    char* envValue = std::getenv("SYNC_HWFRAME_READBACK");
+    m_AsyncReadBackDisabled = envValue != nullptr && strcmp(envValue, "1") == 0;
+}
+
+SwFrameMapper::~SwFrameMapper()
+{
+    if (m_ReadBackThread != nullptr) {
+        {
+            std::lock_guard<std::mutex> locker(m_ReadBackLock);
+            m_ReadBackStopping = true;
+        }
+        m_ReadBackCond.notify_all();
+        SDL_WaitThread(m_ReadBackThread, nullptr);
+    }
+
+    std::lock_guard<std::mutex> locker(m_ReadBackLock);
+    for (int i = 0; i < SW_FRAME_READBACK_SLOTS; i++) {
+        freeReadBackSlot(&m_ReadBackSlots[i]);
+    }
 }
 
 void SwFrameMapper::setVideoFormat(int videoFormat)
@@ -13,6 +50,21 @@ void SwFrameMapper::setVideoFormat(int videoFormat)
     m_VideoFormat = videoFormat;
 }
 
+void SwFrameMapper::setFramePool(FramePool* framePool)
+{
+    m_FramePool = framePool;
+}
+
+void SwFrameMapper::releaseSwFrame(AVFrame** swFrame)
+{
+    if (m_FramePool != nullptr) {
+        m_FramePool->releaseFrame(swFrame);
+    }
+    else {
+        av_frame_free(swFrame);
+    }
+}
+
 bool SwFrameMapper::initializeReadBackFormat(AVBufferRef* hwFrameCtxRef, AVFrame* testFrame)
 {
     auto hwFrameCtx = (AVHWFramesContext*)hwFrameCtxRef->data;
@@ -101,8 +153,6 @@ Exit:
 
 AVFrame* SwFrameMapper::getSwFrameFromHwFrame(AVFrame* hwFrame)
 {
-    int err;
-
     // setVideoFormat() must have been called before our first frame
     SDL_assert(m_VideoFormat != 0);
 
@@ -111,14 +161,223 @@ AVFrame* SwFrameMapper::getSwFrameFromHwFrame(AVFrame* hwFrame)
         if (!initializeReadBackFormat(hwFrame->hw_frames_ctx, hwFrame)) {
             return nullptr;
         }
+
+        // Mapped frames are copied lazily as the renderer reads them,
+        // so only frames we copy ourselves are worth reading back early.
+        m_AsyncReadBackReady = !m_MapFrame && !m_AsyncReadBackDisabled;
+    }
+
+    uint32_t frameId = FrameTimeline::getFrameId(hwFrame);
+    uint64_t startTimeNs = StreamUtils::getMonotonicNanoseconds();
+    AVFrame* swFrame = nullptr;
+
+    if (m_AsyncReadBackReady && frameId != 0) {
+        std::unique_lock<std::mutex> locker(m_ReadBackLock);
+        ReadBackSlot* ourSlot = nullptr;
+
+        m_LastReadBackFrameId = frameId;
+
+        for (int i = 0; i < SW_FRAME_READBACK_SLOTS; i++) {
+            ReadBackSlot* slot = &m_ReadBackSlots[i];
+
+            if (slot->state == RBS_FREE) {
+                continue;
+            }
+            else if (slot->frameId == frameId) {
+                ourSlot = slot;
+            }
+            else if ((int32_t)(slot->frameId - frameId) < 0 && slot->state != RBS_IN_PROGRESS) {
+                // This frame was dropped before it got to us
+                freeReadBackSlot(slot);
+            }
+        }
+
+        if (ourSlot != nullptr) {
+            m_ReadBackCond.wait(locker, [ourSlot] { return ourSlot->state == RBS_DONE; });
+
+            swFrame = ourSlot->swFrame;
+            ourSlot->swFrame = nullptr;
+
+            if (swFrame != nullptr) {
+                m_LastFrameReadBack = true;
+                m_LastReadBackTimeNs = ourSlot->readBackTimeNs;
+                m_LastReadBackWaitNs = StreamUtils::getMonotonicNanoseconds() - startTimeNs;
+            }
+
+            freeReadBackSlot(ourSlot);
+
+            // The worker already logged the failure
+            return swFrame;
+        }
     }
 
-    AVFrame* swFrame = av_frame_alloc();
-    if (swFrame == nullptr) {
-        return nullptr;
+    swFrame = readBackFrame(hwFrame);
+    if (swFrame != nullptr) {
+        m_LastFrameReadBack = true;
+        m_LastReadBackTimeNs = m_LastReadBackWaitNs = StreamUtils::getMonotonicNanoseconds() - startTimeNs;
     }
 
-    swFrame->format = m_SwPixelFormat;
+    return swFrame;
+}
+
+bool SwFrameMapper::getLastReadBackTime(uint64_t* readBackTimeNs, uint64_t* waitTimeNs)
+{
+    if (!m_LastFrameReadBack) {
+        return false;
+    }
+
+    *readBackTimeNs = m_LastReadBackTimeNs;
+    *waitTimeNs = m_LastReadBackWaitNs;
+    m_LastFrameReadBack = false;
+    return true;
+}
+
+void SwFrameMapper::startReadBack(AVFrame* hwFrame)
+{
+    uint32_t frameId = FrameTimeline::getFrameId(hwFrame);
+
+    if (!m_AsyncReadBackReady || frameId == 0 || hwFrame->hw_frames_ctx == nullptr) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> locker(m_ReadBackLock);
+
+    if (m_ReadBackThread == nullptr) {
+        m_ReadBackThread = SDL_CreateThread(SwFrameMapper::readBackThread, "SwFrameReadBack", this);
+        if (m_ReadBackThread == nullptr) {
+            SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                        "SDL_CreateThread() failed: %s",
+                        SDL_GetError());
+            m_AsyncReadBackReady = false;
+            return;
+        }
+    }
+
+    ReadBackSlot* freeSlot = nullptr;
+    for (int i = 0; i < SW_FRAME_READBACK_SLOTS && freeSlot == nullptr; i++) {
+        ReadBackSlot* slot = &m_ReadBackSlots[i];
+
+        // Reclaim frames that were dropped after we read them back
+        if (slot->state == RBS_DONE && (int32_t)(slot->frameId - m_LastReadBackFrameId) <= 0) {
+            freeReadBackSlot(slot);
+        }
+
+        if (slot->state == RBS_FREE) {
+            freeSlot = slot;
+        }
+    }
+
+    // If we're this far ahead of the render thread, it can read the frame back itself
+    if (freeSlot == nullptr) {
+        return;
+    }
+
+    // The frame we're given may be freed before the worker gets to it
+    AVFrame* hwFrameRef = m_FramePool != nullptr ? m_FramePool->acquireFrame() : av_frame_alloc();
+    if (hwFrameRef == nullptr) {
+        return;
+    }
+    if (av_frame_ref(hwFrameRef, hwFrame) < 0) {
+        releaseSwFrame(&hwFrameRef);
+        return;
+    }
+
+    freeSlot->state = RBS_PENDING;
+    freeSlot->frameId = frameId;
+    freeSlot->hwFrame = hwFrameRef;
+    freeSlot->swFrame = nullptr;
+    freeSlot->readBackTimeNs = 0;
+    m_ReadBackCond.notify_all();
+}
+
+void SwFrameMapper::freeReadBackSlot(ReadBackSlot* slot)
+{
+    SDL_assert(slot->state != RBS_IN_PROGRESS);
+
+    releaseSwFrame(&slot->hwFrame);
+    releaseSwFrame(&slot->swFrame);
+    slot->state = RBS_FREE;
+}
+
+int SwFrameMapper::readBackThread(void* context)
+{
+    SwFrameMapper* me = reinterpret_cast<SwFrameMapper*>(context);
+
+    // The render thread may be waiting on us
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+
+    std::unique_lock<std::mutex> locker(me->m_ReadBackLock);
+    for (;;) {
+        ReadBackSlot* nextSlot = nullptr;
+
+        // Read frames back in the order they will be rendered
+        for (int i = 0; i < SW_FRAME_READBACK_SLOTS; i++) {
+            ReadBackSlot* slot = &me->m_ReadBackSlots[i];
+            if (slot->state == RBS_PENDING &&
+                    (nextSlot == nullptr || (int32_t)(slot->frameId - nextSlot->frameId) < 0)) {
+                nextSlot = slot;
+            }
+        }
+
+        if (me->m_ReadBackStopping) {
+            break;
+        }
+        else if (nextSlot == nullptr) {
+            me->m_ReadBackCond.wait(locker);
+            continue;
+        }
+
+        nextSlot->state = RBS_IN_PROGRESS;
+        locker.unlock();
+
+        uint64_t startTimeNs = StreamUtils::getMonotonicNanoseconds();
+        AVFrame* swFrame = me->readBackFrame(nextSlot->hwFrame);
+        uint64_t readBackTimeNs = StreamUtils::getMonotonicNanoseconds() - startTimeNs;
+
+        locker.lock();
+        nextSlot->swFrame = swFrame;
+        nextSlot->readBackTimeNs = readBackTimeNs;
+        nextSlot->state = RBS_DONE;
+
+        // We don't need the hwframe anymore
+        me->releaseSwFrame(&nextSlot->hwFrame);
+
+        me->m_ReadBackCond.notify_all();
+    }
+
+    return 0;
+}
+
+AVFrame* SwFrameMapper::readBackFrame(AVFrame* hwFrame)
+{
+    int err;
+    AVFrame* swFrame;
+
+    if (m_FramePool == nullptr) {
+        swFrame = av_frame_alloc();
+        if (swFrame == nullptr) {
+            return nullptr;
+        }
+
+        swFrame->format = m_SwPixelFormat;
+    }
+    else if (m_MapFrame) {
+        // Mapping references the hwframe's memory, so we only need an empty frame
+        swFrame = m_FramePool->acquireFrame();
+        if (swFrame == nullptr) {
+            return nullptr;
+        }
+
+        swFrame->format = m_SwPixelFormat;
+    }
+    else {
+        // Transfer into pooled buffers rather than having
+        // av_hwframe_transfer_data() allocate new ones.
+        swFrame = m_FramePool->acquireFrame(m_SwPixelFormat, hwFrame->width, hwFrame->height);
+        if (swFrame == nullptr) {
+            return nullptr;
+        }
+    }
 
     if (m_MapFrame) {
         // We don't use AV_HWFRAME_MAP_DIRECT here because it can cause huge
@@ -129,7 +388,7 @@ AVFrame* SwFrameMapper::getSwFrameFromHwFrame(AVFrame* hwFrame)
             SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
                          "av_hwframe_map() failed: %d",
                          err);
-            av_frame_free(&swFrame);
+            releaseSwFrame(&swFrame);
             return nullptr;
         }
     }
@@ -139,7 +398,7 @@ AVFrame* SwFrameMapper::getSwFrameFromHwFrame(AVFrame* hwFrame)
             SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
                          "av_hwframe_transfer_data() failed: %d",
                          err);
-            av_frame_free(&swFrame);
+            releaseSwFrame(&swFrame);
             return nullptr;
         }
 
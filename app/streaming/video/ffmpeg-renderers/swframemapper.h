@@ -1,19 +1,80 @@
 #pragma once
 
 #include "renderer.h"
+#include "framepool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+// Number of frames that can be read back ahead of the render thread
+#define SW_FRAME_READBACK_SLOTS 2
 
 class SwFrameMapper
 {
 public:
     explicit SwFrameMapper(IFFmpegRenderer* renderer);
+    ~SwFrameMapper();
     void setVideoFormat(int videoFormat);
+    void setFramePool(FramePool* framePool);
     AVFrame* getSwFrameFromHwFrame(AVFrame* hwFrame);
+    void releaseSwFrame(AVFrame** swFrame);
+
+    // Starts reading back a hwframe on a worker thread, so the copy can overlap
+    // with rendering the frames ahead of it. getSwFrameFromHwFrame() picks up
+    // the result, or reads the frame back itself if this was never called or
+    // didn't have a free slot. Frames which are dropped before they reach
+    // getSwFrameFromHwFrame() are discarded when a later frame does.
+    void startReadBack(AVFrame* hwFrame);
+
+    // Render thread only. Returns false if no frame has been read back since
+    // the last call. Otherwise, returns the time the last readback took and
+    // the part of it the render thread spent waiting for.
+    bool getLastReadBackTime(uint64_t* readBackTimeNs, uint64_t* waitTimeNs);
 
 private:
+    enum ReadBackSlotState {
+        RBS_FREE,
+        RBS_PENDING,
+        RBS_IN_PROGRESS,
+        RBS_DONE
+    };
+
+    struct ReadBackSlot {
+        ReadBackSlotState state;
+        uint32_t frameId;
+        AVFrame* hwFrame;
+        AVFrame* swFrame;
+        uint64_t readBackTimeNs;
+    };
+
     bool initializeReadBackFormat(AVBufferRef* hwFrameCtxRef, AVFrame* testFrame);
 
+    AVFrame* readBackFrame(AVFrame* hwFrame);
+
+    // Must be called with m_ReadBackLock held
+    void freeReadBackSlot(ReadBackSlot* slot);
+
+    static int readBackThread(void* context);
+
     IFFmpegRenderer* m_Renderer;
+    FramePool* m_FramePool;
     int m_VideoFormat;
     enum AVPixelFormat m_SwPixelFormat;
     bool m_MapFrame;
+
+    // Set once the render thread has picked a format that needs copying
+    std::atomic<bool> m_AsyncReadBackReady;
+    bool m_AsyncReadBackDisabled;
+
+    SDL_Thread* m_ReadBackThread;
+    std::mutex m_ReadBackLock;
+    std::condition_variable m_ReadBackCond;
+    bool m_ReadBackStopping;
+    ReadBackSlot m_ReadBackSlots[SW_FRAME_READBACK_SLOTS];
+    uint32_t m_LastReadBackFrameId;
+
+    bool m_LastFrameReadBack;
+    uint64_t m_LastReadBackTimeNs;
+    uint64_t m_LastReadBackWaitNs;
 };
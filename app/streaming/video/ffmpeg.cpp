@@ -1,6 +1,8 @@
 #include <Limelight.h>
 #include "ffmpeg.h"
 #include "streaming/streamutils.h"
+#include "streaming/tracer.h"
+#include "streaming/streamrecorder.h"
 #include "streaming/session.h"
 #include "utils.h"
 
@@ -11,6 +13,7 @@ extern "C" {
 }
 
 #include "ffmpeg-renderers/sdlvid.h"
+#include "ffmpeg-renderers/nullrenderer.h"
 
 //#ifdef Q_OS_WIN32
 #if defined(_WIN32) || defined(_WIN64)
@@ -56,8 +59,20 @@ extern "C" {
 
 #define MAX_SPS_EXTRA_SIZE 16
 
+// Initial size of each buffer in the packet buffer pool. The pool
+// is recreated with larger buffers if a frame exceeds this size.
+#define INITIAL_PACKET_BUFFER_SIZE (1024 * 1024)
+#define PACKET_BUFFER_SIZE_ALIGNMENT (64 * 1024)
+
 #define FAILED_DECODES_RESET_THRESHOLD 20
 
+// Bounds for how long the decoder thread sleeps while waiting on output
+// from a decoder that doesn't return frames synchronously. We have no way
+// to be notified when such a frame is ready, so we sleep until our estimate
+// of when it should be ready and retry quickly if we were too early.
+#define MIN_OUTPUT_WAIT_US 250
+#define MAX_OUTPUT_WAIT_US 4000
+
 // Note: This is NOT an exhaustive list of all decoders
 // that Moonlight could pick. It will pick any working
 // decoder that matches the codec ID and outputs one of
@@ -122,8 +137,8 @@ int FFmpegVideoDecoder::getDecoderCapabilities()
         capabilities = m_BackendRenderer->getDecoderCapabilities();
 
         if (!isHardwareAccelerated()) {
-            // Slice up to 4 times for parallel CPU decoding, once slice per core
-            int slices = (std::min)(MAX_SLICES, SDL_GetCPUCount());
+            // Slice based on the number of cores and the cost of the stream
+            int slices = m_ThreadScaler.getSliceCount();
             SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
                         "Encoder configured for %d slices per frame",
                         slices);
@@ -215,11 +230,47 @@ enum AVPixelFormat FFmpegVideoDecoder::ffGetFormat(AVCodecContext* context,
     return AV_PIX_FMT_NONE;
 }
 
+// Gets frames from the host through moonlight-common-c
+class HostVideoFrameSource : public IVideoFrameSource
+{
+public:
+    virtual bool waitForNextVideoFrame(VIDEO_FRAME_HANDLE* handle, PDECODE_UNIT* du) override
+    {
+        if (!LiWaitForNextVideoFrame(handle, du)) {
+            return false;
+        }
+
+        if (StreamRecorder::isEnabled()) {
+            StreamRecorder::recordVideoFrame(*du);
+        }
+
+        return true;
+    }
+
+    virtual void completeVideoFrame(VIDEO_FRAME_HANDLE handle, int drStatus) override
+    {
+        LiCompleteVideoFrame(handle, drStatus);
+    }
+
+    virtual void wakeWaitForVideoFrame() override
+    {
+        LiWakeWaitForVideoFrame();
+    }
+
+    virtual void requestIdrFrame() override
+    {
+        LiRequestIdrFrame();
+    }
+};
+
+static HostVideoFrameSource s_HostFrameSource;
+
 FFmpegVideoDecoder::FFmpegVideoDecoder(bool testOnly)
     : m_Pkt(av_packet_alloc()),
       m_VideoDecoderCtx(nullptr),
       m_RequiredPixelFormat(AV_PIX_FMT_NONE),
-      m_DecodeBuffer(1024 * 1024, 0),
+      m_PacketBufferPool(nullptr),
+      m_PacketBufferPoolSize(0),
       m_HwDecodeCfg(nullptr),
       m_BackendRenderer(nullptr),
       m_FrontendRenderer(nullptr),
@@ -229,10 +280,26 @@ FFmpegVideoDecoder::FFmpegVideoDecoder(bool testOnly)
       m_FramesOut(0),
       m_LastFrameNumber(0),
       m_StreamFps(0),
+      m_StreamWidth(0),
+      m_StreamHeight(0),
       m_VideoFormat(0),
+      m_DecoderPixelFormat(AV_PIX_FMT_NONE),
+      m_PendingDecoderReopen(false),
       m_NeedsSpsFixup(false),
       m_TestOnly(testOnly),
-      m_DecoderThread(nullptr)
+      m_Headless(false),
+      m_FrameSource(&s_HostFrameSource),
+      m_DecoderThread(nullptr),
+      m_InputThread(nullptr),
+      m_PendingInputValid(false),
+      m_PendingInputHandle(nullptr),
+      m_PendingInputDu(nullptr),
+      m_OutputLatencyEstimateUs(0),
+      m_OutputPollAttempts(0),
+      m_PendingWndWriteCount(0),
+      m_PendingWndReadCount(0),
+      m_StatsWindowReady(nullptr),
+      m_StatsThread(nullptr)
 {
     SDL_zero(m_ActiveWndVideoStats);
     SDL_zero(m_LastWndVideoStats);
@@ -255,6 +322,10 @@ FFmpegVideoDecoder::~FFmpegVideoDecoder()
     av_log_set_level(AV_LOG_INFO);
 
     av_packet_free(&m_Pkt);
+
+    // Buffers still referenced by outstanding packets or frames
+    // will free themselves when their last reference is dropped.
+    av_buffer_pool_uninit(&m_PacketBufferPool);
 }
 
 IFFmpegRenderer* FFmpegVideoDecoder::getBackendRenderer()
@@ -262,16 +333,86 @@ IFFmpegRenderer* FFmpegVideoDecoder::getBackendRenderer()
     return m_BackendRenderer;
 }
 
+void FFmpegVideoDecoder::getFramePoolStats(PFRAME_POOL_STATS stats)
+{
+    m_FramePool.getStats(stats);
+}
+
+FrameTimeline* FFmpegVideoDecoder::getFrameTimeline()
+{
+    return &m_FrameTimeline;
+}
+
+bool FFmpegVideoDecoder::getTestFrame(int videoFormat, const uint8_t** data, int* length)
+{
+    switch (videoFormat) {
+    case VIDEO_FORMAT_H264:
+        *data = k_H264TestFrame;
+        *length = sizeof(k_H264TestFrame);
+        return true;
+    case VIDEO_FORMAT_H265:
+        *data = k_HEVCMainTestFrame;
+        *length = sizeof(k_HEVCMainTestFrame);
+        return true;
+    case VIDEO_FORMAT_H265_MAIN10:
+        *data = k_HEVCMain10TestFrame;
+        *length = sizeof(k_HEVCMain10TestFrame);
+        return true;
+    case VIDEO_FORMAT_AV1_MAIN8:
+        *data = k_AV1Main8TestFrame;
+        *length = sizeof(k_AV1Main8TestFrame);
+        return true;
+    case VIDEO_FORMAT_AV1_MAIN10:
+        *data = k_AV1Main10TestFrame;
+        *length = sizeof(k_AV1Main10TestFrame);
+        return true;
+    default:
+        return false;
+    }
+}
+
 void FFmpegVideoDecoder::reset()
 {
     // Terminate the decoder thread before doing anything else.
     // It might be touching things we're about to free.
-    if (m_DecoderThread != nullptr) {
+    if (m_DecoderThread != nullptr || m_InputThread != nullptr || m_StatsThread != nullptr) {
         SDL_AtomicSet(&m_DecoderThreadShouldQuit, 1);
-        LiWakeWaitForVideoFrame();
-        SDL_WaitThread(m_DecoderThread, NULL);
+        m_FrameSource->wakeWaitForVideoFrame();
+        {
+            std::lock_guard<std::mutex> locker(m_DecoderWakeLock);
+            m_DecoderWakeCond.notify_all();
+            m_InputSlotFreeCond.notify_all();
+        }
+        if (m_StatsWindowReady != nullptr) {
+            SDL_SemPost(m_StatsWindowReady);
+        }
+        if (m_DecoderThread != nullptr) {
+            SDL_WaitThread(m_DecoderThread, NULL);
+            m_DecoderThread = nullptr;
+        }
+        if (m_InputThread != nullptr) {
+            SDL_WaitThread(m_InputThread, NULL);
+            m_InputThread = nullptr;
+        }
+        if (m_StatsThread != nullptr) {
+            SDL_WaitThread(m_StatsThread, NULL);
+            m_StatsThread = nullptr;
+        }
         SDL_AtomicSet(&m_DecoderThreadShouldQuit, 0);
-        m_DecoderThread = nullptr;
+    }
+
+    // Fold any windows the stats thread didn't get to into the global stats
+    processPendingStatsWindows();
+
+    if (m_StatsWindowReady != nullptr) {
+        SDL_DestroySemaphore(m_StatsWindowReady);
+        m_StatsWindowReady = nullptr;
+    }
+
+    // Return any DU that the decoder thread never picked up
+    if (m_PendingInputValid) {
+        m_FrameSource->completeVideoFrame(m_PendingInputHandle, DR_NEED_IDR);
+        m_PendingInputValid = false;
     }
 
     m_FramesIn = m_FramesOut = 0;
@@ -279,6 +420,12 @@ void FFmpegVideoDecoder::reset()
     while (!m_FrameInfoQueue.empty()) {
         m_FrameInfoQueue.pop();
     }
+    while (!m_FrameTimelineIdQueue.empty()) {
+        m_FrameTimelineIdQueue.pop();
+    }
+    m_OutputLatencyEstimateUs = 0;
+    m_OutputPollAttempts = 0;
+    m_PendingDecoderReopen = false;
 
     delete m_Pacer;
     m_Pacer = nullptr;
@@ -290,7 +437,7 @@ void FFmpegVideoDecoder::reset()
     // need to delete in the renderer destructor.
     avcodec_free_context(&m_VideoDecoderCtx);
 
-    if (!m_TestOnly) {
+    if (!m_TestOnly && !m_Headless) {
         Session::get()->getOverlayManager().setOverlayRenderer(nullptr);
     }
 
@@ -305,6 +452,16 @@ void FFmpegVideoDecoder::reset()
 
     if (!m_TestOnly) {
         logVideoStats(m_GlobalVideoStats, "Global video stats");
+
+        FRAME_POOL_STATS poolStats;
+        m_FramePool.getStats(&poolStats);
+        if (poolStats.hits != 0 || poolStats.misses != 0) {
+            SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
+                        "Frame pool: %u hits, %u misses, %d frames in flight",
+                        poolStats.hits,
+                        poolStats.misses,
+                        poolStats.framesInFlight);
+        }
     }
     else {
         // Test-only decoders can't have any frames submitted
@@ -427,42 +584,21 @@ bool FFmpegVideoDecoder::createFrontendRenderer(PDECODER_PARAMETERS params, bool
     return true;
 }
 
-bool FFmpegVideoDecoder::completeInitialization(const AVCodec* decoder, enum AVPixelFormat requiredFormat, PDECODER_PARAMETERS params, bool testFrame, bool useAlternateFrontend)
+AVCodecContext* FFmpegVideoDecoder::createDecoderContext(const AVCodec* decoder, int threadCount)
 {
-    // In test-only mode, we should only see test frames
-    SDL_assert(!m_TestOnly || testFrame);
-
-    // Create the frontend renderer based on the capabilities of the backend renderer
-    if (!createFrontendRenderer(params, useAlternateFrontend)) {
-        return false;
-    }
-
-    m_RequiredPixelFormat = requiredFormat;
-    m_StreamFps = params->frameRate;
-    m_VideoFormat = params->videoFormat;
-
-    // Don't bother initializing Pacer if we're not actually going to render
-    if (!testFrame) {
-        m_Pacer = new Pacer(m_FrontendRenderer, &m_ActiveWndVideoStats);
-        if (!m_Pacer->initialize(params->window, params->frameRate,
-                                 params->enableFramePacing || (params->enableVsync && (m_FrontendRenderer->getRendererAttributes() & RENDERER_ATTRIBUTE_FORCE_PACING)))) {
-            return false;
-        }
-    }
-
-    m_VideoDecoderCtx = avcodec_alloc_context3(decoder);
-    if (!m_VideoDecoderCtx) {
+    AVCodecContext* context = avcodec_alloc_context3(decoder);
+    if (!context) {
         SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
                      "Unable to allocate video decoder context");
-        return false;
+        return nullptr;
     }
 
     // Always request low delay decoding
-    m_VideoDecoderCtx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    context->flags |= AV_CODEC_FLAG_LOW_DELAY;
 
     // Allow display of corrupt frames and frames missing references
-    m_VideoDecoderCtx->flags |= AV_CODEC_FLAG_OUTPUT_CORRUPT;
-    m_VideoDecoderCtx->flags2 |= AV_CODEC_FLAG2_SHOW_ALL;
+    context->flags |= AV_CODEC_FLAG_OUTPUT_CORRUPT;
+    context->flags2 |= AV_CODEC_FLAG2_SHOW_ALL;
 
     // Report decoding errors to allow us to request a key frame
     //
@@ -471,41 +607,119 @@ bool FFmpegVideoDecoder::completeInitialization(const AVCodec* decoder, enum AVP
     // on screen that persist for a long time. It's easy to cause this condition
     // by using NVDEC and delaying 100 ms randomly in the render path so the decoder
     // runs out of output buffers.
-    m_VideoDecoderCtx->err_recognition = AV_EF_EXPLODE;
+    context->err_recognition = AV_EF_EXPLODE;
 
-    // Enable slice multi-threading for software decoding
-    if (!isHardwareAccelerated()) {
-        m_VideoDecoderCtx->thread_type = FF_THREAD_SLICE;
-        m_VideoDecoderCtx->thread_count = (std::min)(MAX_SLICES, SDL_GetCPUCount());
-    }
-    else {
-        // No threading for HW decode
-        m_VideoDecoderCtx->thread_count = 1;
-    }
+    // Enable slice multi-threading for software decoding. Frame threading
+    // would add a frame of latency per thread, so we never use it.
+    context->thread_type = FF_THREAD_SLICE;
+    context->thread_count = threadCount;
 
     // Setup decoding parameters
-    m_VideoDecoderCtx->width = params->width;
-    m_VideoDecoderCtx->height = params->height;
-    m_VideoDecoderCtx->pix_fmt = requiredFormat != AV_PIX_FMT_NONE ? requiredFormat : m_FrontendRenderer->getPreferredPixelFormat(params->videoFormat);
-    m_VideoDecoderCtx->get_format = ffGetFormat;
+    context->width = m_StreamWidth;
+    context->height = m_StreamHeight;
+    context->pix_fmt = m_DecoderPixelFormat;
+    context->get_format = ffGetFormat;
 
     AVDictionary* options = nullptr;
 
+    if (strcmp(decoder->name, "libdav1d") == 0) {
+        // Keep libdav1d from pipelining frames across threads. With a delay of 1,
+        // it spreads each frame's tiles and post-filtering across its threads.
+        av_dict_set_int(&options, "max_frame_delay", 1, 0);
+    }
+
     // Allow the backend renderer to attach data to this decoder
-    if (!m_BackendRenderer->prepareDecoderContext(m_VideoDecoderCtx, &options)) {
-        return false;
+    if (!m_BackendRenderer->prepareDecoderContext(context, &options)) {
+        av_dict_free(&options);
+        avcodec_free_context(&context);
+        return nullptr;
     }
 
     // Nobody must override our ffGetFormat
-    SDL_assert(m_VideoDecoderCtx->get_format == ffGetFormat);
+    SDL_assert(context->get_format == ffGetFormat);
 
     // Stash a pointer to this object in the context
-    SDL_assert(m_VideoDecoderCtx->opaque == nullptr);
-    m_VideoDecoderCtx->opaque = this;
+    SDL_assert(context->opaque == nullptr);
+    context->opaque = this;
 
-    int err = avcodec_open2(m_VideoDecoderCtx, decoder, &options);
+    int err = avcodec_open2(context, decoder, &options);
     av_dict_free(&options);
     if (err < 0) {
+        avcodec_free_context(&context);
+        return nullptr;
+    }
+
+    return context;
+}
+
+bool FFmpegVideoDecoder::reopenDecoder()
+{
+    // Open the new context before we let go of the old one,
+    // so we can keep going with the old one if this fails.
+    AVCodecContext* context = createDecoderContext(m_VideoDecoderCtx->codec, m_ThreadScaler.getThreadCount());
+    if (context == nullptr) {
+        SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                    "Unable to reopen decoder with %d threads",
+                    m_ThreadScaler.getThreadCount());
+        return false;
+    }
+
+    avcodec_free_context(&m_VideoDecoderCtx);
+    m_VideoDecoderCtx = context;
+
+    // Any frames still inside the old decoder are gone
+    m_FramesIn = m_FramesOut = 0;
+    while (!m_FrameInfoQueue.empty()) {
+        m_FrameInfoQueue.pop();
+    }
+    while (!m_FrameTimelineIdQueue.empty()) {
+        m_FrameTimelineIdQueue.pop();
+    }
+    m_OutputPollAttempts = 0;
+
+    return true;
+}
+
+bool FFmpegVideoDecoder::completeInitialization(const AVCodec* decoder, enum AVPixelFormat requiredFormat, PDECODER_PARAMETERS params, bool testFrame, bool useAlternateFrontend)
+{
+    // In test-only mode, we should only see test frames
+    SDL_assert(!m_TestOnly || testFrame);
+
+    // Create the frontend renderer based on the capabilities of the backend renderer
+    if (!createFrontendRenderer(params, useAlternateFrontend)) {
+        return false;
+    }
+
+    m_RequiredPixelFormat = requiredFormat;
+    m_StreamFps = params->frameRate;
+    m_VideoFormat = params->videoFormat;
+
+    // Don't bother initializing Pacer if we're not actually going to render
+    if (!testFrame) {
+        m_Pacer = new Pacer(m_FrontendRenderer, &m_ActiveWndVideoStats, &m_FramePool, &m_FrameTimeline);
+        if (!m_Pacer->initialize(params->window, params->frameRate,
+                                 params->enableFramePacing || (params->enableVsync && (m_FrontendRenderer->getRendererAttributes() & RENDERER_ATTRIBUTE_FORCE_PACING)))) {
+            return false;
+        }
+    }
+
+    m_StreamWidth = params->width;
+    m_StreamHeight = params->height;
+    m_DecoderPixelFormat = requiredFormat != AV_PIX_FMT_NONE ? requiredFormat : m_FrontendRenderer->getPreferredPixelFormat(params->videoFormat);
+
+    int threadCount;
+    if (m_HwDecodeCfg == nullptr && (decoder->capabilities & AV_CODEC_CAP_HARDWARE) == 0) {
+        m_ThreadScaler.initialize(params->videoFormat, params->width, params->height, params->frameRate,
+                                  strcmp(decoder->name, "libdav1d") == 0);
+        threadCount = m_ThreadScaler.getThreadCount();
+    }
+    else {
+        // No threading for HW decode
+        threadCount = 1;
+    }
+
+    m_VideoDecoderCtx = createDecoderContext(decoder, threadCount);
+    if (m_VideoDecoderCtx == nullptr) {
         SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
                      "Unable to open decoder for format: %x",
                      params->videoFormat);
@@ -518,34 +732,18 @@ bool FFmpegVideoDecoder::completeInitialization(const AVCodec* decoder, enum AVP
     // now to see if things will actually work when the video stream
     // comes in.
     if (testFrame) {
-        switch (params->videoFormat) {
-        case VIDEO_FORMAT_H264:
-            m_Pkt->data = (uint8_t*)k_H264TestFrame;
-            m_Pkt->size = sizeof(k_H264TestFrame);
-            break;
-        case VIDEO_FORMAT_H265:
-            m_Pkt->data = (uint8_t*)k_HEVCMainTestFrame;
-            m_Pkt->size = sizeof(k_HEVCMainTestFrame);
-            break;
-        case VIDEO_FORMAT_H265_MAIN10:
-            m_Pkt->data = (uint8_t*)k_HEVCMain10TestFrame;
-            m_Pkt->size = sizeof(k_HEVCMain10TestFrame);
-            break;
-        case VIDEO_FORMAT_AV1_MAIN8:
-            m_Pkt->data = (uint8_t*)k_AV1Main8TestFrame;
-            m_Pkt->size = sizeof(k_AV1Main8TestFrame);
-            break;
-        case VIDEO_FORMAT_AV1_MAIN10:
-            m_Pkt->data = (uint8_t*)k_AV1Main10TestFrame;
-            m_Pkt->size = sizeof(k_AV1Main10TestFrame);
-            break;
-        default:
+        const uint8_t* testFrameData;
+        int testFrameLength;
+        if (!getTestFrame(params->videoFormat, &testFrameData, &testFrameLength)) {
             SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
                          "No test frame for format: %x",
                          params->videoFormat);
             return false;
         }
 
+        m_Pkt->data = (uint8_t*)testFrameData;
+        m_Pkt->size = testFrameLength;
+
         AVFrame* frame = av_frame_alloc();
         if (!frame) {
             SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
@@ -555,6 +753,7 @@ bool FFmpegVideoDecoder::completeInitialization(const AVCodec* decoder, enum AVP
 
         // Some decoders won't output on the first frame, so we'll submit
         // a few test frames if we get an EAGAIN error.
+        int err;
         for (int retries = 0; retries < 5; retries++) {
             // Most FFmpeg decoders process input using a "push" model.
             // We'll see those fail here if the format is not supported.
@@ -612,16 +811,40 @@ bool FFmpegVideoDecoder::completeInitialization(const AVCodec* decoder, enum AVP
         }
 
         // Tell overlay manager to use this frontend renderer
-        Session::get()->getOverlayManager().setOverlayRenderer(m_FrontendRenderer);
+        if (!m_Headless) {
+            Session::get()->getOverlayManager().setOverlayRenderer(m_FrontendRenderer);
+        }
 
-        // Only create the decoder thread when instantiating the decoder for real. It will use APIs from
-        // moonlight-common-c that can only be legally called with an established connection.
+        // Only create the decoder thread when instantiating the decoder for real. Unless we have another
+        // frame source, it will use APIs from moonlight-common-c that can only be legally called with an
+        // established connection.
         m_DecoderThread = SDL_CreateThread(FFmpegVideoDecoder::decoderThreadProcThunk, "FFDecoder", (void*)this);
         if (m_DecoderThread == nullptr) {
             SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
                          "Failed to create decoder thread: %s", SDL_GetError());
             return false;
         }
+
+        m_InputThread = SDL_CreateThread(FFmpegVideoDecoder::inputThreadProcThunk, "FFDecoderInput", (void*)this);
+        if (m_InputThread == nullptr) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                         "Failed to create decoder input thread: %s", SDL_GetError());
+            return false;
+        }
+
+        m_StatsWindowReady = SDL_CreateSemaphore(0);
+        if (m_StatsWindowReady == nullptr) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                         "Failed to create stats semaphore: %s", SDL_GetError());
+            return false;
+        }
+
+        m_StatsThread = SDL_CreateThread(FFmpegVideoDecoder::statsThreadProcThunk, "FFDecoderStats", (void*)this);
+        if (m_StatsThread == nullptr) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                         "Failed to create decoder stats thread: %s", SDL_GetError());
+            return false;
+        }
     }
 
     return true;
@@ -635,10 +858,25 @@ void FFmpegVideoDecoder::addVideoStats(VIDEO_STATS& src, VIDEO_STATS& dst)
     dst.totalFrames += src.totalFrames;
     dst.networkDroppedFrames += src.networkDroppedFrames;
     dst.pacerDroppedFrames += src.pacerDroppedFrames;
+    dst.pacerMissedVsyncs += src.pacerMissedVsyncs;
     dst.totalReassemblyTime += src.totalReassemblyTime;
     dst.totalDecodeTime += src.totalDecodeTime;
     dst.totalPacerTime += src.totalPacerTime;
     dst.totalRenderTime += src.totalRenderTime;
+    dst.totalDecoderInputWaitTimeUs += src.totalDecoderInputWaitTimeUs;
+    dst.totalDecoderOutputWaitTimeUs += src.totalDecoderOutputWaitTimeUs;
+    dst.readBackFrames += src.readBackFrames;
+    dst.totalReadBackTimeUs += src.totalReadBackTimeUs;
+    dst.totalReadBackWaitTimeUs += src.totalReadBackWaitTimeUs;
+
+    // Percentiles can't be combined exactly, so keep the worst window's values
+    dst.timeline.frames += src.timeline.frames;
+    for (int i = 0; i < FTI_MAX; i++) {
+        dst.timeline.intervals[i].p50Us = (std::max)(dst.timeline.intervals[i].p50Us, src.timeline.intervals[i].p50Us);
+        dst.timeline.intervals[i].p95Us = (std::max)(dst.timeline.intervals[i].p95Us, src.timeline.intervals[i].p95Us);
+        dst.timeline.intervals[i].p99Us = (std::max)(dst.timeline.intervals[i].p99Us, src.timeline.intervals[i].p99Us);
+        dst.timeline.intervals[i].maxUs = (std::max)(dst.timeline.intervals[i].maxUs, src.timeline.intervals[i].maxUs);
+    }
 
     if (dst.minHostProcessingLatency == 0) {
         dst.minHostProcessingLatency = src.minHostProcessingLatency;
@@ -650,7 +888,7 @@ void FFmpegVideoDecoder::addVideoStats(VIDEO_STATS& src, VIDEO_STATS& dst)
     dst.totalHostProcessingLatency += src.totalHostProcessingLatency;
     dst.framesWithHostProcessingLatency += src.framesWithHostProcessingLatency;
 
-    if (!LiGetEstimatedRttInfo(&dst.lastRtt, &dst.lastRttVariance)) {
+    if (m_Headless || !LiGetEstimatedRttInfo(&dst.lastRtt, &dst.lastRttVariance)) {
         dst.lastRtt = 0;
         dst.lastRttVariance = 0;
     }
@@ -696,7 +934,7 @@ void FFmpegVideoDecoder::stringifyVideoStats(VIDEO_STATS& stats, char* output, i
         break;
 
     case VIDEO_FORMAT_H265_MAIN10:
-        if (LiGetCurrentHostDisplayHdrMode()) {
+        if (!m_Headless && LiGetCurrentHostDisplayHdrMode()) {
             codecString = "HEVC Main 10 HDR";
         }
         else {
@@ -709,7 +947,7 @@ void FFmpegVideoDecoder::stringifyVideoStats(VIDEO_STATS& stats, char* output, i
         break;
 
     case VIDEO_FORMAT_AV1_MAIN10:
-        if (LiGetCurrentHostDisplayHdrMode()) {
+        if (!m_Headless && LiGetCurrentHostDisplayHdrMode()) {
             codecString = "AV1 10-bit HDR";
         }
         else {
@@ -725,11 +963,12 @@ void FFmpegVideoDecoder::stringifyVideoStats(VIDEO_STATS& stats, char* output, i
 
     if (stats.receivedFps > 0) {
         if (m_VideoDecoderCtx != nullptr) {
+            // The decoder thread may reopen the context while we're running on the stats thread
             ret = snprintf(&output[offset],
                            length - offset,
                            "Video stream: %dx%d %.2f FPS (Codec: %s)\n",
-                           m_VideoDecoderCtx->width,
-                           m_VideoDecoderCtx->height,
+                           m_StreamWidth,
+                           m_StreamHeight,
                            stats.totalFps,
                            codecString);
             if (ret < 0 || ret >= length - offset) {
@@ -785,14 +1024,19 @@ void FFmpegVideoDecoder::stringifyVideoStats(VIDEO_STATS& stats, char* output, i
                        length - offset,
                        "Frames dropped by your network connection: %.2f%%\n"
                        "Frames dropped due to network jitter: %.2f%%\n"
+                       "Frames that missed V-sync: %.2f%%\n"
                        "Average network latency: %s\n"
                        "Average decoding time: %.2f ms\n"
+                       "Average decoder wait for input/output: %.2f/%.2f ms\n"
                        "Average frame queue delay: %.2f ms\n"
                        "Average rendering time (including monitor V-sync latency): %.2f ms\n",
                        (float)stats.networkDroppedFrames / stats.totalFrames * 100,
                        (float)stats.pacerDroppedFrames / stats.decodedFrames * 100,
+                       (float)stats.pacerMissedVsyncs / stats.renderedFrames * 100,
                        rttString,
                        (float)stats.totalDecodeTime / stats.decodedFrames,
+                       (float)stats.totalDecoderInputWaitTimeUs / 1000 / stats.decodedFrames,
+                       (float)stats.totalDecoderOutputWaitTimeUs / 1000 / stats.decodedFrames,
                        (float)stats.totalPacerTime / stats.renderedFrames,
                        (float)stats.totalRenderTime / stats.renderedFrames);
         if (ret < 0 || ret >= length - offset) {
@@ -802,12 +1046,77 @@ void FFmpegVideoDecoder::stringifyVideoStats(VIDEO_STATS& stats, char* output, i
 
         offset += ret;
     }
+
+    if (!m_Headless && Session::get() != nullptr) {
+        AUDIO_STATS audioStats;
+        Session::get()->getAudioStats(audioStats);
+
+        if (audioStats.lostPackets != 0) {
+            ret = snprintf(&output[offset],
+                           length - offset,
+                           "Audio packets lost: %.2f%% (recovered with FEC: %u, concealed: %u)\n",
+                           (float)audioStats.lostPackets / (audioStats.receivedPackets + audioStats.lostPackets) * 100,
+                           audioStats.fecRecoveredPackets,
+                           audioStats.concealedPackets);
+            if (ret < 0 || ret >= length - offset) {
+                SDL_assert(false);
+                return;
+            }
+
+            offset += ret;
+        }
+    }
+
+    if (stats.readBackFrames != 0) {
+        ret = snprintf(&output[offset],
+                       length - offset,
+                       "Average hardware frame readback time (render wait): %.2f (%.2f) ms\n",
+                       (float)stats.totalReadBackTimeUs / 1000 / stats.readBackFrames,
+                       (float)stats.totalReadBackWaitTimeUs / 1000 / stats.readBackFrames);
+        if (ret < 0 || ret >= length - offset) {
+            SDL_assert(false);
+            return;
+        }
+
+        offset += ret;
+    }
+
+    if (stats.timeline.frames != 0) {
+        ret = snprintf(&output[offset],
+                       length - offset,
+                       "Frame timeline p50/p95/p99/max:\n");
+        if (ret < 0 || ret >= length - offset) {
+            SDL_assert(false);
+            return;
+        }
+
+        offset += ret;
+
+        for (int i = 0; i < FTI_MAX; i++) {
+            const FRAME_TIMELINE_PERCENTILES& interval = stats.timeline.intervals[i];
+
+            ret = snprintf(&output[offset],
+                           length - offset,
+                           "  %s: %.2f/%.2f/%.2f/%.2f ms\n",
+                           FrameTimeline::getIntervalName((FrameTimelineInterval)i),
+                           interval.p50Us / 1000.0f,
+                           interval.p95Us / 1000.0f,
+                           interval.p99Us / 1000.0f,
+                           interval.maxUs / 1000.0f);
+            if (ret < 0 || ret >= length - offset) {
+                SDL_assert(false);
+                return;
+            }
+
+            offset += ret;
+        }
+    }
 }
 
 void FFmpegVideoDecoder::logVideoStats(VIDEO_STATS& stats, const char* title)
 {
     if (stats.renderedFps > 0 || stats.renderedFrames != 0) {
-        char videoStatsStr[512];
+        char videoStatsStr[2048];
         stringifyVideoStats(stats, videoStatsStr, sizeof(videoStatsStr));
 
         SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION,
@@ -1030,6 +1339,12 @@ bool FFmpegVideoDecoder::tryInitializeRendererForUnknownDecoder(const AVCodec* d
         return false;
     }
 
+    if (m_Headless) {
+        // There's nothing to render to, so decode in software and throw the frames away
+        return tryInitializeRenderer(decoder, AV_PIX_FMT_NONE, params, nullptr, nullptr,
+                                     []() -> IFFmpegRenderer* { return new NullRenderer(); });
+    }
+
     if (tryHwAccel) {
         // This might be a hwaccel decoder, so try any hw configs first
         for (int i = 0;; i++) {
@@ -1150,6 +1465,18 @@ bool FFmpegVideoDecoder::initialize(PDECODER_PARAMETERS params)
     // Increase log level until the first frame is decoded
     av_log_set_level(AV_LOG_DEBUG);
 
+    // Allow renderers to allocate frames from our pool
+    params->framePool = &m_FramePool;
+
+    // Without a window, there's no session or host either. This is how the
+    // decode benchmark runs, and it's limited to software decoding.
+    m_Headless = params->window == nullptr;
+    SDL_assert(!m_Headless || (params->frameSource != nullptr && params->vds == StreamingPreferences::VDS_FORCE_SOFTWARE));
+
+    if (params->frameSource != nullptr) {
+        m_FrameSource = params->frameSource;
+    }
+
     // First try decoders that the user has manually specified via environment variables.
     // These must output surfaces in one of the formats that one of our renderers supports,
     // which is currently:
@@ -1410,7 +1737,30 @@ bool FFmpegVideoDecoder::initialize(PDECODER_PARAMETERS params)
     return false;
 }
 
-void FFmpegVideoDecoder::writeBuffer(PLENTRY entry, int& offset)
+AVBufferRef* FFmpegVideoDecoder::allocatePacketBuffer(int size)
+{
+    int requiredPoolSize = size + AV_INPUT_BUFFER_PADDING_SIZE;
+
+    if (requiredPoolSize > m_PacketBufferPoolSize) {
+        // Buffers from the old pool remain valid until the decoder releases
+        // them. The pool itself is freed after its last buffer is returned.
+        av_buffer_pool_uninit(&m_PacketBufferPool);
+
+        m_PacketBufferPoolSize = (std::max)(INITIAL_PACKET_BUFFER_SIZE, m_PacketBufferPoolSize * 2);
+        m_PacketBufferPoolSize = (std::max)(m_PacketBufferPoolSize, requiredPoolSize);
+        m_PacketBufferPoolSize = FFALIGN(m_PacketBufferPoolSize, PACKET_BUFFER_SIZE_ALIGNMENT);
+
+        m_PacketBufferPool = av_buffer_pool_init(m_PacketBufferPoolSize, nullptr);
+        if (m_PacketBufferPool == nullptr) {
+            m_PacketBufferPoolSize = 0;
+            return nullptr;
+        }
+    }
+
+    return av_buffer_pool_get(m_PacketBufferPool);
+}
+
+void FFmpegVideoDecoder::writeBuffer(PLENTRY entry, uint8_t* buffer, int& offset)
 {
     if (m_NeedsSpsFixup && entry->bufferType == BUFFER_TYPE_SPS) {
         h264_stream_t* stream = h264_new();
@@ -1433,18 +1783,18 @@ void FFmpegVideoDecoder::writeBuffer(PLENTRY entry, int& offset)
 
         // Copy the modified NALU data. This clobbers byte 0 and starts NALU data at byte 1.
         // Since it prepended one extra byte, subtract one from the returned length.
-        offset += write_nal_unit(stream, (uint8_t*)&m_DecodeBuffer.data()[initialOffset + nalStart - 1],
+        offset += write_nal_unit(stream, &buffer[initialOffset + nalStart - 1],
                                  MAX_SPS_EXTRA_SIZE + entry->length - nalStart) - 1;
 
         // Copy the NALU prefix over from the original SPS
-        memcpy(const_cast<char *>(&m_DecodeBuffer.data()[initialOffset]), entry->data, nalStart);
+        memcpy(&buffer[initialOffset], entry->data, nalStart);
         offset += nalStart;
 
         h264_free(stream);
     }
     else {
         // Write the buffer as-is
-        memcpy(const_cast<char *>(&m_DecodeBuffer.data()[offset]),
+        memcpy(&buffer[offset],
                entry->data,
                entry->length);
         offset += entry->length;
@@ -1457,156 +1807,316 @@ int FFmpegVideoDecoder::decoderThreadProcThunk(void *context)
     return 0;
 }
 
-void FFmpegVideoDecoder::decoderThreadProc()
+int FFmpegVideoDecoder::inputThreadProcThunk(void *context)
+{
+    ((FFmpegVideoDecoder*)context)->inputThreadProc();
+    return 0;
+}
+
+int FFmpegVideoDecoder::statsThreadProcThunk(void *context)
+{
+    ((FFmpegVideoDecoder*)context)->statsThreadProc();
+    return 0;
+}
+
+void FFmpegVideoDecoder::statsThreadProc()
 {
+    // Formatting the stats and rasterizing the overlay can take a few
+    // milliseconds, so stay out of the way of the streaming threads.
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
     while (!SDL_AtomicGet(&m_DecoderThreadShouldQuit)) {
-        if (m_FramesIn == m_FramesOut) {
-            VIDEO_FRAME_HANDLE handle;
-            PDECODE_UNIT du;
-
-            // Waiting for input. All output frames have been received.
-            // Block until we receive a new frame from the host.
-            if (!LiWaitForNextVideoFrame(&handle, &du)) {
-                // This might be a signal from the main thread to exit
-                continue;
-            }
+        SDL_SemWait(m_StatsWindowReady);
+        processPendingStatsWindows();
+    }
+}
+
+void FFmpegVideoDecoder::processPendingStatsWindows()
+{
+    uint32_t readCount = m_PendingWndReadCount.load(std::memory_order_relaxed);
+
+    while (readCount != m_PendingWndWriteCount.load(std::memory_order_acquire)) {
+        VIDEO_STATS& window = m_PendingWndVideoStats[readCount % MAX_PENDING_STATS_WINDOWS];
+
+        m_FrameTimeline.computeStats(&window.timeline);
+
+        // Update overlay stats if it's enabled
+        if (!m_Headless && Session::get()->getOverlayManager().isOverlayEnabled(Overlay::OverlayDebug)) {
+            VIDEO_STATS lastTwoWndStats = {};
+            addVideoStats(m_LastWndVideoStats, lastTwoWndStats);
+            addVideoStats(window, lastTwoWndStats);
 
-            LiCompleteVideoFrame(handle, submitDecodeUnit(du));
+            stringifyVideoStats(lastTwoWndStats,
+                                Session::get()->getOverlayManager().getOverlayText(Overlay::OverlayDebug),
+                                Session::get()->getOverlayManager().getOverlayMaxTextLength());
+            Session::get()->getOverlayManager().setOverlayTextUpdated(Overlay::OverlayDebug);
         }
 
-        if (m_FramesIn != m_FramesOut) {
-            SDL_assert(m_FramesIn > m_FramesOut);
+        // Accumulate these values into the global stats
+        addVideoStats(window, m_GlobalVideoStats);
 
-            // We have output frames to receive. Let's poll until we get one,
-            // and submit new input data if/when we get it.
-            AVFrame* frame = av_frame_alloc();
-            if (!frame) {
-                // Failed to allocate a frame but we did submit,
-                // so we can return DR_OK
-                SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
-                            "Failed to allocate frame");
-                continue;
-            }
+        // Move this window into the last window slot
+        SDL_memcpy(&m_LastWndVideoStats, &window, sizeof(window));
 
-            int err;
-            do {
-                err = avcodec_receive_frame(m_VideoDecoderCtx, frame);
-                if (err == 0) {
-                    SDL_assert(m_FrameInfoQueue.size() == m_FramesIn - m_FramesOut);
-                    m_FramesOut++;
-
-                    // Attach HDR metadata to the frame if it's not already present. We will defer to
-                    // any metadata contained in the bitstream itself since that is guaranteed to be
-                    // correctly synchronized to each frame, unlike our async HDR metadata message.
-                    SS_HDR_METADATA hdrMetadata;
-                    if (LiGetHdrMetadata(&hdrMetadata)) {
-                        if (av_frame_get_side_data(frame, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA) == nullptr) {
-                            auto mdm = av_mastering_display_metadata_create_side_data(frame);
-
-                            mdm->display_primaries[0][0] = av_make_q(hdrMetadata.displayPrimaries[0].x, 50000);
-                            mdm->display_primaries[0][1] = av_make_q(hdrMetadata.displayPrimaries[0].y, 50000);
-                            mdm->display_primaries[1][0] = av_make_q(hdrMetadata.displayPrimaries[1].x, 50000);
-                            mdm->display_primaries[1][1] = av_make_q(hdrMetadata.displayPrimaries[1].y, 50000);
-                            mdm->display_primaries[2][0] = av_make_q(hdrMetadata.displayPrimaries[2].x, 50000);
-                            mdm->display_primaries[2][1] = av_make_q(hdrMetadata.displayPrimaries[2].y, 50000);
-
-                            mdm->white_point[0] = av_make_q(hdrMetadata.whitePoint.x, 50000);
-                            mdm->white_point[1] = av_make_q(hdrMetadata.whitePoint.y, 50000);
-
-                            mdm->min_luminance = av_make_q(hdrMetadata.minDisplayLuminance, 10000);
-                            mdm->max_luminance = av_make_q(hdrMetadata.maxDisplayLuminance, 1);
-
-                            mdm->has_luminance = hdrMetadata.maxDisplayLuminance != 0 ? 1 : 0;
-                            mdm->has_primaries = hdrMetadata.displayPrimaries[0].x != 0 ? 1 : 0;
-                        }
-
-                        if ((hdrMetadata.maxContentLightLevel != 0 || hdrMetadata.maxFrameAverageLightLevel != 0) &&
-                                av_frame_get_side_data(frame, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL) == nullptr) {
-                            auto clm = av_content_light_metadata_create_side_data(frame);
-
-                            clm->MaxCLL = hdrMetadata.maxContentLightLevel;
-                            clm->MaxFALL = hdrMetadata.maxFrameAverageLightLevel;
-                        }
-                    }
+        // Let the decoder thread reuse this slot
+        m_PendingWndReadCount.store(++readCount, std::memory_order_release);
+    }
+}
 
-                    // Reset failed decodes count if we reached this far
-                    m_ConsecutiveFailedDecodes = 0;
+void FFmpegVideoDecoder::inputThreadProc()
+{
+    while (!SDL_AtomicGet(&m_DecoderThreadShouldQuit)) {
+        VIDEO_FRAME_HANDLE handle;
+        PDECODE_UNIT du;
 
-                    // Restore default log level after a successful decode
-                    av_log_set_level(AV_LOG_INFO);
+        // Wait for the decoder thread to consume the last DU we handed it
+        {
+            std::unique_lock<std::mutex> locker(m_DecoderWakeLock);
+            m_InputSlotFreeCond.wait(locker, [this] {
+                return !m_PendingInputValid || SDL_AtomicGet(&m_DecoderThreadShouldQuit);
+            });
+        }
 
-                    // Capture a frame timestamp to measuring pacing delay
-                    frame->pkt_dts = SDL_GetTicks();
+        if (SDL_AtomicGet(&m_DecoderThreadShouldQuit)) {
+            break;
+        }
 
-                    if (!m_FrameInfoQueue.empty()) {
-                        // Data buffers in the DU are not valid here!
-                        DECODE_UNIT du = m_FrameInfoQueue.front();
-                        m_FrameInfoQueue.pop();
+        // Block until we receive a new frame from the host
+        if (!m_FrameSource->waitForNextVideoFrame(&handle, &du)) {
+            // This might be a signal from the main thread to exit
+            continue;
+        }
 
-                        // Count time in avcodec_send_packet() and avcodec_receive_frame()
-                        // as time spent decoding. Also count time spent in the decode unit
-                        // queue because that's directly caused by decoder latency.
-                        m_ActiveWndVideoStats.totalDecodeTime += LiGetMillis() - du.enqueueTimeMs;
+        // Hand the DU to the decoder thread and wake it up
+        std::lock_guard<std::mutex> locker(m_DecoderWakeLock);
+        m_PendingInputHandle = handle;
+        m_PendingInputDu = du;
+        m_PendingInputValid = true;
+        m_DecoderWakeCond.notify_one();
+    }
+}
 
-                        // Store the presentation time
-                        frame->pts = du.presentationTimeMs;
-                    }
+bool FFmpegVideoDecoder::waitForDecoderWork(VIDEO_FRAME_HANDLE* handle, PDECODE_UNIT* du)
+{
+    std::unique_lock<std::mutex> locker(m_DecoderWakeLock);
+    auto hasWork = [this] {
+        return m_PendingInputValid || SDL_AtomicGet(&m_DecoderThreadShouldQuit);
+    };
+
+    uint64_t waitStartUs = StreamUtils::getMonotonicNanoseconds() / 1000;
+
+    if (m_FramesIn == m_FramesOut) {
+        // Waiting for input. All output frames have been received.
+        m_DecoderWakeCond.wait(locker, hasWork);
+        m_ActiveWndVideoStats.totalDecoderInputWaitTimeUs += StreamUtils::getMonotonicNanoseconds() / 1000 - waitStartUs;
+    }
+    else {
+        SDL_assert(!m_FrameTimelineIdQueue.empty());
+
+        // Sleep until we expect the oldest outstanding frame to be ready. If we
+        // already tried at that point and came up empty, retry after a short delay.
+        uint64_t expectedOutputUs = m_FrameTimeline.getStageTime(m_FrameTimelineIdQueue.front(), FTS_SEND_PACKET) / 1000 +
+                                    m_OutputLatencyEstimateUs;
+        uint64_t timeoutUs;
+        if (m_OutputPollAttempts == 0 && expectedOutputUs > waitStartUs) {
+            timeoutUs = expectedOutputUs - waitStartUs;
+        }
+        else {
+            timeoutUs = MIN_OUTPUT_WAIT_US;
+        }
+        timeoutUs = SDL_clamp(timeoutUs, (uint64_t)MIN_OUTPUT_WAIT_US, (uint64_t)MAX_OUTPUT_WAIT_US);
+
+        // Only waits that ran to the end count as polls for the frame. If new
+        // input woke us early, we haven't reached the predicted time yet.
+        if (!m_DecoderWakeCond.wait_for(locker, std::chrono::microseconds(timeoutUs), hasWork)) {
+            m_OutputPollAttempts++;
+        }
+        m_ActiveWndVideoStats.totalDecoderOutputWaitTimeUs += StreamUtils::getMonotonicNanoseconds() / 1000 - waitStartUs;
+    }
+
+    if (!m_PendingInputValid) {
+        return false;
+    }
+
+    *handle = m_PendingInputHandle;
+    *du = m_PendingInputDu;
+    return true;
+}
+
+void FFmpegVideoDecoder::completePendingInput(VIDEO_FRAME_HANDLE handle, int drStatus)
+{
+    // Complete the frame before letting the input thread fetch
+    // another one, just like we did when we polled for it ourselves.
+    m_FrameSource->completeVideoFrame(handle, drStatus);
 
-                    m_ActiveWndVideoStats.decodedFrames++;
+    std::lock_guard<std::mutex> locker(m_DecoderWakeLock);
+    m_PendingInputValid = false;
+    m_InputSlotFreeCond.notify_one();
+}
+
+void FFmpegVideoDecoder::decoderThreadProc()
+{
+    AVFrame* frame = nullptr;
+
+    while (!SDL_AtomicGet(&m_DecoderThreadShouldQuit)) {
+        VIDEO_FRAME_HANDLE handle;
+        PDECODE_UNIT du;
+
+        // Block until we receive a new frame from the host, an outstanding
+        // frame is expected to be ready, or the main thread wants us to exit.
+        bool haveInput;
+        {
+            TRACE_SCOPE("FFmpegVideoDecoder::waitForDecoderWork");
+            haveInput = waitForDecoderWork(&handle, &du);
+        }
+
+        if (haveInput) {
+            // FIXME: Handle EAGAIN on avcodec_send_packet() properly?
+            completePendingInput(handle, submitDecodeUnit(du));
+        }
 
-                    // Queue the frame for rendering (or render now if pacer is disabled)
-                    m_Pacer->submitFrame(frame);
+        // Receive all output frames that the decoder has ready for us
+        while (m_FramesIn != m_FramesOut && !SDL_AtomicGet(&m_DecoderThreadShouldQuit)) {
+            SDL_assert(m_FramesIn > m_FramesOut);
+
+            if (frame == nullptr) {
+                frame = m_FramePool.acquireFrame();
+                if (!frame) {
+                    // Failed to allocate a frame but we did submit,
+                    // so we can return DR_OK
+                    SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                                "Failed to allocate frame");
+                    break;
                 }
-                else if (err == AVERROR(EAGAIN)) {
-                    VIDEO_FRAME_HANDLE handle;
-                    PDECODE_UNIT du;
-
-                    // No output data, so let's try to submit more input data,
-                    // while we're waiting for this to frame to come back.
-                    if (LiPollNextVideoFrame(&handle, &du)) {
-                        // FIXME: Handle EAGAIN on avcodec_send_packet() properly?
-                        LiCompleteVideoFrame(handle, submitDecodeUnit(du));
+            }
+
+            TraceScope traceScope("FFmpegVideoDecoder::receiveFrame");
+            int err = avcodec_receive_frame(m_VideoDecoderCtx, frame);
+            if (err == 0) {
+                SDL_assert(m_FrameInfoQueue.size() == m_FramesIn - m_FramesOut);
+                m_FramesOut++;
+
+                // Refine our estimate of the decoder's output delay. If the frame was
+                // ready when we woke at the predicted time, we may have slept too long,
+                // so decay the estimate to probe for a shorter delay next time. If it
+                // wasn't, move the estimate towards the latency we actually measured.
+                // Frames that were ready without waiting at all tell us nothing.
+                if (!m_FrameTimelineIdQueue.empty()) {
+                    uint32_t frameId = m_FrameTimelineIdQueue.front();
+                    m_FrameTimelineIdQueue.pop();
+
+                    uint64_t receiveFrameNs = StreamUtils::getMonotonicNanoseconds();
+                    m_FrameTimeline.markStage(frameId, FTS_RECEIVE_FRAME, receiveFrameNs);
+                    FrameTimeline::setFrameId(frame, frameId);
+                    traceScope.setFrameId(frameId);
+
+                    uint64_t outputLatencyUs = (receiveFrameNs - m_FrameTimeline.getStageTime(frameId, FTS_SEND_PACKET)) / 1000;
+
+                    if (m_OutputPollAttempts == 1) {
+                        m_OutputLatencyEstimateUs -= m_OutputLatencyEstimateUs / 16;
                     }
-                    else {
-                        // No output data or input data. Let's wait a little bit.
-                        SDL_Delay(2);
+                    else if (m_OutputPollAttempts > 1) {
+                        m_OutputLatencyEstimateUs = (m_OutputLatencyEstimateUs * 7 + outputLatencyUs) / 8;
                     }
                 }
-                else {
-                    char errorstring[512];
+                m_OutputPollAttempts = 0;
+
+                // Attach HDR metadata to the frame if it's not already present. We will defer to
+                // any metadata contained in the bitstream itself since that is guaranteed to be
+                // correctly synchronized to each frame, unlike our async HDR metadata message.
+                SS_HDR_METADATA hdrMetadata;
+                if (!m_Headless && LiGetHdrMetadata(&hdrMetadata)) {
+                    if (av_frame_get_side_data(frame, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA) == nullptr) {
+                        auto mdm = av_mastering_display_metadata_create_side_data(frame);
+
+                        mdm->display_primaries[0][0] = av_make_q(hdrMetadata.displayPrimaries[0].x, 50000);
+                        mdm->display_primaries[0][1] = av_make_q(hdrMetadata.displayPrimaries[0].y, 50000);
+                        mdm->display_primaries[1][0] = av_make_q(hdrMetadata.displayPrimaries[1].x, 50000);
+                        mdm->display_primaries[1][1] = av_make_q(hdrMetadata.displayPrimaries[1].y, 50000);
+                        mdm->display_primaries[2][0] = av_make_q(hdrMetadata.displayPrimaries[2].x, 50000);
+                        mdm->display_primaries[2][1] = av_make_q(hdrMetadata.displayPrimaries[2].y, 50000);
+
+                        mdm->white_point[0] = av_make_q(hdrMetadata.whitePoint.x, 50000);
+                        mdm->white_point[1] = av_make_q(hdrMetadata.whitePoint.y, 50000);
+
+                        mdm->min_luminance = av_make_q(hdrMetadata.minDisplayLuminance, 10000);
+                        mdm->max_luminance = av_make_q(hdrMetadata.maxDisplayLuminance, 1);
+
+                        mdm->has_luminance = hdrMetadata.maxDisplayLuminance != 0 ? 1 : 0;
+                        mdm->has_primaries = hdrMetadata.displayPrimaries[0].x != 0 ? 1 : 0;
+                    }
 
-                    // FIXME: Should we pop an entry off m_FrameInfoQueue here?
+                    if ((hdrMetadata.maxContentLightLevel != 0 || hdrMetadata.maxFrameAverageLightLevel != 0) &&
+                            av_frame_get_side_data(frame, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL) == nullptr) {
+                        auto clm = av_content_light_metadata_create_side_data(frame);
 
-                    av_strerror(err, errorstring, sizeof(errorstring));
-                    SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
-                                "avcodec_receive_frame() failed: %s (frame %d)",
-                                errorstring,
-                                !m_FrameInfoQueue.empty() ? m_FrameInfoQueue.front().frameNumber : -1);
+                        clm->MaxCLL = hdrMetadata.maxContentLightLevel;
+                        clm->MaxFALL = hdrMetadata.maxFrameAverageLightLevel;
+                    }
+                }
 
-                    if (++m_ConsecutiveFailedDecodes == FAILED_DECODES_RESET_THRESHOLD) {
-                        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
-                                     "Resetting decoder due to consistent failure");
+                // Reset failed decodes count if we reached this far
+                m_ConsecutiveFailedDecodes = 0;
 
-                        SDL_Event event;
-                        event.type = SDL_RENDER_DEVICE_RESET;
-                        SDL_PushEvent(&event);
+                // Restore default log level after a successful decode
+                av_log_set_level(AV_LOG_INFO);
 
-                        // Don't consume any additional data
-                        SDL_AtomicSet(&m_DecoderThreadShouldQuit, 1);
-                    }
+                if (!m_FrameInfoQueue.empty()) {
+                    // Data buffers in the DU are not valid here!
+                    DECODE_UNIT du = m_FrameInfoQueue.front();
+                    m_FrameInfoQueue.pop();
+
+                    // Count time in avcodec_send_packet() and avcodec_receive_frame()
+                    // as time spent decoding. Also count time spent in the decode unit
+                    // queue because that's directly caused by decoder latency.
+                    m_ActiveWndVideoStats.totalDecodeTime += LiGetMillis() - du.enqueueTimeMs;
 
-                    // Just in case the error resulted in the loss of the frame,
-                    // request an IDR frame to reset our decoder state.
-                    LiRequestIdrFrame();
+                    // Store the presentation time
+                    frame->pts = du.presentationTimeMs;
                 }
-            } while (err == AVERROR(EAGAIN) && !SDL_AtomicGet(&m_DecoderThreadShouldQuit));
 
-            if (err != 0) {
-                // Free the frame if we failed to submit it
-                av_frame_free(&frame);
+                m_ActiveWndVideoStats.decodedFrames++;
+
+                // Queue the frame for rendering (or render now if pacer is disabled)
+                m_Pacer->submitFrame(frame);
+                frame = nullptr;
+            }
+            else if (err == AVERROR(EAGAIN)) {
+                // No output yet. Go back to waiting for input or output.
+                break;
+            }
+            else {
+                char errorstring[512];
+
+                // FIXME: Should we pop an entry off m_FrameInfoQueue here?
+
+                av_strerror(err, errorstring, sizeof(errorstring));
+                SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                            "avcodec_receive_frame() failed: %s (frame %d)",
+                            errorstring,
+                            !m_FrameInfoQueue.empty() ? m_FrameInfoQueue.front().frameNumber : -1);
+
+                if (++m_ConsecutiveFailedDecodes == FAILED_DECODES_RESET_THRESHOLD) {
+                    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                                 "Resetting decoder due to consistent failure");
+
+                    SDL_Event event;
+                    event.type = SDL_RENDER_DEVICE_RESET;
+                    SDL_PushEvent(&event);
+
+                    // Don't consume any additional data
+                    SDL_AtomicSet(&m_DecoderThreadShouldQuit, 1);
+                }
+
+                // Just in case the error resulted in the loss of the frame,
+                // request an IDR frame to reset our decoder state.
+                m_FrameSource->requestIdrFrame();
+                break;
             }
         }
     }
+
+    m_FramePool.releaseFrame(&frame);
 }
 
 int FFmpegVideoDecoder::submitDecodeUnit(PDECODE_UNIT du)
@@ -1614,6 +2124,8 @@ int FFmpegVideoDecoder::submitDecodeUnit(PDECODE_UNIT du)
     PLENTRY entry = du->bufferList;
     int err;
 
+    TraceScope traceScope("FFmpegVideoDecoder::submitDecodeUnit");
+
     SDL_assert(!m_TestOnly);
 
     // If this is the first frame, reject anything that's not an IDR frame
@@ -1632,27 +2144,37 @@ int FFmpegVideoDecoder::submitDecodeUnit(PDECODE_UNIT du)
         m_LastFrameNumber = du->frameNumber;
     }
 
-    // Flip stats windows roughly every second
+    // Flip stats windows roughly every second. The stats thread does the
+    // aggregation and overlay rendering, so all we do here is hand off a copy.
+    // If the stats thread is behind, keep accumulating into this window.
     if (SDL_TICKS_PASSED(SDL_GetTicks(), m_ActiveWndVideoStats.measurementStartTimestamp + 1000)) {
-        // Update overlay stats if it's enabled
-        if (Session::get()->getOverlayManager().isOverlayEnabled(Overlay::OverlayDebug)) {
-            VIDEO_STATS lastTwoWndStats = {};
-            addVideoStats(m_LastWndVideoStats, lastTwoWndStats);
-            addVideoStats(m_ActiveWndVideoStats, lastTwoWndStats);
-
-            stringifyVideoStats(lastTwoWndStats,
-                                Session::get()->getOverlayManager().getOverlayText(Overlay::OverlayDebug),
-                                Session::get()->getOverlayManager().getOverlayMaxTextLength());
-            Session::get()->getOverlayManager().setOverlayTextUpdated(Overlay::OverlayDebug);
+        // Software decoders may need more or fewer threads to keep up
+        if (!isHardwareAccelerated() && m_ActiveWndVideoStats.decodedFrames != 0 &&
+                m_ThreadScaler.updateDecodeTime((float)m_ActiveWndVideoStats.totalDecodeTime / m_ActiveWndVideoStats.decodedFrames)) {
+            m_PendingDecoderReopen = true;
         }
 
-        // Accumulate these values into the global stats
-        addVideoStats(m_ActiveWndVideoStats, m_GlobalVideoStats);
+        uint32_t writeCount = m_PendingWndWriteCount.load(std::memory_order_relaxed);
+        if (writeCount - m_PendingWndReadCount.load(std::memory_order_acquire) < MAX_PENDING_STATS_WINDOWS) {
+            SDL_memcpy(&m_PendingWndVideoStats[writeCount % MAX_PENDING_STATS_WINDOWS],
+                       &m_ActiveWndVideoStats,
+                       sizeof(m_ActiveWndVideoStats));
+            m_PendingWndWriteCount.store(writeCount + 1, std::memory_order_release);
+            SDL_SemPost(m_StatsWindowReady);
+
+            // Clear the window for the next one
+            SDL_zero(m_ActiveWndVideoStats);
+            m_ActiveWndVideoStats.measurementStartTimestamp = SDL_GetTicks();
+        }
+    }
 
-        // Move this window into the last window slot and clear it for next window
-        SDL_memcpy(&m_LastWndVideoStats, &m_ActiveWndVideoStats, sizeof(m_ActiveWndVideoStats));
-        SDL_zero(m_ActiveWndVideoStats);
-        m_ActiveWndVideoStats.measurementStartTimestamp = SDL_GetTicks();
+    // The thread count is fixed when the decoder is opened, so we apply
+    // changes by reopening it and starting over from a new IDR frame.
+    if (m_PendingDecoderReopen) {
+        m_PendingDecoderReopen = false;
+        if (reopenDecoder() && du->frameType != FRAME_TYPE_IDR) {
+            return DR_NEED_IDR;
+        }
     }
 
     if (du->frameHostProcessingLatency != 0) {
@@ -1676,16 +2198,37 @@ int FFmpegVideoDecoder::submitDecodeUnit(PDECODE_UNIT du)
         requiredBufferSize += MAX_SPS_EXTRA_SIZE;
     }
 
-    // Ensure the decoder buffer is large enough
-    m_DecodeBuffer.reserve(requiredBufferSize + AV_INPUT_BUFFER_PADDING_SIZE);
+    // Each packet owns a buffer from our pool, so the decoder can hold a
+    // reference to it for as long as it needs without copying the data.
+    // The buffer goes back to the pool when the last reference is dropped.
+    SDL_assert(m_Pkt->buf == nullptr);
+    m_Pkt->buf = allocatePacketBuffer(requiredBufferSize);
+    if (m_Pkt->buf == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "Failed to allocate packet buffer (%d bytes)",
+                     requiredBufferSize);
+        return DR_NEED_IDR;
+    }
 
     int offset = 0;
-    while (entry != nullptr) {
-        writeBuffer(entry, offset);
-        entry = entry->next;
+    if (entry != nullptr && entry->next == nullptr &&
+            !(m_NeedsSpsFixup && entry->bufferType == BUFFER_TYPE_SPS)) {
+        // Most frames arrive as a single picture data entry, so we can
+        // skip the gather logic and copy it straight into the packet.
+        memcpy(m_Pkt->buf->data, entry->data, entry->length);
+        offset = entry->length;
     }
+    else {
+        while (entry != nullptr) {
+            writeBuffer(entry, m_Pkt->buf->data, offset);
+            entry = entry->next;
+        }
+    }
+
+    // Pool buffers are recycled, so we must zero the padding ourselves
+    memset(&m_Pkt->buf->data[offset], 0, AV_INPUT_BUFFER_PADDING_SIZE);
 
-    m_Pkt->data = reinterpret_cast<uint8_t*>(const_cast<char*>(m_DecodeBuffer.data()));
+    m_Pkt->data = m_Pkt->buf->data;
     m_Pkt->size = offset;
 
     if (du->frameType == FRAME_TYPE_IDR) {
@@ -1697,7 +2240,20 @@ int FFmpegVideoDecoder::submitDecodeUnit(PDECODE_UNIT du)
 
     m_ActiveWndVideoStats.totalReassemblyTime += du->enqueueTimeMs - du->receiveTimeMs;
 
+    // The receive and reassembly times are only available from the millisecond
+    // clock in moonlight-common-c, so translate them onto our own clock.
+    uint64_t nowNs = StreamUtils::getMonotonicNanoseconds();
+    uint64_t nowMs = LiGetMillis();
+    uint32_t frameId = m_FrameTimeline.beginFrame(nowNs - (nowMs - du->receiveTimeMs) * 1000000);
+    m_FrameTimeline.markStage(frameId, FTS_REASSEMBLED, nowNs - (nowMs - du->enqueueTimeMs) * 1000000);
+    m_FrameTimeline.markStage(frameId, FTS_SEND_PACKET);
+    traceScope.setFrameId(frameId);
+
     err = avcodec_send_packet(m_VideoDecoderCtx, m_Pkt);
+
+    // The decoder took its own reference to the packet buffer if it needs it
+    av_packet_unref(m_Pkt);
+
     if (err < 0) {
         char errorstring[512];
         av_strerror(err, errorstring, sizeof(errorstring));
@@ -1725,6 +2281,7 @@ int FFmpegVideoDecoder::submitDecodeUnit(PDECODE_UNIT du)
     }
 
     m_FrameInfoQueue.push(*du);
+    m_FrameTimelineIdQueue.push(frameId);
 
     m_FramesIn++;
     return DR_OK;
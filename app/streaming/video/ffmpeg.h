@@ -3,15 +3,24 @@
 #include <functional>
 //#include <QQueue>
 #include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include "decoder.h"
+#include "decoderthreadscaler.h"
 #include "ffmpeg-renderers/renderer.h"
 #include "ffmpeg-renderers/pacer/pacer.h"
+#include "ffmpeg-renderers/framepool.h"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 }
 
+// Completed stats windows that can wait for the stats thread. If it falls
+// this far behind, the decoder thread keeps accumulating the current window.
+#define MAX_PENDING_STATS_WINDOWS 4
+
 class FFmpegVideoDecoder : public IVideoDecoder {
 public:
     FFmpegVideoDecoder(bool testOnly);
@@ -31,6 +40,14 @@ public:
 
     virtual IFFmpegRenderer* getBackendRenderer();
 
+    void getFramePoolStats(PFRAME_POOL_STATS stats);
+
+    // Frames are recorded here from when they enter the decoder until they're presented
+    FrameTimeline* getFrameTimeline();
+
+    // Returns one of the built-in single IDR frame samples
+    static bool getTestFrame(int videoFormat, const uint8_t** data, int* length);
+
 private:
     bool completeInitialization(const AVCodec* decoder,
                                 enum AVPixelFormat requiredFormat,
@@ -44,6 +61,10 @@ private:
 
     void addVideoStats(VIDEO_STATS& src, VIDEO_STATS& dst);
 
+    AVCodecContext* createDecoderContext(const AVCodec* decoder, int threadCount);
+
+    bool reopenDecoder();
+
     bool createFrontendRenderer(PDECODER_PARAMETERS params, bool useAlternateFrontend);
 
     bool isDecoderIgnored(const AVCodec* decoder);
@@ -63,7 +84,9 @@ private:
 
     void reset();
 
-    void writeBuffer(PLENTRY entry, int& offset);
+    void writeBuffer(PLENTRY entry, uint8_t* buffer, int& offset);
+
+    AVBufferRef* allocatePacketBuffer(int size);
 
     static
     enum AVPixelFormat ffGetFormat(AVCodecContext* context,
@@ -73,16 +96,32 @@ private:
 
     static int decoderThreadProcThunk(void* context);
 
+    void inputThreadProc();
+
+    static int inputThreadProcThunk(void* context);
+
+    void statsThreadProc();
+
+    static int statsThreadProcThunk(void* context);
+
+    void processPendingStatsWindows();
+
+    bool waitForDecoderWork(VIDEO_FRAME_HANDLE* handle, PDECODE_UNIT* du);
+
+    void completePendingInput(VIDEO_FRAME_HANDLE handle, int drStatus);
+
     AVPacket* m_Pkt;
     AVCodecContext* m_VideoDecoderCtx;
     enum AVPixelFormat m_RequiredPixelFormat;
-    //QByteArray m_DecodeBuffer;
-    std::string m_DecodeBuffer;
+    AVBufferPool* m_PacketBufferPool;
+    int m_PacketBufferPoolSize;
     const AVCodecHWConfig* m_HwDecodeCfg;
     IFFmpegRenderer* m_BackendRenderer;
     IFFmpegRenderer* m_FrontendRenderer;
     int m_ConsecutiveFailedDecodes;
     Pacer* m_Pacer;
+    FramePool m_FramePool;
+    FrameTimeline m_FrameTimeline;
     VIDEO_STATS m_ActiveWndVideoStats;
     VIDEO_STATS m_LastWndVideoStats;
     VIDEO_STATS m_GlobalVideoStats;
@@ -92,16 +131,56 @@ private:
 
     int m_LastFrameNumber;
     int m_StreamFps;
+    int m_StreamWidth;
+    int m_StreamHeight;
     int m_VideoFormat;
+    enum AVPixelFormat m_DecoderPixelFormat;
+    DecoderThreadScaler m_ThreadScaler;
+    bool m_PendingDecoderReopen;
     bool m_NeedsSpsFixup;
     bool m_TestOnly;
+
+    // Decoding without a window, session or host connection
+    bool m_Headless;
+    IVideoFrameSource* m_FrameSource;
     SDL_Thread* m_DecoderThread;
+    SDL_Thread* m_InputThread;
     SDL_atomic_t m_DecoderThreadShouldQuit;
 
+    // The input thread blocks on moonlight-common-c's frame queue and hands
+    // each DU to the decoder thread through this single-entry mailbox, so the
+    // decoder thread only ever blocks on m_DecoderWakeCond.
+    std::mutex m_DecoderWakeLock;
+    std::condition_variable m_DecoderWakeCond;
+    std::condition_variable m_InputSlotFreeCond;
+    bool m_PendingInputValid;
+    VIDEO_FRAME_HANDLE m_PendingInputHandle;
+    PDECODE_UNIT m_PendingInputDu;
+
+    // Estimated time between avcodec_send_packet() and the frame becoming
+    // available from avcodec_receive_frame() for decoders with output delay
+    uint64_t m_OutputLatencyEstimateUs;
+
+    // Timed out waits for the oldest outstanding frame. The first one
+    // sleeps until the frame is predicted to be ready.
+    int m_OutputPollAttempts;
+
     // Data buffers in the queued DU are not valid
     //QQueue<DECODE_UNIT> m_FrameInfoQueue;
     std::queue<DECODE_UNIT> m_FrameInfoQueue;
 
+    // Timeline IDs of the frames in m_FrameInfoQueue
+    std::queue<uint32_t> m_FrameTimelineIdQueue;
+
+    // The decoder thread publishes each completed stats window here, and the
+    // stats thread aggregates it and renders the overlay text. The last window
+    // and global stats are owned by the stats thread while it's running.
+    VIDEO_STATS m_PendingWndVideoStats[MAX_PENDING_STATS_WINDOWS];
+    std::atomic<uint32_t> m_PendingWndWriteCount;
+    std::atomic<uint32_t> m_PendingWndReadCount;
+    SDL_sem* m_StatsWindowReady;
+    SDL_Thread* m_StatsThread;
+
     static const uint8_t k_H264TestFrame[];
     static const uint8_t k_HEVCMainTestFrame[];
     static const uint8_t k_HEVCMain10TestFrame[];
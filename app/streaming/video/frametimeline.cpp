@@ -0,0 +1,199 @@
+#include "frametimeline.h"
+#include "streaming/streamutils.h"
+
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Frames that haven't been presented within this many frames of the newest
+// frame are assumed to have been dropped. This covers the frames that may
+// be held by the decoder and both of the Pacer's queues.
+#define FRAME_TIMELINE_MAX_IN_FLIGHT 32
+
+FrameTimeline::FrameTimeline()
+{
+    reset();
+}
+
+void FrameTimeline::reset()
+{
+    for (int i = 0; i < FRAME_TIMELINE_RECORDS; i++) {
+        m_Records[i].frameId.store(0, std::memory_order_relaxed);
+        for (int j = 0; j < FTS_MAX; j++) {
+            m_Records[i].timestampsNs[j].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    m_NextFrameId = 1;
+    m_NextScanFrameId = 1;
+}
+
+uint32_t FrameTimeline::beginFrame(uint64_t receiveTimeNs)
+{
+    uint32_t frameId = m_NextFrameId.load(std::memory_order_relaxed);
+
+    // Invalidate the old record before we recycle it. A stage marked for a
+    // frame that's a full ring behind could still race with this, but the
+    // Pacer's queues are far too small for that to happen in practice.
+    Record& record = m_Records[frameId % FRAME_TIMELINE_RECORDS];
+    record.frameId.store(0, std::memory_order_release);
+    for (int i = 0; i < FTS_MAX; i++) {
+        record.timestampsNs[i].store(0, std::memory_order_relaxed);
+    }
+    record.timestampsNs[FTS_RECEIVE].store(receiveTimeNs, std::memory_order_relaxed);
+    record.frameId.store(frameId, std::memory_order_release);
+
+    // 0 is reserved for frames without a timeline record
+    uint32_t nextFrameId = frameId + 1;
+    if (nextFrameId == 0) {
+        nextFrameId = 1;
+    }
+    m_NextFrameId.store(nextFrameId, std::memory_order_release);
+
+    return frameId;
+}
+
+void FrameTimeline::markStage(uint32_t frameId, FrameTimelineStage stage)
+{
+    markStage(frameId, stage, StreamUtils::getMonotonicNanoseconds());
+}
+
+void FrameTimeline::markStage(uint32_t frameId, FrameTimelineStage stage, uint64_t timeNs)
+{
+    if (frameId == 0) {
+        return;
+    }
+
+    Record& record = m_Records[frameId % FRAME_TIMELINE_RECORDS];
+    if (record.frameId.load(std::memory_order_acquire) == frameId) {
+        record.timestampsNs[stage].store(timeNs, std::memory_order_release);
+    }
+}
+
+uint64_t FrameTimeline::getStageTime(uint32_t frameId, FrameTimelineStage stage)
+{
+    if (frameId == 0) {
+        return 0;
+    }
+
+    Record& record = m_Records[frameId % FRAME_TIMELINE_RECORDS];
+    uint64_t timeNs = record.timestampsNs[stage].load(std::memory_order_acquire);
+    if (record.frameId.load(std::memory_order_acquire) != frameId) {
+        return 0;
+    }
+
+    return timeNs;
+}
+
+void FrameTimeline::scanPresentedFrames(uint32_t* nextScanFrameId, const FrameIntervalCallback& callback)
+{
+    uint32_t nextFrameId = m_NextFrameId.load(std::memory_order_acquire);
+
+    // Skip any records that have already been recycled
+    if (nextFrameId - *nextScanFrameId > FRAME_TIMELINE_RECORDS) {
+        *nextScanFrameId = nextFrameId - FRAME_TIMELINE_RECORDS;
+    }
+
+    while (*nextScanFrameId != nextFrameId) {
+        uint32_t frameId = *nextScanFrameId;
+        uint64_t timestampsNs[FTS_MAX];
+        bool complete = true;
+
+        for (int i = 0; i < FTS_MAX; i++) {
+            timestampsNs[i] = getStageTime(frameId, (FrameTimelineStage)i);
+            if (timestampsNs[i] == 0) {
+                complete = false;
+            }
+        }
+
+        if (complete) {
+            uint32_t intervalsUs[FTI_MAX];
+
+            for (int i = 0; i < FTI_TOTAL; i++) {
+                // The receive and reassembly times come from a millisecond clock,
+                // so they can be slightly ahead of the following stage.
+                uint64_t intervalNs = timestampsNs[i + 1] > timestampsNs[i] ? timestampsNs[i + 1] - timestampsNs[i] : 0;
+                intervalsUs[i] = (uint32_t)(intervalNs / 1000);
+            }
+            intervalsUs[FTI_TOTAL] = (uint32_t)((timestampsNs[FTS_PRESENT] - timestampsNs[FTS_RECEIVE]) / 1000);
+
+            callback(intervalsUs);
+        }
+        else if (nextFrameId - frameId <= FRAME_TIMELINE_MAX_IN_FLIGHT) {
+            // This frame is still in flight, so we'll pick it up next time
+            break;
+        }
+
+        (*nextScanFrameId)++;
+        if (*nextScanFrameId == 0) {
+            *nextScanFrameId = 1;
+        }
+    }
+}
+
+void FrameTimeline::computeStats(PFRAME_TIMELINE_STATS stats)
+{
+    uint32_t samples = 0;
+
+    SDL_zerop(stats);
+
+    scanPresentedFrames(&m_NextScanFrameId, [this, &samples](const uint32_t intervalsUs[FTI_MAX]) {
+        for (int i = 0; i < FTI_MAX; i++) {
+            m_IntervalSamplesUs[i][samples] = intervalsUs[i];
+        }
+        samples++;
+    });
+
+    stats->frames = samples;
+    if (samples == 0) {
+        return;
+    }
+
+    for (int i = 0; i < FTI_MAX; i++) {
+        uint32_t* begin = m_IntervalSamplesUs[i];
+        uint32_t* end = begin + samples;
+
+        std::nth_element(begin, begin + samples * 50 / 100, end);
+        stats->intervals[i].p50Us = begin[samples * 50 / 100];
+        std::nth_element(begin, begin + samples * 95 / 100, end);
+        stats->intervals[i].p95Us = begin[samples * 95 / 100];
+        std::nth_element(begin, begin + samples * 99 / 100, end);
+        stats->intervals[i].p99Us = begin[samples * 99 / 100];
+        stats->intervals[i].maxUs = *std::max_element(begin, end);
+    }
+}
+
+uint32_t FrameTimeline::getFrameId(const AVFrame* frame)
+{
+    return (uint32_t)(uintptr_t)frame->opaque;
+}
+
+void FrameTimeline::setFrameId(AVFrame* frame, uint32_t frameId)
+{
+    frame->opaque = (void*)(uintptr_t)frameId;
+}
+
+const char* FrameTimeline::getIntervalName(FrameTimelineInterval interval)
+{
+    switch (interval) {
+    case FTI_REASSEMBLY:
+        return "Reassembly";
+    case FTI_DECODE_QUEUE:
+        return "Decode queue";
+    case FTI_DECODE:
+        return "Decode";
+    case FTI_SUBMIT:
+        return "Submit";
+    case FTI_PACING:
+        return "Pacing";
+    case FTI_RENDER:
+        return "Render";
+    case FTI_TOTAL:
+        return "End-to-end";
+    default:
+        SDL_assert(false);
+        return "";
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+
+struct AVFrame;
+
+// Size of the timeline ring. This must be larger than the number of
+// frames we can receive in a stats window at the highest frame rate.
+#define FRAME_TIMELINE_RECORDS 1024
+
+enum FrameTimelineStage {
+    FTS_RECEIVE,
+    FTS_REASSEMBLED,
+    FTS_SEND_PACKET,
+    FTS_RECEIVE_FRAME,
+    FTS_PACER_ENQUEUE,
+    FTS_RENDER_START,
+    FTS_PRESENT,
+    FTS_MAX
+};
+
+// Intervals between consecutive stages, plus the end-to-end time
+enum FrameTimelineInterval {
+    FTI_REASSEMBLY,
+    FTI_DECODE_QUEUE,
+    FTI_DECODE,
+    FTI_SUBMIT,
+    FTI_PACING,
+    FTI_RENDER,
+    FTI_TOTAL,
+    FTI_MAX
+};
+
+typedef struct _FRAME_TIMELINE_PERCENTILES {
+    uint32_t p50Us;
+    uint32_t p95Us;
+    uint32_t p99Us;
+    uint32_t maxUs;
+} FRAME_TIMELINE_PERCENTILES;
+
+typedef struct _FRAME_TIMELINE_STATS {
+    // Number of presented frames the percentiles were computed from
+    uint32_t frames;
+    FRAME_TIMELINE_PERCENTILES intervals[FTI_MAX];
+} FRAME_TIMELINE_STATS, *PFRAME_TIMELINE_STATS;
+
+// Records monotonic nanosecond timestamps for each stage of each frame in a
+// fixed-size ring. Stages are marked by the decoder, V-sync and render threads
+// without locking. Frames are tracked through the pipeline by an ID stored
+// in AVFrame::opaque.
+class FrameTimeline
+{
+public:
+    FrameTimeline();
+
+    // Called by the decoder thread when a frame enters the pipeline.
+    // Returns the frame's ID, which is never 0.
+    uint32_t beginFrame(uint64_t receiveTimeNs);
+
+    // Marks the stage with the current time. IDs of 0 and records
+    // which have already been recycled are ignored.
+    void markStage(uint32_t frameId, FrameTimelineStage stage);
+
+    void markStage(uint32_t frameId, FrameTimelineStage stage, uint64_t timeNs);
+
+    // Returns 0 if the stage hasn't been reached or the record was recycled
+    uint64_t getStageTime(uint32_t frameId, FrameTimelineStage stage);
+
+    // Computes percentiles over the frames presented since the last call.
+    // This must only be called from one thread at a time.
+    void computeStats(PFRAME_TIMELINE_STATS stats);
+
+    typedef std::function<void(const uint32_t intervalsUs[FTI_MAX])> FrameIntervalCallback;
+
+    // Calls back with the intervals of each frame presented since the frame
+    // ID in the cursor and advances it. Cursors start at 1, and each one must
+    // only be used from one thread at a time. Scanning must keep up with the
+    // ring, or the oldest frames are skipped.
+    void scanPresentedFrames(uint32_t* nextScanFrameId, const FrameIntervalCallback& callback);
+
+    void reset();
+
+    static uint32_t getFrameId(const AVFrame* frame);
+
+    static void setFrameId(AVFrame* frame, uint32_t frameId);
+
+    static const char* getIntervalName(FrameTimelineInterval interval);
+
+private:
+    struct Record {
+        std::atomic<uint32_t> frameId;
+        std::atomic<uint64_t> timestampsNs[FTS_MAX];
+    };
+
+    Record m_Records[FRAME_TIMELINE_RECORDS];
+    std::atomic<uint32_t> m_NextFrameId;
+    uint32_t m_NextScanFrameId;
+
+    // Scratch space for computeStats() so it doesn't allocate
+    uint32_t m_IntervalSamplesUs[FTI_MAX][FRAME_TIMELINE_RECORDS];
+};
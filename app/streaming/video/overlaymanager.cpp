@@ -3,6 +3,20 @@
 
 using namespace Overlay;
 
+// Glyphs in the atlas are the printable ASCII range. Anything
+// outside of it is drawn as FALLBACK_GLYPH.
+#define FIRST_GLYPH ' '
+#define LAST_GLYPH '~'
+#define GLYPH_COUNT (LAST_GLYPH - FIRST_GLYPH + 1)
+#define FALLBACK_GLYPH '?'
+
+// Lines are wrapped at this width, like TTF_RenderText_Blended_Wrapped() did
+#define WRAP_WIDTH 1024
+
+// Round the canvas width up to this many glyphs, so small changes in the
+// length of the longest line don't force us to redraw the whole canvas.
+#define CANVAS_WIDTH_GLYPH_ALIGNMENT 8
+
 OverlayManager::OverlayManager() :
     m_Renderer(nullptr),
     m_FontData(Path::readDataFile("ModeSeven.ttf"))
@@ -31,8 +45,11 @@ OverlayManager::OverlayManager() :
 OverlayManager::~OverlayManager()
 {
     for (int i = 0; i < OverlayType::OverlayMax; i++) {
-        if (m_Overlays[i].surface != nullptr) {
-            SDL_FreeSurface(m_Overlays[i].surface);
+        if (m_Overlays[i].canvas != nullptr) {
+            SDL_FreeSurface(m_Overlays[i].canvas);
+        }
+        if (m_Overlays[i].glyphAtlas != nullptr) {
+            SDL_FreeSurface(m_Overlays[i].glyphAtlas);
         }
         if (m_Overlays[i].font != nullptr) {
             TTF_CloseFont(m_Overlays[i].font);
@@ -80,7 +97,59 @@ SDL_Surface* OverlayManager::getUpdatedOverlaySurface(OverlayType type)
 {
     // If a new surface is available, return it. If not, return nullptr.
     // Caller must free the surface on success.
-    return (SDL_Surface*)SDL_AtomicSetPtr((void**)&m_Overlays[type].surface, nullptr);
+    SDL_Surface* surface = nullptr;
+
+    SDL_AtomicLock(&m_Overlays[type].canvasLock);
+    if (m_Overlays[type].updated) {
+        surface = SDL_DuplicateSurface(m_Overlays[type].canvas);
+        m_Overlays[type].updated = false;
+    }
+    SDL_AtomicUnlock(&m_Overlays[type].canvasLock);
+
+    return surface;
+}
+
+SDL_Surface* OverlayManager::getUpdatedOverlayRegion(OverlayType type, bool wholeOverlay, SDL_Rect* regionRect,
+                                                     int* overlayWidth, int* overlayHeight)
+{
+    // If a new region is available, return it. If not, return nullptr.
+    // Caller must free the surface on success.
+    SDL_Surface* surface = nullptr;
+
+    SDL_AtomicLock(&m_Overlays[type].canvasLock);
+    if (m_Overlays[type].updated) {
+        SDL_Surface* canvas = m_Overlays[type].canvas;
+
+        if (wholeOverlay) {
+            *regionRect = { 0, 0, canvas->w, canvas->h };
+        }
+        else {
+            *regionRect = m_Overlays[type].dirtyRect;
+        }
+        *overlayWidth = canvas->w;
+        *overlayHeight = canvas->h;
+
+        if (!SDL_RectEmpty(regionRect)) {
+            surface = SDL_CreateRGBSurfaceWithFormat(0, regionRect->w, regionRect->h, 32, canvas->format->format);
+            if (surface != nullptr) {
+                SDL_Rect src = *regionRect;
+                SDL_BlitSurface(canvas, &src, surface, nullptr);
+            }
+            else {
+                SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                             "SDL_CreateRGBSurfaceWithFormat() failed: %s",
+                             SDL_GetError());
+            }
+        }
+
+        // Try again on the next call if we couldn't make a copy
+        if (surface != nullptr || SDL_RectEmpty(regionRect)) {
+            m_Overlays[type].updated = false;
+        }
+    }
+    SDL_AtomicUnlock(&m_Overlays[type].canvasLock);
+
+    return surface;
 }
 
 void OverlayManager::setOverlayTextUpdated(OverlayType type)
@@ -124,44 +193,211 @@ void OverlayManager::notifyOverlayUpdated(OverlayType type)
         return;
     }
 
-    // Construct the required font to render the overlay
-    if (m_Overlays[type].font == nullptr) {
-        if (m_FontData.empty()) {
-            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
-                         "SDL overlay font failed to load");
-            return;
-        }
+    {
+        std::lock_guard<std::mutex> locker(m_ComposeLock);
 
-        // m_FontData must stay around until the font is closed
-        m_Overlays[type].font = TTF_OpenFontRW(SDL_RWFromConstMem(m_FontData.data(), m_FontData.size()),
-                                               1,
-                                               m_Overlays[type].fontSize);
+        // Construct the required font to render the overlay
         if (m_Overlays[type].font == nullptr) {
-            SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
-                        "TTF_OpenFont() failed: %s",
-                        TTF_GetError());
+            if (m_FontData.empty()) {
+                SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                             "SDL overlay font failed to load");
+                return;
+            }
+
+            // m_FontData must stay around until the font is closed
+            m_Overlays[type].font = TTF_OpenFontRW(SDL_RWFromConstMem(m_FontData.data(), m_FontData.size()),
+                                                   1,
+                                                   m_Overlays[type].fontSize);
+            if (m_Overlays[type].font == nullptr) {
+                SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                            "TTF_OpenFont() failed: %s",
+                            TTF_GetError());
 
-            // Can't proceed without a font
+                // Can't proceed without a font
+                return;
+            }
+        }
+
+        // Rasterize the glyphs once, so updates are just blits
+        if (m_Overlays[type].glyphAtlas == nullptr && !buildGlyphAtlas(type)) {
             return;
         }
+
+        SDL_AtomicLock(&m_Overlays[type].canvasLock);
+        if (m_Overlays[type].enabled) {
+            SDL_Rect dirtyRect;
+            if (composeOverlay(type, &dirtyRect)) {
+                if (m_Overlays[type].updated) {
+                    // The renderer never took the last update, so it still
+                    // needs the regions that changed in that one too.
+                    SDL_UnionRect(&m_Overlays[type].dirtyRect, &dirtyRect, &m_Overlays[type].dirtyRect);
+                }
+                else {
+                    m_Overlays[type].dirtyRect = dirtyRect;
+                }
+                m_Overlays[type].updated = true;
+            }
+            else {
+                m_Overlays[type].updated = false;
+            }
+        }
+        else {
+            // Start from a blank canvas when the overlay is enabled again
+            if (m_Overlays[type].canvas != nullptr) {
+                SDL_FreeSurface(m_Overlays[type].canvas);
+                m_Overlays[type].canvas = nullptr;
+            }
+            m_OverlayLines[type].clear();
+
+            m_Overlays[type].updated = false;
+        }
+        SDL_AtomicUnlock(&m_Overlays[type].canvasLock);
     }
 
-    SDL_Surface* oldSurface = (SDL_Surface*)SDL_AtomicSetPtr((void**)&m_Overlays[type].surface, nullptr);
+    // Notify the renderer
+    m_Renderer->notifyOverlayUpdated(type);
+}
+
+bool OverlayManager::buildGlyphAtlas(OverlayType type)
+{
+    TTF_Font* font = m_Overlays[type].font;
+    int advance;
 
-    // Free the old surface
-    if (oldSurface != nullptr) {
-        SDL_FreeSurface(oldSurface);
+    if (TTF_GlyphMetrics(font, 'M', nullptr, nullptr, nullptr, nullptr, &advance) != 0) {
+        SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                    "TTF_GlyphMetrics() failed: %s",
+                    TTF_GetError());
+        return false;
     }
 
-    if (m_Overlays[type].enabled) {
-        // The _Wrapped variant is required for line breaks to work
-        SDL_Surface* surface = TTF_RenderText_Blended_Wrapped(m_Overlays[type].font,
-                                                              m_Overlays[type].text,
-                                                              m_Overlays[type].color,
-                                                              1024);
-        SDL_AtomicSetPtr((void**)&m_Overlays[type].surface, surface);
+    m_Overlays[type].glyphWidth = advance;
+    m_Overlays[type].glyphHeight = TTF_FontHeight(font);
+    m_Overlays[type].lineHeight = TTF_FontLineSkip(font);
+
+    SDL_Surface* atlas = SDL_CreateRGBSurfaceWithFormat(0,
+                                                        advance * GLYPH_COUNT,
+                                                        m_Overlays[type].glyphHeight,
+                                                        32,
+                                                        SDL_PIXELFORMAT_ARGB8888);
+    if (atlas == nullptr) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                     "SDL_CreateRGBSurfaceWithFormat() failed: %s",
+                     SDL_GetError());
+        return false;
     }
 
-    // Notify the renderer
-    m_Renderer->notifyOverlayUpdated(type);
+    for (int i = 0; i < GLYPH_COUNT; i++) {
+        SDL_Surface* glyph = TTF_RenderGlyph_Blended(font, FIRST_GLYPH + i, m_Overlays[type].color);
+        if (glyph == nullptr) {
+            // Leave this cell blank
+            continue;
+        }
+
+        // Copy the glyph's alpha as-is rather than blending it onto the empty atlas
+        SDL_SetSurfaceBlendMode(glyph, SDL_BLENDMODE_NONE);
+
+        SDL_Rect src = { 0, 0, SDL_min(glyph->w, advance), SDL_min(glyph->h, m_Overlays[type].glyphHeight) };
+        SDL_Rect dst = { i * advance, 0, src.w, src.h };
+        SDL_BlitSurface(glyph, &src, atlas, &dst);
+        SDL_FreeSurface(glyph);
+    }
+
+    SDL_SetSurfaceBlendMode(atlas, SDL_BLENDMODE_NONE);
+    m_Overlays[type].glyphAtlas = atlas;
+    return true;
+}
+
+// Returns false if there is nothing to draw. The caller must hold canvasLock.
+bool OverlayManager::composeOverlay(OverlayType type, SDL_Rect* dirtyRect)
+{
+    int glyphWidth = m_Overlays[type].glyphWidth;
+    int lineHeight = m_Overlays[type].lineHeight;
+    int maxColumns = SDL_max(WRAP_WIDTH / glyphWidth, 1);
+
+    // Lay out the text into lines, wrapping any that are too long
+    std::vector<std::string> lines;
+    std::string line;
+    int columns = 0;
+    for (const char* c = m_Overlays[type].text; *c != 0; c++) {
+        if (*c == '\n') {
+            lines.push_back(line);
+            line.clear();
+            continue;
+        }
+
+        if ((int)line.length() == maxColumns) {
+            lines.push_back(line);
+            line.clear();
+        }
+
+        line.push_back(*c);
+        columns = SDL_max(columns, (int)line.length());
+    }
+    if (!line.empty()) {
+        lines.push_back(line);
+    }
+
+    if (lines.empty()) {
+        return false;
+    }
+
+    columns = (columns + CANVAS_WIDTH_GLYPH_ALIGNMENT - 1) / CANVAS_WIDTH_GLYPH_ALIGNMENT * CANVAS_WIDTH_GLYPH_ALIGNMENT;
+    columns = SDL_min(columns, maxColumns);
+
+    int width = columns * glyphWidth;
+    int height = (int)lines.size() * lineHeight;
+
+    // The canvas is sized to fit the text exactly, because renderers position
+    // the overlay based on its size. If that changes, we redraw everything.
+    SDL_Surface* canvas = m_Overlays[type].canvas;
+    bool redrawAll = false;
+    if (canvas == nullptr || canvas->w != width || canvas->h != height) {
+        if (canvas != nullptr) {
+            SDL_FreeSurface(canvas);
+        }
+
+        canvas = m_Overlays[type].canvas = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888);
+        if (canvas == nullptr) {
+            SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                         "SDL_CreateRGBSurfaceWithFormat() failed: %s",
+                         SDL_GetError());
+            return false;
+        }
+
+        SDL_SetSurfaceBlendMode(canvas, SDL_BLENDMODE_NONE);
+        redrawAll = true;
+    }
+
+    std::vector<std::string>& oldLines = m_OverlayLines[type];
+    SDL_zerop(dirtyRect);
+
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (!redrawAll && i < oldLines.size() && oldLines[i] == lines[i]) {
+            continue;
+        }
+
+        SDL_Rect lineRect = { 0, (int)i * lineHeight, width, lineHeight };
+        SDL_FillRect(canvas, &lineRect, 0);
+
+        for (size_t j = 0; j < lines[i].length(); j++) {
+            char c = lines[i][j];
+            if (c < FIRST_GLYPH || c > LAST_GLYPH) {
+                c = FALLBACK_GLYPH;
+            }
+
+            SDL_Rect src = { (c - FIRST_GLYPH) * glyphWidth, 0, glyphWidth, m_Overlays[type].glyphHeight };
+            SDL_Rect dst = { (int)j * glyphWidth, lineRect.y, glyphWidth, m_Overlays[type].glyphHeight };
+            SDL_BlitSurface(m_Overlays[type].glyphAtlas, &src, canvas, &dst);
+        }
+
+        if (SDL_RectEmpty(dirtyRect)) {
+            *dirtyRect = lineRect;
+        }
+        else {
+            SDL_UnionRect(dirtyRect, &lineRect, dirtyRect);
+        }
+    }
+
+    oldLines.swap(lines);
+    return true;
 }
@@ -2,6 +2,8 @@
 
 //#include <QString>
 #include <string>
+#include <vector>
+#include <mutex>
 
 #include <SDL.h>
 #include <SDL_ttf.h>
@@ -38,20 +40,48 @@ public:
     int getOverlayFontSize(OverlayType type);
     SDL_Surface* getUpdatedOverlaySurface(OverlayType type);
 
+    // Returns just the pixels that changed since the caller last took an
+    // update, for renderers that keep their own copy of the overlay. The
+    // region is at regionRect within an overlay of the returned size.
+    // Renderers without a copy of the current overlay pass wholeOverlay.
+    SDL_Surface* getUpdatedOverlayRegion(OverlayType type, bool wholeOverlay, SDL_Rect* regionRect,
+                                         int* overlayWidth, int* overlayHeight);
+
     void setOverlayRenderer(IOverlayRenderer* renderer);
 
 private:
     void notifyOverlayUpdated(OverlayType type);
+    bool buildGlyphAtlas(OverlayType type);
+    bool composeOverlay(OverlayType type, SDL_Rect* dirtyRect);
 
     struct {
         bool enabled;
         int fontSize;
         SDL_Color color;
-        char text[512];
+        char text[2048];
 
         TTF_Font* font;
-        SDL_Surface* surface;
+
+        // Printable ASCII glyphs rendered once in a single row. The font is
+        // monospaced, so every glyph occupies a cell of the same width.
+        SDL_Surface* glyphAtlas;
+        int glyphWidth;
+        int glyphHeight;
+        int lineHeight;
+
+        // Composed text that persists between updates, so we only need to
+        // redraw the lines that changed. Renderers copy what they need
+        // from it, so it's only touched with canvasLock held.
+        SDL_SpinLock canvasLock;
+        SDL_Surface* canvas;
+
+        // Set when the canvas has changed since the renderer last took an
+        // update, along with the region that changed
+        bool updated;
+        SDL_Rect dirtyRect;
     } m_Overlays[OverlayMax];
+    std::vector<std::string> m_OverlayLines[OverlayMax];
+    std::mutex m_ComposeLock;
     IOverlayRenderer* m_Renderer;
     std::string m_FontData;
 };
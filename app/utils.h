@@ -25,6 +25,7 @@ namespace StringUtils {
     bool isValidIPv6(const std::string& ipstr);
     std::string replacePlaceholder(const std::string& value, const std::string& from, const std::string& to);
     bool caseInsensitiveCompare(const std::string& str1, const std::string& str2);
+    std::vector<std::string> splitCommandLine(const char* commandLine);
 #ifdef _WIN32
     std::wstring stringToWString(const std::string& str);
 #endif
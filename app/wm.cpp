@@ -265,6 +265,36 @@ bool StringUtils::caseInsensitiveCompare(const std::string& str1, const std::str
     return true;
 }
 
+std::vector<std::string> StringUtils::splitCommandLine(const char* commandLine)
+{
+    std::vector<std::string> args;
+
+    // Split on whitespace, keeping quoted paths together
+    for (const char* p = commandLine; p != nullptr && *p != 0;) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == 0) {
+            break;
+        }
+
+        std::string arg;
+        bool quoted = false;
+        while (*p != 0 && (quoted || (*p != ' ' && *p != '\t'))) {
+            if (*p == '"') {
+                quoted = !quoted;
+            }
+            else {
+                arg += *p;
+            }
+            p++;
+        }
+        args.push_back(arg);
+    }
+
+    return args;
+}
+
 #ifdef _WIN32
 std::wstring StringUtils::stringToWString(const std::string& str)
 {